@@ -50,6 +50,12 @@ static DBusConnection *conn = NULL;
 struct ftp_data {
 	struct obc_session *session;
 	DBusMessage *msg;
+	GHashTable *sizes;	/* File sizes from the last listing */
+};
+
+struct listing {
+	DBusMessageIter *iter;
+	GHashTable *sizes;
 };
 
 static void async_cb(GObex *obex, GError *err, GObexPacket *rsp,
@@ -82,6 +88,8 @@ static DBusMessage *change_folder(DBusConnection *connection,
 		return g_dbus_create_error(message,
 				"org.openobex.Error.InvalidArguments", NULL);
 
+	g_hash_table_remove_all(ftp->sizes);
+
 	g_obex_setpath(obex, folder, async_cb, message, &err);
 	if (err != NULL) {
 		DBusMessage *reply;
@@ -137,7 +145,10 @@ static void xml_element(GMarkupParseContext *ctxt,
 			gpointer user_data,
 			GError **gerr)
 {
-	DBusMessageIter dict, *iter = user_data;
+	struct listing *listing = user_data;
+	DBusMessageIter dict, *iter = listing->iter;
+	const gchar *name = NULL;
+	gint64 size = -1;
 	gchar *key;
 	gint i;
 
@@ -157,14 +168,21 @@ static void xml_element(GMarkupParseContext *ctxt,
 	for (key = (gchar *) names[i]; key; key = (gchar *) names[++i]) {
 		key[0] = g_ascii_toupper(key[0]);
 		if (g_str_equal("Size", key) == TRUE) {
-			guint64 size;
 			size = g_ascii_strtoll(values[i], NULL, 10);
 			dict_append_entry(&dict, key, DBUS_TYPE_UINT64, &size);
 		} else
 			dict_append_entry(&dict, key, DBUS_TYPE_STRING, &values[i]);
+
+		if (g_str_equal("Name", key) == TRUE)
+			name = values[i];
 	}
 
 	dbus_message_iter_close_container(iter, &dict);
+
+	/* Length can't describe files above 4 GiB, the listing can */
+	if (name != NULL && size >= 0 && strcasecmp("file", element) == 0)
+		g_hash_table_replace(listing->sizes, g_strdup(name),
+					g_memdup(&size, sizeof(size)));
 }
 
 static const GMarkupParser parser = {
@@ -205,11 +223,14 @@ static void list_folder_callback(struct obc_session *session,
 	GMarkupParseContext *ctxt;
 	DBusMessage *reply;
 	DBusMessageIter iter, array;
+	struct listing listing = { &array, ftp->sizes };
 	const char *buf;
 	int size;
 
 	reply = dbus_message_new_method_return(ftp->msg);
 
+	g_hash_table_remove_all(ftp->sizes);
+
 	buf = obc_transfer_get_buffer(transfer, &size);
 	if (size == 0)
 		goto done;
@@ -220,7 +241,7 @@ static void list_folder_callback(struct obc_session *session,
 			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
 			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
 			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
-	ctxt = g_markup_parse_context_new(&parser, 0, &array, NULL);
+	ctxt = g_markup_parse_context_new(&parser, 0, &listing, NULL);
 	g_markup_parse_context_parse(ctxt, buf, strlen(buf) - 1, NULL);
 	g_markup_parse_context_free(ctxt);
 	dbus_message_iter_close_container(&iter, &array);
@@ -291,6 +312,7 @@ static DBusMessage *get_file(DBusConnection *connection,
 	struct ftp_data *ftp = user_data;
 	struct obc_session *session = ftp->session;
 	const char *target_file, *source_file;
+	gint64 *size;
 
 	if (ftp->msg)
 		return g_dbus_create_error(message,
@@ -304,8 +326,10 @@ static DBusMessage *get_file(DBusConnection *connection,
 		return g_dbus_create_error(message,
 				"org.openobex.Error.InvalidArguments", NULL);
 
-	if (obc_session_get(session, NULL, source_file,
-			target_file, NULL, 0, get_file_callback, ftp) < 0)
+	size = g_hash_table_lookup(ftp->sizes, source_file);
+
+	if (obc_session_get_file(session, source_file, target_file,
+				size ? *size : -1, get_file_callback, ftp) < 0)
 		return g_dbus_create_error(message,
 				"org.openobex.Error.Failed",
 				"Failed");
@@ -454,6 +478,7 @@ static void ftp_free(void *data)
 {
 	struct ftp_data *ftp = data;
 
+	g_hash_table_destroy(ftp->sizes);
 	obc_session_unref(ftp->session);
 	g_free(ftp);
 }
@@ -472,6 +497,8 @@ static int ftp_probe(struct obc_session *session)
 		return -ENOMEM;
 
 	ftp->session = obc_session_ref(session);
+	ftp->sizes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+								g_free);
 
 	if (!g_dbus_register_interface(conn, path, FTP_INTERFACE, ftp_methods,
 						NULL, NULL, ftp, ftp_free)) {
@@ -36,11 +36,14 @@
 
 #include "log.h"
 #include "manager.h"
+#include "transfer.h"
+#include "session.h"
 
 static GMainLoop *event_loop = NULL;
 
 static char *option_debug = NULL;
 static gboolean option_stderr = FALSE;
+static int option_idle_timeout = 0;
 
 static gboolean parse_debug(const char *key, const char *value,
 				gpointer user_data, GError **error)
@@ -53,12 +56,36 @@ static gboolean parse_debug(const char *key, const char *value,
 	return TRUE;
 }
 
+static gboolean parse_fsync(const char *key, const char *value,
+				gpointer user_data, GError **error)
+{
+	if (g_str_equal(value, "none"))
+		obc_transfer_set_sync(OBC_TRANSFER_SYNC_NONE);
+	else if (g_str_equal(value, "complete"))
+		obc_transfer_set_sync(OBC_TRANSFER_SYNC_COMPLETE);
+	else if (g_str_equal(value, "flush"))
+		obc_transfer_set_sync(OBC_TRANSFER_SYNC_FLUSH);
+	else {
+		g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+					"Invalid fsync policy: %s", value);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static GOptionEntry options[] = {
 	{ "debug", 'd', G_OPTION_FLAG_OPTIONAL_ARG,
 				G_OPTION_ARG_CALLBACK, parse_debug,
 				"Enable debug information output", "DEBUG" },
 	{ "stderr", 's', 0, G_OPTION_ARG_NONE, &option_stderr,
 				"Write log information to stderr" },
+	{ "fsync", 0, 0, G_OPTION_ARG_CALLBACK, parse_fsync,
+				"When to sync downloaded files to disk: none, "
+				"complete or flush", "POLICY" },
+	{ "idle-timeout", 'i', 0, G_OPTION_ARG_INT, &option_idle_timeout,
+				"Seconds to keep idle sessions connected "
+				"for reuse", "SECONDS" },
 	{ NULL },
 };
 
@@ -85,6 +112,13 @@ int main(int argc, char *argv[])
 
 	g_option_context_free(context);
 
+	if (option_idle_timeout < 0) {
+		g_printerr("Invalid idle timeout: %d\n", option_idle_timeout);
+		exit(EXIT_FAILURE);
+	}
+
+	obc_session_set_idle_timeout(option_idle_timeout);
+
 	event_loop = g_main_loop_new(NULL, FALSE);
 
 	__obex_log_init("obex-client", option_debug, !option_stderr);
@@ -320,6 +320,40 @@ static DBusMessage *map_push_message(DBusConnection *connection,
 	return NULL;
 }
 
+static DBusMessage *map_push_message_fd(DBusConnection *connection,
+					DBusMessage *message, void *user_data)
+{
+	struct map_data *map = user_data;
+	const char *folder;
+	struct dummy_apparam app;
+	uint8_t buf[2 + sizeof("<UTF-8>") - 1];
+	int fd, err;
+
+	if (dbus_message_get_args(message, NULL,
+				DBUS_TYPE_STRING, &folder,
+				DBUS_TYPE_UNIX_FD, &fd,
+				DBUS_TYPE_INVALID) == FALSE)
+		return g_dbus_create_error(message,
+				"org.openobex.Error.InvalidArguments", NULL);
+
+	app.tag = 0x14;
+	app.len = 1;
+
+	memcpy(buf, &app, 2);
+	memcpy(buf + 2, "<UTF-8>", sizeof(buf) - 2);
+
+	/* The message is streamed from the fd, which the session now owns */
+	err = obc_session_put_fd(map->session, fd, "x-bt/message", folder,
+					buf, sizeof(buf), empty_cb, map);
+	if (err < 0)
+		return g_dbus_create_error(message, "org.openobex.Error.Failed",
+									NULL);
+
+	map->msg = dbus_message_ref(message);
+
+	return NULL;
+}
+
 static GDBusMethodTable map_methods[] = {
 	{ "SetFolder",		"s", "",	map_setpath,
 						G_DBUS_METHOD_FLAG_ASYNC },
@@ -332,6 +366,8 @@ static GDBusMethodTable map_methods[] = {
 						G_DBUS_METHOD_FLAG_ASYNC },
 	{ "PushMessage",	"ss", "s",	map_push_message,
 						G_DBUS_METHOD_FLAG_ASYNC },
+	{ "PushMessageFd",	"sh", "",	map_push_message_fd,
+						G_DBUS_METHOD_FLAG_ASYNC },
 	{ }
 };
 
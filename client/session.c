@@ -59,9 +59,13 @@
 
 static guint64 counter = 0;
 
+/* Seconds a connected session lingers after its last user is gone */
+static guint idle_timeout = 0;
+
 struct callback_data {
 	struct obc_session *session;
 	sdp_session_t *sdp;
+	gboolean cached;	/* channel taken from channel_cache */
 	session_callback_t func;
 	void *data;
 };
@@ -102,21 +106,178 @@ struct obc_session {
 	GSList *pending_calls;
 	void *priv;
 	char *adapter;
+	gboolean reusable;	/* OBEX connected and link still up */
+	guint idle_id;		/* Pending expiry while in the idle pool */
 };
 
 static GSList *sessions = NULL;
 
+/* Adapter object paths by source address, valid until BlueZ tells us
+ * otherwise or refuses a session on them */
+static GHashTable *adapter_cache = NULL;
+static DBusConnection *adapter_conn = NULL;
+static guint adapter_watches[3];
+
+/* RFCOMM channels found through SDP by source/destination/service */
+static GHashTable *channel_cache = NULL;
+
 static void session_prepare_put(struct obc_session *session, GError *err,
 								void *data);
 static void session_terminate_transfer(struct obc_session *session,
 					struct obc_transfer *transfer,
 					GError *gerr);
+static int session_retry_sdp(struct callback_data *callback);
 
 GQuark obex_io_error_quark(void)
 {
 	return g_quark_from_static_string("obex-io-error-quark");
 }
 
+void obc_session_set_idle_timeout(guint seconds)
+{
+	idle_timeout = seconds;
+}
+
+static void adapter_cache_clear(void)
+{
+	guint i;
+
+	if (adapter_cache == NULL)
+		return;
+
+	DBG("");
+
+	g_hash_table_destroy(adapter_cache);
+	adapter_cache = NULL;
+
+	for (i = 0; i < G_N_ELEMENTS(adapter_watches); i++) {
+		if (adapter_watches[i] == 0)
+			continue;
+
+		g_dbus_remove_watch(adapter_conn, adapter_watches[i]);
+		adapter_watches[i] = 0;
+	}
+
+	dbus_connection_unref(adapter_conn);
+	adapter_conn = NULL;
+}
+
+static gboolean adapter_changed(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	adapter_cache_clear();
+
+	return TRUE;
+}
+
+static void bluez_disconnected(DBusConnection *conn, void *user_data)
+{
+	adapter_cache_clear();
+}
+
+static const char *adapter_cache_lookup(struct obc_session *session)
+{
+	char address[18];
+
+	if (adapter_cache == NULL)
+		return NULL;
+
+	ba2str(&session->src, address);
+
+	return g_hash_table_lookup(adapter_cache, address);
+}
+
+static void adapter_cache_add(struct obc_session *session,
+							const char *adapter)
+{
+	char address[18];
+
+	if (adapter_cache == NULL) {
+		adapter_conn = dbus_connection_ref(session->conn_system);
+		adapter_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
+
+		adapter_watches[0] = g_dbus_add_signal_watch(adapter_conn,
+					BT_BUS_NAME, BT_PATH, BT_MANAGER_IFACE,
+					"AdapterRemoved", adapter_changed,
+					NULL, NULL);
+		adapter_watches[1] = g_dbus_add_signal_watch(adapter_conn,
+					BT_BUS_NAME, BT_PATH, BT_MANAGER_IFACE,
+					"DefaultAdapterChanged",
+					adapter_changed, NULL, NULL);
+		adapter_watches[2] = g_dbus_add_disconnect_watch(adapter_conn,
+					BT_BUS_NAME, bluez_disconnected,
+					NULL, NULL);
+	}
+
+	ba2str(&session->src, address);
+
+	g_hash_table_replace(adapter_cache, g_strdup(address),
+							g_strdup(adapter));
+}
+
+static gboolean adapter_cache_match(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	return g_str_equal(value, user_data);
+}
+
+static void adapter_cache_remove(const char *adapter)
+{
+	if (adapter_cache == NULL || adapter == NULL)
+		return;
+
+	g_hash_table_foreach_remove(adapter_cache, adapter_cache_match,
+							(gpointer) adapter);
+}
+
+static char *channel_cache_key(struct obc_session *session)
+{
+	char src[18], dst[18];
+
+	ba2str(&session->src, src);
+	ba2str(&session->dst, dst);
+
+	return g_strdup_printf("%s/%s/%s", src, dst, session->driver->uuid);
+}
+
+static uint8_t channel_cache_lookup(struct obc_session *session)
+{
+	char *key;
+	gpointer channel;
+
+	if (channel_cache == NULL)
+		return 0;
+
+	key = channel_cache_key(session);
+	channel = g_hash_table_lookup(channel_cache, key);
+	g_free(key);
+
+	return GPOINTER_TO_UINT(channel);
+}
+
+static void channel_cache_add(struct obc_session *session, uint8_t channel)
+{
+	if (channel_cache == NULL)
+		channel_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+
+	g_hash_table_replace(channel_cache, channel_cache_key(session),
+						GUINT_TO_POINTER(channel));
+}
+
+static void channel_cache_remove(struct obc_session *session)
+{
+	char *key;
+
+	if (channel_cache == NULL)
+		return;
+
+	key = channel_cache_key(session);
+	g_hash_table_remove(channel_cache, key);
+	g_free(key);
+}
+
 struct obc_session *obc_session_ref(struct obc_session *session)
 {
 	g_atomic_int_inc(&session->refcount);
@@ -190,8 +351,13 @@ static void session_free(struct obc_session *session)
 	if (session->watch)
 		g_dbus_remove_watch(session->conn, session->watch);
 
-	if (session->obex != NULL)
+	if (session->idle_id > 0)
+		g_source_remove(session->idle_id);
+
+	if (session->obex != NULL) {
+		g_obex_set_disconnect_function(session->obex, NULL, NULL);
 		g_obex_unref(session->obex);
+	}
 
 	if (session->io != NULL) {
 		g_io_channel_shutdown(session->io, TRUE, NULL);
@@ -265,6 +431,61 @@ static struct pending_req *send_method_call(DBusConnection *connection,
 	return req;
 }
 
+static void session_release(struct obc_session *session)
+{
+	if (session->adapter)
+		send_method_call(session->conn_system,
+				BT_BUS_NAME, session->adapter,
+				BT_ADAPTER_IFACE, "ReleaseSession",
+				NULL, NULL,
+				DBUS_TYPE_INVALID);
+	session_free(session);
+}
+
+static gboolean session_idle_expired(gpointer user_data)
+{
+	struct obc_session *session = user_data;
+
+	DBG("%p", session);
+
+	session->idle_id = 0;
+	session_release(session);
+
+	return FALSE;
+}
+
+/*
+ * Park a connected session that just lost its last user so a following
+ * request to the same device and service can skip connection setup.
+ * The pool holds the reference until the idle timeout expires.
+ */
+static gboolean session_linger(struct obc_session *session)
+{
+	if (idle_timeout == 0 || !session->reusable || session->pending)
+		return FALSE;
+
+	g_atomic_int_inc(&session->refcount);
+
+	if (session->path)
+		session_unregistered(session);
+
+	if (session->agent) {
+		obc_agent_release(session->agent);
+		obc_agent_free(session->agent);
+		session->agent = NULL;
+	}
+
+	g_free(session->callback);
+	session->callback = NULL;
+
+	session->idle_id = g_timeout_add_seconds(idle_timeout,
+						session_idle_expired, session);
+
+	DBG("%p idle for %u seconds", session, idle_timeout);
+
+	return TRUE;
+}
+
 void obc_session_unref(struct obc_session *session)
 {
 	gboolean ret;
@@ -276,12 +497,26 @@ void obc_session_unref(struct obc_session *session)
 	if (ret == FALSE)
 		return;
 
-	send_method_call(session->conn_system,
-				BT_BUS_NAME, session->adapter,
-				BT_ADAPTER_IFACE, "ReleaseSession",
-				NULL, NULL,
-				DBUS_TYPE_INVALID);
-	session_free(session);
+	if (session_linger(session))
+		return;
+
+	session_release(session);
+}
+
+static void session_disconnected(GObex *obex, GError *err, gpointer user_data)
+{
+	struct obc_session *session = user_data;
+
+	DBG("%p", session);
+
+	session->reusable = FALSE;
+
+	if (session->idle_id == 0)
+		return;
+
+	g_source_remove(session->idle_id);
+	session->idle_id = 0;
+	session_release(session);
 }
 
 static void connect_cb(GObex *obex, GError *err, GObexPacket *rsp,
@@ -301,8 +536,13 @@ static void connect_cb(GObex *obex, GError *err, GObexPacket *rsp,
 	if (rsp_code != G_OBEX_RSP_SUCCESS)
 		gerr = g_error_new(OBEX_IO_ERROR, -EIO,
 				"OBEX Connect failed with 0x%02x", rsp_code);
+	else
+		callback->session->reusable = TRUE;
 
 done:
+	if (gerr != NULL && callback->cached)
+		channel_cache_remove(callback->session);
+
 	callback->func(callback->session, gerr, callback->data);
 	if (gerr != NULL)
 		g_error_free(gerr);
@@ -321,6 +561,10 @@ static void rfcomm_callback(GIOChannel *io, GError *err, gpointer user_data)
 
 	if (err != NULL) {
 		error("%s", err->message);
+
+		if (callback->cached && session_retry_sdp(callback) == 0)
+			return;
+
 		goto done;
 	}
 
@@ -348,6 +592,8 @@ static void rfcomm_callback(GIOChannel *io, GError *err, gpointer user_data)
 		goto done;
 	}
 
+	g_obex_set_disconnect_function(obex, session_disconnected, session);
+
 	session->obex = obex;
 	sessions = g_slist_prepend(sessions, session);
 
@@ -439,6 +685,7 @@ static void search_callback(uint8_t type, uint16_t status,
 		goto failed;
 
 	session->channel = channel;
+	channel_cache_add(session, channel);
 
 	g_io_channel_set_close_on_unref(session->io, FALSE);
 	g_io_channel_unref(session->io);
@@ -586,6 +833,29 @@ static sdp_session_t *service_connect(const bdaddr_t *src, const bdaddr_t *dst,
 	return sdp;
 }
 
+/* A cached channel did not work out, the service may have moved */
+static int session_retry_sdp(struct callback_data *callback)
+{
+	struct obc_session *session = callback->session;
+
+	DBG("channel %u is stale", session->channel);
+
+	channel_cache_remove(session);
+	callback->cached = FALSE;
+	session->channel = 0;
+
+	if (session->io != NULL) {
+		g_io_channel_shutdown(session->io, TRUE, NULL);
+		g_io_channel_unref(session->io);
+		session->io = NULL;
+	}
+
+	callback->sdp = service_connect(&session->src, &session->dst,
+						service_callback, callback);
+
+	return (callback->sdp == NULL) ? -ENOMEM : 0;
+}
+
 static gboolean connection_complete(gpointer data)
 {
 	struct callback_data *cb = data;
@@ -605,6 +875,16 @@ static void owner_disconnected(DBusConnection *connection, void *user_data)
 
 	DBG("");
 
+	/* Nobody else may reuse a session bound to this owner */
+	session->reusable = FALSE;
+
+	if (session->idle_id > 0) {
+		g_source_remove(session->idle_id);
+		session->idle_id = 0;
+		session_release(session);
+		return;
+	}
+
 	obc_session_shutdown(session);
 }
 
@@ -669,6 +949,11 @@ static int session_connect(struct obc_session *session,
 {
 	int err;
 
+	if (session->obex == NULL && session->channel == 0) {
+		session->channel = channel_cache_lookup(session);
+		callback->cached = session->channel > 0;
+	}
+
 	if (session->obex) {
 		g_idle_add(connection_complete, callback);
 		err = 0;
@@ -678,6 +963,9 @@ static int session_connect(struct obc_session *session,
 							rfcomm_callback,
 							callback);
 		err = (session->io == NULL) ? -EINVAL : 0;
+
+		if (err < 0 && callback->cached)
+			err = session_retry_sdp(callback);
 	} else {
 		callback->sdp = service_connect(&session->src, &session->dst,
 						service_callback, callback);
@@ -706,6 +994,7 @@ static void adapter_reply(DBusPendingCall *call, void *user_data)
 				err.name, err.message);
 		dbus_error_free(&err);
 
+		adapter_cache_remove(session->adapter);
 		goto failed;
 	}
 
@@ -722,6 +1011,28 @@ proceed:
 	dbus_message_unref(reply);
 }
 
+static int adapter_request_session(struct obc_session *session,
+					const char *adapter,
+					struct callback_data *callback)
+{
+	struct pending_req *req;
+
+	g_free(session->adapter);
+	session->adapter = g_strdup(adapter);
+
+	req = send_method_call(session->conn_system,
+				BT_BUS_NAME, adapter,
+				BT_ADAPTER_IFACE, "RequestSession",
+				adapter_reply, callback,
+				DBUS_TYPE_INVALID);
+	if (!req)
+		return -ENOMEM;
+
+	session->pending_calls = g_slist_prepend(session->pending_calls, req);
+
+	return 0;
+}
+
 static void manager_reply(DBusPendingCall *call, void *user_data)
 {
 	DBusError err;
@@ -750,17 +1061,10 @@ static void manager_reply(DBusPendingCall *call, void *user_data)
 				DBUS_TYPE_INVALID)) {
 		DBG("adapter path %s", adapter);
 
-		session->adapter = g_strdup(adapter);
-		req = send_method_call(session->conn_system,
-					BT_BUS_NAME, adapter,
-					BT_ADAPTER_IFACE, "RequestSession",
-					adapter_reply, callback,
-					DBUS_TYPE_INVALID);
-		if (!req)
-			goto failed;
+		adapter_cache_add(session, adapter);
 
-		session->pending_calls = g_slist_prepend(session->pending_calls,
-									req);
+		if (adapter_request_session(session, adapter, callback) < 0)
+			goto failed;
 	} else
 		goto failed;
 
@@ -786,13 +1090,21 @@ struct obc_session *obc_session_create(const char *source,
 	struct callback_data *callback;
 	struct pending_req *req;
 	struct obc_driver *driver;
+	const char *adapter;
 
 	if (destination == NULL)
 		return NULL;
 
 	session = session_find(source, destination, service, channel, owner);
 	if (session) {
-		obc_session_ref(session);
+		/* Take over the reference held by the idle pool */
+		if (session->idle_id > 0) {
+			DBG("%p reused from idle pool", session);
+			g_source_remove(session->idle_id);
+			session->idle_id = 0;
+		} else
+			obc_session_ref(session);
+
 		goto proceed;
 	}
 
@@ -840,6 +1152,24 @@ proceed:
 	callback->func = function;
 	callback->data = user_data;
 
+	/* Already holding a BlueZ session on this adapter */
+	if (session->adapter != NULL) {
+		if (session_connect(session, callback) < 0)
+			goto fail;
+
+		goto done;
+	}
+
+	adapter = adapter_cache_lookup(session);
+	if (adapter != NULL) {
+		DBG("cached adapter path %s", adapter);
+
+		if (adapter_request_session(session, adapter, callback) < 0)
+			goto fail;
+
+		goto done;
+	}
+
 	if (source) {
 		req = send_method_call(session->conn_system,
 				BT_BUS_NAME, BT_PATH,
@@ -855,18 +1185,22 @@ proceed:
 				DBUS_TYPE_INVALID);
 	}
 
-	if (!req) {
-		obc_session_unref(session);
-		g_free(callback);
-		return NULL;
-	}
+	if (!req)
+		goto fail;
 
 	session->pending_calls = g_slist_prepend(session->pending_calls, req);
 
+done:
 	if (owner)
 		obc_session_set_owner(session, owner, owner_disconnected);
 
 	return session;
+
+fail:
+	obc_session_unref(session);
+	obc_session_unref(session);
+	g_free(callback);
+	return NULL;
 }
 
 void obc_session_shutdown(struct obc_session *session)
@@ -1219,9 +1553,9 @@ static void session_prepare_get(struct obc_session *session,
 	DBG("Transfer(%p) started", transfer);
 }
 
-int obc_session_get(struct obc_session *session, const char *type,
+static int session_get(struct obc_session *session, const char *type,
 		const char *filename, const char *targetname,
-		const guint8 *apparam, gint apparam_size,
+		const guint8 *apparam, gint apparam_size, gint64 size,
 		session_callback_t func, void *user_data)
 {
 	struct obc_transfer *transfer;
@@ -1248,6 +1582,9 @@ int obc_session_get(struct obc_session *session, const char *type,
 		return -EIO;
 	}
 
+	if (size >= 0)
+		obc_transfer_set_size(transfer, size);
+
 	if (func != NULL) {
 		struct session_callback *callback;
 		callback = g_new0(struct session_callback, 1);
@@ -1263,6 +1600,23 @@ int obc_session_get(struct obc_session *session, const char *type,
 	return 0;
 }
 
+int obc_session_get(struct obc_session *session, const char *type,
+		const char *filename, const char *targetname,
+		const guint8 *apparam, gint apparam_size,
+		session_callback_t func, void *user_data)
+{
+	return session_get(session, type, filename, targetname, apparam,
+					apparam_size, -1, func, user_data);
+}
+
+int obc_session_get_file(struct obc_session *session, const char *filename,
+				const char *targetname, gint64 size,
+				session_callback_t func, void *user_data)
+{
+	return session_get(session, NULL, filename, targetname, NULL, 0,
+						size, func, user_data);
+}
+
 int obc_session_send(struct obc_session *session, const char *filename,
 				const char *targetname)
 {
@@ -1429,6 +1783,64 @@ int obc_session_put(struct obc_session *session, char *buf, const char *type,
 	return 0;
 }
 
+int obc_session_put_fd(struct obc_session *session, int fd, const char *type,
+				const char *targetname,
+				const guint8 *apparam, gint apparam_size,
+				session_callback_t func, void *user_data)
+{
+	struct obc_transfer *transfer;
+	struct obc_transfer_params *params = NULL;
+	int err;
+
+	if (session->obex == NULL)
+		return -ENOTCONN;
+
+	if (session->pending != NULL)
+		return -EISCONN;
+
+	if (apparam != NULL) {
+		params = g_new0(struct obc_transfer_params, 1);
+		params->data = g_memdup(apparam, apparam_size);
+		params->size = apparam_size;
+	}
+
+	transfer = obc_transfer_register(session->conn, NULL, targetname,
+							type, params, session);
+	if (transfer == NULL) {
+		if (params != NULL) {
+			g_free(params->data);
+			g_free(params);
+		}
+		return -EIO;
+	}
+
+	/* The transfer owns the fd from here on */
+	err = obc_transfer_set_fd(transfer, fd);
+	if (err < 0) {
+		close(fd);
+		goto fail;
+	}
+
+	err = session_request(session, session_prepare_put, transfer);
+	if (err < 0)
+		goto fail;
+
+	if (func != NULL) {
+		struct session_callback *callback;
+		callback = g_new0(struct session_callback, 1);
+		callback->func = func;
+		callback->data = user_data;
+		session->callback = callback;
+	}
+
+	return 0;
+
+fail:
+	obc_transfer_unregister(transfer);
+
+	return err;
+}
+
 static void agent_destroy(gpointer data, gpointer user_data)
 {
 	struct obc_session *session = user_data;
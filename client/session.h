@@ -34,6 +34,8 @@ GQuark obex_io_error_quark(void);
 typedef void (*session_callback_t) (struct obc_session *session,
 					GError *err, void *user_data);
 
+void obc_session_set_idle_timeout(guint seconds);
+
 struct obc_session *obc_session_create(const char *source,
 						const char *destination,
 						const char *service,
@@ -70,6 +72,9 @@ int obc_session_get(struct obc_session *session, const char *type,
 		const char *filename, const char *targetname,
 		const guint8  *apparam, gint apparam_size,
 		session_callback_t func, void *user_data);
+int obc_session_get_file(struct obc_session *session, const char *filename,
+				const char *targetname, gint64 size,
+				session_callback_t func, void *user_data);
 int obc_session_pull(struct obc_session *session,
 				const char *type, const char *filename,
 				session_callback_t function, void *user_data);
@@ -79,3 +84,7 @@ int obc_session_put(struct obc_session *session, char *buf, const char *type,
 				const char *filename, const char *targetname,
 				const guint8 *apparam, gint apparam_size,
 				session_callback_t func, void *user_data);
+int obc_session_put_fd(struct obc_session *session, int fd, const char *type,
+				const char *targetname,
+				const guint8 *apparam, gint apparam_size,
+				session_callback_t func, void *user_data);
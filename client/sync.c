@@ -157,12 +157,38 @@ static DBusMessage *sync_putphonebook(DBusConnection *connection,
 	return dbus_message_new_method_return(message);
 }
 
+static DBusMessage *sync_putphonebook_fd(DBusConnection *connection,
+			DBusMessage *message, void *user_data)
+{
+	struct sync_data *sync = user_data;
+	int fd;
+
+	if (dbus_message_get_args(message, NULL,
+			DBUS_TYPE_UNIX_FD, &fd,
+			DBUS_TYPE_INVALID) == FALSE)
+		return g_dbus_create_error(message,
+			ERROR_INF ".InvalidArguments", NULL);
+
+	/* set default phonebook_path to memory internal phonebook */
+	if (!sync->phonebook_path)
+		sync->phonebook_path = g_strdup("telecom/pb.vcf");
+
+	if (obc_session_put_fd(sync->session, fd, NULL, sync->phonebook_path,
+						NULL, 0, NULL, NULL) < 0)
+		return g_dbus_create_error(message,
+				ERROR_INF ".Failed", "Failed");
+
+	return dbus_message_new_method_return(message);
+}
+
 static GDBusMethodTable sync_methods[] = {
 	{ "SetLocation", "s", "", sync_setlocation },
 	{ "GetPhonebook", "", "s", sync_getphonebook,
 			G_DBUS_METHOD_FLAG_ASYNC },
 	{ "PutPhonebook", "s", "", sync_putphonebook,
 			G_DBUS_METHOD_FLAG_ASYNC },
+	{ "PutPhonebookFd", "h", "", sync_putphonebook_fd,
+			G_DBUS_METHOD_FLAG_ASYNC },
 	{}
 };
 
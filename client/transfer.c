@@ -25,16 +25,20 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 #include <gdbus.h>
 
 #include "log.h"
+#include "fileio.h"
 #include "transfer.h"
 #include "session.h"
 
@@ -43,7 +47,11 @@
 
 #define DEFAULT_BUFFER_SIZE 4096
 
+/* Received data is coalesced up to this size before hitting the file */
+#define SINK_BUFFER_SIZE (64 * 1024)
+
 static guint64 counter = 0;
+static enum obc_transfer_sync sync_policy = OBC_TRANSFER_SYNC_NONE;
 
 struct transfer_callback {
 	transfer_callback_t func;
@@ -60,10 +68,13 @@ struct obc_transfer {
 	char *name;		/* Transfer object name */
 	char *type;		/* Transfer object type */
 	int fd;
+	gboolean stream;	/* fd is a pipe or socket */
+	guint fd_watch;
 	guint xfer;
 	char *buffer;
 	size_t buffer_len;
 	int filled;
+	gboolean preallocated;
 	gint64 size;
 	gint64 transferred;
 	int err;
@@ -122,7 +133,8 @@ static DBusMessage *obc_transfer_get_properties(DBusConnection *connection,
 			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
 
 	append_entry(&dict, "Name", DBUS_TYPE_STRING, &transfer->name);
-	append_entry(&dict, "Size", DBUS_TYPE_UINT64, &transfer->size);
+	if (transfer->size >= 0)
+		append_entry(&dict, "Size", DBUS_TYPE_UINT64, &transfer->size);
 	append_entry(&dict, "Filename", DBUS_TYPE_STRING, &transfer->filename);
 
 	dbus_message_iter_close_container(&iter, &dict);
@@ -190,6 +202,9 @@ static void obc_transfer_free(struct obc_transfer *transfer)
 	if (transfer->xfer)
 		g_obex_cancel_transfer(transfer->xfer);
 
+	if (transfer->fd_watch > 0)
+		g_source_remove(transfer->fd_watch);
+
 	if (transfer->fd > 0)
 		close(transfer->fd);
 
@@ -230,6 +245,7 @@ struct obc_transfer *obc_transfer_register(DBusConnection *conn,
 	transfer->name = g_strdup(name);
 	transfer->type = g_strdup(type);
 	transfer->params = params;
+	transfer->size = -1;
 
 	/* for OBEX specific mime types we don't need to register a transfer */
 	if (type != NULL && name == NULL &&
@@ -408,27 +424,166 @@ done:
 		callback->func(transfer, transfer->size, err, callback->data);
 }
 
-static gboolean get_xfer_progress(const void *buf, gsize len,
-							gpointer user_data)
+static int sink_writev(int fd, struct iovec *iov, int iovcnt)
 {
-	struct obc_transfer *transfer = user_data;
-	struct transfer_callback *callback = transfer->callback;
+	while (iovcnt > 0) {
+		ssize_t w = writev(fd, iov, iovcnt);
 
-	obc_transfer_read(transfer, buf, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
 
-	if (transfer->fd > 0) {
-		gint w;
+			return -errno;
+		}
 
-		w = write(transfer->fd, transfer->buffer, transfer->filled);
-		if (w < 0) {
-			transfer->err = -errno;
-			return FALSE;
+		/* Skip over what made it, short writes resume mid-vector */
+		while (iovcnt > 0 && (gsize) w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			iovcnt--;
 		}
 
-		transfer->filled -= w;
+		if (iovcnt > 0) {
+			iov->iov_base = (guint8 *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
 	}
 
-	if (callback)
+	return 0;
+}
+
+static int sink_flush_iov(struct obc_transfer *transfer, const void *buf,
+								gsize len)
+{
+	struct iovec iov[2];
+	int iovcnt = 0, err;
+
+	if (transfer->filled > 0) {
+		iov[iovcnt].iov_base = transfer->buffer;
+		iov[iovcnt].iov_len = transfer->filled;
+		iovcnt++;
+	}
+
+	if (len > 0) {
+		iov[iovcnt].iov_base = (void *) buf;
+		iov[iovcnt].iov_len = len;
+		iovcnt++;
+	}
+
+	if (iovcnt == 0)
+		return 0;
+
+	err = sink_writev(transfer->fd, iov, iovcnt);
+	if (err < 0)
+		return err;
+
+	transfer->filled = 0;
+
+	if (sync_policy == OBC_TRANSFER_SYNC_FLUSH &&
+					fdatasync(transfer->fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int sink_flush(struct obc_transfer *transfer)
+{
+	return sink_flush_iov(transfer, NULL, 0);
+}
+
+static void sink_preallocate(struct obc_transfer *transfer)
+{
+	guint32 length;
+	int err;
+
+	if (transfer->preallocated)
+		return;
+
+	transfer->preallocated = TRUE;
+
+	/* Objects above 4 GiB come without Length, keep the size given */
+	if (g_obex_get_transfer_length(transfer->xfer, &length))
+		transfer->size = length;
+
+	err = fileio_preallocate(transfer->fd, transfer->size);
+	if (err < 0)
+		DBG("fallocate(): %s(%d)", strerror(-err), -err);
+}
+
+static int sink_data(struct obc_transfer *transfer, const void *buf,
+								gsize len)
+{
+	sink_preallocate(transfer);
+
+	/*
+	 * A chunk that doesn't fit goes straight from the packet to the
+	 * file, in one writev together with the buffered data.
+	 */
+	if (transfer->filled + len > SINK_BUFFER_SIZE)
+		return sink_flush_iov(transfer, buf, len);
+
+	if (transfer->buffer_len < SINK_BUFFER_SIZE) {
+		g_free(transfer->buffer);
+		transfer->buffer = g_malloc(SINK_BUFFER_SIZE);
+		transfer->buffer_len = SINK_BUFFER_SIZE;
+	}
+
+	memcpy(transfer->buffer + transfer->filled, buf, len);
+	transfer->filled += len;
+
+	return 0;
+}
+
+static void get_xfer_complete(GObex *obex, GError *err, gpointer user_data)
+{
+	struct obc_transfer *transfer = user_data;
+	GError *gerr = NULL;
+	int ret;
+
+	/* Keep what was received, even if the transfer failed */
+	ret = sink_flush(transfer);
+
+	if (err != NULL) {
+		if (ret < 0)
+			error("write(): %s(%d)", strerror(-ret), -ret);
+		goto done;
+	}
+
+	/* Under OBC_TRANSFER_SYNC_FLUSH the flush already synced */
+	if (ret == 0 && sync_policy == OBC_TRANSFER_SYNC_COMPLETE &&
+					fdatasync(transfer->fd) < 0)
+		ret = -errno;
+
+	if (ret < 0) {
+		error("write(): %s(%d)", strerror(-ret), -ret);
+		gerr = g_error_new(OBEX_IO_ERROR, ret, "%s", strerror(-ret));
+		err = gerr;
+	}
+
+done:
+	xfer_complete(obex, err, transfer);
+
+	if (gerr)
+		g_error_free(gerr);
+}
+
+static gboolean get_xfer_progress(const void *buf, gsize len,
+							gpointer user_data)
+{
+	struct obc_transfer *transfer = user_data;
+	struct transfer_callback *callback = transfer->callback;
+	int err;
+
+	err = sink_data(transfer, buf, len);
+	if (err < 0) {
+		transfer->err = err;
+		return FALSE;
+	}
+
+	transfer->transferred += len;
+
+	/* Completion is only reported once the data has been flushed */
+	if (callback && transfer->transferred != transfer->size)
 		callback->func(transfer, transfer->transferred, NULL,
 							callback->data);
 
@@ -460,18 +615,69 @@ static gssize put_buf_xfer_progress(void *buf, gsize len, gpointer user_data)
 	return size;
 }
 
+static gboolean put_fd_ready(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct obc_transfer *transfer = user_data;
+
+	transfer->fd_watch = 0;
+
+	/* Errors and hangups are picked up by the next read */
+	g_obex_resume(obc_session_get_obex(transfer->session));
+
+	return FALSE;
+}
+
+static void put_fd_watch(struct obc_transfer *transfer)
+{
+	GIOChannel *io;
+
+	if (transfer->fd_watch > 0)
+		return;
+
+	io = g_io_channel_unix_new(transfer->fd);
+	transfer->fd_watch = g_io_add_watch(io,
+					G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+					put_fd_ready, transfer);
+	g_io_channel_unref(io);
+}
+
+static gboolean put_fd_readable(struct obc_transfer *transfer)
+{
+	struct pollfd pfd = { .fd = transfer->fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) != 0;
+}
+
 static gssize put_xfer_progress(void *buf, gsize len, gpointer user_data)
 {
 	struct obc_transfer *transfer = user_data;
 	struct transfer_callback *callback = transfer->callback;
 	gssize size;
 
+	/*
+	 * Don't block the mainloop on pipes and sockets, gobex suspends
+	 * the transfer on -EAGAIN until the fd becomes readable.
+	 */
+	if (transfer->stream && !put_fd_readable(transfer)) {
+		put_fd_watch(transfer);
+		return -EAGAIN;
+	}
+
 	size = read(transfer->fd, buf, len);
-	if (size <= 0) {
+	if (size < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			put_fd_watch(transfer);
+			return -EAGAIN;
+		}
+
 		transfer->err = -errno;
-		return size;
+		return -errno;
 	}
 
+	if (size == 0)
+		return 0;
+
 	if (callback)
 		callback->func(transfer, transfer->transferred, NULL,
 							callback->data);
@@ -524,7 +730,7 @@ int obc_transfer_get(struct obc_transfer *transfer, transfer_callback_t func,
 		}
 		transfer->fd = fd;
 		data_cb = get_xfer_progress;
-		complete_cb = xfer_complete;
+		complete_cb = get_xfer_complete;
 	}
 
 	obex = obc_session_get_obex(session);
@@ -592,7 +798,7 @@ done:
 		g_obex_packet_add_bytes(req, G_OBEX_HDR_TYPE, transfer->type,
 						strlen(transfer->type) + 1);
 
-	if (transfer->size < UINT32_MAX)
+	if (transfer->size >= 0 && transfer->size < UINT32_MAX)
 		g_obex_packet_add_uint32(req, G_OBEX_HDR_LENGTH, transfer->size);
 
 	if (transfer->params != NULL)
@@ -658,6 +864,44 @@ gint64 obc_transfer_get_size(struct obc_transfer *transfer)
 	return transfer->size;
 }
 
+void obc_transfer_set_size(struct obc_transfer *transfer, gint64 size)
+{
+	transfer->size = size;
+}
+
+int obc_transfer_set_fd(struct obc_transfer *transfer, int fd)
+{
+	struct stat st;
+	off_t offset;
+
+	if (fstat(fd, &st) < 0) {
+		error("fstat(): %s(%d)", strerror(errno), errno);
+		return -errno;
+	}
+
+	transfer->fd = fd;
+
+	if (!S_ISREG(st.st_mode)) {
+		transfer->stream = TRUE;
+		transfer->size = -1;
+		return 0;
+	}
+
+	/* Regular files (and memfds) are sent from the current offset */
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset > st.st_size)
+		offset = 0;
+
+	transfer->size = st.st_size - offset;
+
+	return 0;
+}
+
+void obc_transfer_set_sync(enum obc_transfer_sync policy)
+{
+	sync_policy = policy;
+}
+
 int obc_transfer_set_file(struct obc_transfer *transfer)
 {
 	int fd;
@@ -28,6 +28,13 @@ struct obc_transfer_params {
 
 struct obc_transfer;
 
+/* When downloaded data is forced to stable storage */
+enum obc_transfer_sync {
+	OBC_TRANSFER_SYNC_NONE,		/* Left to the kernel */
+	OBC_TRANSFER_SYNC_COMPLETE,	/* Once the transfer completes */
+	OBC_TRANSFER_SYNC_FLUSH,	/* After every coalesced write */
+};
+
 typedef void (*transfer_callback_t) (struct obc_transfer *transfer,
 					gint64 transferred, GError *err,
 					void *user_data);
@@ -55,4 +62,7 @@ void obc_transfer_clear_buffer(struct obc_transfer *transfer);
 void obc_transfer_set_name(struct obc_transfer *transfer, const char *name);
 const char *obc_transfer_get_path(struct obc_transfer *transfer);
 gint64 obc_transfer_get_size(struct obc_transfer *transfer);
+void obc_transfer_set_size(struct obc_transfer *transfer, gint64 size);
 int obc_transfer_set_file(struct obc_transfer *transfer);
+int obc_transfer_set_fd(struct obc_transfer *transfer, int fd);
+void obc_transfer_set_sync(enum obc_transfer_sync policy);
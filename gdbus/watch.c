@@ -41,7 +41,19 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 					DBusMessage *message, void *user_data);
 
 static guint listener_id = 0;
-static GSList *listeners = NULL;
+static guint listener_seq = 0;
+static GQueue listeners = G_QUEUE_INIT;
+
+/*
+ * Signal dispatch would otherwise scan every listener, so listeners are
+ * also indexed by member and arg0 (and by member alone for signals which
+ * have no string arg0). Lists are kept in registration order so lookups
+ * return the same listener a full scan would.
+ */
+static GHashTable *match_index = NULL;
+static GHashTable *member_index = NULL;
+static GHashTable *name_index = NULL;
+static GHashTable *callback_index = NULL;
 
 struct service_data {
 	DBusConnection *conn;
@@ -58,6 +70,7 @@ struct filter_callback {
 	GDBusSignalFunction signal_func;
 	GDBusDestroyFunction destroy_func;
 	struct service_data *data;
+	struct filter_data *filter;
 	void *user_data;
 	guint id;
 };
@@ -76,52 +89,186 @@ struct filter_data {
 	guint name_watch;
 	gboolean lock;
 	gboolean registered;
+	guint seq;
+	char *match_key;
+	char *member_key;
+	GList *link;
 };
 
-static struct filter_data *filter_data_find(DBusConnection *connection,
-							const char *name,
-							const char *owner,
-							const char *path,
-							const char *interface,
-							const char *member,
-							const char *argument)
+struct filter_query {
+	DBusConnection *connection;
+	const char *name;
+	const char *owner;
+	const char *path;
+	const char *interface;
+	const char *member;
+	const char *argument;
+};
+
+static char *index_key(const char *member, const char *argument)
+{
+	/* Prefixes keep NULL (wildcard) apart from empty strings */
+	return g_strconcat(member ? "+" : "-", member ? member : "", "\n",
+				argument ? "+" : "-", argument ? argument : "",
+				NULL);
+}
+
+static void index_add(GHashTable **index, const char *key,
+						struct filter_data *data)
 {
-	GSList *current;
+	GSList *list;
 
-	for (current = listeners;
-			current != NULL; current = current->next) {
-		struct filter_data *data = current->data;
+	if (*index == NULL)
+		*index = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
 
-		if (connection != data->connection)
-			continue;
+	list = g_hash_table_lookup(*index, key);
+	list = g_slist_append(list, data);
+	g_hash_table_insert(*index, g_strdup(key), list);
+}
 
-		if (name && data->name &&
-				g_str_equal(name, data->name) == FALSE)
-			continue;
+static void index_remove(GHashTable *index, const char *key,
+						struct filter_data *data)
+{
+	GSList *list;
 
-		if (owner && data->owner &&
-				g_str_equal(owner, data->owner) == FALSE)
-			continue;
+	if (index == NULL)
+		return;
 
-		if (path && data->path &&
-				g_str_equal(path, data->path) == FALSE)
-			continue;
+	list = g_hash_table_lookup(index, key);
+	list = g_slist_remove(list, data);
 
-		if (interface && data->interface &&
-				g_str_equal(interface, data->interface) == FALSE)
-			continue;
+	if (list == NULL)
+		g_hash_table_remove(index, key);
+	else
+		g_hash_table_insert(index, g_strdup(key), list);
+}
 
-		if (member && data->member &&
-				g_str_equal(member, data->member) == FALSE)
-			continue;
+static void filter_data_link(struct filter_data *data)
+{
+	data->seq = ++listener_seq;
+	data->match_key = index_key(data->member, data->argument);
+	data->member_key = index_key(data->member, NULL);
 
-		if (argument && data->argument &&
-				g_str_equal(argument, data->argument) == FALSE)
-			continue;
+	g_queue_push_tail(&listeners, data);
+	data->link = g_queue_peek_tail_link(&listeners);
 
+	index_add(&match_index, data->match_key, data);
+	index_add(&member_index, data->member_key, data);
+
+	if (data->name)
+		index_add(&name_index, data->name, data);
+}
+
+static void filter_data_unlink(struct filter_data *data)
+{
+	g_queue_delete_link(&listeners, data->link);
+	data->link = NULL;
+
+	index_remove(match_index, data->match_key, data);
+	index_remove(member_index, data->member_key, data);
+
+	if (data->name)
+		index_remove(name_index, data->name, data);
+}
+
+static gboolean filter_data_match(struct filter_data *data,
+					const struct filter_query *query)
+{
+	if (query->connection != data->connection)
+		return FALSE;
+
+	if (query->name && data->name &&
+			g_str_equal(query->name, data->name) == FALSE)
+		return FALSE;
+
+	if (query->owner && data->owner &&
+			g_str_equal(query->owner, data->owner) == FALSE)
+		return FALSE;
+
+	if (query->path && data->path &&
+			g_str_equal(query->path, data->path) == FALSE)
+		return FALSE;
+
+	if (query->interface && data->interface &&
+			g_str_equal(query->interface, data->interface) == FALSE)
+		return FALSE;
+
+	if (query->member && data->member &&
+			g_str_equal(query->member, data->member) == FALSE)
+		return FALSE;
+
+	if (query->argument && data->argument &&
+			g_str_equal(query->argument, data->argument) == FALSE)
+		return FALSE;
+
+	return TRUE;
+}
+
+static struct filter_data *bucket_find(GHashTable *index,
+					const char *member,
+					const char *argument,
+					const struct filter_query *query,
+					struct filter_data *best)
+{
+	char *key;
+	GSList *l;
+
+	if (index == NULL)
+		return best;
+
+	key = index_key(member, argument);
+	l = g_hash_table_lookup(index, key);
+	g_free(key);
+
+	for (; l != NULL; l = l->next) {
+		struct filter_data *data = l->data;
+
+		/* An earlier registered listener already matched */
+		if (best && best->seq < data->seq)
+			break;
+
+		if (filter_data_match(data, query))
+			return data;
+	}
+
+	return best;
+}
+
+static struct filter_data *filter_data_find(DBusConnection *connection,
+							const char *name,
+							const char *owner,
+							const char *path,
+							const char *interface,
+							const char *member,
+							const char *argument)
+{
+	struct filter_query query = { connection, name, owner, path,
+					interface, member, argument };
+	struct filter_data *data = NULL;
+	GList *l;
+
+	if (member != NULL && argument != NULL) {
+		data = bucket_find(match_index, member, argument, &query, data);
+		data = bucket_find(match_index, member, NULL, &query, data);
+		data = bucket_find(match_index, NULL, argument, &query, data);
+		data = bucket_find(match_index, NULL, NULL, &query, data);
 		return data;
 	}
 
+	if (member != NULL) {
+		data = bucket_find(member_index, member, NULL, &query, data);
+		data = bucket_find(member_index, NULL, NULL, &query, data);
+		return data;
+	}
+
+	for (l = listeners.head; l != NULL; l = l->next) {
+		data = l->data;
+
+		if (filter_data_match(data, &query))
+			return data;
+	}
+
 	return NULL;
 }
 
@@ -241,37 +388,25 @@ proceed:
 		return NULL;
 	}
 
-	listeners = g_slist_append(listeners, data);
+	filter_data_link(data);
 
 	return data;
 }
 
-static struct filter_callback *filter_data_find_callback(
-						struct filter_data *data,
-						guint id)
+static void callback_index_remove(struct filter_callback *cb)
 {
-	GSList *l;
-
-	for (l = data->callbacks; l; l = l->next) {
-		struct filter_callback *cb = l->data;
-		if (cb->id == id)
-			return cb;
-	}
-	for (l = data->processed; l; l = l->next) {
-		struct filter_callback *cb = l->data;
-		if (cb->id == id)
-			return cb;
-	}
-
-	return NULL;
+	if (callback_index != NULL)
+		g_hash_table_remove(callback_index, GUINT_TO_POINTER(cb->id));
 }
 
 static void filter_data_free(struct filter_data *data)
 {
 	GSList *l;
 
-	for (l = data->callbacks; l != NULL; l = l->next)
+	for (l = data->callbacks; l != NULL; l = l->next) {
+		callback_index_remove(l->data);
 		g_free(l->data);
+	}
 
 	g_slist_free(data->callbacks);
 	g_dbus_remove_watch(data->connection, data->name_watch);
@@ -281,6 +416,8 @@ static void filter_data_free(struct filter_data *data)
 	g_free(data->interface);
 	g_free(data->member);
 	g_free(data->argument);
+	g_free(data->match_key);
+	g_free(data->member_key);
 	dbus_connection_unref(data->connection);
 	g_free(data);
 }
@@ -295,9 +432,13 @@ static void filter_data_call_and_free(struct filter_data *data)
 			cb->disc_func(data->connection, cb->user_data);
 		if (cb->destroy_func)
 			cb->destroy_func(cb->user_data);
+		callback_index_remove(cb);
 		g_free(cb);
 	}
 
+	g_slist_free(data->callbacks);
+	data->callbacks = NULL;
+
 	filter_data_free(data);
 }
 
@@ -318,8 +459,14 @@ static struct filter_callback *filter_data_add_callback(
 	cb->signal_func = signal;
 	cb->destroy_func = destroy;
 	cb->user_data = user_data;
+	cb->filter = data;
 	cb->id = ++listener_id;
 
+	if (callback_index == NULL)
+		callback_index = g_hash_table_new(NULL, NULL);
+
+	g_hash_table_insert(callback_index, GUINT_TO_POINTER(cb->id), cb);
+
 	if (data->lock)
 		data->processed = g_slist_append(data->processed, cb);
 	else
@@ -364,6 +511,7 @@ static gboolean filter_data_remove_callback(struct filter_data *data,
 	if (cb->destroy_func)
 		cb->destroy_func(cb->user_data);
 
+	callback_index_remove(cb);
 	g_free(cb);
 
 	/* Don't remove the filter if other callbacks exist or data is lock
@@ -375,7 +523,7 @@ static gboolean filter_data_remove_callback(struct filter_data *data,
 		return FALSE;
 
 	connection = dbus_connection_ref(data->connection);
-	listeners = g_slist_remove(listeners, data);
+	filter_data_unlink(data);
 	filter_data_free(data);
 
 	/* Remove filter if there are no listeners left for the connection */
@@ -421,11 +569,11 @@ static void update_name_cache(const char *name, const char *owner)
 {
 	GSList *l;
 
-	for (l = listeners; l != NULL; l = l->next) {
-		struct filter_data *data = l->data;
+	if (name == NULL || name_index == NULL)
+		return;
 
-		if (g_strcmp0(data->name, name) != 0)
-			continue;
+	for (l = g_hash_table_lookup(name_index, name); l; l = l->next) {
+		struct filter_data *data = l->data;
 
 		g_free(data->owner);
 		data->owner = g_strdup(owner);
@@ -436,16 +584,14 @@ static const char *check_name_cache(const char *name)
 {
 	GSList *l;
 
-	for (l = listeners; l != NULL; l = l->next) {
-		struct filter_data *data = l->data;
-
-		if (g_strcmp0(data->name, name) != 0)
-			continue;
+	if (name == NULL || name_index == NULL)
+		return NULL;
 
-		return data->owner;
-	}
+	l = g_hash_table_lookup(name_index, name);
+	if (l == NULL)
+		return NULL;
 
-	return NULL;
+	return ((struct filter_data *) l->data)->owner;
 }
 
 static DBusHandlerResult service_filter(DBusConnection *connection,
@@ -536,7 +682,7 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 
 	remove_match(data);
 
-	listeners = g_slist_remove(listeners, data);
+	filter_data_unlink(data);
 	filter_data_free(data);
 
 	/* Remove filter if there no listener left for the connection */
@@ -714,24 +860,18 @@ guint g_dbus_add_signal_watch(DBusConnection *connection,
 
 gboolean g_dbus_remove_watch(DBusConnection *connection, guint id)
 {
-	struct filter_data *data;
 	struct filter_callback *cb;
-	GSList *ldata;
 
-	if (id == 0)
+	if (id == 0 || callback_index == NULL)
 		return FALSE;
 
-	for (ldata = listeners; ldata; ldata = ldata->next) {
-		data = ldata->data;
+	cb = g_hash_table_lookup(callback_index, GUINT_TO_POINTER(id));
+	if (cb == NULL)
+		return FALSE;
 
-		cb = filter_data_find_callback(data, id);
-		if (cb) {
-			filter_data_remove_callback(data, cb);
-			return TRUE;
-		}
-	}
+	filter_data_remove_callback(cb->filter, cb);
 
-	return FALSE;
+	return TRUE;
 }
 
 void g_dbus_remove_all_watches(DBusConnection *connection)
@@ -740,7 +880,7 @@ void g_dbus_remove_all_watches(DBusConnection *connection)
 
 	while ((data = filter_data_find(connection, NULL, NULL, NULL, NULL,
 					NULL, NULL))) {
-		listeners = g_slist_remove(listeners, data);
+		filter_data_unlink(data);
 		filter_data_call_and_free(data);
 	}
 
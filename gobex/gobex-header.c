@@ -134,6 +134,64 @@ gssize g_obex_header_encode(GObexHeader *header, void *buf, gsize buf_len)
 	return header->hlen;
 }
 
+/* Checks the framing of a header, returning its length or 0 on error */
+gsize g_obex_header_parse_length(const void *data, gsize len, GError **err)
+{
+	const guint8 *buf = data;
+	guint16 hdr_len;
+
+	if (len < 2) {
+		g_set_error(err, G_OBEX_ERROR, G_OBEX_ERROR_PARSE_ERROR,
+						"Too short header in packet");
+		goto failed;
+	}
+
+	switch (G_OBEX_HDR_ENC(buf[0])) {
+	case G_OBEX_HDR_ENC_UNICODE:
+	case G_OBEX_HDR_ENC_BYTES:
+		if (len < 3) {
+			g_set_error(err, G_OBEX_ERROR,
+					G_OBEX_ERROR_PARSE_ERROR,
+					"Not enough data for header (0x%02x)",
+					buf[0]);
+			goto failed;
+		}
+
+		memcpy(&hdr_len, &buf[1], sizeof(hdr_len));
+		hdr_len = g_ntohs(hdr_len);
+
+		/* Non-empty strings need at least the NUL terminator */
+		if (hdr_len > len || hdr_len < 3 || (hdr_len == 4 &&
+				G_OBEX_HDR_ENC(buf[0]) == G_OBEX_HDR_ENC_UNICODE)) {
+			g_set_error(err, G_OBEX_ERROR,
+				G_OBEX_ERROR_PARSE_ERROR,
+				"Invalid header (0x%02x) length (%u)",
+				buf[0], hdr_len);
+			goto failed;
+		}
+
+		return hdr_len;
+	case G_OBEX_HDR_ENC_UINT8:
+		return 2;
+	case G_OBEX_HDR_ENC_UINT32:
+		if (len < 5) {
+			g_set_error(err, G_OBEX_ERROR,
+					G_OBEX_ERROR_PARSE_ERROR,
+					"Too short uint32 header");
+			goto failed;
+		}
+
+		return 5;
+	}
+
+	g_assert_not_reached();
+
+failed:
+	if (err && *err)
+		g_obex_debug(G_OBEX_DEBUG_ERROR, "%s", (*err)->message);
+	return 0;
+}
+
 GObexHeader *g_obex_header_decode(const void *data, gsize len,
 				GObexDataPolicy data_policy, gsize *parsed,
 				GError **err)
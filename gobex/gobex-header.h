@@ -80,6 +80,7 @@ guint8 g_obex_header_get_id(GObexHeader *header);
 guint16 g_obex_header_get_length(GObexHeader *header);
 
 gssize g_obex_header_encode(GObexHeader *header, void *buf, gsize buf_len);
+gsize g_obex_header_parse_length(const void *data, gsize len, GError **err);
 GObexHeader *g_obex_header_decode(const void *data, gsize len,
 				GObexDataPolicy data_policy, gsize *parsed,
 				GError **err);
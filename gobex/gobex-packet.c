@@ -32,6 +32,17 @@
 
 #define FINAL_BIT 0x80
 
+/* Headers of decoded packets kept inline, more need an allocation */
+#define INLINE_HEADERS 8
+
+/* Header of a decoded packet, turned into a GObexHeader when accessed */
+struct packet_header {
+	guint8 id;
+	guint16 offset;		/* Into the encoded headers */
+	guint16 len;
+	GObexHeader *hdr;
+};
+
 struct _GObexPacket {
 	guint8 opcode;
 	gboolean final;
@@ -47,16 +58,91 @@ struct _GObexPacket {
 	gsize hlen;		/* Length of all encoded headers */
 	GSList *headers;
 
+	/* Received headers, only decoded on first access */
+	const guint8 *hbuf;
+	guint8 *hbuf_copy;
+	struct packet_header *lazy;
+	guint nlazy;
+	guint8 lookup[256];	/* Position + 1 of the first header by id */
+	struct packet_header inline_hdrs[INLINE_HEADERS];
+
 	GObexDataProducer get_body;
 	gpointer get_body_data;
 };
 
+static GObexHeader *lazy_header(struct packet_header *ph,
+							const guint8 *hbuf)
+{
+	GError *err = NULL;
+	gsize parsed;
+
+	if (ph->hdr != NULL)
+		return ph->hdr;
+
+	/* Copied packets keep their own buffer, so it can be referenced */
+	ph->hdr = g_obex_header_decode(hbuf + ph->offset, ph->len,
+					G_OBEX_DATA_REF, &parsed, &err);
+	if (ph->hdr == NULL) {
+		g_obex_debug(G_OBEX_DEBUG_ERROR, "%s", err->message);
+		g_error_free(err);
+	}
+
+	return ph->hdr;
+}
+
+static GObexHeader *lazy_get_header(GObexPacket *pkt, guint8 id)
+{
+	guint i;
+
+	i = pkt->lookup[id];
+	if (i > 0)
+		return lazy_header(&pkt->lazy[i - 1], pkt->hbuf);
+
+	/* Only the first 255 headers fit the lookup table */
+	for (i = G_MAXUINT8; i < pkt->nlazy; i++) {
+		if (pkt->lazy[i].id == id)
+			return lazy_header(&pkt->lazy[i], pkt->hbuf);
+	}
+
+	return NULL;
+}
+
+/* Turns the received headers into a regular list before modifications */
+static void lazy_materialize(GObexPacket *pkt)
+{
+	guint i;
+
+	if (pkt->lazy == NULL)
+		return;
+
+	for (i = pkt->nlazy; i > 0; i--) {
+		struct packet_header *ph = &pkt->lazy[i - 1];
+		GObexHeader *hdr = lazy_header(ph, pkt->hbuf);
+
+		if (hdr == NULL) {
+			pkt->hlen -= ph->len;
+			continue;
+		}
+
+		pkt->headers = g_slist_prepend(pkt->headers, hdr);
+	}
+
+	if (pkt->lazy != pkt->inline_hdrs)
+		g_free(pkt->lazy);
+
+	pkt->lazy = NULL;
+	pkt->nlazy = 0;
+}
+
 GObexHeader *g_obex_packet_get_header(GObexPacket *pkt, guint8 id)
 {
 	GSList *l;
 
 	g_obex_debug(G_OBEX_DEBUG_PACKET, "opcode 0x%02x", pkt->opcode);
 
+	if (pkt->lazy != NULL)
+		return lazy_get_header(pkt, id);
+
 	for (l = pkt->headers; l != NULL; l = g_slist_next(l)) {
 		GObexHeader *hdr = l->data;
 
@@ -94,6 +180,8 @@ gboolean g_obex_packet_prepend_header(GObexPacket *pkt, GObexHeader *header)
 {
 	g_obex_debug(G_OBEX_DEBUG_PACKET, "opcode 0x%02x", pkt->opcode);
 
+	lazy_materialize(pkt);
+
 	pkt->headers = g_slist_prepend(pkt->headers, header);
 	pkt->hlen += g_obex_header_get_length(header);
 
@@ -104,6 +192,8 @@ gboolean g_obex_packet_add_header(GObexPacket *pkt, GObexHeader *header)
 {
 	g_obex_debug(G_OBEX_DEBUG_PACKET, "opcode 0x%02x", pkt->opcode);
 
+	lazy_materialize(pkt);
+
 	pkt->headers = g_slist_append(pkt->headers, header);
 	pkt->hlen += g_obex_header_get_length(header);
 
@@ -261,6 +351,8 @@ GObexPacket *g_obex_packet_new(guint8 opcode, gboolean final,
 
 void g_obex_packet_free(GObexPacket *pkt)
 {
+	guint i;
+
 	g_obex_debug(G_OBEX_DEBUG_PACKET, "opcode 0x%02x", pkt->opcode);
 
 	switch (pkt->data_policy) {
@@ -272,35 +364,76 @@ void g_obex_packet_free(GObexPacket *pkt)
 		break;
 	}
 
+	for (i = 0; i < pkt->nlazy; i++) {
+		if (pkt->lazy[i].hdr != NULL)
+			g_obex_header_free(pkt->lazy[i].hdr);
+	}
+
+	if (pkt->lazy != pkt->inline_hdrs)
+		g_free(pkt->lazy);
+
 	g_slist_foreach(pkt->headers, (GFunc) g_obex_header_free, NULL);
 	g_slist_free(pkt->headers);
+	g_free(pkt->hbuf_copy);
 	g_free(pkt);
 }
 
+/*
+ * Only the framing is checked here, headers are decoded when looked up so
+ * that e.g. a PUT stream does not pay for headers nobody reads.
+ */
 static gboolean parse_headers(GObexPacket *pkt, const void *data, gsize len,
 						GObexDataPolicy data_policy,
 						GError **err)
 {
 	const guint8 *buf = data;
+	gsize offset, parsed;
+	guint i, count = 0;
 
 	g_obex_debug(G_OBEX_DEBUG_PACKET, "opcode 0x%02x", pkt->opcode);
 
-	while (len > 0) {
-		GObexHeader *header;
-		gsize parsed;
-
-		header = g_obex_header_decode(buf, len, data_policy, &parsed,
-									err);
-		if (header == NULL)
+	for (offset = 0; offset < len; offset += parsed) {
+		parsed = g_obex_header_parse_length(buf + offset, len - offset,
+								err);
+		if (parsed == 0)
 			return FALSE;
 
-		pkt->headers = g_slist_append(pkt->headers, header);
-		pkt->hlen += parsed;
+		count++;
+	}
 
-		len -= parsed;
-		buf += parsed;
+	if (count == 0)
+		return TRUE;
+
+	if (data_policy == G_OBEX_DATA_COPY) {
+		pkt->hbuf_copy = g_memdup(data, len);
+		buf = pkt->hbuf_copy;
+	}
+
+	pkt->hbuf = buf;
+	pkt->hlen = len;
+
+	if (count <= INLINE_HEADERS)
+		pkt->lazy = pkt->inline_hdrs;
+	else
+		pkt->lazy = g_new(struct packet_header, count);
+
+	for (i = 0, offset = 0; i < count; i++, offset += parsed) {
+		struct packet_header *ph = &pkt->lazy[i];
+
+		parsed = g_obex_header_parse_length(buf + offset, len - offset,
+								NULL);
+
+		ph->id = buf[offset];
+		ph->offset = offset;
+		ph->len = parsed;
+		ph->hdr = NULL;
+
+		if (i < G_MAXUINT8 && pkt->lookup[ph->id] == 0)
+			pkt->lookup[ph->id] = i + 1;
 	}
 
+	pkt->nlazy = count;
+
 	return TRUE;
 }
 
@@ -422,6 +555,12 @@ gssize g_obex_packet_encode(GObexPacket *pkt, guint8 *buf, gsize len)
 
 	count = 3 + pkt->data_len;
 
+	/* Received headers are forwarded as they came in */
+	if (pkt->lazy != NULL) {
+		memcpy(buf + count, pkt->hbuf, pkt->hlen);
+		count += pkt->hlen;
+	}
+
 	for (l = pkt->headers; l != NULL; l = g_slist_next(l)) {
 		GObexHeader *hdr = l->data;
 
@@ -0,0 +1,148 @@
+/*
+ *
+ *  OBEX library with GLib integration
+ *
+ *  Copyright (C) 2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <time.h>
+
+#include "gobex-shaper.h"
+
+/* Tokens are accumulated for at most this long while idle */
+#define BURST_MSEC	100
+#define BURST_MIN	4096
+
+struct _GObexShaper {
+	gint ref_count;
+	guint64 rate;		/* Bytes per second, 0 for unlimited */
+	gint64 tokens;		/* Negative while in debt */
+	guint64 last;		/* Last refill in microseconds */
+};
+
+static guint64 shaper_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static gint64 shaper_burst(GObexShaper *shaper)
+{
+	return MAX(shaper->rate * BURST_MSEC / 1000, BURST_MIN);
+}
+
+static void shaper_refill(GObexShaper *shaper)
+{
+	guint64 now = shaper_time();
+	guint64 elapsed = now - shaper->last;
+
+	shaper->last = now;
+
+	if (shaper->rate == 0)
+		return;
+
+	/* Avoid overflowing after long idle periods */
+	if (elapsed > 1000000)
+		elapsed = 1000000;
+
+	shaper->tokens += shaper->rate * elapsed / 1000000;
+	shaper->tokens = MIN(shaper->tokens, shaper_burst(shaper));
+}
+
+GObexShaper *g_obex_shaper_new(guint64 rate)
+{
+	GObexShaper *shaper;
+
+	shaper = g_new0(GObexShaper, 1);
+	shaper->ref_count = 1;
+	shaper->last = shaper_time();
+	shaper->rate = rate;
+
+	/* Start with a full bucket */
+	if (rate > 0)
+		shaper->tokens = shaper_burst(shaper);
+
+	return shaper;
+}
+
+GObexShaper *g_obex_shaper_ref(GObexShaper *shaper)
+{
+	g_atomic_int_inc(&shaper->ref_count);
+
+	return shaper;
+}
+
+void g_obex_shaper_unref(GObexShaper *shaper)
+{
+	if (!g_atomic_int_dec_and_test(&shaper->ref_count))
+		return;
+
+	g_free(shaper);
+}
+
+void g_obex_shaper_set_rate(GObexShaper *shaper, guint64 rate)
+{
+	shaper_refill(shaper);
+
+	shaper->rate = rate;
+
+	/* Any debt is forgiven when the limit is lifted */
+	if (rate == 0)
+		shaper->tokens = 0;
+	else
+		shaper->tokens = MIN(shaper->tokens, shaper_burst(shaper));
+}
+
+guint64 g_obex_shaper_get_rate(GObexShaper *shaper)
+{
+	return shaper->rate;
+}
+
+/* Returns the milliseconds to wait before the next packet may be sent */
+guint g_obex_shaper_delay(GObexShaper *shaper)
+{
+	if (shaper->rate == 0)
+		return 0;
+
+	shaper_refill(shaper);
+
+	if (shaper->tokens > 0)
+		return 0;
+
+	return (-shaper->tokens + 1) * 1000 / shaper->rate + 1;
+}
+
+/*
+ * Packets are never split, a packet allowed to go out may take the bucket
+ * into debt which the following packets have to wait out.
+ */
+void g_obex_shaper_consume(GObexShaper *shaper, gsize bytes)
+{
+	if (shaper->rate == 0)
+		return;
+
+	shaper_refill(shaper);
+
+	shaper->tokens -= bytes;
+}
@@ -0,0 +1,44 @@
+/*
+ *
+ *  OBEX library with GLib integration
+ *
+ *  Copyright (C) 2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __GOBEX_SHAPER_H
+#define __GOBEX_SHAPER_H
+
+#include <glib.h>
+
+/*
+ * Token bucket limiting the rate at which packets are sent. A shaper can
+ * be shared by several GObex instances to cap their combined rate, e.g.
+ * all sessions to the same peer.
+ */
+typedef struct _GObexShaper GObexShaper;
+
+GObexShaper *g_obex_shaper_new(guint64 rate);
+GObexShaper *g_obex_shaper_ref(GObexShaper *shaper);
+void g_obex_shaper_unref(GObexShaper *shaper);
+
+void g_obex_shaper_set_rate(GObexShaper *shaper, guint64 rate);
+guint64 g_obex_shaper_get_rate(GObexShaper *shaper);
+
+guint g_obex_shaper_delay(GObexShaper *shaper);
+void g_obex_shaper_consume(GObexShaper *shaper, gsize bytes);
+
+#endif /* __GOBEX_SHAPER_H */
@@ -49,6 +49,11 @@ struct transfer {
 	GObexDataConsumer data_consumer;
 	GObexFunc complete_func;
 
+	gboolean has_length;
+	guint32 length;
+
+	GSList *rsp_headers;	/* Queued for the final PUT response */
+
 	gpointer user_data;
 };
 
@@ -73,6 +78,9 @@ static void transfer_free(struct transfer *transfer)
 		g_obex_remove_request_function(transfer->obex,
 							transfer->abort_id);
 
+	g_slist_free_full(transfer->rsp_headers,
+					(GDestroyNotify) g_obex_header_free);
+
 	g_obex_unref(transfer->obex);
 	g_free(transfer);
 }
@@ -195,6 +203,13 @@ static void transfer_response(GObex *obex, GError *err, GObexPacket *rsp,
 	}
 
 	if (transfer->opcode == G_OBEX_OP_GET) {
+		GObexHeader *hdr;
+
+		hdr = g_obex_packet_get_header(rsp, G_OBEX_HDR_LENGTH);
+		if (hdr != NULL && g_obex_header_get_uint32(hdr,
+							&transfer->length))
+			transfer->has_length = TRUE;
+
 		handle_get_body(transfer, rsp, &err);
 		if (err != NULL)
 			goto failed;
@@ -352,6 +367,21 @@ static guint8 put_get_bytes(struct transfer *transfer, GObexPacket *req)
 	return rsp;
 }
 
+static void put_add_rsp_headers(struct transfer *transfer, GObexPacket *rsp,
+								guint8 rspcode)
+{
+	GSList *l;
+
+	if (rspcode != G_OBEX_RSP_SUCCESS)
+		return;
+
+	for (l = transfer->rsp_headers; l != NULL; l = g_slist_next(l))
+		g_obex_packet_add_header(rsp, l->data);
+
+	g_slist_free(transfer->rsp_headers);
+	transfer->rsp_headers = NULL;
+}
+
 static void transfer_put_req_first(struct transfer *transfer, GObexPacket *req,
 					guint8 first_hdr_id, va_list args)
 {
@@ -364,6 +394,7 @@ static void transfer_put_req_first(struct transfer *transfer, GObexPacket *req,
 	rspcode = put_get_bytes(transfer, req);
 
 	rsp = g_obex_packet_new_valist(rspcode, TRUE, first_hdr_id, args);
+	put_add_rsp_headers(transfer, rsp, rspcode);
 	if (!g_obex_send(transfer->obex, rsp, &err)) {
 		transfer_complete(transfer, err);
 		g_error_free(err);
@@ -385,6 +416,7 @@ static void transfer_put_req(GObex *obex, GObexPacket *req, gpointer user_data)
 	rspcode = put_get_bytes(transfer, req);
 
 	rsp = g_obex_packet_new(rspcode, TRUE, G_OBEX_HDR_INVALID);
+	put_add_rsp_headers(transfer, rsp, rspcode);
 	if (!g_obex_send(obex, rsp, &err)) {
 		transfer_complete(transfer, err);
 		g_error_free(err);
@@ -585,6 +617,36 @@ guint g_obex_get_rsp(GObex *obex, GObexDataProducer data_func,
 	return transfer->id;
 }
 
+gboolean g_obex_put_rsp_add_header(GObex *obex, GObexHeader *header)
+{
+	GSList *l;
+
+	for (l = transfers; l != NULL; l = g_slist_next(l)) {
+		struct transfer *t = l->data;
+
+		if (t->obex != obex || t->opcode != G_OBEX_OP_PUT ||
+						t->data_consumer == NULL)
+			continue;
+
+		t->rsp_headers = g_slist_append(t->rsp_headers, header);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+gboolean g_obex_get_transfer_length(guint id, guint32 *length)
+{
+	struct transfer *transfer = find_transfer(id);
+
+	if (transfer == NULL || !transfer->has_length)
+		return FALSE;
+
+	*length = transfer->length;
+
+	return TRUE;
+}
+
 gboolean g_obex_cancel_transfer(guint id)
 {
 	struct transfer *transfer = NULL;
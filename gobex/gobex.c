@@ -26,6 +26,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "gobex.h"
 #include "glib-helper.h"
@@ -54,6 +56,11 @@ struct _GObex {
 	gboolean (*read) (GObex *obex, GError **err);
 	gboolean (*write) (GObex *obex, GError **err);
 
+	GObexTransportType transport_type;
+
+	FILE *capture;
+	guint64 capture_last;
+
 	guint8 *rx_buf;
 	size_t rx_data;
 	guint16 rx_pkt_len;
@@ -67,6 +74,9 @@ struct _GObex {
 
 	guint write_source;
 
+	GSList *shapers;
+	guint shaper_source;
+
 	gssize io_rx_mtu;
 	gssize io_tx_mtu;
 
@@ -247,6 +257,113 @@ static gboolean req_timeout(gpointer user_data)
 	return FALSE;
 }
 
+static guint64 capture_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void capture_packet(GObex *obex, guint8 dir, const void *buf,
+								gsize len)
+{
+	guint8 rec[G_OBEX_CAPTURE_REC_SIZE];
+	guint64 now, delta;
+	guint32 u32;
+	guint16 u16;
+
+	if (obex->capture == NULL)
+		return;
+
+	now = capture_time();
+	delta = now - obex->capture_last;
+	obex->capture_last = now;
+
+	u32 = g_htonl(MIN(delta, G_MAXUINT32));
+	memcpy(&rec[0], &u32, sizeof(u32));
+	rec[4] = dir;
+	u16 = g_htons(len);
+	memcpy(&rec[5], &u16, sizeof(u16));
+
+	if (fwrite(rec, sizeof(rec), 1, obex->capture) == 1 &&
+				fwrite(buf, len, 1, obex->capture) == 1)
+		return;
+
+	g_obex_debug(G_OBEX_DEBUG_ERROR, "capture write failed: %s",
+							strerror(errno));
+	g_obex_capture_stop(obex);
+}
+
+gboolean g_obex_capture_start(GObex *obex, const char *filename,
+								GError **err)
+{
+	guint8 hdr[G_OBEX_CAPTURE_HDR_SIZE];
+	GError *local = NULL;
+
+	g_obex_debug(G_OBEX_DEBUG_COMMAND, "%s", filename);
+
+	g_obex_capture_stop(obex);
+
+	obex->capture = fopen(filename, "w");
+	if (obex->capture == NULL) {
+		g_set_error(&local, G_OBEX_ERROR, G_OBEX_ERROR_FAILED,
+				"Unable to open %s: %s", filename,
+				strerror(errno));
+		goto fail;
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, G_OBEX_CAPTURE_MAGIC, strlen(G_OBEX_CAPTURE_MAGIC));
+	hdr[8] = G_OBEX_CAPTURE_VERSION;
+	hdr[9] = obex->transport_type;
+
+	if (fwrite(hdr, sizeof(hdr), 1, obex->capture) != 1) {
+		g_set_error(&local, G_OBEX_ERROR, G_OBEX_ERROR_FAILED,
+				"Unable to write %s: %s", filename,
+				strerror(errno));
+		g_obex_capture_stop(obex);
+		goto fail;
+	}
+
+	obex->capture_last = capture_time();
+
+	return TRUE;
+
+fail:
+	g_obex_debug(G_OBEX_DEBUG_ERROR, "%s", local->message);
+	g_propagate_error(err, local);
+	return FALSE;
+}
+
+void g_obex_capture_stop(GObex *obex)
+{
+	if (obex->capture == NULL)
+		return;
+
+	g_obex_debug(G_OBEX_DEBUG_COMMAND, "");
+
+	fclose(obex->capture);
+	obex->capture = NULL;
+}
+
+static void capture_from_env(GObex *obex)
+{
+	static guint count = 0;
+	const char *dir;
+	char *filename;
+
+	dir = g_getenv("GOBEX_CAPTURE");
+	if (dir == NULL)
+		return;
+
+	filename = g_strdup_printf("%s/gobex-%d-%u.cap", dir, (int) getpid(),
+								count++);
+	g_obex_capture_start(obex, filename, NULL);
+	g_free(filename);
+}
+
 static gboolean write_stream(GObex *obex, GError **err)
 {
 	GIOStatus status;
@@ -290,6 +407,40 @@ static gboolean write_packet(GObex *obex, GError **err)
 	return TRUE;
 }
 
+/* Upper bound so that rate changes are picked up quickly */
+#define SHAPER_MAX_DELAY	100
+
+static void enable_tx(GObex *obex);
+
+static gboolean shaper_resume(gpointer user_data)
+{
+	GObex *obex = user_data;
+
+	obex->shaper_source = 0;
+	enable_tx(obex);
+
+	return FALSE;
+}
+
+static guint shapers_delay(GObex *obex)
+{
+	guint delay = 0;
+	GSList *l;
+
+	for (l = obex->shapers; l != NULL; l = g_slist_next(l))
+		delay = MAX(delay, g_obex_shaper_delay(l->data));
+
+	return MIN(delay, SHAPER_MAX_DELAY);
+}
+
+static void shapers_consume(GObex *obex, gsize bytes)
+{
+	GSList *l;
+
+	for (l = obex->shapers; l != NULL; l = g_slist_next(l))
+		g_obex_shaper_consume(l->data, bytes);
+}
+
 static gboolean write_data(GIOChannel *io, GIOCondition cond,
 							gpointer user_data)
 {
@@ -302,12 +453,24 @@ static gboolean write_data(GIOChannel *io, GIOCondition cond,
 		goto stop_tx;
 
 	if (obex->tx_data == 0) {
-		struct pending_pkt *p = g_queue_pop_head(obex->tx_queue);
+		struct pending_pkt *p;
 		ssize_t len;
+		guint delay;
 
-		if (p == NULL)
+		if (g_queue_get_length(obex->tx_queue) == 0)
 			goto stop_tx;
 
+		/* Wait for the shapers before taking the next packet */
+		delay = shapers_delay(obex);
+		if (delay > 0) {
+			obex->shaper_source = g_timeout_add(delay,
+							shaper_resume, obex);
+			obex->write_source = 0;
+			return FALSE;
+		}
+
+		p = g_queue_pop_head(obex->tx_queue);
+
 		/* Can't send a request while there's a pending one */
 		if (obex->pending_req && p->id > 0) {
 			g_queue_push_head(obex->tx_queue, p);
@@ -333,6 +496,10 @@ static gboolean write_data(GIOChannel *io, GIOCondition cond,
 		} else
 			pending_pkt_free(p);
 
+		capture_packet(obex, G_OBEX_CAPTURE_TX, obex->tx_buf, len);
+
+		shapers_consume(obex, len);
+
 		obex->tx_data = len;
 		obex->tx_sent = 0;
 	}
@@ -363,7 +530,7 @@ static void enable_tx(GObex *obex)
 	if (obex->suspended)
 		return;
 
-	if (obex->write_source > 0)
+	if (obex->write_source > 0 || obex->shaper_source > 0)
 		return;
 
 	cond = G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
@@ -662,6 +829,11 @@ void g_obex_suspend(GObex *obex)
 		obex->write_source = 0;
 	}
 
+	if (obex->shaper_source > 0) {
+		g_source_remove(obex->shaper_source);
+		obex->shaper_source = 0;
+	}
+
 	obex->suspended = TRUE;
 }
 
@@ -675,6 +847,28 @@ void g_obex_resume(GObex *obex)
 		enable_tx(obex);
 }
 
+void g_obex_add_shaper(GObex *obex, GObexShaper *shaper)
+{
+	g_obex_debug(G_OBEX_DEBUG_COMMAND, "conn %u", obex->conn_id);
+
+	obex->shapers = g_slist_prepend(obex->shapers,
+						g_obex_shaper_ref(shaper));
+}
+
+void g_obex_remove_shaper(GObex *obex, GObexShaper *shaper)
+{
+	GSList *l;
+
+	g_obex_debug(G_OBEX_DEBUG_COMMAND, "conn %u", obex->conn_id);
+
+	l = g_slist_find(obex->shapers, shaper);
+	if (l == NULL)
+		return;
+
+	obex->shapers = g_slist_delete_link(obex->shapers, l);
+	g_obex_shaper_unref(shaper);
+}
+
 static void parse_connect_data(GObex *obex, GObexPacket *pkt)
 {
 	const struct connect_data *data;
@@ -920,6 +1114,8 @@ static gboolean incoming_data(GIOChannel *io, GIOCondition cond,
 	if (obex->rx_data < 3 || obex->rx_data < obex->rx_pkt_len)
 		return TRUE;
 
+	capture_packet(obex, G_OBEX_CAPTURE_RX, obex->rx_buf, obex->rx_data);
+
 	obex->rx_last_op = obex->rx_buf[0] & ~FINAL_BIT;
 
 	if (obex->pending_req) {
@@ -1050,6 +1246,8 @@ GObex *g_obex_new(GIOChannel *io, GObexTransportType transport_type,
 	obex->rx_buf = g_malloc(obex->rx_mtu);
 	obex->tx_buf = g_malloc(obex->tx_mtu);
 
+	obex->transport_type = transport_type;
+
 	switch (transport_type) {
 	case G_OBEX_TRANSPORT_STREAM:
 		obex->read = read_stream;
@@ -1069,6 +1267,8 @@ GObex *g_obex_new(GIOChannel *io, GObexTransportType transport_type,
 	cond = G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
 	obex->io_source = g_io_add_watch(io, cond, incoming_data, obex);
 
+	capture_from_env(obex);
+
 	return obex;
 }
 
@@ -1109,6 +1309,13 @@ void g_obex_unref(GObex *obex)
 	if (obex->write_source > 0)
 		g_source_remove(obex->write_source);
 
+	if (obex->shaper_source > 0)
+		g_source_remove(obex->shaper_source);
+
+	g_slist_free_full(obex->shapers, (GDestroyNotify) g_obex_shaper_unref);
+
+	g_obex_capture_stop(obex);
+
 	g_free(obex->rx_buf);
 	g_free(obex->tx_buf);
 
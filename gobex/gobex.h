@@ -27,6 +27,7 @@
 
 #include <gobex/gobex-defs.h>
 #include <gobex/gobex-packet.h>
+#include <gobex/gobex-shaper.h>
 
 typedef enum {
 	G_OBEX_TRANSPORT_STREAM,
@@ -35,6 +36,22 @@ typedef enum {
 
 typedef struct _GObex GObex;
 
+/*
+ * Capture file layout, all integers in network byte order:
+ *
+ *   header: magic[8] "GOBEXCAP", version (u8), transport (u8),
+ *           reserved (u16)
+ *   record: delta (u32, microseconds since previous record, saturating),
+ *           direction (u8), length (u16), packet[length]
+ */
+#define G_OBEX_CAPTURE_MAGIC		"GOBEXCAP"
+#define G_OBEX_CAPTURE_VERSION		1
+#define G_OBEX_CAPTURE_HDR_SIZE		12
+#define G_OBEX_CAPTURE_REC_SIZE		7
+
+#define G_OBEX_CAPTURE_RX		0x00
+#define G_OBEX_CAPTURE_TX		0x01
+
 typedef void (*GObexFunc) (GObex *obex, GError *err, gpointer user_data);
 typedef void (*GObexRequestFunc) (GObex *obex, GObexPacket *req,
 							gpointer user_data);
@@ -62,6 +79,13 @@ gboolean g_obex_remove_request_function(GObex *obex, guint id);
 void g_obex_suspend(GObex *obex);
 void g_obex_resume(GObex *obex);
 
+void g_obex_add_shaper(GObex *obex, GObexShaper *shaper);
+void g_obex_remove_shaper(GObex *obex, GObexShaper *shaper);
+
+gboolean g_obex_capture_start(GObex *obex, const char *filename,
+								GError **err);
+void g_obex_capture_stop(GObex *obex);
+
 GObex *g_obex_new(GIOChannel *io, GObexTransportType transport_type,
 						gssize rx_mtu, gssize tx_mtu);
 
@@ -117,6 +141,11 @@ guint g_obex_get_rsp(GObex *obex, GObexDataProducer data_func,
 			GObexFunc complete_func, gpointer user_data,
 			GError **err, guint8 first_hdr_id, ...);
 
+/* Queues a header for the final response of the incoming PUT, e.g. the Name
+ * of the stored object. The header is owned by the transfer on success. */
+gboolean g_obex_put_rsp_add_header(GObex *obex, GObexHeader *header);
+
+gboolean g_obex_get_transfer_length(guint id, guint32 *length);
 gboolean g_obex_cancel_transfer(guint id);
 
 const char *g_obex_strerror(guint8 err_code);
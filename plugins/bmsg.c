@@ -0,0 +1,254 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2010-2011  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "messages.h"
+#include "bmsg.h"
+
+/* Pushed bMessages are parsed line by line, except for the content */
+#define BMSG_LINE_MAX		1024
+
+/* BEGIN:MSG<CRLF> and <CRLF>END:MSG<CRLF> are included in LENGTH */
+#define BMSG_CONTENT_OVERHEAD	22
+
+struct bmsg_parser {
+	const struct bmsg_parser_cb *cb;
+	void *user_data;
+	GString *line;		/* Incomplete line from the previous feed */
+	char *type;
+	gboolean read;
+	char *encoding;
+	char *charset;
+	GSList *recipients;
+	unsigned int benv;	/* Envelope nesting level */
+	gboolean vcard;
+	size_t length;		/* LENGTH of the current body */
+	size_t remaining;	/* Content bytes left in the current MSG */
+	gboolean begun;		/* Handed to the callbacks */
+	gboolean finished;
+};
+
+struct bmsg_parser *bmsg_parser_new(const struct bmsg_parser_cb *cb,
+							void *user_data)
+{
+	struct bmsg_parser *parser;
+
+	parser = g_new0(struct bmsg_parser, 1);
+	parser->cb = cb;
+	parser->user_data = user_data;
+	parser->line = g_string_sized_new(128);
+
+	return parser;
+}
+
+void bmsg_parser_free(struct bmsg_parser *parser)
+{
+	g_string_free(parser->line, TRUE);
+	g_free(parser->type);
+	g_free(parser->encoding);
+	g_free(parser->charset);
+	g_slist_free_full(parser->recipients, g_free);
+	g_free(parser);
+}
+
+gboolean bmsg_parser_finished(struct bmsg_parser *parser)
+{
+	return parser->finished;
+}
+
+static int content_begin(struct bmsg_parser *parser)
+{
+	int err;
+
+	if (parser->length < BMSG_CONTENT_OVERHEAD)
+		return -EBADMSG;
+
+	if (!parser->begun) {
+		struct messages_bmessage bmsg;
+
+		if (parser->type == NULL)
+			return -EBADMSG;
+
+		bmsg.type = parser->type;
+		bmsg.read = parser->read;
+		bmsg.encoding = parser->encoding;
+		bmsg.charset = parser->charset;
+		bmsg.recipients = parser->recipients;
+
+		err = parser->cb->begin(&bmsg, parser->user_data);
+		if (err < 0)
+			return err;
+
+		parser->begun = TRUE;
+	}
+
+	parser->remaining = parser->length - BMSG_CONTENT_OVERHEAD;
+
+	return 0;
+}
+
+static int parse_property(struct bmsg_parser *parser, const char *line)
+{
+	const char *value = strchr(line, ':');
+	size_t len;
+
+	if (value == NULL)
+		return 0;
+
+	len = value - line;
+	value++;
+
+	if (parser->vcard) {
+		/* Only recipients matter, the originator is this device */
+		if (parser->benv == 0 || *value == '\0')
+			return 0;
+
+		if (g_str_has_prefix(line, "TEL") ||
+					g_str_has_prefix(line, "EMAIL"))
+			parser->recipients = g_slist_append(parser->recipients,
+							g_strdup(value));
+
+		return 0;
+	}
+
+	if (len == 6 && strncmp(line, "STATUS", len) == 0) {
+		parser->read = g_str_equal(value, "READ");
+	} else if (len == 4 && strncmp(line, "TYPE", len) == 0) {
+		g_free(parser->type);
+		parser->type = g_strdup(value);
+	} else if (len == 8 && strncmp(line, "ENCODING", len) == 0) {
+		g_free(parser->encoding);
+		parser->encoding = g_strdup(value);
+	} else if (len == 7 && strncmp(line, "CHARSET", len) == 0) {
+		g_free(parser->charset);
+		parser->charset = g_strdup(value);
+	} else if (len == 6 && strncmp(line, "LENGTH", len) == 0) {
+		char *end;
+
+		parser->length = strtoul(value, &end, 10);
+		if (*value == '\0' || *end != '\0')
+			return -EBADMSG;
+	}
+
+	return 0;
+}
+
+static int parse_line(struct bmsg_parser *parser, const char *line)
+{
+	int err;
+
+	if (g_str_has_prefix(line, "BEGIN:")) {
+		line += 6;
+
+		if (g_str_equal(line, "MSG"))
+			return content_begin(parser);
+
+		if (g_str_equal(line, "BENV"))
+			parser->benv++;
+		else if (g_str_equal(line, "VCARD"))
+			parser->vcard = TRUE;
+
+		return 0;
+	}
+
+	if (g_str_has_prefix(line, "END:")) {
+		line += 4;
+
+		if (g_str_equal(line, "BENV") && parser->benv > 0)
+			parser->benv--;
+		else if (g_str_equal(line, "VCARD"))
+			parser->vcard = FALSE;
+		else if (g_str_equal(line, "BBODY"))
+			parser->length = 0;
+		else if (g_str_equal(line, "BMSG")) {
+			if (!parser->begun)
+				return -EBADMSG;
+
+			err = parser->cb->end(parser->user_data);
+			if (err < 0)
+				return err;
+
+			parser->finished = TRUE;
+		}
+
+		return 0;
+	}
+
+	return parse_property(parser, line);
+}
+
+int bmsg_parser_feed(struct bmsg_parser *parser, const char *buf, size_t len)
+{
+	const char *data = buf, *end = buf + len;
+	GString *line = parser->line;
+	int err;
+
+	while (data < end && !parser->finished) {
+		const char *eol, *next;
+
+		/* Message content is handed over as is, it may be binary */
+		if (parser->remaining > 0) {
+			size_t size = MIN(parser->remaining,
+						(size_t) (end - data));
+
+			err = parser->cb->data(data, size, parser->user_data);
+			if (err < 0)
+				return err;
+
+			parser->remaining -= size;
+			data += size;
+			continue;
+		}
+
+		eol = memchr(data, '\n', end - data);
+		next = eol ? eol + 1 : end;
+
+		if (line->len + (next - data) > BMSG_LINE_MAX)
+			return -EBADMSG;
+
+		g_string_append_len(line, data, next - data);
+		data = next;
+
+		if (eol == NULL)
+			break;
+
+		while (line->len > 0 && (line->str[line->len - 1] == '\n' ||
+					line->str[line->len - 1] == '\r'))
+			g_string_truncate(line, line->len - 1);
+
+		err = parse_line(parser, line->str);
+		g_string_truncate(line, 0);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2010-2011  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Incremental parser of the bMessages pushed with PushMessage. The envelope
+ * is parsed line by line, the content of every MSG is passed on as is.
+ */
+struct bmsg_parser;
+
+struct bmsg_parser_cb {
+	/* Called on the first BEGIN:MSG with the properties found so far */
+	int (*begin) (const struct messages_bmessage *bmsg, void *user_data);
+	/* Chunk of message content, may contain binary data */
+	int (*data) (const char *chunk, size_t len, void *user_data);
+	/* Called on END:BMSG, nothing is parsed after it */
+	int (*end) (void *user_data);
+};
+
+struct bmsg_parser *bmsg_parser_new(const struct bmsg_parser_cb *cb,
+							void *user_data);
+void bmsg_parser_free(struct bmsg_parser *parser);
+
+/* Parses the next len bytes of the bMessage. Returns 0, -EBADMSG if the
+ * bMessage is malformed or the error returned by a callback.
+ */
+int bmsg_parser_feed(struct bmsg_parser *parser, const char *buf, size_t len);
+gboolean bmsg_parser_finished(struct bmsg_parser *parser);
@@ -37,6 +37,7 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/sendfile.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
 #include <wait.h>
 #include <inttypes.h>
@@ -48,6 +49,8 @@
 #include "log.h"
 #include "mimetype.h"
 #include "filesystem.h"
+#include "xml.h"
+#include "fileio.h"
 
 #define EOL_CHARS "\n"
 
@@ -64,16 +67,20 @@
 
 #define FL_PARENT_FOLDER_ELEMENT "<parent-folder/>" EOL_CHARS
 
-#define FL_FILE_ELEMENT "<file name=\"%s\" size=\"%" PRIu64 "\"" \
-			" %s accessed=\"%s\" " \
-			"modified=\"%s\" created=\"%s\"/>" EOL_CHARS
+/* Initial allocation for a rendered listing, avoids early regrowth */
+#define LISTING_INITIAL_SIZE	4096
 
-#define FL_FOLDER_ELEMENT "<folder name=\"%s\" %s accessed=\"%s\" " \
-			"modified=\"%s\" created=\"%s\"/>" EOL_CHARS
+/* Bounds of the rendered folder-listing cache */
+#define LISTING_CACHE_ENTRIES	16
+#define LISTING_CACHE_SIZE	(1024 * 1024)
 
-#define FL_FOLDER_ELEMENT_PCSUITE "<folder name=\"%s\" %s accessed=\"%s\"" \
-			" modified=\"%s\" mem-type=\"DEV\"" \
-			" created=\"%s\"/>" EOL_CHARS
+/*
+ * Access time changes are ignored, otherwise every GET would invalidate
+ * the listing of its folder.
+ */
+#define LISTING_WATCH_MASK	(IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | \
+				IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+				IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
 
 #define FTP_TARGET_SIZE 16
 
@@ -86,6 +93,21 @@ static const uint8_t FTP_TARGET[FTP_TARGET_SIZE] = {
 static const uint8_t PCSUITE_WHO[PCSUITE_WHO_SIZE] = {
 			'P', 'C', ' ', 'S', 'u', 'i', 't', 'e' };
 
+struct listing_entry {
+	char *name;
+	gboolean pcsuite;
+	int wd;
+	GString *listing;
+};
+
+/* Most recently used first */
+static GList *listing_cache = NULL;
+static size_t listing_cache_size = 0;
+static int listing_inotify = -1;
+static guint listing_watch = 0;
+static unsigned int listing_hits = 0;
+static unsigned int listing_misses = 0;
+
 gboolean is_filename(const char *name)
 {
 	if (strchr(name, '/'))
@@ -120,51 +142,63 @@ int verify_path(const char *path)
 	return ret;
 }
 
-static char *file_stat_line(char *filename, struct stat *fstat,
-					struct stat *dstat, gboolean root,
-					gboolean pcsuite)
+static void append_perm(GString *object, const char *name, mode_t mode,
+					mode_t r, mode_t w, mode_t d)
 {
-	char perm[51], atime[18], ctime[18], mtime[18];
-	char *escaped, *ret = NULL;
+	char perm[3];
+	size_t len = 0;
+
+	if (mode & r)
+		perm[len++] = 'R';
+	if (mode & w)
+		perm[len++] = 'W';
+	if (d)
+		perm[len++] = 'D';
+
+	g_string_append_c(object, ' ');
+	g_string_append(object, name);
+	g_string_append_len(object, "=\"", 2);
+	g_string_append_len(object, perm, len);
+	g_string_append_c(object, '"');
+}
 
-	snprintf(perm, 50, "user-perm=\"%s%s%s\" group-perm=\"%s%s%s\" "
-			"other-perm=\"%s%s%s\"",
-			(fstat->st_mode & S_IRUSR ? "R" : ""),
-			(fstat->st_mode & S_IWUSR ? "W" : ""),
-			(dstat->st_mode & S_IWUSR ? "D" : ""),
-			(fstat->st_mode & S_IRGRP ? "R" : ""),
-			(fstat->st_mode & S_IWGRP ? "W" : ""),
-			(dstat->st_mode & S_IWGRP ? "D" : ""),
-			(fstat->st_mode & S_IROTH ? "R" : ""),
-			(fstat->st_mode & S_IWOTH ? "W" : ""),
-			(dstat->st_mode & S_IWOTH ? "D" : ""));
+static gboolean append_stat_line(GString *object, const char *filename,
+					struct stat *fstat, struct stat *dstat,
+					gboolean root, gboolean pcsuite)
+{
+	if (S_ISDIR(fstat->st_mode)) {
+		g_string_append(object, "<folder");
+		xml_attr(object, "name", filename);
+	} else if (S_ISREG(fstat->st_mode)) {
+		g_string_append(object, "<file");
+		xml_attr(object, "name", filename);
+		xml_attr_uint64(object, "size", fstat->st_size);
+	} else
+		return FALSE;
 
-	strftime(atime, 17, "%Y%m%dT%H%M%SZ", gmtime(&fstat->st_atime));
-	strftime(ctime, 17, "%Y%m%dT%H%M%SZ", gmtime(&fstat->st_ctime));
-	strftime(mtime, 17, "%Y%m%dT%H%M%SZ", gmtime(&fstat->st_mtime));
+	append_perm(object, "user-perm", fstat->st_mode, S_IRUSR, S_IWUSR,
+						dstat->st_mode & S_IWUSR);
+	append_perm(object, "group-perm", fstat->st_mode, S_IRGRP, S_IWGRP,
+						dstat->st_mode & S_IWGRP);
+	append_perm(object, "other-perm", fstat->st_mode, S_IROTH, S_IWOTH,
+						dstat->st_mode & S_IWOTH);
 
-	escaped = g_markup_escape_text(filename, -1);
+	xml_attr_time(object, "accessed", fstat->st_atime);
+	xml_attr_time(object, "modified", fstat->st_mtime);
 
-	if (S_ISDIR(fstat->st_mode)) {
-		if (pcsuite && root && g_str_equal(filename, "Data"))
-			ret = g_strdup_printf(FL_FOLDER_ELEMENT_PCSUITE,
-						escaped, perm, atime,
-						mtime, ctime);
-		else
-			ret = g_strdup_printf(FL_FOLDER_ELEMENT, escaped, perm,
-							atime, mtime, ctime);
-	} else if (S_ISREG(fstat->st_mode))
-		ret = g_strdup_printf(FL_FILE_ELEMENT, escaped,
-					(uint64_t) fstat->st_size,
-					perm, atime, mtime, ctime);
-
-	g_free(escaped);
+	if (S_ISDIR(fstat->st_mode) && pcsuite && root &&
+					g_str_equal(filename, "Data"))
+		g_string_append(object, " mem-type=\"DEV\"");
 
-	return ret;
+	xml_attr_time(object, "created", fstat->st_ctime);
+
+	g_string_append(object, "/>" EOL_CHARS);
+
+	return TRUE;
 }
 
 static void *filesystem_open(const char *name, int oflag, mode_t mode,
-					void *context, size_t *size, int *err)
+					void *context, int64_t *size, int *err)
 {
 	struct stat stats;
 	struct statvfs buf;
@@ -207,12 +241,17 @@ static void *filesystem_open(const char *name, int oflag, mode_t mode,
 		goto done;
 
 	avail = (uint64_t) buf.f_bsize * buf.f_bavail;
-	if (avail < *size) {
+	if (avail < (uint64_t) *size) {
 		if (err)
 			*err = -ENOSPC;
 		goto failed;
 	}
 
+	/* Reserve the blocks up front, aborted pushes keep their real size */
+	ret = fileio_preallocate(fd, *size);
+	if (ret < 0)
+		DBG("fallocate(): %s(%d)", strerror(-ret), -ret);
+
 done:
 	if (err)
 		*err = 0;
@@ -268,9 +307,9 @@ static int filesystem_rename(const char *name, const char *destname)
 	return ret;
 }
 
-static int sendfile_async(int out_fd, int in_fd, off_t *offset, size_t count)
+static int sendfile_async(int out_fd, int in_fd, off_t *offset, off_t count)
 {
-	int pid;
+	int pid, err;
 
 	/* Run sendfile on child process */
 	pid = fork();
@@ -286,20 +325,21 @@ static int sendfile_async(int out_fd, int in_fd, off_t *offset, size_t count)
 	}
 
 	/* At child */
-	if (sendfile(out_fd, in_fd, offset, count) < 0)
-		error("sendfile(): %s (%d)", strerror(errno), errno);
+	err = fileio_sendfile(out_fd, in_fd, offset, count);
+	if (err < 0)
+		error("sendfile(): %s (%d)", strerror(-err), -err);
 
 	close(in_fd);
 	close(out_fd);
 
-	exit(errno);
+	exit(-err);
 }
 
 static int filesystem_copy(const char *name, const char *destname)
 {
 	void *in, *out;
 	ssize_t ret;
-	size_t size;
+	int64_t size;
 	struct stat st;
 	int in_fd, out_fd, err;
 
@@ -403,7 +443,7 @@ static int capability_exec(const char **argv, int *output, int *err)
 }
 
 static void *capability_open(const char *name, int oflag, mode_t mode,
-					void *context, size_t *size, int *err)
+					void *context, int64_t *size, int *err)
 {
 	struct capability_object *object = NULL;
 	char *buf;
@@ -471,12 +511,12 @@ static GString *append_folder_preamble(GString *object)
 }
 
 static GString *append_listing(GString *object, const char *name,
-				gboolean pcsuite, size_t *size, int *err)
+				gboolean pcsuite, int64_t *size, int *err)
 {
 	struct stat fstat, dstat;
 	struct dirent *ep;
 	DIR *dp;
-	gboolean root;
+	gboolean root, utf8;
 	int ret;
 
 	root = g_str_equal(name, obex_option_root_folder());
@@ -504,42 +544,38 @@ static GString *append_listing(GString *object, const char *name,
 		goto failed;
 	}
 
+	utf8 = g_get_filename_charsets(NULL);
+
 	while ((ep = readdir(dp))) {
-		char *filename;
-		char *fullname;
-		char *line;
+		char *converted = NULL;
+		const char *filename;
 
 		if (ep->d_name[0] == '.')
 			continue;
 
-		filename = g_filename_to_utf8(ep->d_name, -1, NULL, NULL, NULL);
-		if (filename == NULL) {
-			error("g_filename_to_utf8: invalid filename");
-			continue;
-		}
-
-		fullname = g_build_filename(name, ep->d_name, NULL);
-
-		ret = stat(fullname, &fstat);
+		/* Stat relative to the directory, no need to build paths */
+		ret = fstatat(dirfd(dp), ep->d_name, &fstat, 0);
 		if (ret < 0) {
 			DBG("stat: %s(%d)", strerror(errno), errno);
-			g_free(filename);
-			g_free(fullname);
 			continue;
 		}
 
-		g_free(fullname);
-
-		line = file_stat_line(filename, &fstat, &dstat, root, FALSE);
-		if (line == NULL) {
-			g_free(filename);
-			continue;
+		if (utf8 && g_utf8_validate(ep->d_name, -1, NULL))
+			filename = ep->d_name;
+		else {
+			converted = g_filename_to_utf8(ep->d_name, -1, NULL,
+								NULL, NULL);
+			if (converted == NULL) {
+				error("g_filename_to_utf8: invalid filename");
+				continue;
+			}
+
+			filename = converted;
 		}
 
-		g_free(filename);
+		append_stat_line(object, filename, &fstat, &dstat, root, FALSE);
 
-		object = g_string_append(object, line);
-		g_free(line);
+		g_free(converted);
 	}
 
 	closedir(dp);
@@ -561,28 +597,259 @@ failed:
 	return NULL;
 }
 
-static void *folder_open(const char *name, int oflag, mode_t mode,
-					void *context, size_t *size, int *err)
+static void listing_watch_release(int wd)
 {
-	GString *object;
+	GList *l;
 
-	object = g_string_new(FL_VERSION);
-	object = append_folder_preamble(object);
-	object = g_string_append(object, FL_BODY_BEGIN);
+	/* FTP and PC Suite listings of a folder share the same watch */
+	for (l = listing_cache; l; l = l->next) {
+		struct listing_entry *entry = l->data;
+
+		if (entry->wd == wd)
+			return;
+	}
 
-	return append_listing(object, name, FALSE, size, err);
+	inotify_rm_watch(listing_inotify, wd);
 }
 
-static void *pcsuite_open(const char *name, int oflag, mode_t mode,
-					void *context, size_t *size, int *err)
+static void listing_entry_free(struct listing_entry *entry)
+{
+	listing_cache = g_list_remove(listing_cache, entry);
+	listing_cache_size -= entry->listing->len;
+
+	g_string_free(entry->listing, TRUE);
+	g_free(entry->name);
+	g_free(entry);
+}
+
+static void listing_cache_invalidate(int wd)
+{
+	GList *l, *next;
+
+	for (l = listing_cache; l; l = next) {
+		struct listing_entry *entry = l->data;
+
+		next = l->next;
+
+		if (entry->wd != wd)
+			continue;
+
+		DBG("%s", entry->name);
+
+		listing_entry_free(entry);
+	}
+
+	inotify_rm_watch(listing_inotify, wd);
+}
+
+static void listing_inotify_drain(void)
+{
+	char buf[1024];
+	ssize_t len, offset;
+
+	if (listing_inotify < 0)
+		return;
+
+	/* The descriptor is non-blocking, read until the queue is empty */
+	while ((len = read(listing_inotify, buf, sizeof(buf))) > 0) {
+		offset = 0;
+
+		while (offset + (ssize_t) sizeof(struct inotify_event) <= len) {
+			struct inotify_event *event = (void *) buf + offset;
+
+			offset += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_IGNORED)
+				continue;
+
+			listing_cache_invalidate(event->wd);
+		}
+	}
+}
+
+static gboolean listing_inotify_event(GIOChannel *io, GIOCondition cond,
+							void *user_data)
+{
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		listing_watch = 0;
+		return FALSE;
+	}
+
+	listing_inotify_drain();
+
+	return TRUE;
+}
+
+static GString *listing_cache_lookup(const char *name, gboolean pcsuite)
+{
+	GList *l;
+
+	/*
+	 * Changes made by this very session (PUT, DELETE, MKDIR) are queued
+	 * but the main loop hasn't seen them yet, pick them up now.
+	 */
+	listing_inotify_drain();
+
+	for (l = listing_cache; l; l = l->next) {
+		struct listing_entry *entry = l->data;
+
+		if (entry->pcsuite != pcsuite || !g_str_equal(entry->name, name))
+			continue;
+
+		listing_cache = g_list_delete_link(listing_cache, l);
+		listing_cache = g_list_prepend(listing_cache, entry);
+
+		listing_hits++;
+		DBG("%s hit (hits %u misses %u)", name, listing_hits,
+							listing_misses);
+
+		/* The object is consumed by string_read, hand out a copy */
+		return g_string_new_len(entry->listing->str,
+						entry->listing->len);
+	}
+
+	listing_misses++;
+	DBG("%s miss (hits %u misses %u)", name, listing_hits,
+							listing_misses);
+
+	return NULL;
+}
+
+static gboolean listing_cache_store(const char *name, gboolean pcsuite,
+						int wd, GString *listing)
+{
+	struct listing_entry *entry;
+
+	if (listing->len > LISTING_CACHE_SIZE)
+		return FALSE;
+
+	while (listing_cache != NULL &&
+			(g_list_length(listing_cache) >= LISTING_CACHE_ENTRIES ||
+			listing_cache_size + listing->len > LISTING_CACHE_SIZE)) {
+		int evicted_wd;
+
+		entry = g_list_last(listing_cache)->data;
+		evicted_wd = entry->wd;
+
+		listing_entry_free(entry);
+
+		if (evicted_wd != wd)
+			listing_watch_release(evicted_wd);
+	}
+
+	entry = g_new0(struct listing_entry, 1);
+	entry->name = g_strdup(name);
+	entry->pcsuite = pcsuite;
+	entry->wd = wd;
+	entry->listing = g_string_new_len(listing->str, listing->len);
+
+	listing_cache = g_list_prepend(listing_cache, entry);
+	listing_cache_size += listing->len;
+
+	return TRUE;
+}
+
+static void listing_cache_init(void)
+{
+	GIOChannel *io;
+
+	listing_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (listing_inotify < 0) {
+		error("inotify_init1(): %s(%d)", strerror(errno), errno);
+		return;
+	}
+
+	io = g_io_channel_unix_new(listing_inotify);
+	g_io_channel_set_close_on_unref(io, TRUE);
+	listing_watch = g_io_add_watch(io,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				listing_inotify_event, NULL);
+	g_io_channel_unref(io);
+}
+
+static void listing_cache_exit(void)
+{
+	DBG("hits %u misses %u", listing_hits, listing_misses);
+
+	/* Watches go away together with the inotify descriptor */
+	while (listing_cache != NULL)
+		listing_entry_free(listing_cache->data);
+
+	/* Removing the watch closes the inotify descriptor */
+	if (listing_watch > 0)
+		g_source_remove(listing_watch);
+	else if (listing_inotify >= 0)
+		close(listing_inotify);
+
+	listing_watch = 0;
+	listing_inotify = -1;
+}
+
+void filesystem_listing_stats(unsigned int *hits, unsigned int *misses)
+{
+	if (hits)
+		*hits = listing_hits;
+
+	if (misses)
+		*misses = listing_misses;
+}
+
+static void *listing_open(const char *name, gboolean pcsuite, int64_t *size,
+								int *err)
 {
 	GString *object;
+	int wd = -1;
+
+	object = listing_cache_lookup(name, pcsuite);
+	if (object != NULL) {
+		if (size)
+			*size = object->len;
+
+		if (err)
+			*err = 0;
+
+		return object;
+	}
+
+	/*
+	 * Watch before rendering so changes done meanwhile invalidate the
+	 * entry once it is stored.
+	 */
+	if (listing_watch > 0)
+		wd = inotify_add_watch(listing_inotify, name,
+							LISTING_WATCH_MASK);
+
+	object = g_string_sized_new(LISTING_INITIAL_SIZE);
+	object = g_string_append(object, FL_VERSION);
+
+	if (pcsuite)
+		object = append_pcsuite_preamble(object);
+	else
+		object = append_folder_preamble(object);
 
-	object = g_string_new(FL_VERSION);
-	object = append_pcsuite_preamble(object);
 	object = g_string_append(object, FL_BODY_BEGIN);
 
-	return append_listing(object, name, TRUE, size, err);
+	object = append_listing(object, name, pcsuite, size, err);
+
+	if (wd < 0)
+		return object;
+
+	if (object == NULL || !listing_cache_store(name, pcsuite, wd, object))
+		listing_watch_release(wd);
+
+	return object;
+}
+
+static void *folder_open(const char *name, int oflag, mode_t mode,
+					void *context, int64_t *size, int *err)
+{
+	return listing_open(name, FALSE, size, err);
+}
+
+static void *pcsuite_open(const char *name, int oflag, mode_t mode,
+					void *context, int64_t *size, int *err)
+{
+	return listing_open(name, TRUE, size, err);
 }
 
 static int string_free(void *object)
@@ -698,6 +965,8 @@ static int filesystem_init(void)
 {
 	int err;
 
+	listing_cache_init();
+
 	err = obex_mime_type_driver_register(&folder);
 	if (err < 0)
 		return err;
@@ -718,6 +987,8 @@ static void filesystem_exit(void)
 	obex_mime_type_driver_unregister(&folder);
 	obex_mime_type_driver_unregister(&capability);
 	obex_mime_type_driver_unregister(&file);
+
+	listing_cache_exit();
 }
 
 OBEX_PLUGIN_DEFINE(filesystem, filesystem_init, filesystem_exit)
@@ -24,3 +24,4 @@
 ssize_t string_read(void *object, void *buf, size_t count);
 gboolean is_filename(const char *name);
 int verify_path(const char *path);
+void filesystem_listing_stats(unsigned int *hits, unsigned int *misses);
@@ -133,6 +133,11 @@ static int get_by_type(struct ftp_session *ftp, const char *type)
 
 	g_free(path);
 
+	/* Listings are rendered in memory, released on transfer reset */
+	if (err == 0 && type != NULL && g_ascii_strcasecmp(type, LST_TYPE) == 0
+					&& obex_get_size(os) > 0)
+		obex_mem_update(os, "ftp", obex_get_size(os));
+
 	return err;
 }
 
@@ -228,9 +233,9 @@ int ftp_put(struct obex_session *os, void *user_data)
 {
 	struct ftp_session *ftp = user_data;
 	const char *name = obex_get_name(os);
-	ssize_t size = obex_get_size(os);
+	int64_t size = obex_get_size(os);
 
-	DBG("%p name %s size %zd", ftp, name, size);
+	DBG("%p name %s size %" PRId64, ftp, name, size);
 
 	if (ftp->folder == NULL)
 		return -EPERM;
@@ -110,6 +110,11 @@ struct irmc_session {
 	char manu[DID_LEN];
 	char model[DID_LEN];
 	void *request;
+	void *count_request;
+	gboolean lastpart;
+	gboolean reading;
+	size_t part_size;
+	guint prefetch_id;
 };
 
 #define IRMC_TARGET_SIZE 9
@@ -141,58 +146,114 @@ static void phonebook_size_result(const char *buffer, size_t bufsize,
 
 	irmc->params->maxlistcount = vcards;
 
-	if (irmc->request) {
-		phonebook_req_finalize(irmc->request);
-		irmc->request = NULL;
+	if (irmc->count_request) {
+		phonebook_req_finalize(irmc->count_request);
+		irmc->count_request = NULL;
 	}
 }
 
+/*
+ * Copy one part to the output buffer, adding an X-IRMC-LUID line with
+ * the same value after every UID line. Backends never split a vCard
+ * across parts, so a single pass over each part is enough.
+ */
+static void luid_append(GString *out, const char *buffer, size_t bufsize)
+{
+	const char *s = buffer, *end = buffer + bufsize;
+
+	while (s < end) {
+		const char *eol = memchr(s, '\n', end - s);
+		const char *next = eol ? eol + 1 : end;
+
+		g_string_append_len(out, s, next - s);
+
+		/*
+		 * Not sure if UID is still needed if X-IRMC-LUID is there
+		 */
+		if (next - s > 4 && strncmp(s, "UID:", 4) == 0) {
+			g_string_append_len(out, "X-IRMC-LUID:", 12);
+			g_string_append_len(out, s + 4, next - s - 4);
+
+			if (eol == NULL)
+				g_string_append_len(out, "\r\n", 2);
+		}
+
+		s = next;
+	}
+}
+
+static void irmc_mem_update(struct irmc_session *irmc)
+{
+	obex_mem_update(irmc->os, "irmc", irmc->buffer ? irmc->buffer->len : 0);
+}
+
+static int irmc_prefetch(struct irmc_session *irmc)
+{
+	if (irmc->lastpart || irmc->reading || irmc->request == NULL)
+		return 0;
+
+	/* Keep at most the part being sent plus the next one */
+	if (irmc->buffer && irmc->buffer->len > 0) {
+		if (irmc->buffer->len > irmc->part_size)
+			return 0;
+
+		if (obex_mem_soft_exceeded(irmc->os))
+			return 0;
+	}
+
+	return phonebook_pull_next(irmc->request, &irmc->reading);
+}
+
+static gboolean irmc_prefetch_cb(void *user_data)
+{
+	struct irmc_session *irmc = user_data;
+
+	irmc->prefetch_id = 0;
+
+	/* Errors are reported once the client drains the buffer */
+	irmc_prefetch(irmc);
+
+	return FALSE;
+}
+
 static void query_result(const char *buffer, size_t bufsize, int vcards,
 				int missed, gboolean lastpart, void *user_data)
 {
 	struct irmc_session *irmc = user_data;
-	const char *s, *t;
 
-	DBG("bufsize %zu vcards %d missed %d", bufsize, vcards, missed);
+	DBG("bufsize %zu vcards %d missed %d lastpart %d", bufsize, vcards,
+							missed, lastpart);
 
-	if (irmc->request) {
+	if (irmc->request && lastpart) {
 		phonebook_req_finalize(irmc->request);
 		irmc->request = NULL;
 	}
 
+	irmc->lastpart = lastpart;
+	irmc->reading = FALSE;
+
+	if (vcards < 0) {
+		obex_object_set_io_flags(irmc, G_IO_ERR, -ENOENT);
+		return;
+	}
+
 	/* first add a 'owner' vcard */
 	if (!irmc->buffer)
 		irmc->buffer = g_string_new(owner_vcard);
-	else
-		irmc->buffer = g_string_append(irmc->buffer, owner_vcard);
 
-	if (buffer == NULL)
-		goto done;
+	if (buffer != NULL) {
+		size_t len = irmc->buffer->len;
 
-	/* loop around buffer and add X-IRMC-LUID attribs */
-	s = buffer;
-	while ((t = strstr(s, "UID:")) != NULL) {
-		/* add upto UID: into buffer */
-		irmc->buffer = g_string_append_len(irmc->buffer, s, t-s);
-		/*
-		 * add UID: line into buffer
-		 * Not sure if UID is still needed if X-IRMC-LUID is there
-		 */
-		s = t;
-		t = strstr(s, "\r\n");
-		t += 2;
-		irmc->buffer = g_string_append_len(irmc->buffer, s, t-s);
-		/* add X-IRMC-LUID with same number as UID */
-		irmc->buffer = g_string_append_len(irmc->buffer,
-							"X-IRMC-LUID:", 12);
-		s += 4; /* point to uid number */
-		irmc->buffer = g_string_append_len(irmc->buffer, s, t-s);
-		s = t;
+		luid_append(irmc->buffer, buffer, bufsize);
+		irmc->part_size = irmc->buffer->len - len;
 	}
-	/* add remaining bit of buffer */
-	irmc->buffer = g_string_append(irmc->buffer, s);
 
-done:
+	irmc_mem_update(irmc);
+
+	if (!lastpart)
+		phonebook_pull_next_later(&irmc->prefetch_id, irmc_prefetch_cb,
+									irmc);
+
 	obex_object_set_io_flags(irmc, G_IO_IN, 0);
 }
 
@@ -226,9 +287,9 @@ static void *irmc_connect(struct obex_session *os, int *err)
 	param->maxlistcount = 0; /* to count the number of vcards... */
 	param->filter = 0x200085; /* UID TEL N VERSION */
 	irmc->params = param;
-	irmc->request = phonebook_pull("telecom/pb.vcf", irmc->params,
+	irmc->count_request = phonebook_pull("telecom/pb.vcf", irmc->params,
 					phonebook_size_result, irmc, err);
-	ret = phonebook_pull_read(irmc->request);
+	ret = phonebook_pull_read(irmc->count_request, 0, 0);
 	if (err)
 		*err = ret;
 
@@ -262,6 +323,9 @@ static void irmc_disconnect(struct obex_session *os, void *user_data)
 
 	manager_unregister_session(os);
 
+	if (irmc->count_request)
+		phonebook_req_finalize(irmc->count_request);
+
 	if (irmc->params) {
 		if (irmc->params->searchval)
 			g_free(irmc->params->searchval);
@@ -319,7 +383,9 @@ static void *irmc_open_pb(const char *name, struct irmc_session *irmc,
 			goto fail;
 		}
 
-		ret = phonebook_pull_read(irmc->request);
+		irmc->lastpart = FALSE;
+
+		ret = irmc_prefetch(irmc);
 		if (ret < 0) {
 			DBG("phonebook_pull_read failed...");
 			goto fail;
@@ -411,7 +477,7 @@ static void *irmc_open_nt(const char *name, struct irmc_session *irmc,
 }
 
 static void *irmc_open(const char *name, int oflag, mode_t mode, void *context,
-							size_t *size, int *err)
+							int64_t *size, int *err)
 {
 	struct irmc_session *irmc = context;
 	int ret = 0;
@@ -461,19 +527,45 @@ static int irmc_close(void *object)
 		irmc->request = NULL;
 	}
 
+	if (irmc->prefetch_id > 0) {
+		g_source_remove(irmc->prefetch_id);
+		irmc->prefetch_id = 0;
+	}
+
+	irmc->lastpart = FALSE;
+	irmc->reading = FALSE;
+	irmc->part_size = 0;
+
+	irmc_mem_update(irmc);
+
 	return 0;
 }
 
 static ssize_t irmc_read(void *object, void *buf, size_t count)
 {
 	struct irmc_session *irmc = object;
-	int len;
+	int len, ret;
 
 	DBG("buffer %p count %zu", irmc->buffer, count);
 	if (!irmc->buffer)
                 return -EAGAIN;
 
 	len = string_read(irmc->buffer, buf, count);
+	irmc_mem_update(irmc);
+
+	/* Only phonebook pulls have a request, other objects are static */
+	if (irmc->request == NULL)
+		goto done;
+
+	ret = irmc_prefetch(irmc);
+	if (ret < 0 && len == 0)
+		return -EPERM;
+
+	/* Next part already requested, suspend until it arrives */
+	if (len == 0 && !irmc->lastpart)
+		return -EAGAIN;
+
+done:
 	DBG("returning %d bytes", len);
 	return len;
 }
@@ -26,10 +26,14 @@
 #endif
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 #include <fcntl.h>
 #include <inttypes.h>
 
+#include <gobex.h>
+
 #include "obexd.h"
 #include "plugin.h"
 #include "log.h"
@@ -38,8 +42,10 @@
 #include "mimetype.h"
 #include "filesystem.h"
 #include "manager.h"
+#include "xml.h"
 
 #include "messages.h"
+#include "bmsg.h"
 
 /* Channel number according to bluez doc/assigned-numbers.txt */
 #define MAS_CHANNEL	16
@@ -96,38 +102,119 @@
 #define FL_BODY_BEGIN "<folder-listing version=\"1.0\">"
 #define FL_BODY_EMPTY "<folder-listing version=\"1.0\"/>"
 #define FL_PARENT_FOLDER_ELEMENT "<parent-folder/>"
-#define FL_FOLDER_ELEMENT "<folder name=\"%s\"/>"
 #define FL_BODY_END "</folder-listing>"
 
 #define ML_BODY_BEGIN "<MAP-msg-listing version=\"1.0\">"
 #define ML_BODY_END "</MAP-msg-listing>"
 
+/* Application parameters used by GetMessage, PushMessage and
+ * SetMessageStatus */
+#define ATTACHMENT_TAG		0x0A
+#define TRANSPARENT_TAG		0x0B
+#define RETRY_TAG		0x0C
+#define CHARSET_TAG		0x14
+#define FRACTIONREQUEST_TAG	0x15
+#define FRACTIONDELIVER_TAG	0x16
+#define STATUSINDICATOR_TAG	0x17
+#define STATUSVALUE_TAG		0x18
+
+#define CHARSET_UTF8		0x01
+#define FRACTION_NEXT		0x01
+#define FRACTION_LAST		0x01
+
+/* Ask the backend for the next chunk once less than this is buffered */
+#define MESSAGE_LOW_WATERMARK	(32 * 1024)
+
+/* Listing buffers up to this size are kept for the next request */
+#define SPARE_BUFFER_SIZE	4096
+#define SPARE_BUFFER_MAX	(64 * 1024)
+
+struct aparam_header {
+	uint8_t tag;
+	uint8_t len;
+	uint8_t val[0];
+} __attribute__ ((packed));
+
+struct bmsg_push {
+	char *name;
+	unsigned long flags;
+	struct bmsg_parser *parser;
+};
+
 struct mas_session {
+	struct obex_session *os;
 	struct mas_request *request;
 	void *backend_data;
 	gboolean finished;
 	gboolean nth_call;
 	GString *buffer;
+	GString *spare;		/* Emptied buffer kept for the next request */
+	unsigned long flags;	/* GetMessage MESSAGES_* flags */
+	gboolean started;	/* First bMessage chunk received */
+	gboolean fmore;
+	gboolean stalled;	/* Backend waits for messages_get_message_next */
+	gboolean aparam_sent;
+	struct bmsg_push *push;
 };
 
 static const uint8_t MAS_TARGET[TARGET_SIZE] = {
 			0xbb, 0x58, 0x2b, 0x40, 0x42, 0x0c, 0x11, 0xdb,
 			0xb0, 0xde, 0x08, 0x00, 0x20, 0x0c, 0x9a, 0x66  };
 
+static void bmsg_push_free(struct bmsg_push *push)
+{
+	g_free(push->name);
+	bmsg_parser_free(push->parser);
+	g_free(push);
+}
+
 static void reset_request(struct mas_session *mas)
 {
 	if (mas->buffer) {
-		g_string_free(mas->buffer, TRUE);
+		if (mas->spare == NULL &&
+				mas->buffer->allocated_len <= SPARE_BUFFER_MAX)
+			mas->spare = g_string_truncate(mas->buffer, 0);
+		else
+			g_string_free(mas->buffer, TRUE);
+
 		mas->buffer = NULL;
 	}
 
+	if (mas->push) {
+		bmsg_push_free(mas->push);
+		mas->push = NULL;
+	}
+
 	mas->nth_call = FALSE;
 	mas->finished = FALSE;
+	mas->flags = 0;
+	mas->started = FALSE;
+	mas->fmore = FALSE;
+	mas->stalled = FALSE;
+	mas->aparam_sent = FALSE;
+}
+
+static GString *mas_buffer_new(struct mas_session *mas)
+{
+	GString *buffer = mas->spare;
+
+	mas->spare = NULL;
+
+	return buffer ? buffer : g_string_sized_new(SPARE_BUFFER_SIZE);
+}
+
+static void mas_mem_update(struct mas_session *mas)
+{
+	obex_mem_update(mas->os, "mas", mas->buffer ? mas->buffer->len : 0);
 }
 
 static void mas_clean(struct mas_session *mas)
 {
 	reset_request(mas);
+
+	if (mas->spare)
+		g_string_free(mas->spare, TRUE);
+
 	g_free(mas);
 }
 
@@ -138,6 +225,7 @@ static void *mas_connect(struct obex_session *os, int *err)
 	DBG("");
 
 	mas = g_new0(struct mas_session, 1);
+	mas->os = os;
 
 	*err = messages_connect(&mas->backend_data);
 	if (*err < 0)
@@ -160,6 +248,7 @@ static void mas_disconnect(struct obex_session *os, void *user_data)
 	DBG("");
 
 	manager_unregister_session(os);
+
 	messages_disconnect(mas->backend_data);
 
 	mas_clean(mas);
@@ -214,20 +303,6 @@ failed:
 	return ret;
 }
 
-/* FIXME: Preserve whitespaces */
-static void g_string_append_escaped_printf(GString *string,
-						const gchar *format, ...)
-{
-	va_list ap;
-	char *escaped;
-
-	va_start(ap, format);
-	escaped = g_markup_vprintf_escaped(format, ap);
-	g_string_append(string, escaped);
-	g_free(escaped);
-	va_end(ap);
-}
-
 static const char *yesorno(gboolean a)
 {
 	if (a)
@@ -242,6 +317,7 @@ static void get_messages_listing_cb(void *session, int err, uint16_t size,
 					void *user_data)
 {
 	struct mas_session *mas = user_data;
+	GString *buf;
 
 	if (err < 0 && err != -EAGAIN) {
 		obex_object_set_io_flags(mas, G_IO_ERR, err);
@@ -260,111 +336,100 @@ static void get_messages_listing_cb(void *session, int err, uint16_t size,
 		goto proceed;
 	}
 
-	g_string_append(mas->buffer, "<msg");
+	buf = mas->buffer;
+
+	g_string_append(buf, "<msg");
 
-	g_string_append_escaped_printf(mas->buffer, " handle=\"%s\"",
-								entry->handle);
+	xml_attr(buf, "handle", entry->handle);
 
 	if (entry->mask & PMASK_SUBJECT)
-		g_string_append_escaped_printf(mas->buffer, " subject=\"%s\"",
-				entry->subject);
+		xml_attr(buf, "subject", entry->subject);
 
 	if (entry->mask & PMASK_DATETIME)
-		g_string_append_escaped_printf(mas->buffer, " datetime=\"%s\"",
-				entry->datetime);
+		xml_attr(buf, "datetime", entry->datetime);
 
 	if (entry->mask & PMASK_SENDER_NAME)
-		g_string_append_escaped_printf(mas->buffer,
-						" sender_name=\"%s\"",
-						entry->sender_name);
+		xml_attr(buf, "sender_name", entry->sender_name);
 
 	if (entry->mask & PMASK_SENDER_ADDRESSING)
-		g_string_append_escaped_printf(mas->buffer,
-						" sender_addressing=\"%s\"",
-						entry->sender_addressing);
+		xml_attr(buf, "sender_addressing", entry->sender_addressing);
 
 	if (entry->mask & PMASK_REPLYTO_ADDRESSING)
-		g_string_append_escaped_printf(mas->buffer,
-						" replyto_addressing=\"%s\"",
+		xml_attr(buf, "replyto_addressing",
 						entry->replyto_addressing);
 
 	if (entry->mask & PMASK_RECIPIENT_NAME)
-		g_string_append_escaped_printf(mas->buffer,
-						" recipient_name=\"%s\"",
-						entry->recipient_name);
+		xml_attr(buf, "recipient_name", entry->recipient_name);
 
 	if (entry->mask & PMASK_RECIPIENT_ADDRESSING)
-		g_string_append_escaped_printf(mas->buffer,
-						" recipient_addressing=\"%s\"",
+		xml_attr(buf, "recipient_addressing",
 						entry->recipient_addressing);
 
 	if (entry->mask & PMASK_TYPE)
-		g_string_append_escaped_printf(mas->buffer, " type=\"%s\"",
-				entry->type);
+		xml_attr(buf, "type", entry->type);
 
 	if (entry->mask & PMASK_RECEPTION_STATUS)
-		g_string_append_escaped_printf(mas->buffer,
-						" reception_status=\"%s\"",
-						entry->reception_status);
+		xml_attr(buf, "reception_status", entry->reception_status);
 
 	if (entry->mask & PMASK_SIZE)
-		g_string_append_escaped_printf(mas->buffer, " size=\"%s\"",
-				entry->size);
+		xml_attr(buf, "size", entry->size);
 
 	if (entry->mask & PMASK_ATTACHMENT_SIZE)
-		g_string_append_escaped_printf(mas->buffer,
-						" attachment_size=\"%s\"",
-						entry->attachment_size);
+		xml_attr(buf, "attachment_size", entry->attachment_size);
 
 	if (entry->mask & PMASK_TEXT)
-		g_string_append_escaped_printf(mas->buffer, " text=\"%s\"",
-				yesorno(entry->text));
+		xml_attr(buf, "text", yesorno(entry->text));
 
 	if (entry->mask & PMASK_READ)
-		g_string_append_escaped_printf(mas->buffer, " read=\"%s\"",
-				yesorno(entry->read));
+		xml_attr(buf, "read", yesorno(entry->read));
 
 	if (entry->mask & PMASK_SENT)
-		g_string_append_escaped_printf(mas->buffer, " sent=\"%s\"",
-				yesorno(entry->sent));
+		xml_attr(buf, "sent", yesorno(entry->sent));
 
 	if (entry->mask & PMASK_PROTECTED)
-		g_string_append_escaped_printf(mas->buffer, " protected=\"%s\"",
-				yesorno(entry->protect));
+		xml_attr(buf, "protected", yesorno(entry->protect));
 
 	if (entry->mask & PMASK_PRIORITY)
-		g_string_append_escaped_printf(mas->buffer, " priority=\"%s\"",
-				yesorno(entry->priority));
+		xml_attr(buf, "priority", yesorno(entry->priority));
 
-	g_string_append(mas->buffer, "/>\n");
+	g_string_append(buf, "/>\n");
 
 proceed:
+	mas_mem_update(mas);
+
 	if (err != -EAGAIN)
 		obex_object_set_io_flags(mas, G_IO_IN, 0);
 }
 
 static void get_message_cb(void *session, int err, gboolean fmore,
-					const char *chunk, void *user_data)
+				const char *chunk, size_t len, void *user_data)
 {
 	struct mas_session *mas = user_data;
 
-	DBG("");
+	DBG("err %d fmore %d len %zu", err, fmore, len);
 
 	if (err < 0 && err != -EAGAIN) {
 		obex_object_set_io_flags(mas, G_IO_ERR, err);
 		return;
 	}
 
-	if (!chunk) {
-		mas->finished = TRUE;
-		goto proceed;
+	if (!mas->started) {
+		mas->started = TRUE;
+		mas->fmore = fmore;
 	}
 
-	g_string_append(mas->buffer, chunk);
+	if (chunk != NULL && len > 0)
+		g_string_append_len(mas->buffer, chunk, len);
 
-proceed:
-	if (err != -EAGAIN)
-		obex_object_set_io_flags(mas, G_IO_IN, 0);
+	if (err == -EAGAIN)
+		mas->stalled = TRUE;
+	else
+		mas->finished = TRUE;
+
+	mas_mem_update(mas);
+
+	/* Every chunk is handed out right away, nothing accumulates */
+	obex_object_set_io_flags(mas, G_IO_IN, 0);
 }
 
 static void get_folder_listing_cb(void *session, int err, uint16_t size,
@@ -397,11 +462,15 @@ static void get_folder_listing_cb(void *session, int err, uint16_t size,
 
 	if (g_strcmp0(name, "..") == 0)
 		g_string_append(mas->buffer, FL_PARENT_FOLDER_ELEMENT);
-	else
-		g_string_append_escaped_printf(mas->buffer, FL_FOLDER_ELEMENT,
-									name);
+	else {
+		g_string_append(mas->buffer, "<folder");
+		xml_attr(mas->buffer, "name", name);
+		g_string_append(mas->buffer, "/>");
+	}
 
 proceed:
+	mas_mem_update(mas);
+
 	if (err != -EAGAIN)
 		obex_object_set_io_flags(mas, G_IO_IN, err);
 }
@@ -430,7 +499,7 @@ static int mas_setpath(struct obex_session *os, void *user_data)
 }
 
 static void *folder_listing_open(const char *name, int oflag, mode_t mode,
-				void *driver_data, size_t *size, int *err)
+				void *driver_data, int64_t *size, int *err)
 {
 	struct mas_session *mas = driver_data;
 
@@ -441,12 +510,12 @@ static void *folder_listing_open(const char *name, int oflag, mode_t mode,
 
 	DBG("name = %s", name);
 
+	mas->buffer = mas_buffer_new(mas);
+
 	/* 1024 is the default when there was no MaxListCount sent */
 	*err = messages_get_folder_listing(mas->backend_data, name, 1024, 0,
 			get_folder_listing_cb, mas);
 
-	mas->buffer = g_string_new("");
-
 	if (*err < 0)
 		return NULL;
 	else
@@ -454,7 +523,7 @@ static void *folder_listing_open(const char *name, int oflag, mode_t mode,
 }
 
 static void *msg_listing_open(const char *name, int oflag, mode_t mode,
-				void *driver_data, size_t *size, int *err)
+				void *driver_data, int64_t *size, int *err)
 {
 	struct mas_session *mas = driver_data;
 	struct messages_filter filter = { 0, };
@@ -466,36 +535,166 @@ static void *msg_listing_open(const char *name, int oflag, mode_t mode,
 		return NULL;
 	}
 
+	mas->buffer = mas_buffer_new(mas);
+
 	*err = messages_get_messages_listing(mas->backend_data, name, 0xffff, 0,
 			&filter,
 			get_messages_listing_cb, mas);
 
-	mas->buffer = g_string_new("");
-
 	if (*err < 0)
 		return NULL;
 	else
 		return mas;
 }
 
+static int aparam_get_uint8(struct obex_session *os, uint8_t tag,
+								uint8_t *val)
+{
+	const uint8_t *buffer;
+	ssize_t size, len = 0;
+
+	size = obex_get_apparam(os, &buffer);
+
+	while (len + (ssize_t) sizeof(struct aparam_header) <= size) {
+		const struct aparam_header *hdr = (void *) (buffer + len);
+
+		len += sizeof(struct aparam_header) + hdr->len;
+		if (len > size)
+			break;
+
+		if (hdr->tag != tag)
+			continue;
+
+		if (hdr->len != 1)
+			return -EBADR;
+
+		*val = hdr->val[0];
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static unsigned long get_message_flags(struct obex_session *os)
+{
+	unsigned long flags = 0;
+	uint8_t val;
+
+	if (aparam_get_uint8(os, ATTACHMENT_TAG, &val) == 0 && val)
+		flags |= MESSAGES_ATTACHMENT;
+
+	if (aparam_get_uint8(os, CHARSET_TAG, &val) == 0 &&
+							val == CHARSET_UTF8)
+		flags |= MESSAGES_UTF8;
+
+	if (aparam_get_uint8(os, FRACTIONREQUEST_TAG, &val) == 0) {
+		flags |= MESSAGES_FRACTION;
+		if (val == FRACTION_NEXT)
+			flags |= MESSAGES_NEXT;
+	}
+
+	DBG("flags 0x%lx", flags);
+
+	return flags;
+}
+
+static unsigned long push_message_flags(struct obex_session *os)
+{
+	unsigned long flags = 0;
+	uint8_t val;
+
+	if (aparam_get_uint8(os, TRANSPARENT_TAG, &val) == 0 && val)
+		flags |= MESSAGES_TRANSPARENT;
+
+	if (aparam_get_uint8(os, RETRY_TAG, &val) == 0 && val)
+		flags |= MESSAGES_RETRY;
+
+	if (aparam_get_uint8(os, CHARSET_TAG, &val) == 0 &&
+							val == CHARSET_UTF8)
+		flags |= MESSAGES_UTF8;
+
+	DBG("flags 0x%lx", flags);
+
+	return flags;
+}
+
+static int push_begin(const struct messages_bmessage *bmsg, void *user_data)
+{
+	struct mas_session *mas = user_data;
+
+	return messages_push_message_begin(mas->backend_data, mas->push->name,
+							mas->push->flags, bmsg);
+}
+
+static int push_data(const char *chunk, size_t len, void *user_data)
+{
+	struct mas_session *mas = user_data;
+
+	return messages_push_message_data(mas->backend_data, chunk, len);
+}
+
+static int push_end(void *user_data)
+{
+	struct mas_session *mas = user_data;
+	char *handle;
+	int err;
+
+	/* Commit here so errors still reach the client */
+	err = messages_push_message_end(mas->backend_data, &handle);
+	if (err < 0)
+		return err;
+
+	/* The handle goes back in the final response */
+	if (handle != NULL && obex_put_set_response_name(mas->os, handle) < 0)
+		error("Unable to return message handle %s", handle);
+
+	g_free(handle);
+
+	mas->finished = TRUE;
+
+	return 0;
+}
+
+static const struct bmsg_parser_cb push_cb = {
+	.begin = push_begin,
+	.data = push_data,
+	.end = push_end,
+};
+
+static void *push_message_open(const char *name, struct mas_session *mas,
+								int *err)
+{
+	struct bmsg_push *push;
+
+	DBG("name %s", name);
+
+	push = g_new0(struct bmsg_push, 1);
+	push->name = g_strdup(name);
+	push->flags = push_message_flags(mas->os);
+	push->parser = bmsg_parser_new(&push_cb, mas);
+
+	mas->push = push;
+	*err = 0;
+
+	return mas;
+}
+
 static void *message_open(const char *name, int oflag, mode_t mode,
-				void *driver_data, size_t *size, int *err)
+				void *driver_data, int64_t *size, int *err)
 {
 	struct mas_session *mas = driver_data;
 
 	DBG("");
 
-	if (oflag != O_RDONLY) {
-		DBG("Message pushing unsupported");
-		*err = -EINVAL;
+	if (oflag != O_RDONLY)
+		return push_message_open(name, mas, err);
 
-		return NULL;
-	}
+	mas->flags = get_message_flags(mas->os);
 
-	*err = messages_get_message(mas->backend_data, name, 0,
-			get_message_cb, mas);
+	mas->buffer = mas_buffer_new(mas);
 
-	mas->buffer = g_string_new("");
+	*err = messages_get_message(mas->backend_data, name, mas->flags,
+			get_message_cb, mas);
 
 	if (*err < 0)
 		return NULL;
@@ -504,7 +703,7 @@ static void *message_open(const char *name, int oflag, mode_t mode,
 }
 
 static void *any_open(const char *name, int oflag, mode_t mode,
-				void *driver_data, size_t *size, int *err)
+				void *driver_data, int64_t *size, int *err)
 {
 	DBG("");
 
@@ -528,6 +727,63 @@ static ssize_t any_read(void *obj, void *buf, size_t count)
 	DBG("");
 
 	len = string_read(mas->buffer, buf, count);
+	mas_mem_update(mas);
+
+	if (len == 0 && !mas->finished)
+		return -EAGAIN;
+
+	return len;
+}
+
+static ssize_t message_get_next_header(void *object, void *buf, size_t mtu,
+								uint8_t *hi)
+{
+	struct mas_session *mas = object;
+	struct aparam_header *hdr = buf;
+
+	if (!(mas->flags & MESSAGES_FRACTION) || mas->aparam_sent)
+		return 0;
+
+	/* FractionDeliver has to go out before the body */
+	if (!mas->started)
+		return -EAGAIN;
+
+	if (mtu < sizeof(struct aparam_header) + 1)
+		return -ENOBUFS;
+
+	hdr->tag = FRACTIONDELIVER_TAG;
+	hdr->len = 1;
+	hdr->val[0] = mas->fmore ? 0 : FRACTION_LAST;
+
+	mas->aparam_sent = TRUE;
+	*hi = G_OBEX_HDR_APPARAM;
+
+	return sizeof(struct aparam_header) + 1;
+}
+
+static ssize_t message_read(void *obj, void *buf, size_t count)
+{
+	struct mas_session *mas = obj;
+	ssize_t len;
+	int err;
+
+	DBG("");
+
+	len = string_read(mas->buffer, buf, count);
+	mas_mem_update(mas);
+
+	if (mas->stalled && mas->buffer->len < MESSAGE_LOW_WATERMARK) {
+		/* The backend may deliver the next chunk synchronously */
+		mas->stalled = FALSE;
+
+		err = messages_get_message_next(mas->backend_data);
+		if (err < 0) {
+			/* Stay stalled so the error surfaces once drained */
+			mas->stalled = TRUE;
+			if (len == 0)
+				return err;
+		}
+	}
 
 	if (len == 0 && !mas->finished)
 		return -EAGAIN;
@@ -535,6 +791,57 @@ static ssize_t any_read(void *obj, void *buf, size_t count)
 	return len;
 }
 
+static ssize_t push_message_write(void *object, const void *buf, size_t count)
+{
+	struct mas_session *mas = object;
+	int err;
+
+	if (mas->push == NULL || mas->finished)
+		return count;
+
+	err = bmsg_parser_feed(mas->push->parser, buf, count);
+	if (err < 0)
+		return err;
+
+	return count;
+}
+
+static void *message_status_open(const char *name, int oflag, mode_t mode,
+				void *driver_data, int64_t *size, int *err)
+{
+	struct mas_session *mas = driver_data;
+	struct messages_status status;
+	uint8_t indicator, value;
+
+	DBG("name %s", name);
+
+	if (oflag == O_RDONLY || name == NULL) {
+		*err = -EBADR;
+		return NULL;
+	}
+
+	if (aparam_get_uint8(mas->os, STATUSINDICATOR_TAG, &indicator) < 0 ||
+			aparam_get_uint8(mas->os, STATUSVALUE_TAG, &value) < 0 ||
+			indicator > MESSAGES_STATUS_DELETED) {
+		*err = -EBADR;
+		return NULL;
+	}
+
+	status.handle = name;
+	status.indicator = indicator;
+	status.value = value ? TRUE : FALSE;
+
+	/* Applied before the response so failures reach the client */
+	*err = messages_set_message_status(mas->backend_data, &status, 1);
+	if (*err < 0)
+		return NULL;
+
+	/* Nothing left for the backend, the body is just filler */
+	mas->finished = TRUE;
+
+	return mas;
+}
+
 static int any_close(void *obj)
 {
 	struct mas_session *mas = obj;
@@ -580,8 +887,9 @@ static struct obex_mime_type_driver mime_message = {
 	.mimetype = "x-bt/message",
 	.open = message_open,
 	.close = any_close,
-	.read = any_read,
-	.write = any_write,
+	.read = message_read,
+	.get_next_header = message_get_next_header,
+	.write = push_message_write,
 };
 
 static struct obex_mime_type_driver mime_folder_listing = {
@@ -618,7 +926,7 @@ static struct obex_mime_type_driver mime_message_status = {
 	.target = MAS_TARGET,
 	.target_size = TARGET_SIZE,
 	.mimetype = "x-bt/messageStatus",
-	.open = any_open,
+	.open = message_status_open,
 	.close = any_close,
 	.read = any_read,
 	.write = any_write,
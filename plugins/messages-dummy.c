@@ -21,155 +21,2175 @@
  *
  */
 
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
+#include "log.h"
 #include "messages.h"
 
-static char *root_folder = NULL;
+/*
+ * Messages are stored as bMessage files named after their handle, one
+ * directory per folder. Each folder also has an index holding the listing
+ * properties of its messages, so listings never open the messages
+ * themselves. The index is rebuilt from the bMessage files when missing.
+ */
+#define INDEX_FILE		".index"
+#define INDEX_MAGIC		"MAPIDX1\n"
+#define INDEX_MAGIC_LEN		8
+#define HANDLE_FILE		".handle"
+#define MESSAGE_SUFFIX		".bmsg"
+#define PUSH_FILE		".push-XXXXXX"	/* Per upload spool */
+
+/* Entries delivered per main loop iteration when listing */
+#define LISTING_BATCH		256
+#define MESSAGE_CHUNK		(16 * 1024)
+#define SUBJECT_MAX		256
+
+/* LENGTH of a stored bMessage counts the content and these delimiters */
+#define MSG_BEGIN		"BEGIN:MSG\r\n"
+#define MSG_END			"\r\nEND:MSG\r\n"
+#define MSG_OVERHEAD		(sizeof(MSG_BEGIN) - 1 + sizeof(MSG_END) - 1)
+
+/* Rewrite the index once more than half of it are deleted entries */
+#define COMPACT_MIN		64
+
+/* Seconds flag changes are held in memory before going to the index */
+#define FLAGS_SAVE_TIMEOUT	2
+
+#define ENTRY_READ		(1 << 0)
+#define ENTRY_SENT		(1 << 1)
+#define ENTRY_PROTECTED		(1 << 2)
+#define ENTRY_PRIORITY		(1 << 3)
+#define ENTRY_TEXT		(1 << 4)
+#define ENTRY_DELETED		(1 << 5)
+
+#define FILTER_SMS_GSM		(1 << 0)
+#define FILTER_SMS_CDMA		(1 << 1)
+#define FILTER_EMAIL		(1 << 2)
+#define FILTER_MMS		(1 << 3)
+
+#define ENTRY_MASK	(PMASK_SUBJECT | PMASK_DATETIME | PMASK_SENDER_NAME | \
+			PMASK_SENDER_ADDRESSING | PMASK_RECIPIENT_NAME | \
+			PMASK_RECIPIENT_ADDRESSING | PMASK_TYPE | PMASK_SIZE | \
+			PMASK_RECEPTION_STATUS | PMASK_TEXT | \
+			PMASK_ATTACHMENT_SIZE | PMASK_PRIORITY | PMASK_READ | \
+			PMASK_SENT | PMASK_PROTECTED)
+
+enum entry_field {
+	FIELD_TYPE,
+	FIELD_SUBJECT,
+	FIELD_DATETIME,
+	FIELD_SENDER_NAME,
+	FIELD_SENDER_ADDRESSING,
+	FIELD_RECIPIENT_NAME,
+	FIELD_RECIPIENT_ADDRESSING,
+	FIELD_RECEPTION_STATUS,
+	FIELD_COUNT,
+};
+
+enum entry_type {
+	TYPE_OTHER,
+	TYPE_SMS_GSM,
+	TYPE_SMS_CDMA,
+	TYPE_EMAIL,
+	TYPE_MMS,
+	TYPE_COUNT,
+};
+
+/* On-disk record, followed by FIELD_COUNT NUL terminated strings */
+struct index_record {
+	uint32_t length;
+	uint32_t flags;
+	uint64_t handle;
+	uint32_t size;
+	uint32_t attachment_size;
+} __attribute__ ((packed));
+
+struct index_entry {
+	uint64_t handle;
+	uint32_t flags;
+	uint32_t size;
+	uint32_t attachment_size;
+	uint8_t type;			/* enum entry_type */
+	off_t offset;			/* Of the record in the index file */
+	size_t fields[FIELD_COUNT];	/* Offsets into folder_index data */
+};
+
+/* Where the last listing of an index stopped, for the next page */
+struct listing_cursor {
+	struct messages_filter filter;
+	unsigned int generation;
+	uint16_t size;
+	unsigned int matched;		/* Matching entries from pos on */
+	unsigned int pos;
+};
+
+struct folder_index {
+	char *path;
+	GString *data;			/* Index file contents */
+	GArray *entries;		/* Oldest first */
+	GHashTable *handles;		/* handle -> position in entries */
+	unsigned int deleted;
+	unsigned int unread;		/* Live entries not marked read */
+	/* Live entries by type, read and priority */
+	unsigned int counts[TYPE_COUNT][2][2];
+	unsigned int generation;	/* Bumped whenever entries change */
+	struct listing_cursor *cursor;
+	GArray *pending;		/* Offsets of records to write flags */
+	guint save_id;
+	time_t mtime;
+	off_t size;
+};
+
+struct listing_request {
+	char *folder;			/* Index is looked up per batch */
+	struct messages_filter filter;
+	messages_get_messages_listing_cb cb;
+	unsigned int pos;		/* Entries left to look at */
+	unsigned int matched;		/* Matching entries from pos on */
+	unsigned int generation;
+	uint16_t offset;
+	uint16_t max;
+	uint16_t size;
+	gboolean newmsg;
+};
+
+struct message_request {
+	int fd;
+	messages_get_message_cb cb;
+};
+
+struct push_request {
+	char *folder;
+	char *spool;
+	int fd;
+	char *type;
+	gboolean read;
+	char *encoding;
+	char *charset;
+	GSList *recipients;
+	GString *subject;
+	gboolean subject_done;
+	uint32_t size;
+	unsigned long flags;
+};
 
 struct session {
 	char *cwd;
 	char *cwd_absolute;
+	void *user_data;
+	guint id;
+	struct listing_request *listing;
+	struct message_request *message;
+	struct push_request *push;
+	messages_folder_listing_cb folder_cb;
+	GSList *folders;
+	uint16_t folder_size;
 };
 
-int messages_init(void)
+static char *root_folder = NULL;
+
+/* Loaded folder indexes, by absolute path */
+static GHashTable *indexes = NULL;
+
+static int index_flush(struct folder_index *index);
+
+static void filter_copy(struct messages_filter *dst,
+				const struct messages_filter *src)
 {
-	char *tmp;
+	*dst = *src;
+	dst->period_begin = g_strdup(src->period_begin);
+	dst->period_end = g_strdup(src->period_end);
+	dst->recipient = g_strdup(src->recipient);
+	dst->originator = g_strdup(src->originator);
+}
 
-	if (root_folder)
-		return 0;
+static void filter_clear(struct messages_filter *filter)
+{
+	g_free(filter->period_begin);
+	g_free(filter->period_end);
+	g_free(filter->recipient);
+	g_free(filter->originator);
+	memset(filter, 0, sizeof(*filter));
+}
 
-	tmp = getenv("MAP_ROOT");
-	if (tmp) {
-		root_folder = g_strdup(tmp);
-		return 0;
+static void index_free(void *data)
+{
+	struct folder_index *index = data;
+
+	index_flush(index);
+
+	if (index->cursor) {
+		filter_clear(&index->cursor->filter);
+		g_free(index->cursor);
 	}
 
-	tmp = getenv("HOME");
-	if (!tmp)
-		return -ENOENT;
+	g_free(index->path);
+	g_string_free(index->data, TRUE);
+	g_array_free(index->entries, TRUE);
+	g_array_free(index->pending, TRUE);
+	g_hash_table_destroy(index->handles);
+	g_free(index);
+}
 
-	root_folder = g_build_filename(tmp, "map-messages", NULL);
+static guint handle_hash(gconstpointer key)
+{
+	uint64_t handle = *(const uint64_t *) key;
 
-	return 0;
+	return (guint) (handle ^ (handle >> 32));
 }
 
-void messages_exit(void)
+static gboolean handle_equal(gconstpointer a, gconstpointer b)
 {
-	g_free(root_folder);
-	root_folder = NULL;
+	return *(const uint64_t *) a == *(const uint64_t *) b;
 }
 
-int messages_connect(void **s)
+static struct folder_index *index_new(const char *path)
 {
-	struct session *session;
+	struct folder_index *index;
 
-	session = g_new0(struct session, 1);
-	session->cwd = g_strdup("");
-	session->cwd_absolute = g_strdup(root_folder);
+	index = g_new0(struct folder_index, 1);
+	index->path = g_strdup(path);
+	index->data = g_string_new(NULL);
+	index->entries = g_array_new(FALSE, FALSE, sizeof(struct index_entry));
+	index->handles = g_hash_table_new_full(handle_hash, handle_equal,
+								g_free, NULL);
+	index->pending = g_array_new(FALSE, FALSE, sizeof(off_t));
 
-	*s = session;
+	return index;
+}
+
+static const char *entry_field(struct folder_index *index,
+				const struct index_entry *entry,
+				enum entry_field field)
+{
+	return index->data->str + entry->fields[field];
+}
+
+static uint8_t entry_type(const char *type)
+{
+	if (g_str_equal(type, "SMS_GSM"))
+		return TYPE_SMS_GSM;
+
+	if (g_str_equal(type, "SMS_CDMA"))
+		return TYPE_SMS_CDMA;
+
+	if (g_str_equal(type, "EMAIL"))
+		return TYPE_EMAIL;
+
+	if (g_str_equal(type, "MMS"))
+		return TYPE_MMS;
+
+	return TYPE_OTHER;
+}
+
+/* Adds delta to the counters of a live entry */
+static void index_count_entry(struct folder_index *index,
+				const struct index_entry *entry, int delta)
+{
+	if (entry->flags & ENTRY_DELETED)
+		return;
+
+	index->counts[entry->type][!!(entry->flags & ENTRY_READ)]
+				[!!(entry->flags & ENTRY_PRIORITY)] += delta;
+}
+
+static void index_add_record(struct folder_index *index, const char *rec,
+							off_t offset)
+{
+	const struct index_record *hdr = (const void *) rec;
+	struct index_entry entry;
+	const char *p = rec + sizeof(*hdr);
+	int i;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.handle = hdr->handle;
+	entry.flags = hdr->flags;
+	entry.size = hdr->size;
+	entry.attachment_size = hdr->attachment_size;
+	entry.offset = offset;
+
+	for (i = 0; i < FIELD_COUNT; i++) {
+		entry.fields[i] = p - index->data->str;
+		p += strlen(p) + 1;
+	}
+
+	entry.type = entry_type(entry_field(index, &entry, FIELD_TYPE));
+
+	if (entry.flags & ENTRY_DELETED)
+		index->deleted++;
+	else if (!(entry.flags & ENTRY_READ))
+		index->unread++;
+
+	index_count_entry(index, &entry, 1);
+	index->generation++;
+
+	/* Keyed by value, the entries array moves as it grows */
+	g_hash_table_insert(index->handles,
+				g_memdup(&entry.handle, sizeof(entry.handle)),
+				GUINT_TO_POINTER(index->entries->len));
+
+	g_array_append_val(index->entries, entry);
+}
+
+/* Validates and indexes records in data starting at offset */
+static int index_parse(struct folder_index *index, size_t offset)
+{
+	while (offset < index->data->len) {
+		const struct index_record *hdr;
+		const char *p, *end;
+		int i;
+
+		if (index->data->len - offset < sizeof(*hdr))
+			return -EILSEQ;
+
+		hdr = (const void *) (index->data->str + offset);
+		if (hdr->length < sizeof(*hdr) + FIELD_COUNT ||
+				hdr->length > index->data->len - offset)
+			return -EILSEQ;
+
+		/* Every string has to be terminated within the record */
+		p = index->data->str + offset + sizeof(*hdr);
+		end = index->data->str + offset + hdr->length;
+		for (i = 0; i < FIELD_COUNT; i++) {
+			p = memchr(p, '\0', end - p);
+			if (p == NULL)
+				return -EILSEQ;
+			p++;
+		}
+
+		index_add_record(index, index->data->str + offset, offset);
+		offset += hdr->length;
+	}
 
 	return 0;
 }
 
-void messages_disconnect(void *s)
+/* Drops the parsed entries and parses the index data again */
+static int index_reparse(struct folder_index *index)
 {
-	struct session *session = s;
+	g_array_set_size(index->entries, 0);
+	g_hash_table_remove_all(index->handles);
+	index->deleted = 0;
+	index->unread = 0;
+	memset(index->counts, 0, sizeof(index->counts));
+	index->generation++;
 
-	g_free(session->cwd);
-	g_free(session->cwd_absolute);
-	g_free(session);
+	return index_parse(index, INDEX_MAGIC_LEN);
 }
 
-int messages_set_notification_registration(void *session,
-		void (*send_event)(void *session,
-			const struct messages_event *event, void *user_data),
-		void *user_data)
+static void record_append(GString *buf, uint64_t handle, uint32_t flags,
+				uint32_t size, uint32_t attachment_size,
+				const char **fields)
 {
-	return -EINVAL;
+	struct index_record hdr;
+	size_t start = buf->len;
+	int i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	g_string_append_len(buf, (const char *) &hdr, sizeof(hdr));
+
+	for (i = 0; i < FIELD_COUNT; i++) {
+		g_string_append(buf, fields[i] ? fields[i] : "");
+		g_string_append_c(buf, '\0');
+	}
+
+	hdr.length = buf->len - start;
+	hdr.flags = flags;
+	hdr.handle = handle;
+	hdr.size = size;
+	hdr.attachment_size = attachment_size;
+
+	memcpy(buf->str + start, &hdr, sizeof(hdr));
 }
 
-int messages_set_folder(void *s, const char *name, gboolean cdup)
+static void index_stat(struct folder_index *index)
 {
-	struct session *session = s;
-	char *newrel = NULL;
-	char *newabs;
-	char *tmp;
+	char *file = g_build_filename(index->path, INDEX_FILE, NULL);
+	struct stat st;
 
-	if (name && (strchr(name, '/') || strcmp(name, "..") == 0))
-		return -EBADR;
+	if (stat(file, &st) == 0) {
+		index->mtime = st.st_mtime;
+		index->size = st.st_size;
+	}
 
-	if (cdup) {
-		if (session->cwd[0] == 0)
-			return -ENOENT;
+	g_free(file);
+}
 
-		newrel = g_path_get_dirname(session->cwd);
+static int index_write(struct folder_index *index)
+{
+	char *file, *tmp;
+	GError *gerr = NULL;
+	int err = 0;
 
-		/* We use empty string for indication of the root directory */
-		if (newrel[0] == '.' && newrel[1] == 0)
-			newrel[0] = 0;
+	/* The whole data goes out, including any pending flags */
+	g_array_set_size(index->pending, 0);
+	if (index->save_id > 0) {
+		g_source_remove(index->save_id);
+		index->save_id = 0;
+	}
+
+	file = g_build_filename(index->path, INDEX_FILE, NULL);
+	tmp = g_strconcat(file, ".tmp", NULL);
+
+	if (!g_file_set_contents(tmp, index->data->str, index->data->len,
+								&gerr)) {
+		error("Unable to write %s: %s", tmp, gerr->message);
+		g_error_free(gerr);
+		err = -EIO;
+	} else if (rename(tmp, file) < 0) {
+		err = -errno;
+		unlink(tmp);
 	}
 
-	tmp = newrel;
-	if (!cdup && (!name || name[0] == 0))
-		newrel = g_strdup("");
-	else
-		newrel = g_build_filename(newrel ? newrel : session->cwd, name,
-				NULL);
 	g_free(tmp);
+	g_free(file);
 
-	newabs = g_build_filename(root_folder, newrel, NULL);
+	index_stat(index);
 
-	if (!g_file_test(newabs, G_FILE_TEST_IS_DIR)) {
-		g_free(newrel);
-		g_free(newabs);
-		return -ENOENT;
+	return err;
+}
+
+static char *vcard_property(const char *line, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (g_ascii_strncasecmp(line, name, len) != 0)
+		return NULL;
+
+	if (line[len] != ':' && line[len] != ';')
+		return NULL;
+
+	line = strchr(line + len, ':');
+
+	return line ? g_strdup(line + 1) : NULL;
+}
+
+struct bmsg_info {
+	gboolean read;
+	char *type;
+	char *sender_name;
+	char *sender_addressing;
+	char *recipient_name;
+	char *recipient_addressing;
+	char *subject;
+	uint32_t size;
+};
+
+static void bmsg_info_clear(struct bmsg_info *info)
+{
+	g_free(info->type);
+	g_free(info->sender_name);
+	g_free(info->sender_addressing);
+	g_free(info->recipient_name);
+	g_free(info->recipient_addressing);
+	g_free(info->subject);
+	memset(info, 0, sizeof(*info));
+}
+
+/* Length of str cut to SUBJECT_MAX bytes of valid UTF-8 */
+static size_t subject_len(const char *str, size_t len)
+{
+	const char *end;
+
+	/* Back off to the start of the character that does not fit */
+	if (len > SUBJECT_MAX) {
+		end = g_utf8_find_prev_char(str, str + SUBJECT_MAX + 1);
+		len = end ? end - str : 0;
 	}
 
-	g_free(session->cwd);
-	session->cwd = newrel;
+	g_utf8_validate(str, len, &end);
 
-	g_free(session->cwd_absolute);
-	session->cwd_absolute = newabs;
+	return end - str;
+}
 
-	return 0;
+/* Only used when an index has to be rebuilt */
+static gboolean bmsg_parse(const char *contents, struct bmsg_info *info)
+{
+	char **lines, **l;
+	gboolean benv = FALSE, vcard = FALSE, msg = FALSE;
+
+	memset(info, 0, sizeof(*info));
+
+	lines = g_strsplit(contents, "\n", -1);
+
+	for (l = lines; *l; l++) {
+		char *line = g_strchomp(*l);
+		char **name, **addressing;
+		char *value;
+
+		if (msg) {
+			if (g_str_equal(line, "END:MSG")) {
+				msg = FALSE;
+				continue;
+			}
+
+			if (info->subject == NULL && line[0] != '\0') {
+				size_t len = subject_len(line, strlen(line));
+
+				info->subject = g_strndup(line, len);
+			}
+
+			info->size += strlen(line) + 2;
+			continue;
+		}
+
+		if (g_str_equal(line, "BEGIN:MSG")) {
+			msg = TRUE;
+			continue;
+		}
+
+		if (g_str_equal(line, "BEGIN:BENV")) {
+			benv = TRUE;
+			continue;
+		}
+
+		if (g_str_equal(line, "BEGIN:VCARD")) {
+			vcard = TRUE;
+			continue;
+		}
+
+		if (g_str_equal(line, "END:VCARD")) {
+			vcard = FALSE;
+			continue;
+		}
+
+		if (g_str_has_prefix(line, "STATUS:")) {
+			info->read = g_str_equal(line + 7, "READ");
+			continue;
+		}
+
+		if (g_str_has_prefix(line, "TYPE:") && !vcard) {
+			g_free(info->type);
+			info->type = g_strdup(line + 5);
+			continue;
+		}
+
+		if (!vcard)
+			continue;
+
+		/* Originator vCard comes before the envelope */
+		name = benv ? &info->recipient_name : &info->sender_name;
+		addressing = benv ? &info->recipient_addressing :
+						&info->sender_addressing;
+
+		value = vcard_property(line, "FN");
+		if (value == NULL)
+			value = vcard_property(line, "N");
+		if (value != NULL) {
+			if (*name == NULL)
+				*name = value;
+			else
+				g_free(value);
+			continue;
+		}
+
+		value = vcard_property(line, "TEL");
+		if (value == NULL)
+			value = vcard_property(line, "EMAIL");
+		if (value != NULL) {
+			if (*addressing == NULL)
+				*addressing = value;
+			else
+				g_free(value);
+		}
+	}
+
+	g_strfreev(lines);
+
+	return info->type != NULL;
 }
 
-int messages_get_folder_listing(void *session,
-		const char *name,
-		uint16_t max, uint16_t offset,
-		messages_folder_listing_cb callback,
-		void *user_data)
+static void format_datetime(time_t t, char *buf, size_t len)
 {
-	return -EINVAL;
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(buf, len, "%Y%m%dT%H%M%S", &tm);
 }
 
-int messages_get_messages_listing(void *session,
-		const char *name,
-		uint16_t max, uint16_t offset,
-		const struct messages_filter *filter,
-		messages_get_messages_listing_cb callback,
-		void *user_data)
+static gboolean folder_is_sent(const char *path)
 {
-	return -EINVAL;
+	char *base = g_path_get_basename(path);
+	gboolean sent = g_ascii_strcasecmp(base, "sent") == 0;
+
+	g_free(base);
+
+	return sent;
 }
 
-int messages_get_message(void *session,
-		const char *handle,
-		unsigned long flags,
-		messages_get_message_cb callback,
-		void *user_data)
+static void index_append_info(struct folder_index *index, uint64_t handle,
+				const struct bmsg_info *info, time_t mtime)
 {
-	return -EINVAL;
+	char datetime[32];
+	const char *fields[FIELD_COUNT];
+	uint32_t flags = ENTRY_TEXT;
+
+	format_datetime(mtime, datetime, sizeof(datetime));
+
+	fields[FIELD_TYPE] = info->type;
+	fields[FIELD_SUBJECT] = info->subject;
+	fields[FIELD_DATETIME] = datetime;
+	fields[FIELD_SENDER_NAME] = info->sender_name;
+	fields[FIELD_SENDER_ADDRESSING] = info->sender_addressing;
+	fields[FIELD_RECIPIENT_NAME] = info->recipient_name;
+	fields[FIELD_RECIPIENT_ADDRESSING] = info->recipient_addressing;
+	fields[FIELD_RECEPTION_STATUS] = "complete";
+
+	if (info->read)
+		flags |= ENTRY_READ;
+
+	if (folder_is_sent(index->path))
+		flags |= ENTRY_SENT;
+
+	record_append(index->data, handle, flags, info->size, 0, fields);
+}
+
+struct scanned {
+	uint64_t handle;
+	time_t mtime;
+	char *name;
+};
+
+static gint scanned_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct scanned *sa = a, *sb = b;
+
+	if (sa->mtime != sb->mtime)
+		return sa->mtime < sb->mtime ? -1 : 1;
+
+	return sa->handle < sb->handle ? -1 : sa->handle > sb->handle;
+}
+
+static int index_rebuild(struct folder_index *index)
+{
+	struct dirent *ep;
+	GSList *files = NULL, *l;
+	DIR *dp;
+
+	DBG("%s", index->path);
+
+	dp = opendir(index->path);
+	if (dp == NULL)
+		return -errno;
+
+	while ((ep = readdir(dp))) {
+		struct scanned *s;
+		struct stat st;
+		char *end;
+		uint64_t handle;
+
+		if (!g_str_has_suffix(ep->d_name, MESSAGE_SUFFIX))
+			continue;
+
+		handle = g_ascii_strtoull(ep->d_name, &end, 16);
+		if (end == ep->d_name || !g_str_equal(end, MESSAGE_SUFFIX))
+			continue;
+
+		if (fstatat(dirfd(dp), ep->d_name, &st, 0) < 0)
+			continue;
+
+		s = g_new0(struct scanned, 1);
+		s->handle = handle;
+		s->mtime = st.st_mtime;
+		s->name = g_strdup(ep->d_name);
+
+		files = g_slist_prepend(files, s);
+	}
+
+	closedir(dp);
+
+	files = g_slist_sort(files, scanned_cmp);
+
+	g_string_assign(index->data, "");
+	g_string_append_len(index->data, INDEX_MAGIC, INDEX_MAGIC_LEN);
+
+	for (l = files; l; l = l->next) {
+		struct scanned *s = l->data;
+		struct bmsg_info info;
+		char *file, *contents;
+
+		file = g_build_filename(index->path, s->name, NULL);
+
+		if (g_file_get_contents(file, &contents, NULL, NULL)) {
+			if (bmsg_parse(contents, &info))
+				index_append_info(index, s->handle, &info,
+								s->mtime);
+			else
+				DBG("%s is not a bMessage", file);
+
+			bmsg_info_clear(&info);
+			g_free(contents);
+		}
+
+		g_free(file);
+		g_free(s->name);
+		g_free(s);
+	}
+
+	g_slist_free(files);
+
+	index_reparse(index);
+
+	return index_write(index);
+}
+
+static int index_load(struct folder_index *index)
+{
+	char *file, *contents;
+	gsize len;
+	int err;
+
+	file = g_build_filename(index->path, INDEX_FILE, NULL);
+
+	if (!g_file_get_contents(file, &contents, &len, NULL)) {
+		g_free(file);
+		return index_rebuild(index);
+	}
+
+	g_free(file);
+
+	g_string_assign(index->data, "");
+	g_string_append_len(index->data, contents, len);
+	g_free(contents);
+
+	if (len < INDEX_MAGIC_LEN ||
+			memcmp(index->data->str, INDEX_MAGIC, INDEX_MAGIC_LEN))
+		return index_rebuild(index);
+
+	err = index_reparse(index);
+	if (err < 0) {
+		error("Corrupted index in %s, rebuilding", index->path);
+		return index_rebuild(index);
+	}
+
+	index_stat(index);
+
+	return 0;
 }
 
-void messages_abort(void *session)
+/* Returns the index of a folder, reloading it if changed behind our back */
+static struct folder_index *index_get(const char *path)
 {
+	struct folder_index *index;
+	char *file;
+	struct stat st;
+
+	index = g_hash_table_lookup(indexes, path);
+
+	/* Memory is ahead of the file until pending flags are written */
+	if (index != NULL && index->pending->len > 0)
+		return index;
+
+	if (index != NULL) {
+		file = g_build_filename(path, INDEX_FILE, NULL);
+
+		if (stat(file, &st) == 0 && st.st_mtime == index->mtime &&
+						st.st_size == index->size) {
+			g_free(file);
+			return index;
+		}
+
+		g_free(file);
+
+		if (index_load(index) < 0) {
+			g_hash_table_remove(indexes, path);
+			return NULL;
+		}
+
+		return index;
+	}
+
+	if (!g_file_test(path, G_FILE_TEST_IS_DIR))
+		return NULL;
+
+	index = index_new(path);
+
+	if (index_load(index) < 0) {
+		index_free(index);
+		return NULL;
+	}
+
+	g_hash_table_insert(indexes, index->path, index);
+
+	return index;
+}
+
+static struct index_entry *index_lookup(struct folder_index *index,
+							uint64_t handle)
+{
+	gpointer value;
+	struct index_entry *entry;
+
+	if (!g_hash_table_lookup_extended(index->handles, &handle, NULL,
+								&value))
+		return NULL;
+
+	entry = &g_array_index(index->entries, struct index_entry,
+						GPOINTER_TO_UINT(value));
+	if (entry->flags & ENTRY_DELETED)
+		return NULL;
+
+	return entry;
+}
+
+static void load_tree(const char *path)
+{
+	struct dirent *ep;
+	DIR *dp;
+
+	index_get(path);
+
+	dp = opendir(path);
+	if (dp == NULL)
+		return;
+
+	while ((ep = readdir(dp))) {
+		char *child;
+
+		if (ep->d_name[0] == '.')
+			continue;
+
+		child = g_build_filename(path, ep->d_name, NULL);
+
+		if (g_file_test(child, G_FILE_TEST_IS_DIR))
+			load_tree(child);
+
+		g_free(child);
+	}
+
+	closedir(dp);
+}
+
+/* Handles are unique in the whole store, the message may be anywhere */
+static struct folder_index *find_message(struct session *session,
+				uint64_t handle, struct index_entry **entry)
+{
+	struct folder_index *index;
+	GHashTableIter iter;
+	gpointer value;
+	gboolean loaded = FALSE;
+
+	index = index_get(session->cwd_absolute);
+	if (index && (*entry = index_lookup(index, handle)))
+		return index;
+
+retry:
+	g_hash_table_iter_init(&iter, indexes);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		index = value;
+
+		*entry = index_lookup(index, handle);
+		if (*entry != NULL)
+			return index;
+	}
+
+	if (!loaded) {
+		loaded = TRUE;
+		load_tree(root_folder);
+		goto retry;
+	}
+
+	return NULL;
+}
+
+static gboolean parse_handle(const char *str, uint64_t *handle)
+{
+	char *end;
+
+	if (str == NULL || *str == '\0')
+		return FALSE;
+
+	*handle = g_ascii_strtoull(str, &end, 16);
+
+	return *end == '\0';
+}
+
+static char *message_path(struct folder_index *index, uint64_t handle)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%" PRIX64 MESSAGE_SUFFIX, handle);
+
+	return g_build_filename(index->path, name, NULL);
+}
+
+static uint64_t next_handle(void)
+{
+	char *file, *contents, buf[32];
+	uint64_t handle = 0;
+
+	file = g_build_filename(root_folder, HANDLE_FILE, NULL);
+
+	if (g_file_get_contents(file, &contents, NULL, NULL)) {
+		handle = g_ascii_strtoull(contents, NULL, 16);
+		g_free(contents);
+	}
+
+	/* Stay clear of handles given to hand made messages */
+	if (handle == 0)
+		handle = g_get_real_time();
+
+	snprintf(buf, sizeof(buf), "%" PRIX64 "\n", handle + 1);
+	g_file_set_contents(file, buf, -1, NULL);
+
+	g_free(file);
+
+	return handle;
+}
+
+static void index_compact(struct folder_index *index)
+{
+	GString *data;
+	unsigned int i;
+
+	if (index->deleted < COMPACT_MIN ||
+				index->deleted * 2 < index->entries->len)
+		return;
+
+	DBG("%s: dropping %u deleted entries", index->path, index->deleted);
+
+	data = g_string_sized_new(index->data->len);
+	g_string_append_len(data, INDEX_MAGIC, INDEX_MAGIC_LEN);
+
+	for (i = 0; i < index->entries->len; i++) {
+		struct index_entry *entry = &g_array_index(index->entries,
+						struct index_entry, i);
+		const struct index_record *hdr;
+
+		if (entry->flags & ENTRY_DELETED)
+			continue;
+
+		hdr = (const void *) (index->data->str + entry->offset);
+		g_string_append_len(data, (const char *) hdr, hdr->length);
+	}
+
+	g_string_free(index->data, TRUE);
+	index->data = data;
+
+	index_reparse(index);
+
+	index_write(index);
+}
+
+/* Writes the queued flag changes in place, with a single open */
+static int index_flush(struct folder_index *index)
+{
+	char *file;
+	struct stat st;
+	unsigned int i;
+	int fd, err = 0;
+
+	if (index->save_id > 0) {
+		g_source_remove(index->save_id);
+		index->save_id = 0;
+	}
+
+	if (index->pending->len == 0)
+		return 0;
+
+	file = g_build_filename(index->path, INDEX_FILE, NULL);
+
+	/* Offsets are only valid for the file the index was loaded from */
+	if (stat(file, &st) < 0 || st.st_mtime != index->mtime ||
+						st.st_size != index->size) {
+		DBG("%s changed, dropping %u flag updates", file,
+							index->pending->len);
+		err = -ESTALE;
+		goto done;
+	}
+
+	fd = open(file, O_WRONLY);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	for (i = 0; i < index->pending->len; i++) {
+		off_t offset = g_array_index(index->pending, off_t, i);
+		const struct index_record *hdr = (const void *)
+						(index->data->str + offset);
+
+		if (pwrite(fd, &hdr->flags, sizeof(hdr->flags), offset +
+				offsetof(struct index_record, flags)) < 0) {
+			err = -errno;
+			break;
+		}
+	}
+
+	close(fd);
+
+	index_stat(index);
+
+done:
+	g_array_set_size(index->pending, 0);
+	g_free(file);
+
+	if (err < 0)
+		error("Unable to update flags in %s: %s", index->path,
+							strerror(-err));
+
+	return err;
+}
+
+static gboolean index_save_cb(gpointer user_data)
+{
+	struct folder_index *index = user_data;
+
+	index->save_id = 0;
+	index_flush(index);
+
+	return FALSE;
+}
+
+/*
+ * Updates the flags of an entry in memory, the index file is updated by
+ * index_flush() for all changes queued in the meantime.
+ */
+static void index_set_flags(struct folder_index *index,
+				struct index_entry *entry, uint32_t flags)
+{
+	struct index_record *hdr;
+
+	if (entry->flags == flags)
+		return;
+
+	/* Only the transition counts, the flag may already be set */
+	if ((flags & ENTRY_DELETED) && !(entry->flags & ENTRY_DELETED))
+		index->deleted++;
+	else if (!(flags & ENTRY_DELETED) && (entry->flags & ENTRY_DELETED))
+		index->deleted--;
+
+	if (!(entry->flags & (ENTRY_READ | ENTRY_DELETED)))
+		index->unread--;
+
+	if (!(flags & (ENTRY_READ | ENTRY_DELETED)))
+		index->unread++;
+
+	index_count_entry(index, entry, -1);
+	entry->flags = flags;
+	index_count_entry(index, entry, 1);
+	index->generation++;
+
+	hdr = (void *) (index->data->str + entry->offset);
+	hdr->flags = flags;
+
+	g_array_append_val(index->pending, entry->offset);
+
+	if (index->save_id == 0)
+		index->save_id = g_timeout_add_seconds(FLAGS_SAVE_TIMEOUT,
+							index_save_cb, index);
+}
+
+static int index_append(struct folder_index *index, uint64_t handle,
+				uint32_t flags, uint32_t size,
+				const char **fields)
+{
+	size_t start = index->data->len;
+	char *file;
+	int fd, err = 0;
+
+	record_append(index->data, handle, flags, size, 0, fields);
+
+	file = g_build_filename(index->path, INDEX_FILE, NULL);
+
+	fd = open(file, O_WRONLY | O_APPEND);
+	if (fd < 0)
+		err = -errno;
+	else {
+		if (write(fd, index->data->str + start,
+					index->data->len - start) < 0)
+			err = -errno;
+		close(fd);
+	}
+
+	g_free(file);
+
+	if (err < 0) {
+		g_string_truncate(index->data, start);
+		return err;
+	}
+
+	index_parse(index, start);
+	index_stat(index);
+
+	return 0;
+}
+
+int messages_init(void)
+{
+	char *tmp;
+
+	if (root_folder)
+		return 0;
+
+	tmp = getenv("MAP_ROOT");
+	if (tmp)
+		root_folder = g_strdup(tmp);
+	else {
+		tmp = getenv("HOME");
+		if (!tmp)
+			return -ENOENT;
+
+		root_folder = g_build_filename(tmp, "map-messages", NULL);
+	}
+
+	indexes = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+								index_free);
+
+	return 0;
+}
+
+void messages_exit(void)
+{
+	if (indexes) {
+		g_hash_table_destroy(indexes);
+		indexes = NULL;
+	}
+
+	g_free(root_folder);
+	root_folder = NULL;
+}
+
+int messages_connect(void **s)
+{
+	struct session *session;
+
+	session = g_new0(struct session, 1);
+	session->cwd = g_strdup("");
+	session->cwd_absolute = g_strdup(root_folder);
+
+	*s = session;
+
+	return 0;
+}
+
+void messages_disconnect(void *s)
+{
+	struct session *session = s;
+
+	messages_abort(session);
+
+	g_free(session->cwd);
+	g_free(session->cwd_absolute);
+	g_free(session);
+}
+
+int messages_set_notification_registration(void *session,
+		void (*send_event)(void *session,
+			const struct messages_event *event, void *user_data),
+		void *user_data)
+{
+	return -EINVAL;
+}
+
+int messages_set_folder(void *s, const char *name, gboolean cdup)
+{
+	struct session *session = s;
+	char *newrel = NULL;
+	char *newabs;
+	char *tmp;
+
+	if (name && (strchr(name, '/') || strcmp(name, "..") == 0))
+		return -EBADR;
+
+	if (cdup) {
+		if (session->cwd[0] == 0)
+			return -ENOENT;
+
+		newrel = g_path_get_dirname(session->cwd);
+
+		/* We use empty string for indication of the root directory */
+		if (newrel[0] == '.' && newrel[1] == 0)
+			newrel[0] = 0;
+	}
+
+	tmp = newrel;
+	if (!cdup && (!name || name[0] == 0))
+		newrel = g_strdup("");
+	else
+		newrel = g_build_filename(newrel ? newrel : session->cwd, name,
+				NULL);
+	g_free(tmp);
+
+	newabs = g_build_filename(root_folder, newrel, NULL);
+
+	/* Folders with a loaded index are known to exist */
+	if (!g_hash_table_lookup(indexes, newabs) &&
+				!g_file_test(newabs, G_FILE_TEST_IS_DIR)) {
+		g_free(newrel);
+		g_free(newabs);
+		return -ENOENT;
+	}
+
+	g_free(session->cwd);
+	session->cwd = newrel;
+
+	g_free(session->cwd_absolute);
+	session->cwd_absolute = newabs;
+
+	return 0;
+}
+
+static char *session_folder(struct session *session, const char *name)
+{
+	if (name == NULL || name[0] == '\0')
+		return g_strdup(session->cwd_absolute);
+
+	if (strchr(name, '/') || strcmp(name, "..") == 0)
+		return NULL;
+
+	return g_build_filename(session->cwd_absolute, name, NULL);
+}
+
+static gboolean folder_listing_cb(void *user_data)
+{
+	struct session *session = user_data;
+	GSList *l;
+
+	session->id = 0;
+
+	for (l = session->folders; l; l = l->next)
+		session->folder_cb(session, -EAGAIN, session->folder_size,
+						l->data, session->user_data);
+
+	session->folder_cb(session, 0, session->folder_size, NULL,
+							session->user_data);
+
+	g_slist_free_full(session->folders, g_free);
+	session->folders = NULL;
+
+	return FALSE;
+}
+
+int messages_get_folder_listing(void *s,
+		const char *name,
+		uint16_t max, uint16_t offset,
+		messages_folder_listing_cb callback,
+		void *user_data)
+{
+	struct session *session = s;
+	struct dirent *ep;
+	GSList *folders = NULL, *l;
+	char *path;
+	DIR *dp;
+	uint16_t n;
+
+	if (session->id > 0)
+		return -EBUSY;
+
+	path = session_folder(session, name);
+	if (path == NULL)
+		return -EBADR;
+
+	dp = opendir(path);
+	g_free(path);
+
+	if (dp == NULL)
+		return -ENOENT;
+
+	while ((ep = readdir(dp))) {
+		struct stat st;
+
+		if (ep->d_name[0] == '.')
+			continue;
+
+		if (fstatat(dirfd(dp), ep->d_name, &st, 0) < 0 ||
+						!S_ISDIR(st.st_mode))
+			continue;
+
+		folders = g_slist_insert_sorted(folders, g_strdup(ep->d_name),
+							(GCompareFunc) strcmp);
+	}
+
+	closedir(dp);
+
+	session->folder_size = g_slist_length(folders);
+
+	/* Keep only the requested window */
+	for (l = folders, n = 0; l; l = l->next, n++) {
+		if (n >= offset && n - offset < max)
+			session->folders = g_slist_prepend(session->folders,
+								l->data);
+		else
+			g_free(l->data);
+	}
+
+	g_slist_free(folders);
+	session->folders = g_slist_reverse(session->folders);
+
+	session->folder_cb = callback;
+	session->user_data = user_data;
+	session->id = g_idle_add(folder_listing_cb, session);
+
+	return 0;
+}
+
+static const uint8_t type_filters[TYPE_COUNT] = {
+	[TYPE_SMS_GSM] = FILTER_SMS_GSM,
+	[TYPE_SMS_CDMA] = FILTER_SMS_CDMA,
+	[TYPE_EMAIL] = FILTER_EMAIL,
+	[TYPE_MMS] = FILTER_MMS,
+};
+
+static gboolean type_filtered(uint8_t mask, uint8_t type)
+{
+	return (mask & type_filters[type]) != 0;
+}
+
+static gboolean flags_filtered(const struct messages_filter *filter,
+							uint32_t flags)
+{
+	if (filter->read_status == 0x01 && (flags & ENTRY_READ))
+		return TRUE;
+
+	if (filter->read_status == 0x02 && !(flags & ENTRY_READ))
+		return TRUE;
+
+	if (filter->priority == 0x01 && !(flags & ENTRY_PRIORITY))
+		return TRUE;
+
+	if (filter->priority == 0x02 && (flags & ENTRY_PRIORITY))
+		return TRUE;
+
+	return FALSE;
+}
+
+static gboolean entry_matches(struct folder_index *index,
+				const struct index_entry *entry,
+				const struct messages_filter *filter)
+{
+	const char *datetime;
+
+	if (entry->flags & ENTRY_DELETED)
+		return FALSE;
+
+	if (type_filtered(filter->type, entry->type))
+		return FALSE;
+
+	if (flags_filtered(filter, entry->flags))
+		return FALSE;
+
+	/* Timestamps compare as strings in the MAP format */
+	datetime = entry_field(index, entry, FIELD_DATETIME);
+
+	if (filter->period_begin &&
+			strcmp(datetime, filter->period_begin) < 0)
+		return FALSE;
+
+	if (filter->period_end && strcmp(datetime, filter->period_end) >= 0)
+		return FALSE;
+
+	if (filter->recipient && !strstr(entry_field(index, entry,
+					FIELD_RECIPIENT_ADDRESSING),
+					filter->recipient) &&
+			!strstr(entry_field(index, entry, FIELD_RECIPIENT_NAME),
+					filter->recipient))
+		return FALSE;
+
+	if (filter->originator && !strstr(entry_field(index, entry,
+					FIELD_SENDER_ADDRESSING),
+					filter->originator) &&
+			!strstr(entry_field(index, entry, FIELD_SENDER_NAME),
+					filter->originator))
+		return FALSE;
+
+	return TRUE;
+}
+
+static gboolean filter_active(const struct messages_filter *filter)
+{
+	return filter->type || filter->period_begin || filter->period_end ||
+		filter->read_status || filter->recipient ||
+		filter->originator || filter->priority;
+}
+
+/* Filters on type and flags only are answered by the counters */
+static gboolean filter_counted(const struct messages_filter *filter)
+{
+	return !filter->period_begin && !filter->period_end &&
+				!filter->recipient && !filter->originator;
+}
+
+static gboolean filter_equal(const struct messages_filter *a,
+				const struct messages_filter *b)
+{
+	return a->type == b->type && a->read_status == b->read_status &&
+			a->priority == b->priority &&
+			g_strcmp0(a->period_begin, b->period_begin) == 0 &&
+			g_strcmp0(a->period_end, b->period_end) == 0 &&
+			g_strcmp0(a->recipient, b->recipient) == 0 &&
+			g_strcmp0(a->originator, b->originator) == 0;
+}
+
+static unsigned int index_count(struct folder_index *index,
+				const struct messages_filter *filter)
+{
+	unsigned int type, read, priority, count = 0;
+
+	for (type = 0; type < TYPE_COUNT; type++) {
+		if (type_filtered(filter->type, type))
+			continue;
+
+		for (read = 0; read < 2; read++) {
+			for (priority = 0; priority < 2; priority++) {
+				uint32_t flags = (read ? ENTRY_READ : 0) |
+					(priority ? ENTRY_PRIORITY : 0);
+
+				if (!flags_filtered(filter, flags))
+					count += index->counts[type][read]
+								[priority];
+			}
+		}
+	}
+
+	return count;
+}
+
+/* The cursor of the last listing, if the index did not change since */
+static struct listing_cursor *index_cursor(struct folder_index *index,
+				const struct messages_filter *filter)
+{
+	struct listing_cursor *cursor = index->cursor;
+
+	if (cursor == NULL || cursor->generation != index->generation)
+		return NULL;
+
+	if (!filter_equal(&cursor->filter, filter))
+		return NULL;
+
+	return cursor;
+}
+
+static void index_cursor_save(struct folder_index *index,
+				const struct listing_request *req)
+{
+	struct listing_cursor *cursor = index->cursor;
+
+	if (cursor == NULL)
+		cursor = index->cursor = g_new0(struct listing_cursor, 1);
+	else
+		filter_clear(&cursor->filter);
+
+	filter_copy(&cursor->filter, &req->filter);
+	cursor->generation = req->generation;
+	cursor->size = req->size;
+	cursor->matched = req->matched;
+	cursor->pos = req->pos;
+}
+
+static void listing_free(struct listing_request *req)
+{
+	g_free(req->folder);
+	filter_clear(&req->filter);
+	g_free(req);
+}
+
+static void listing_send(struct session *session, struct folder_index *index,
+				const struct index_entry *entry)
+{
+	struct listing_request *req = session->listing;
+	struct messages_message msg;
+	char handle[17], size[11], attachment_size[11];
+
+	snprintf(handle, sizeof(handle), "%" PRIX64, entry->handle);
+	snprintf(size, sizeof(size), "%u", entry->size);
+	snprintf(attachment_size, sizeof(attachment_size), "%u",
+						entry->attachment_size);
+
+	memset(&msg, 0, sizeof(msg));
+
+	msg.mask = ENTRY_MASK;
+	if (req->filter.parameter_mask)
+		msg.mask &= req->filter.parameter_mask;
+
+	msg.handle = handle;
+	msg.subject = (char *) entry_field(index, entry, FIELD_SUBJECT);
+	msg.datetime = (char *) entry_field(index, entry, FIELD_DATETIME);
+	msg.sender_name = (char *) entry_field(index, entry,
+							FIELD_SENDER_NAME);
+	msg.sender_addressing = (char *) entry_field(index, entry,
+						FIELD_SENDER_ADDRESSING);
+	msg.recipient_name = (char *) entry_field(index, entry,
+							FIELD_RECIPIENT_NAME);
+	msg.recipient_addressing = (char *) entry_field(index, entry,
+						FIELD_RECIPIENT_ADDRESSING);
+	msg.type = (char *) entry_field(index, entry, FIELD_TYPE);
+	msg.reception_status = (char *) entry_field(index, entry,
+						FIELD_RECEPTION_STATUS);
+	msg.size = size;
+	msg.attachment_size = attachment_size;
+	msg.text = (entry->flags & ENTRY_TEXT) != 0;
+	msg.read = (entry->flags & ENTRY_READ) != 0;
+	msg.sent = (entry->flags & ENTRY_SENT) != 0;
+	msg.protect = (entry->flags & ENTRY_PROTECTED) != 0;
+	msg.priority = (entry->flags & ENTRY_PRIORITY) != 0;
+
+	req->cb(session, -EAGAIN, req->size, req->newmsg, &msg,
+							session->user_data);
+}
+
+static gboolean messages_listing_cb(void *user_data)
+{
+	struct session *session = user_data;
+	struct listing_request *req = session->listing;
+	struct folder_index *index;
+	unsigned int batch = 0;
+	int err = 0;
+
+	/* A failed reload drops the index, do not keep a pointer to it */
+	index = g_hash_table_lookup(indexes, req->folder);
+	if (index == NULL) {
+		err = -ENOENT;
+		goto done;
+	}
+
+	/* The index may have been reloaded or compacted in between */
+	if (req->pos > index->entries->len)
+		req->pos = index->entries->len;
+
+	while (req->pos > 0 && req->max > 0 && batch < LISTING_BATCH) {
+		const struct index_entry *entry;
+
+		/* Newest first */
+		entry = &g_array_index(index->entries, struct index_entry,
+								--req->pos);
+
+		if (!entry_matches(index, entry, &req->filter))
+			continue;
+
+		batch++;
+		req->matched++;
+
+		if (req->offset > 0) {
+			req->offset--;
+			continue;
+		}
+
+		listing_send(session, index, entry);
+		req->max--;
+	}
+
+	if (req->pos > 0 && req->max > 0)
+		return TRUE;
+
+	/* The next page picks up from here unless the index changes */
+	if (index->generation == req->generation)
+		index_cursor_save(index, req);
+
+done:
+	session->id = 0;
+	session->listing = NULL;
+
+	req->cb(session, err, req->size, req->newmsg, NULL,
+							session->user_data);
+
+	listing_free(req);
+
+	return FALSE;
+}
+
+int messages_get_messages_listing(void *s,
+		const char *name,
+		uint16_t max, uint16_t offset,
+		const struct messages_filter *filter,
+		messages_get_messages_listing_cb callback,
+		void *user_data)
+{
+	struct session *session = s;
+	struct listing_request *req;
+	struct folder_index *index;
+	struct listing_cursor *cursor;
+	unsigned int i, live;
+	char *path;
+
+	if (session->id > 0)
+		return -EBUSY;
+
+	path = session_folder(session, name);
+	if (path == NULL)
+		return -EBADR;
+
+	index = index_get(path);
+	if (index == NULL) {
+		g_free(path);
+		return -ENOENT;
+	}
+
+	req = g_new0(struct listing_request, 1);
+	req->folder = path;
+	req->cb = callback;
+	req->pos = index->entries->len;
+	req->max = max;
+	req->offset = offset;
+	req->generation = index->generation;
+
+	filter_copy(&req->filter, filter);
+
+	live = index->entries->len - index->deleted;
+	cursor = index_cursor(index, filter);
+
+	/*
+	 * Without a filter the listing size is known and the window can be
+	 * located directly when no deleted entries are in the way. Otherwise
+	 * paging through a listing goes on from where the last page ended.
+	 */
+	if (!filter_active(filter) && index->deleted == 0) {
+		req->pos = live > offset ? live - offset : 0;
+		req->matched = live - req->pos;
+		req->offset = 0;
+	} else if (cursor && offset >= cursor->matched) {
+		req->pos = cursor->pos;
+		req->matched = cursor->matched;
+		req->offset = offset - cursor->matched;
+	}
+
+	/* Only filters on the message contents need a walk */
+	if (!filter_active(filter))
+		req->size = MIN(live, 0xffff);
+	else if (filter_counted(filter))
+		req->size = MIN(index_count(index, filter), 0xffff);
+	else if (cursor)
+		req->size = cursor->size;
+	else {
+		for (i = 0; i < index->entries->len; i++) {
+			const struct index_entry *entry = &g_array_index(
+					index->entries, struct index_entry, i);
+
+			if (entry_matches(index, entry, &req->filter))
+				req->size = MIN(req->size + 1, 0xffff);
+		}
+	}
+
+	req->newmsg = index->unread > 0;
+
+	session->listing = req;
+	session->user_data = user_data;
+	session->id = g_idle_add(messages_listing_cb, session);
+
+	return 0;
+}
+
+static gboolean message_read_cb(void *user_data)
+{
+	struct session *session = user_data;
+	struct message_request *req = session->message;
+	char buf[MESSAGE_CHUNK];
+	ssize_t len;
+
+	session->id = 0;
+
+	len = read(req->fd, buf, sizeof(buf));
+	if (len < 0) {
+		int err = -errno;
+
+		session->message = NULL;
+		close(req->fd);
+
+		req->cb(session, err, FALSE, NULL, 0, session->user_data);
+
+		g_free(req);
+		return FALSE;
+	}
+
+	if (len == sizeof(buf)) {
+		/* More follows once messages_get_message_next is called */
+		req->cb(session, -EAGAIN, FALSE, buf, len, session->user_data);
+		return FALSE;
+	}
+
+	session->message = NULL;
+	close(req->fd);
+
+	req->cb(session, 0, FALSE, buf, len, session->user_data);
+
+	g_free(req);
+
+	return FALSE;
+}
+
+int messages_get_message(void *s,
+		const char *handle,
+		unsigned long flags,
+		messages_get_message_cb callback,
+		void *user_data)
+{
+	struct session *session = s;
+	struct message_request *req;
+	struct folder_index *index;
+	struct index_entry *entry;
+	uint64_t h;
+	char *path;
+	int fd;
+
+	if (session->id > 0 || session->message != NULL)
+		return -EBUSY;
+
+	if (!parse_handle(handle, &h))
+		return -EBADR;
+
+	index = find_message(session, h, &entry);
+	if (index == NULL)
+		return -ENOENT;
+
+	path = message_path(index, h);
+	fd = open(path, O_RDONLY);
+	g_free(path);
+
+	if (fd < 0)
+		return -ENOENT;
+
+	req = g_new0(struct message_request, 1);
+	req->fd = fd;
+	req->cb = callback;
+
+	session->message = req;
+	session->user_data = user_data;
+	session->id = g_idle_add(message_read_cb, session);
+
+	return 0;
+}
+
+int messages_get_message_next(void *s)
+{
+	struct session *session = s;
+
+	if (session->message == NULL)
+		return -EINVAL;
+
+	if (session->id == 0)
+		session->id = g_idle_add(message_read_cb, session);
+
+	return 0;
+}
+
+static void push_free(struct push_request *push)
+{
+	if (push->fd >= 0)
+		close(push->fd);
+
+	unlink(push->spool);
+
+	g_free(push->spool);
+	g_free(push->folder);
+	g_free(push->type);
+	g_free(push->encoding);
+	g_free(push->charset);
+	g_slist_free_full(push->recipients, g_free);
+	g_string_free(push->subject, TRUE);
+	g_free(push);
+}
+
+int messages_push_message_begin(void *s, const char *name,
+		unsigned long flags,
+		const struct messages_bmessage *bmsg)
+{
+	struct session *session = s;
+	struct push_request *push;
+	char *path, *spool;
+	GSList *l;
+	int fd;
+
+	if (session->push != NULL)
+		return -EBUSY;
+
+	path = session_folder(session, name);
+	if (path == NULL)
+		return -EBADR;
+
+	if (index_get(path) == NULL) {
+		g_free(path);
+		return -ENOENT;
+	}
+
+	/* Uploads to the same folder may run in parallel sessions */
+	spool = g_build_filename(path, PUSH_FILE, NULL);
+	fd = g_mkstemp(spool);
+	if (fd < 0) {
+		int err = -errno;
+
+		g_free(spool);
+		g_free(path);
+		return err;
+	}
+
+	push = g_new0(struct push_request, 1);
+	push->folder = path;
+	push->spool = spool;
+	push->fd = fd;
+	push->type = g_strdup(bmsg->type);
+	push->read = bmsg->read;
+	push->encoding = g_strdup(bmsg->encoding);
+	push->charset = g_strdup(bmsg->charset);
+	push->subject = g_string_new(NULL);
+	push->flags = flags;
+
+	for (l = bmsg->recipients; l; l = l->next)
+		push->recipients = g_slist_append(push->recipients,
+							g_strdup(l->data));
+
+	session->push = push;
+
+	return 0;
+}
+
+int messages_push_message_data(void *s, const char *chunk, size_t len)
+{
+	struct session *session = s;
+	struct push_request *push = session->push;
+	size_t i;
+
+	if (push == NULL)
+		return -EINVAL;
+
+	if (write(push->fd, chunk, len) != (ssize_t) len)
+		return -EIO;
+
+	push->size += len;
+
+	/* The first non-empty line of the content serves as subject */
+	for (i = 0; i < len && !push->subject_done; i++) {
+		if (chunk[i] == '\r' || chunk[i] == '\n') {
+			if (push->subject->len > 0)
+				push->subject_done = TRUE;
+			continue;
+		}
+
+		/* One byte more tells whether the last character fits */
+		if (push->subject->len <= SUBJECT_MAX)
+			g_string_append_c(push->subject, chunk[i]);
+	}
+
+	return 0;
+}
+
+static int push_write_message(struct push_request *push, const char *path)
+{
+	char buf[MESSAGE_CHUNK];
+	GString *header;
+	char *tmp, *folder;
+	ssize_t len;
+	GSList *l;
+	int fd, err = 0;
+
+	folder = g_path_get_basename(push->folder);
+
+	header = g_string_new("BEGIN:BMSG\r\nVERSION:1.0\r\n");
+	g_string_append_printf(header, "STATUS:%s\r\n",
+					push->read ? "READ" : "UNREAD");
+	g_string_append_printf(header, "TYPE:%s\r\n", push->type);
+	g_string_append_printf(header, "FOLDER:%s\r\n", folder);
+	g_string_append(header, "BEGIN:BENV\r\n");
+
+	for (l = push->recipients; l; l = l->next)
+		g_string_append_printf(header, "BEGIN:VCARD\r\nVERSION:2.1\r\n"
+				"N:\r\n%s:%s\r\nEND:VCARD\r\n",
+				strchr(l->data, '@') ? "EMAIL" : "TEL",
+				(char *) l->data);
+
+	g_string_append(header, "BEGIN:BBODY\r\n");
+
+	if (push->encoding)
+		g_string_append_printf(header, "ENCODING:%s\r\n",
+							push->encoding);
+
+	if (push->charset)
+		g_string_append_printf(header, "CHARSET:%s\r\n",
+							push->charset);
+
+	g_string_append_printf(header, "LENGTH:%u\r\n" MSG_BEGIN,
+				push->size + (uint32_t) MSG_OVERHEAD);
+
+	g_free(folder);
+
+	tmp = g_strconcat(path, ".XXXXXX", NULL);
+
+	fd = g_mkstemp(tmp);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	if (write(fd, header->str, header->len) != (ssize_t) header->len)
+		goto fail;
+
+	/* Copy the content over without holding it in memory */
+	if (lseek(push->fd, 0, SEEK_SET) < 0)
+		goto fail;
+
+	while ((len = read(push->fd, buf, sizeof(buf))) > 0) {
+		if (write(fd, buf, len) != len)
+			goto fail;
+	}
+
+	if (len < 0)
+		goto fail;
+
+	g_string_assign(header, MSG_END "END:BBODY\r\nEND:BENV\r\n"
+							"END:BMSG\r\n");
+
+	if (write(fd, header->str, header->len) != (ssize_t) header->len)
+		goto fail;
+
+	if (close(fd) < 0) {
+		fd = -1;
+		goto fail;
+	}
+
+	fd = -1;
+
+	if (rename(tmp, path) < 0)
+		goto fail;
+
+	goto done;
+
+fail:
+	err = -EIO;
+
+	if (fd >= 0)
+		close(fd);
+
+	unlink(tmp);
+
+done:
+	g_string_free(header, TRUE);
+	g_free(tmp);
+
+	return err;
+}
+
+int messages_push_message_end(void *s, char **handle)
+{
+	struct session *session = s;
+	struct push_request *push = session->push;
+	struct folder_index *index;
+	const char *fields[FIELD_COUNT];
+	char datetime[32], *path;
+	uint32_t flags = ENTRY_TEXT;
+	uint64_t id;
+	int err;
+
+	*handle = NULL;
+
+	if (push == NULL)
+		return -EINVAL;
+
+	session->push = NULL;
+
+	index = index_get(push->folder);
+	if (index == NULL) {
+		err = -ENOENT;
+		goto done;
+	}
+
+	id = next_handle();
+	path = message_path(index, id);
+
+	err = push_write_message(push, path);
+	if (err < 0) {
+		g_free(path);
+		goto done;
+	}
+
+	format_datetime(time(NULL), datetime, sizeof(datetime));
+
+	g_string_truncate(push->subject, subject_len(push->subject->str,
+							push->subject->len));
+
+	memset(fields, 0, sizeof(fields));
+	fields[FIELD_TYPE] = push->type;
+	fields[FIELD_SUBJECT] = push->subject->str;
+	fields[FIELD_DATETIME] = datetime;
+	fields[FIELD_RECIPIENT_ADDRESSING] = push->recipients ?
+					push->recipients->data : NULL;
+	fields[FIELD_RECEPTION_STATUS] = "complete";
+
+	if (push->read)
+		flags |= ENTRY_READ;
+
+	err = index_append(index, id, flags, push->size, fields);
+	if (err < 0) {
+		unlink(path);
+	} else {
+		*handle = g_strdup_printf("%" PRIX64, id);
+		DBG("stored %s in %s", *handle, index->path);
+	}
+
+	g_free(path);
+
+done:
+	push_free(push);
+
+	return err;
+}
+
+static int message_delete(struct folder_index *index,
+				struct index_entry *entry)
+{
+	struct folder_index *deleted;
+	const char *fields[FIELD_COUNT];
+	char *src, *dst, *path;
+	uint64_t handle = entry->handle;
+	uint32_t flags, size;
+	int i, err;
+
+	src = message_path(index, handle);
+	path = g_build_filename(root_folder, "telecom", "msg", "deleted",
+									NULL);
+
+	/* Deleting from the deleted folder removes the message for good */
+	deleted = g_str_equal(path, index->path) ? NULL : index_get(path);
+	g_free(path);
+
+	if (deleted == NULL) {
+		index_set_flags(index, entry, entry->flags | ENTRY_DELETED);
+		unlink(src);
+		err = 0;
+		goto done;
+	}
+
+	for (i = 0; i < FIELD_COUNT; i++)
+		fields[i] = entry_field(index, entry, i);
+
+	/* Copy the strings, appending may move the other index data */
+	for (i = 0; i < FIELD_COUNT; i++)
+		fields[i] = g_strdup(fields[i]);
+
+	flags = entry->flags;
+	size = entry->size;
+
+	dst = message_path(deleted, handle);
+
+	if (rename(src, dst) < 0) {
+		err = -errno;
+	} else {
+		index_set_flags(index, entry, flags | ENTRY_DELETED);
+		err = index_append(deleted, handle, flags, size, fields);
+	}
+
+	for (i = 0; i < FIELD_COUNT; i++)
+		g_free((char *) fields[i]);
+
+	g_free(dst);
+
+done:
+	g_free(src);
+
+	return err;
+}
+
+int messages_set_message_status(void *s,
+		const struct messages_status *status, unsigned int count)
+{
+	struct session *session = s;
+	GSList *touched = NULL, *l;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < count; i++) {
+		struct folder_index *index;
+		struct index_entry *entry;
+		uint64_t handle;
+		uint32_t flags;
+		int ret;
+
+		if (!parse_handle(status[i].handle, &handle)) {
+			err = -EBADR;
+			continue;
+		}
+
+		index = find_message(session, handle, &entry);
+		if (index == NULL) {
+			err = -ENOENT;
+			continue;
+		}
+
+		switch (status[i].indicator) {
+		case MESSAGES_STATUS_READ:
+			flags = status[i].value ? entry->flags | ENTRY_READ :
+						entry->flags & ~ENTRY_READ;
+			index_set_flags(index, entry, flags);
+			ret = 0;
+			break;
+		case MESSAGES_STATUS_DELETED:
+			/* Undeleting is not supported */
+			if (!status[i].value) {
+				ret = -ENOSYS;
+				break;
+			}
+
+			ret = message_delete(index, entry);
+			if (!g_slist_find(touched, index))
+				touched = g_slist_prepend(touched, index);
+			break;
+		default:
+			ret = -EBADR;
+			break;
+		}
+
+		if (ret < 0)
+			err = ret;
+	}
+
+	/*
+	 * Compacting moves entries, only do it after the whole batch. The
+	 * messages are gone already, so deletions are written right away;
+	 * read status changes wait for FLAGS_SAVE_TIMEOUT.
+	 */
+	for (l = touched; l; l = l->next) {
+		int ret;
+
+		index_compact(l->data);
+
+		ret = index_flush(l->data);
+		if (ret < 0)
+			err = ret;
+	}
+
+	g_slist_free(touched);
+
+	return err;
+}
+
+void messages_abort(void *s)
+{
+	struct session *session = s;
+
+	if (session->id > 0) {
+		g_source_remove(session->id);
+		session->id = 0;
+	}
+
+	if (session->listing) {
+		listing_free(session->listing);
+		session->listing = NULL;
+	}
+
+	if (session->message) {
+		close(session->message->fd);
+		g_free(session->message);
+		session->message = NULL;
+	}
+
+	if (session->push) {
+		push_free(session->push);
+		session->push = NULL;
+	}
+
+	g_slist_free_full(session->folders, g_free);
+	session->folders = NULL;
 }
@@ -321,6 +321,36 @@ int messages_get_message(void *session,
 	return -EINVAL;
 }
 
+int messages_get_message_next(void *session)
+{
+	return -EINVAL;
+}
+
+int messages_push_message_begin(void *session, const char *name,
+		unsigned long flags,
+		const struct messages_bmessage *bmsg)
+{
+	return -EINVAL;
+}
+
+int messages_push_message_data(void *session, const char *chunk, size_t len)
+{
+	return -EINVAL;
+}
+
+int messages_push_message_end(void *session, char **handle)
+{
+	*handle = NULL;
+
+	return -EINVAL;
+}
+
+int messages_set_message_status(void *session,
+		const struct messages_status *status, unsigned int count)
+{
+	return -EINVAL;
+}
+
 void messages_abort(void *session)
 {
 }
@@ -254,13 +254,19 @@ int messages_get_messages_listing(void *session,
  *	MESSAGES_NEXT: If fraction is true this indicates whether to retrieve
  *		first fraction
  *	or the next one.
- * fmore: Indicates whether next fraction is available.
- * chunk: chunk of bMessage body
+ * fmore: Indicates whether next fraction is available. Must be valid from
+ *	the first callback on, as it is sent before the bMessage body.
+ * chunk: chunk of bMessage body, not NUL-terminated and may contain
+ *	binary data.
+ * len: Length of chunk in bytes.
  *
- * Callback allows for returning bMessage in chunks.
+ * Callback allows for returning bMessage in chunks. While err is -EAGAIN
+ * more chunks follow, but the backend shall not deliver the next one until
+ * messages_get_message_next() is called. The last chunk (possibly empty)
+ * is delivered with err set to 0.
  */
 typedef void (*messages_get_message_cb)(void *session, int err, gboolean fmore,
-	const char *chunk, void *user_data);
+	const char *chunk, size_t len, void *user_data);
 
 int messages_get_message(void *session,
 		const char *handle,
@@ -268,6 +274,87 @@ int messages_get_message(void *session,
 		messages_get_message_cb callback,
 		void *user_data);
 
+/* Asks for the next chunk of the bMessage being retrieved.
+ *
+ * session: Backend session.
+ */
+int messages_get_message_next(void *session);
+
+#define MESSAGES_TRANSPARENT	(1 << 4)
+#define MESSAGES_RETRY		(1 << 5)
+
+/* Envelope of a pushed bMessage, as parsed before its body.
+ *
+ * type: TYPE property, e.g. "SMS_GSM" or "EMAIL".
+ * read: STATUS property is READ.
+ * encoding, charset: Properties of the body, NULL if not present.
+ * recipients: TEL or EMAIL value of every recipient vCard.
+ */
+struct messages_bmessage {
+	const char *type;
+	gboolean read;
+	const char *encoding;
+	const char *charset;
+	GSList *recipients;
+};
+
+/* Starts storing a bMessage pushed by the client (PushMessage).
+ *
+ * session: Backend session.
+ * name: Optional subdirectory name, relative to the current one.
+ * flags: or-ed mask of following:
+ *	MESSAGES_UTF8: Body is UTF-8, otherwise native encoding.
+ *	MESSAGES_TRANSPARENT: Do not keep a copy in the sent folder.
+ *	MESSAGES_RETRY: Retry sending if the network is not available.
+ * bmsg: Parsed envelope, only valid during the call.
+ *
+ * The body follows in calls to messages_push_message_data() as the client
+ * sends it, and is committed by messages_push_message_end(). An upload that
+ * is not committed is dropped with messages_abort().
+ */
+int messages_push_message_begin(void *session, const char *name,
+		unsigned long flags,
+		const struct messages_bmessage *bmsg);
+
+/* Appends a chunk of the message content (between BEGIN:MSG and END:MSG) to
+ * the message being pushed. The chunk may contain binary data.
+ */
+int messages_push_message_data(void *session, const char *chunk, size_t len);
+
+/* Commits the message being pushed.
+ *
+ * handle: On success, the handle assigned to the new message, to be freed
+ *	with g_free(). May be set to NULL if the backend assigns none.
+ */
+int messages_push_message_end(void *session, char **handle);
+
+#define MESSAGES_STATUS_READ	0x00
+#define MESSAGES_STATUS_DELETED	0x01
+
+/* Single SetMessageStatus request.
+ *
+ * indicator: MESSAGES_STATUS_READ or MESSAGES_STATUS_DELETED.
+ * value: New value of the indicated status.
+ */
+struct messages_status {
+	const char *handle;
+	uint8_t indicator;
+	gboolean value;
+};
+
+/* Applies status changes, in a single transaction where possible.
+ *
+ * session: Backend session.
+ * status: Array of changes, in the order the client requested them.
+ * count: Number of elements in status.
+ *
+ * Called before the SetMessageStatus response is sent, so the change must be
+ * applied by the time this returns. Writing it to storage may be deferred to
+ * batch consecutive requests, as long as later requests see the change.
+ */
+int messages_set_message_status(void *session,
+		const struct messages_status *status, unsigned int count);
+
 /* Aborts currently pending request.
  *
  * session: Backend session.
@@ -96,8 +96,7 @@
 
 static void *opp_connect(struct obex_session *os, int *err)
 {
-	manager_register_transfer(os);
-
+	/* The transfer object is registered once the push is announced */
 	if (err)
 		*err = 0;
 
@@ -50,6 +50,7 @@
 #include "filesystem.h"
 #include "manager.h"
 #include "glib-helper.h"
+#include "xml.h"
 
 #define PHONEBOOK_TYPE		"x-bt/phonebook"
 #define VCARDLISTING_TYPE	"x-bt/vcard-listing"
@@ -64,6 +65,10 @@
 #define FORMAT_TAG		0X07
 #define PHONEBOOKSIZE_TAG	0X08
 #define NEWMISSEDCALLS_TAG	0X09
+#define PRIMARYVERSION_TAG	0X0A
+#define SECONDARYVERSION_TAG	0X0B
+#define DATABASEID_TAG		0X0D
+#define SUPPORTEDFEATURES_TAG	0X10
 
 /* The following length is in the unit of byte */
 #define ORDER_LEN		1
@@ -74,9 +79,36 @@
 #define FORMAT_LEN		1
 #define PHONEBOOKSIZE_LEN	2
 #define NEWMISSEDCALLS_LEN	1
+#define PRIMARYVERSION_LEN	16
+#define SECONDARYVERSION_LEN	16
+#define DATABASEID_LEN		16
+#define SUPPORTEDFEATURES_LEN	4
+
+/* PbapSupportedFeatures bits, clients that don't send it are 1.1 ones */
+#define FEATURE_DATABASE_ID	(1 << 2)
+#define FEATURE_FOLDER_VERSION	(1 << 3)
+#define FEATURES_DEFAULT	0x00000003
 
 #define PBAP_CHANNEL	15
 
+/* Upper bound of vCard data buffered ahead of the client */
+#define PREFETCH_MAX_SIZE	(256 * 1024)
+
+/*
+ * Number searches match on trailing digits: shorter search values must
+ * match a whole number suffix, longer ones at least this many digits.
+ */
+#define NUMBER_MATCH_MIN	7
+#define NUMBER_MAX_DIGITS	32
+
+/* Folder version counters and database identifier storage */
+#define VERSIONS_FILE		"pbap-versions"
+#define VERSIONS_GROUP		"Database"
+#define VERSIONS_SAVE_TIMEOUT	2
+
+/* Seconds to wait for a burst of changes to end before rescanning */
+#define CACHE_REFRESH_DELAY	2
+
 #define PBAP_RECORD "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>	\
 <record>								\
   <attribute id=\"0x0001\">						\
@@ -104,7 +136,7 @@
     <sequence>								\
       <sequence>							\
         <uuid value=\"0x1130\"/>					\
-        <uint16 value=\"0x0100\" name=\"version\"/>			\
+        <uint16 value=\"0x0101\" name=\"version\"/>			\
       </sequence>							\
     </sequence>								\
   </attribute>								\
@@ -124,10 +156,26 @@ struct aparam_header {
 	uint8_t val[0];
 } __attribute__ ((packed));
 
+/*
+ * Reverse digit trie of the normalized numbers of the cached entries.
+ * Every leading part of a number is added too, so any run of digits of
+ * a number is the path to some node.
+ */
+struct number_node {
+	char digit;
+	struct number_node *child;
+	struct number_node *next;
+	GSList *entries;	/* Whole numbers ending at this node */
+	GSList *partial;	/* Leading parts ending at this node */
+};
+
 struct cache {
+	gint refcount;
+	char *folder;
 	gboolean valid;
 	uint32_t index;
 	GSList *entries;
+	struct number_node *numbers;
 };
 
 struct cache_entry {
@@ -135,22 +183,29 @@ struct cache_entry {
 	char *id;
 	char *name;
 	char *sound;
-	char *tel;
+};
+
+struct folder_version {
+	uint64_t primary;
+	uint64_t secondary;
 };
 
 struct pbap_session {
+	struct obex_session *os;
 	struct apparam_field *params;
+	uint32_t features;
 	char *folder;
 	uint32_t find_handle;
-	struct cache cache;
+	struct cache *cache;
 	struct pbap_object *obj;
 };
 
 struct pbap_object {
 	GString *buffer;
 	GByteArray *aparams;
+	char *folder;
 	gboolean firstpacket;
-	gboolean lastpart;
+	struct phonebook_prefetch prefetch;
 	struct pbap_session *session;
 	void *request;
 };
@@ -159,6 +214,10 @@ static const uint8_t PBAP_TARGET[TARGET_SIZE] = {
 			0x79, 0x61, 0x35, 0xF0,  0xF0, 0xC5, 0x11, 0xD8,
 			0x09, 0x66, 0x08, 0x00,  0x20, 0x0C, 0x9A, 0x66  };
 
+static GHashTable *folder_versions = NULL;
+static uint8_t database_id[DATABASEID_LEN];
+static guint versions_save_id = 0;
+
 typedef int (*cache_entry_find_f) (const struct cache_entry *entry,
 			const char *value);
 
@@ -169,7 +228,6 @@ static void cache_entry_free(void *data)
 	g_free(entry->id);
 	g_free(entry->name);
 	g_free(entry->sound);
-	g_free(entry->tel);
 	g_free(entry);
 }
 
@@ -201,13 +259,173 @@ static gboolean entry_sound_find(const struct cache_entry *entry,
 	return (g_strstr_len(entry->sound, -1, value) ? TRUE : FALSE);
 }
 
-static gboolean entry_tel_find(const struct cache_entry *entry,
-		const char *value)
+/*
+ * Keeps only the dialable digits of a number, dropping separators, '+'
+ * and anything after a pause or extension marker. Only the last
+ * NUMBER_MAX_DIGITS digits are kept as matching works on suffixes.
+ */
+static size_t number_normalize(const char *number, char *digits)
 {
-	if (!entry->tel)
-		return FALSE;
+	size_t len = 0;
+
+	for (; *number; number++) {
+		if (strchr(",;pPwWxX", *number))
+			break;
+
+		if (!g_ascii_isdigit(*number))
+			continue;
+
+		if (len == NUMBER_MAX_DIGITS) {
+			memmove(digits, digits + 1, len - 1);
+			len--;
+		}
+
+		digits[len++] = *number;
+	}
+
+	return len;
+}
+
+static struct number_node *number_node_find(struct number_node *node,
+								char digit)
+{
+	for (node = node->child; node; node = node->next) {
+		if (node->digit == digit)
+			return node;
+	}
+
+	return NULL;
+}
+
+static void number_node_free(struct number_node *node)
+{
+	while (node) {
+		struct number_node *next = node->next;
+
+		number_node_free(node->child);
+		g_slist_free(node->entries);
+		g_slist_free(node->partial);
+		g_free(node);
+
+		node = next;
+	}
+}
+
+static void number_index_insert(struct cache *cache, const char *digits,
+				size_t len, gboolean whole,
+				struct cache_entry *entry)
+{
+	struct number_node *node;
+	GSList **entries;
+
+	for (node = cache->numbers; len > 0; len--) {
+		struct number_node *child;
+
+		child = number_node_find(node, digits[len - 1]);
+		if (child == NULL) {
+			child = g_new0(struct number_node, 1);
+			child->digit = digits[len - 1];
+			child->next = node->child;
+			node->child = child;
+		}
+
+		node = child;
+	}
+
+	entries = whole ? &node->entries : &node->partial;
+
+	/* The same number may be listed twice for one contact */
+	if (*entries && (*entries)->data == entry)
+		return;
+
+	*entries = g_slist_prepend(*entries, entry);
+}
+
+static void number_index_add(struct cache *cache, const char *number,
+					struct cache_entry *entry)
+{
+	char digits[NUMBER_MAX_DIGITS];
+	size_t len, end;
+
+	len = number_normalize(number, digits);
+	if (len == 0)
+		return;
+
+	if (cache->numbers == NULL)
+		cache->numbers = g_new0(struct number_node, 1);
+
+	for (end = len; end > 0; end--)
+		number_index_insert(cache, digits, end, end == len, entry);
+}
+
+static void number_collect(GSList *entries, GHashTable *matches)
+{
+	for (; entries; entries = entries->next)
+		g_hash_table_insert(matches, entries->data, entries->data);
+}
+
+static void number_collect_subtree(struct number_node *node,
+					gboolean partial, GHashTable *matches)
+{
+	number_collect(node->entries, matches);
+
+	if (partial)
+		number_collect(node->partial, matches);
+
+	for (node = node->child; node; node = node->next)
+		number_collect_subtree(node, partial, matches);
+}
+
+static void number_match(gpointer key, gpointer value, gpointer user_data)
+{
+	GSList **list = user_data;
+
+	*list = g_slist_prepend(*list, key);
+}
+
+/*
+ * Returns the cache entries having a number which contains the digits of
+ * value or which shares at least NUMBER_MATCH_MIN trailing digits with it.
+ * This way "+44 7700 900123" finds a contact stored as "07700900123" and
+ * the other way around, while "7700" still finds both.
+ */
+static GSList *number_index_lookup(struct cache *cache, const char *value)
+{
+	char digits[NUMBER_MAX_DIGITS];
+	struct number_node *node = cache->numbers;
+	GHashTable *matches;
+	GSList *list = NULL;
+	size_t len, depth;
+
+	if (node == NULL)
+		return NULL;
+
+	len = number_normalize(value, digits);
 
-	return (g_strstr_len(entry->tel, -1, value) ? TRUE : FALSE);
+	matches = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (depth = 0; depth < len; depth++) {
+		struct number_node *child;
+
+		child = number_node_find(node, digits[len - depth - 1]);
+		if (child == NULL)
+			break;
+
+		if (depth >= NUMBER_MATCH_MIN)
+			number_collect(node->entries, matches);
+
+		node = child;
+	}
+
+	if (depth == len)
+		number_collect_subtree(node, TRUE, matches);
+	else if (depth >= NUMBER_MATCH_MIN)
+		number_collect_subtree(node, FALSE, matches);
+
+	g_hash_table_foreach(matches, number_match, &list);
+	g_hash_table_destroy(matches);
+
+	return list;
 }
 
 static const char *cache_find(struct cache *cache, uint32_t handle)
@@ -224,17 +442,260 @@ static const char *cache_find(struct cache *cache, uint32_t handle)
 	return NULL;
 }
 
-static void cache_clear(struct cache *cache)
+static struct cache *cache_new(const char *folder)
+{
+	struct cache *cache = g_new0(struct cache, 1);
+
+	cache->refcount = 1;
+	cache->folder = g_strdup(folder);
+
+	return cache;
+}
+
+static struct cache *cache_ref(struct cache *cache)
 {
+	cache->refcount++;
+
+	return cache;
+}
+
+static void cache_unref(struct cache *cache)
+{
+	if (cache == NULL || --cache->refcount > 0)
+		return;
+
 	g_slist_free_full(cache->entries, cache_entry_free);
-	cache->entries = NULL;
+	number_node_free(cache->numbers);
+	g_free(cache->folder);
+	g_free(cache);
+}
+
+static void cache_add(struct cache *cache, const char *id, uint32_t handle,
+				const char *name, const char *sound,
+				GSList *tels)
+{
+	struct cache_entry *entry = g_new0(struct cache_entry, 1);
+
+	if (handle != PHONEBOOK_INVALID_HANDLE)
+		entry->handle = handle;
+	else
+		entry->handle = ++cache->index;
+
+	entry->id = g_strdup(id);
+	entry->name = g_strdup(name);
+	entry->sound = g_strdup(sound);
+
+	for (; tels; tels = tels->next)
+		number_index_add(cache, tels->data, entry);
+
+	cache->entries = g_slist_append(cache->entries, entry);
+}
+
+static void session_cache_set(struct pbap_session *pbap, struct cache *cache)
+{
+	cache_unref(pbap->cache);
+	pbap->cache = cache;
+}
+
+static gboolean session_cache_valid(struct pbap_session *pbap,
+							const char *folder)
+{
+	return pbap->cache != NULL && pbap->cache->valid &&
+				g_strcmp0(pbap->cache->folder, folder) == 0;
+}
+
+/*
+ * Listing caches of the standard folders are shared by all sessions. They
+ * are built in the background, one folder at a time, once a client
+ * connects, and rebuilt whenever the backend reports a change, so listings
+ * don't have to wait for a full backend scan.
+ */
+static const char *shared_folders[] = { "/telecom/pb", "/telecom/ich",
+					"/telecom/och", "/telecom/mch",
+					"/telecom/cch", NULL };
+
+static GHashTable *shared_caches = NULL;
+static GSList *stale_folders = NULL;
+static GSList *unsupported_folders = NULL;	/* Rejected by the backend */
+static struct cache *building = NULL;
+static void *building_request = NULL;
+static guint warm_id = 0;
+
+static gboolean shared_folder(const char *folder)
+{
+	int i;
+
+	if (g_slist_find_custom(unsupported_folders, folder,
+						(GCompareFunc) g_strcmp0))
+		return FALSE;
+
+	for (i = 0; shared_folders[i]; i++) {
+		if (g_strcmp0(shared_folders[i], folder) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static struct cache *shared_cache_get(const char *folder)
+{
+	if (shared_caches == NULL || folder == NULL)
+		return NULL;
+
+	return g_hash_table_lookup(shared_caches, folder);
+}
+
+static void shared_cache_set(struct cache *cache)
+{
+	DBG("folder %s entries %u", cache->folder,
+					g_slist_length(cache->entries));
+
+	g_hash_table_replace(shared_caches, g_strdup(cache->folder), cache);
+}
+
+static gboolean warm_next(void *user_data);
+
+static void warm_schedule(guint delay)
+{
+	if (warm_id > 0 || building != NULL || stale_folders == NULL)
+		return;
+
+	if (delay > 0)
+		warm_id = g_timeout_add_seconds(delay, warm_next, NULL);
+	else
+		warm_id = g_idle_add(warm_next, NULL);
+}
+
+static void warm_entry_notify(const char *id, uint32_t handle,
+					const char *name, const char *sound,
+					GSList *tels, void *user_data)
+{
+	cache_add(building, id, handle, name, sound, tels);
+}
+
+static void warm_ready_notify(void *user_data)
+{
+	phonebook_req_finalize(building_request);
+	building_request = NULL;
+
+	building->valid = TRUE;
+
+	/* Changed again while scanning, the result is already outdated */
+	if (g_slist_find_custom(stale_folders, building->folder,
+						(GCompareFunc) g_strcmp0))
+		cache_unref(building);
+	else
+		shared_cache_set(building);
+
+	building = NULL;
+
+	warm_schedule(0);
+}
+
+static gboolean warm_next(void *user_data)
+{
+	char *folder;
+	int err;
+
+	warm_id = 0;
+
+	while (stale_folders != NULL && building == NULL) {
+		folder = stale_folders->data;
+		stale_folders = g_slist_delete_link(stale_folders,
+								stale_folders);
+
+		DBG("building cache of %s", folder);
+
+		building = cache_new(folder);
+		g_free(folder);
+
+		building_request = phonebook_create_cache(building->folder,
+						warm_entry_notify,
+						warm_ready_notify, NULL, &err);
+		if (err == 0)
+			break;
+
+		DBG("unable to build cache: %s (%d)", strerror(-err), -err);
+
+		/* Not served by this backend, don't try again on changes */
+		if (err == -ENOENT)
+			unsupported_folders = g_slist_prepend(
+						unsupported_folders,
+						g_strdup(building->folder));
+
+		if (building_request) {
+			phonebook_req_finalize(building_request);
+			building_request = NULL;
+		}
+
+		cache_unref(building);
+		building = NULL;
+	}
+
+	return FALSE;
+}
+
+static void warm_folder(const char *folder, guint delay)
+{
+	if (shared_caches == NULL || !shared_folder(folder))
+		return;
+
+	if (!g_slist_find_custom(stale_folders, folder,
+						(GCompareFunc) g_strcmp0))
+		stale_folders = g_slist_append(stale_folders,
+							g_strdup(folder));
+
+	warm_schedule(delay);
+}
+
+static void warm_start(void)
+{
+	int i;
+
+	for (i = 0; shared_folders[i]; i++) {
+		if (shared_cache_get(shared_folders[i]) != NULL)
+			continue;
+
+		if (building && g_str_equal(building->folder,
+							shared_folders[i]))
+			continue;
+
+		warm_folder(shared_folders[i], 0);
+	}
+}
+
+static void warm_cleanup(void)
+{
+	if (warm_id > 0) {
+		g_source_remove(warm_id);
+		warm_id = 0;
+	}
+
+	if (building_request) {
+		phonebook_req_finalize(building_request);
+		building_request = NULL;
+	}
+
+	cache_unref(building);
+	building = NULL;
+
+	g_slist_free_full(stale_folders, g_free);
+	stale_folders = NULL;
+
+	g_slist_free_full(unsupported_folders, g_free);
+	unsupported_folders = NULL;
+
+	if (shared_caches) {
+		g_hash_table_destroy(shared_caches);
+		shared_caches = NULL;
+	}
 }
 
 static GByteArray *append_aparam_header(GByteArray *buf, uint8_t tag,
 							const void *val)
 {
-	/* largest aparam is for phonebooksize (4 bytes) */
-	uint8_t aparam[sizeof(struct aparam_header) + PHONEBOOKSIZE_LEN];
+	/* largest aparams are the 128-bit version counters and database id */
+	uint8_t aparam[sizeof(struct aparam_header) + DATABASEID_LEN];
 	struct aparam_header *hdr = (struct aparam_header *) aparam;
 
 	switch (tag) {
@@ -252,11 +713,328 @@ static GByteArray *append_aparam_header(GByteArray *buf, uint8_t tag,
 
 		return g_byte_array_append(buf,	aparam,
 			sizeof(struct aparam_header) + NEWMISSEDCALLS_LEN);
+	case PRIMARYVERSION_TAG:
+		hdr->tag = PRIMARYVERSION_TAG;
+		hdr->len = PRIMARYVERSION_LEN;
+		memcpy(hdr->val, val, PRIMARYVERSION_LEN);
+
+		return g_byte_array_append(buf,	aparam,
+			sizeof(struct aparam_header) + PRIMARYVERSION_LEN);
+	case SECONDARYVERSION_TAG:
+		hdr->tag = SECONDARYVERSION_TAG;
+		hdr->len = SECONDARYVERSION_LEN;
+		memcpy(hdr->val, val, SECONDARYVERSION_LEN);
+
+		return g_byte_array_append(buf,	aparam,
+			sizeof(struct aparam_header) + SECONDARYVERSION_LEN);
+	case DATABASEID_TAG:
+		hdr->tag = DATABASEID_TAG;
+		hdr->len = DATABASEID_LEN;
+		memcpy(hdr->val, val, DATABASEID_LEN);
+
+		return g_byte_array_append(buf,	aparam,
+			sizeof(struct aparam_header) + DATABASEID_LEN);
 	default:
 		return buf;
 	}
 }
 
+static char *versions_filename(void)
+{
+	return g_build_filename(g_get_user_data_dir(), "obexd", VERSIONS_FILE,
+									NULL);
+}
+
+static void database_id_generate(void)
+{
+	int i;
+
+	for (i = 0; i < DATABASEID_LEN; i += sizeof(guint32)) {
+		guint32 r = g_random_int();
+
+		memcpy(database_id + i, &r, sizeof(r));
+	}
+}
+
+static gboolean database_id_parse(const char *str)
+{
+	int i;
+
+	if (str == NULL || strlen(str) != DATABASEID_LEN * 2)
+		return FALSE;
+
+	for (i = 0; i < DATABASEID_LEN; i++) {
+		int hi = g_ascii_xdigit_value(str[i * 2]);
+		int lo = g_ascii_xdigit_value(str[i * 2 + 1]);
+
+		if (hi < 0 || lo < 0)
+			return FALSE;
+
+		database_id[i] = (hi << 4) | lo;
+	}
+
+	return TRUE;
+}
+
+static struct folder_version *folder_version_get(const char *folder)
+{
+	struct folder_version *version;
+
+	version = g_hash_table_lookup(folder_versions, folder);
+	if (version != NULL)
+		return version;
+
+	version = g_new0(struct folder_version, 1);
+	g_hash_table_insert(folder_versions, g_strdup(folder), version);
+
+	return version;
+}
+
+static void versions_save_folder(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct folder_version *version = value;
+	GKeyFile *keyfile = user_data;
+	char *str;
+
+	str = g_strdup_printf("%" PRIu64, version->primary);
+	g_key_file_set_string(keyfile, key, "Primary", str);
+	g_free(str);
+
+	str = g_strdup_printf("%" PRIu64, version->secondary);
+	g_key_file_set_string(keyfile, key, "Secondary", str);
+	g_free(str);
+}
+
+static void versions_save(void)
+{
+	GKeyFile *keyfile;
+	GError *gerr = NULL;
+	char *filename, *dirname, *data;
+	char id[DATABASEID_LEN * 2 + 1];
+	gsize len;
+	int i;
+
+	keyfile = g_key_file_new();
+
+	for (i = 0; i < DATABASEID_LEN; i++)
+		sprintf(id + i * 2, "%02x", database_id[i]);
+
+	g_key_file_set_string(keyfile, VERSIONS_GROUP, "Identifier", id);
+	g_hash_table_foreach(folder_versions, versions_save_folder, keyfile);
+
+	data = g_key_file_to_data(keyfile, &len, NULL);
+	g_key_file_free(keyfile);
+
+	filename = versions_filename();
+	dirname = g_path_get_dirname(filename);
+	g_mkdir_with_parents(dirname, 0700);
+	g_free(dirname);
+
+	if (!g_file_set_contents(filename, data, len, &gerr)) {
+		error("Unable to store %s: %s", filename, gerr->message);
+		g_error_free(gerr);
+	}
+
+	g_free(filename);
+	g_free(data);
+}
+
+static gboolean versions_save_timeout(gpointer user_data)
+{
+	versions_save_id = 0;
+	versions_save();
+
+	return FALSE;
+}
+
+static void versions_load(void)
+{
+	GKeyFile *keyfile;
+	char *filename, *str;
+	char **groups;
+	int i;
+
+	folder_versions = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, g_free);
+
+	keyfile = g_key_file_new();
+	filename = versions_filename();
+
+	if (!g_key_file_load_from_file(keyfile, filename, 0, NULL))
+		goto reset;
+
+	str = g_key_file_get_string(keyfile, VERSIONS_GROUP, "Identifier",
+									NULL);
+	if (!database_id_parse(str)) {
+		g_free(str);
+		goto reset;
+	}
+
+	g_free(str);
+
+	groups = g_key_file_get_groups(keyfile, NULL);
+	for (i = 0; groups[i] != NULL; i++) {
+		struct folder_version *version;
+
+		if (g_str_equal(groups[i], VERSIONS_GROUP))
+			continue;
+
+		version = folder_version_get(groups[i]);
+
+		str = g_key_file_get_string(keyfile, groups[i], "Primary",
+									NULL);
+		version->primary = str ? g_ascii_strtoull(str, NULL, 10) : 0;
+		g_free(str);
+
+		str = g_key_file_get_string(keyfile, groups[i], "Secondary",
+									NULL);
+		version->secondary = str ? g_ascii_strtoull(str, NULL, 10) : 0;
+		g_free(str);
+	}
+
+	g_strfreev(groups);
+	goto done;
+
+reset:
+	/*
+	 * Without the previous state the counters can't be trusted by the
+	 * clients anymore: a new database identifier invalidates their
+	 * caches.
+	 */
+	DBG("Generating new database identifier");
+	database_id_generate();
+	versions_save();
+
+done:
+	g_free(filename);
+	g_key_file_free(keyfile);
+}
+
+static void versions_cleanup(void)
+{
+	if (versions_save_id > 0) {
+		g_source_remove(versions_save_id);
+		versions_save_id = 0;
+		versions_save();
+	}
+
+	g_hash_table_destroy(folder_versions);
+	folder_versions = NULL;
+}
+
+static void phonebook_changed(const char *folder, gboolean secondary,
+							void *user_data)
+{
+	struct folder_version *version;
+
+	DBG("folder %s secondary %d", folder, secondary);
+
+	version = folder_version_get(folder);
+	version->primary++;
+
+	/* Secondary counter only tracks N, FN, TEL, EMAIL and MAILER */
+	if (secondary)
+		version->secondary++;
+
+	/* Coalesce bursts of changes into a single write */
+	if (versions_save_id == 0)
+		versions_save_id = g_timeout_add_seconds(VERSIONS_SAVE_TIMEOUT,
+						versions_save_timeout, NULL);
+
+	/* Stop handing out the old listing, rebuild once things settle */
+	if (shared_caches != NULL && shared_folder(folder)) {
+		g_hash_table_remove(shared_caches, folder);
+		warm_folder(folder, CACHE_REFRESH_DELAY);
+	}
+}
+
+static void counter_to_be128(uint64_t counter, uint8_t *val)
+{
+	uint64_t val64 = GUINT64_TO_BE(counter);
+
+	memset(val, 0, 8);
+	memcpy(val + 8, &val64, sizeof(val64));
+}
+
+static void append_folder_versions(struct pbap_object *obj)
+{
+	struct folder_version *version;
+	uint8_t counter[PRIMARYVERSION_LEN];
+	uint32_t features;
+
+	if (obj->session == NULL)
+		return;
+
+	features = obj->session->features;
+	if (!(features & (FEATURE_FOLDER_VERSION | FEATURE_DATABASE_ID)))
+		return;
+
+	if (obj->aparams == NULL)
+		obj->aparams = g_byte_array_new();
+
+	if (obj->folder != NULL && (features & FEATURE_FOLDER_VERSION)) {
+		version = folder_version_get(obj->folder);
+
+		counter_to_be128(version->primary, counter);
+		obj->aparams = append_aparam_header(obj->aparams,
+						PRIMARYVERSION_TAG, counter);
+
+		counter_to_be128(version->secondary, counter);
+		obj->aparams = append_aparam_header(obj->aparams,
+						SECONDARYVERSION_TAG, counter);
+	}
+
+	if (features & FEATURE_DATABASE_ID)
+		obj->aparams = append_aparam_header(obj->aparams,
+						DATABASEID_TAG, database_id);
+}
+
+static void vobject_mem_update(struct pbap_object *obj)
+{
+	if (obj->session == NULL)
+		return;
+
+	obex_mem_update(obj->session->os, "pbap",
+				obj->buffer ? obj->buffer->len : 0);
+}
+
+static gboolean vobject_prefetch_needed(struct pbap_object *obj)
+{
+	if (obj->request == NULL)
+		return FALSE;
+
+	/* Only parts ahead of the one being sent count against memory */
+	if (obj->prefetch.buffered > 0 &&
+				obex_mem_soft_exceeded(obj->session->os))
+		return FALSE;
+
+	return phonebook_prefetch_needed(&obj->prefetch,
+				obex_option_pbap_prefetch(), PREFETCH_MAX_SIZE);
+}
+
+static int vobject_prefetch(struct pbap_object *obj)
+{
+	if (!vobject_prefetch_needed(obj))
+		return 0;
+
+	DBG("%u parts buffered", g_queue_get_length(obj->prefetch.parts));
+
+	return phonebook_pull_next(obj->request, &obj->prefetch.reading);
+}
+
+static gboolean vobject_prefetch_cb(void *user_data)
+{
+	struct pbap_object *obj = user_data;
+
+	obj->prefetch.id = 0;
+
+	/* Errors are reported once the client drains the buffer */
+	vobject_prefetch(obj);
+
+	return FALSE;
+}
+
 static void phonebook_size_result(const char *buffer, size_t bufsize,
 					int vcards, int missed,
 					gboolean lastpart, void *user_data)
@@ -302,9 +1080,9 @@ static void query_result(const char *buffer, size_t bufsize, int vcards,
 		pbap->obj->request = NULL;
 	}
 
-	pbap->obj->lastpart = lastpart;
-
 	if (vcards < 0) {
+		pbap->obj->prefetch.reading = FALSE;
+		pbap->obj->prefetch.lastpart = lastpart;
 		obex_object_set_io_flags(pbap->obj, G_IO_ERR, -ENOENT);
 		return;
 	}
@@ -315,12 +1093,17 @@ static void query_result(const char *buffer, size_t bufsize, int vcards,
 		pbap->obj->buffer = g_string_append_len(pbap->obj->buffer,
 							buffer,	bufsize);
 
+	vobject_mem_update(pbap->obj);
+
+	phonebook_prefetch_received(&pbap->obj->prefetch, bufsize, lastpart,
+					vobject_prefetch_cb, pbap->obj);
+
 	if (missed > 0)	{
 		DBG("missed %d", missed);
 
-		pbap->obj->firstpacket = TRUE;
+		if (!pbap->obj->aparams)
+			pbap->obj->aparams = g_byte_array_new();
 
-		pbap->obj->aparams = g_byte_array_new();
 		pbap->obj->aparams = append_aparam_header(pbap->obj->aparams,
 						NEWMISSEDCALLS_TAG, &missed);
 	}
@@ -330,23 +1113,31 @@ static void query_result(const char *buffer, size_t bufsize, int vcards,
 
 static void cache_entry_notify(const char *id, uint32_t handle,
 					const char *name, const char *sound,
-					const char *tel, void *user_data)
+					GSList *tels, void *user_data)
 {
 	struct pbap_session *pbap = user_data;
-	struct cache_entry *entry = g_new0(struct cache_entry, 1);
-	struct cache *cache = &pbap->cache;
 
-	if (handle != PHONEBOOK_INVALID_HANDLE)
-		entry->handle = handle;
-	else
-		entry->handle = ++pbap->cache.index;
+	cache_add(pbap->cache, id, handle, name, sound, tels);
+}
 
-	entry->id = g_strdup(id);
-	entry->name = g_strdup(name);
-	entry->sound = g_strdup(sound);
-	entry->tel = g_strdup(tel);
+/* A cache built for this session can serve everybody until it changes */
+static void cache_ready(struct pbap_session *pbap)
+{
+	struct cache *cache = pbap->cache;
 
-	cache->entries = g_slist_append(cache->entries, entry);
+	cache->valid = TRUE;
+
+	if (shared_caches == NULL || !shared_folder(cache->folder))
+		return;
+
+	if (shared_cache_get(cache->folder) != NULL)
+		return;
+
+	if (g_slist_find_custom(stale_folders, cache->folder,
+						(GCompareFunc) g_strcmp0))
+		return;
+
+	shared_cache_set(cache_ref(cache));
 }
 
 static int alpha_sort(gconstpointer a, gconstpointer b)
@@ -377,10 +1168,10 @@ static int phonetical_sort(gconstpointer a, gconstpointer b)
 	return g_strcmp0(e1->sound, e2->sound);
 }
 
-static GSList *sort_entries(GSList *l, uint8_t order, uint8_t search_attrib,
-							const char *value)
+static GSList *sort_entries(struct cache *cache, uint8_t order,
+				uint8_t search_attrib, const char *value)
 {
-	GSList *sorted = NULL;
+	GSList *sorted = NULL, *matches, *l = cache->entries;
 	cache_entry_find_f find;
 	GCompareFunc sort;
 	char *searchval;
@@ -404,16 +1195,22 @@ static GSList *sort_entries(GSList *l, uint8_t order, uint8_t search_attrib,
 		break;
 	}
 
+	/*
+	 * Numbers are looked up by their digits in the number index, see
+	 * number_index_lookup().
+	 */
+	if (search_attrib == 1 && value) {
+		matches = number_index_lookup(cache, value);
+
+		return g_slist_sort(matches, sort);
+	}
+
 	/*
 	 * This implementation checks if the given field CONTAINS the
 	 * search value(case insensitive). Name is the default field
 	 * when the attribute is not provided.
 	 */
 	switch (search_attrib) {
-		/* Number */
-		case 1:
-			find = entry_tel_find;
-			break;
 		/* Sound */
 		case 2:
 			find = entry_sound_find;
@@ -449,7 +1246,7 @@ static int generate_response(void *user_data)
 
 	if (max == 0) {
 		/* Ignore all other parameter and return PhoneBookSize */
-		uint16_t size = htons(g_slist_length(pbap->cache.entries));
+		uint16_t size = htons(g_slist_length(pbap->cache->entries));
 
 		pbap->obj->aparams = g_byte_array_new();
 		pbap->obj->aparams = append_aparam_header(pbap->obj->aparams,
@@ -462,28 +1259,35 @@ static int generate_response(void *user_data)
 	 * Don't free the sorted list content: this list contains
 	 * only the reference for the "real" cache entry.
 	 */
-	sorted = sort_entries(pbap->cache.entries, pbap->params->order,
+	sorted = sort_entries(pbap->cache, pbap->params->order,
 				pbap->params->searchattrib,
 				(const char *) pbap->params->searchval);
 
 	/* Computing offset considering first entry of the phonebook */
 	l = g_slist_nth(sorted, pbap->params->liststartoffset);
 
-	pbap->obj->buffer = g_string_new(VCARD_LISTING_BEGIN);
+	pbap->obj->buffer = g_string_sized_new(sizeof(VCARD_LISTING_BEGIN) +
+				MIN(max, g_slist_length(l)) *
+				VCARD_LISTING_ELEMENT_SIZE);
+	g_string_append(pbap->obj->buffer, VCARD_LISTING_BEGIN);
+
 	for (; l && max; l = l->next, max--) {
 		const struct cache_entry *entry = l->data;
-		char *escaped_name = g_markup_escape_text(entry->name, -1);
-
-		g_string_append_printf(pbap->obj->buffer,
-			VCARD_LISTING_ELEMENT, entry->handle, escaped_name);
+		GString *buffer = pbap->obj->buffer;
 
-		g_free(escaped_name);
+		g_string_append(buffer, "<card handle = \"");
+		xml_append_uint64(buffer, entry->handle);
+		g_string_append(buffer, ".vcf\" name = \"");
+		xml_append_escaped(buffer, entry->name);
+		g_string_append(buffer, "\"/>" EOL);
 	}
 
 	pbap->obj->buffer = g_string_append(pbap->obj->buffer,
 							VCARD_LISTING_END);
 	g_slist_free(sorted);
 
+	vobject_mem_update(pbap->obj);
+
 	return 0;
 }
 
@@ -496,7 +1300,7 @@ static void cache_ready_notify(void *user_data)
 	phonebook_req_finalize(pbap->obj->request);
 	pbap->obj->request = NULL;
 
-	pbap->cache.valid = TRUE;
+	cache_ready(pbap);
 
 	generate_response(pbap);
 	obex_object_set_io_flags(pbap->obj, G_IO_IN, 0);
@@ -510,9 +1314,9 @@ static void cache_entry_done(void *user_data)
 
 	DBG("");
 
-	pbap->cache.valid = TRUE;
+	cache_ready(pbap);
 
-	id = cache_find(&pbap->cache, pbap->find_handle);
+	id = cache_find(pbap->cache, pbap->find_handle);
 	if (id == NULL) {
 		DBG("Entry %d not found on cache", pbap->find_handle);
 		obex_object_set_io_flags(pbap->obj, G_IO_ERR, -ENOENT);
@@ -609,16 +1413,51 @@ failed:
 	return NULL;
 }
 
+static uint32_t parse_features(const uint8_t *buffer, ssize_t hlen)
+{
+	struct aparam_header *hdr;
+	ssize_t len = 0;
+	uint32_t val32;
+
+	while (len + (ssize_t) sizeof(struct aparam_header) <= hlen) {
+		hdr = (void *) buffer + len;
+
+		if (len + (ssize_t) sizeof(struct aparam_header) + hdr->len >
+									hlen)
+			break;
+
+		if (hdr->tag == SUPPORTEDFEATURES_TAG &&
+					hdr->len == SUPPORTEDFEATURES_LEN) {
+			memcpy(&val32, hdr->val, sizeof(val32));
+			return GUINT32_FROM_BE(val32);
+		}
+
+		len += hdr->len + sizeof(struct aparam_header);
+	}
+
+	return FEATURES_DEFAULT;
+}
+
 static void *pbap_connect(struct obex_session *os, int *err)
 {
 	struct pbap_session *pbap;
+	const uint8_t *buffer;
+	ssize_t rsize;
 
 	manager_register_session(os);
 
 	pbap = g_new0(struct pbap_session, 1);
+	pbap->os = os;
 	pbap->folder = g_strdup("/");
 	pbap->find_handle = PHONEBOOK_INVALID_HANDLE;
 
+	rsize = obex_get_apparam(os, &buffer);
+	pbap->features = parse_features(buffer, rsize);
+
+	DBG("features 0x%08x", pbap->features);
+
+	warm_start();
+
 	if (err)
 		*err = 0;
 
@@ -717,12 +1556,7 @@ static int pbap_setpath(struct obex_session *os, void *user_data)
 	g_free(pbap->folder);
 	pbap->folder = fullname;
 
-	/*
-	 * FIXME: Define a criteria to mark the cache as invalid
-	 */
-	pbap->cache.valid = FALSE;
-	pbap->cache.index = 0;
-	cache_clear(&pbap->cache);
+	session_cache_set(pbap, NULL);
 
 	return 0;
 }
@@ -741,7 +1575,7 @@ static void pbap_disconnect(struct obex_session *os, void *user_data)
 		g_free(pbap->params);
 	}
 
-	cache_clear(&pbap->cache);
+	session_cache_set(pbap, NULL);
 	g_free(pbap->folder);
 	g_free(pbap);
 }
@@ -774,6 +1608,8 @@ static struct pbap_object *vobject_create(struct pbap_session *pbap,
 
 	obj = g_new0(struct pbap_object, 1);
 	obj->session = pbap;
+	phonebook_prefetch_init(&obj->prefetch);
+	obj->firstpacket = TRUE;
 	pbap->obj = obj;
 	obj->request = request;
 
@@ -781,9 +1617,10 @@ static struct pbap_object *vobject_create(struct pbap_session *pbap,
 }
 
 static void *vobject_pull_open(const char *name, int oflag, mode_t mode,
-				void *context, size_t *size, int *err)
+				void *context, int64_t *size, int *err)
 {
 	struct pbap_session *pbap = context;
+	struct pbap_object *obj;
 	phonebook_cb cb;
 	int ret;
 	void *request;
@@ -812,14 +1649,24 @@ static void *vobject_pull_open(const char *name, int oflag, mode_t mode,
 		goto fail;
 
 	/* reading first part of results from backend */
-	ret = phonebook_pull_read(request);
+	ret = phonebook_pull_read(request, PHONEBOOK_PART_VCARDS,
+							PHONEBOOK_PART_SIZE);
 	if (ret < 0)
 		goto fail;
 
 	if (err)
 		*err = 0;
 
-	return vobject_create(pbap, request);
+	obj = vobject_create(pbap, request);
+	obj->prefetch.reading = TRUE;
+
+	/* Version counters are kept per folder, without the .vcf suffix */
+	if (g_str_has_suffix(name, ".vcf"))
+		obj->folder = g_strndup(name, strlen(name) - 4);
+	else
+		obj->folder = g_strdup(name);
+
+	return obj;
 
 fail:
 	if (err)
@@ -843,6 +1690,10 @@ static int vobject_close(void *object)
 	if (obj->aparams)
 		g_byte_array_free(obj->aparams, TRUE);
 
+	g_free(obj->folder);
+
+	phonebook_prefetch_clear(&obj->prefetch);
+
 	if (obj->request)
 		phonebook_req_finalize(obj->request);
 
@@ -852,14 +1703,15 @@ static int vobject_close(void *object)
 }
 
 static void *vobject_list_open(const char *name, int oflag, mode_t mode,
-				void *context, size_t *size, int *err)
+				void *context, int64_t *size, int *err)
 {
 	struct pbap_session *pbap = context;
 	struct pbap_object *obj = NULL;
+	struct cache *cache;
 	int ret;
 	void *request;
 
-	DBG("name %s context %p valid %d", name, context, pbap->cache.valid);
+	DBG("name %s context %p", name, context);
 
 	if (oflag != O_RDONLY) {
 		ret = -EPERM;
@@ -873,10 +1725,15 @@ static void *vobject_list_open(const char *name, int oflag, mode_t mode,
 
 	/* PullvCardListing always get the contacts from the cache */
 
-	if (pbap->cache.valid) {
+	cache = shared_cache_get(name);
+	if (cache != NULL)
+		session_cache_set(pbap, cache_ref(cache));
+
+	if (session_cache_valid(pbap, name)) {
 		obj = vobject_create(pbap, NULL);
 		ret = generate_response(pbap);
 	} else {
+		session_cache_set(pbap, cache_new(name));
 		request = phonebook_create_cache(name, cache_entry_notify,
 					cache_ready_notify, pbap, &ret);
 		if (ret == 0)
@@ -885,6 +1742,8 @@ static void *vobject_list_open(const char *name, int oflag, mode_t mode,
 	if (ret < 0)
 		goto fail;
 
+	obj->folder = g_strdup(name);
+
 	if (err)
 		*err = 0;
 
@@ -901,7 +1760,7 @@ fail:
 }
 
 static void *vobject_vcard_open(const char *name, int oflag, mode_t mode,
-					void *context, size_t *size, int *err)
+					void *context, int64_t *size, int *err)
 {
 	struct pbap_session *pbap = context;
 	const char *id;
@@ -909,7 +1768,7 @@ static void *vobject_vcard_open(const char *name, int oflag, mode_t mode,
 	int ret;
 	void *request;
 
-	DBG("name %s context %p valid %d", name, context, pbap->cache.valid);
+	DBG("name %s context %p", name, context);
 
 	if (oflag != O_RDONLY) {
 		ret = -EPERM;
@@ -921,14 +1780,23 @@ static void *vobject_vcard_open(const char *name, int oflag, mode_t mode,
 		goto fail;
 	}
 
-	if (pbap->cache.valid == FALSE) {
+	/* Keep resolving handles against the listing the client got */
+	if (!session_cache_valid(pbap, pbap->folder)) {
+		struct cache *cache = shared_cache_get(pbap->folder);
+
+		if (cache != NULL)
+			session_cache_set(pbap, cache_ref(cache));
+	}
+
+	if (!session_cache_valid(pbap, pbap->folder)) {
 		pbap->find_handle = handle;
+		session_cache_set(pbap, cache_new(pbap->folder));
 		request = phonebook_create_cache(pbap->folder,
 			cache_entry_notify, cache_entry_done, pbap, &ret);
 		goto done;
 	}
 
-	id = cache_find(&pbap->cache, handle);
+	id = cache_find(pbap->cache, handle);
 	if (!id) {
 		ret = -ENOENT;
 		goto fail;
@@ -971,20 +1839,18 @@ static ssize_t vobject_pull_get_next_header(void *object, void *buf, size_t mtu,
 								uint8_t *hi)
 {
 	struct pbap_object *obj = object;
-	struct pbap_session *pbap = obj->session;
 
 	if (!obj->buffer && !obj->aparams)
 		return -EAGAIN;
 
 	*hi = G_OBEX_HDR_APPARAM;
 
-	if (pbap->params->maxlistcount == 0 || obj->firstpacket) {
+	if (obj->firstpacket) {
 		obj->firstpacket = FALSE;
-
-		return array_read(obj->aparams, buf, mtu);
+		append_folder_versions(obj);
 	}
 
-	return 0;
+	return array_read(obj->aparams, buf, mtu);
 }
 
 static ssize_t vobject_pull_read(void *object, void *buf, size_t count)
@@ -1003,15 +1869,20 @@ static ssize_t vobject_pull_read(void *object, void *buf, size_t count)
 		return -ENOSTR;
 
 	len = string_read(obj->buffer, buf, count);
-	if (len == 0 && !obj->lastpart) {
-		/* in case when buffer is empty and we know that more
-		 * data is still available in backend, requesting new
-		 * data part via phonebook_pull_read and returning
-		 * -EAGAIN to suspend request for now */
-		ret = phonebook_pull_read(obj->request);
-		if (ret)
-			return -EPERM;
+	phonebook_prefetch_consume(&obj->prefetch, len);
+	vobject_mem_update(obj);
+
+	/* Keep the backend busy with the next part(s) while this one is
+	 * being sent, so part boundaries don't stall the stream */
+	ret = vobject_prefetch(obj);
+	if (ret < 0 && len == 0)
+		return -EPERM;
 
+	if (len == 0 && !obj->prefetch.lastpart) {
+		/* in case when buffer is empty and we know that more
+		 * data is still available in backend, the next part is
+		 * already requested so returning -EAGAIN to suspend
+		 * request for now */
 		return -EAGAIN;
 	}
 
@@ -1025,41 +1896,50 @@ static ssize_t vobject_list_get_next_header(void *object, void *buf, size_t mtu,
 	struct pbap_session *pbap = obj->session;
 
 	/* Backend still busy reading contacts */
-	if (!pbap->cache.valid)
+	if (pbap->cache == NULL || !pbap->cache->valid)
 		return -EAGAIN;
 
 	*hi = G_OBEX_HDR_APPARAM;
 
-	if (pbap->params->maxlistcount == 0)
-		return array_read(obj->aparams, buf, mtu);
+	if (obj->firstpacket) {
+		obj->firstpacket = FALSE;
+		append_folder_versions(obj);
+	}
 
-	return 0;
+	return array_read(obj->aparams, buf, mtu);
 }
 
 static ssize_t vobject_list_read(void *object, void *buf, size_t count)
 {
 	struct pbap_object *obj = object;
 	struct pbap_session *pbap = obj->session;
+	ssize_t len;
 
-	DBG("valid %d maxlistcount %d", pbap->cache.valid,
-						pbap->params->maxlistcount);
+	DBG("maxlistcount %d", pbap->params->maxlistcount);
 
 	if (pbap->params->maxlistcount == 0)
 		return -ENOSTR;
 
-	return string_read(obj->buffer, buf, count);
+	len = string_read(obj->buffer, buf, count);
+	vobject_mem_update(obj);
+
+	return len;
 }
 
 static ssize_t vobject_vcard_read(void *object, void *buf, size_t count)
 {
 	struct pbap_object *obj = object;
+	ssize_t len;
 
 	DBG("buffer %p", obj->buffer);
 
 	if (!obj->buffer)
 		return -EAGAIN;
 
-	return string_read(obj->buffer, buf, count);
+	len = string_read(obj->buffer, buf, count);
+	vobject_mem_update(obj);
+
+	return len;
 }
 
 static struct obex_mime_type_driver mime_pull = {
@@ -1099,6 +1979,13 @@ static int pbap_init(void)
 	if (err < 0)
 		return err;
 
+	versions_load();
+
+	/* Shared caches are only safe if the backend reports changes */
+	if (phonebook_set_change_notification(phonebook_changed, NULL) == 0)
+		shared_caches = g_hash_table_new_full(g_str_hash, g_str_equal,
+					g_free, (GDestroyNotify) cache_unref);
+
 	err = obex_mime_type_driver_register(&mime_pull);
 	if (err < 0)
 		goto fail_mime_pull;
@@ -1124,6 +2011,9 @@ fail_mime_vcard:
 fail_mime_list:
 	obex_mime_type_driver_unregister(&mime_pull);
 fail_mime_pull:
+	phonebook_set_change_notification(NULL, NULL);
+	warm_cleanup();
+	versions_cleanup();
 	phonebook_exit();
 
 	return err;
@@ -1135,6 +2025,9 @@ static void pbap_exit(void)
 	obex_mime_type_driver_unregister(&mime_pull);
 	obex_mime_type_driver_unregister(&mime_list);
 	obex_mime_type_driver_unregister(&mime_vcard);
+	phonebook_set_change_notification(NULL, NULL);
+	warm_cleanup();
+	versions_cleanup();
 	phonebook_exit();
 }
 
@@ -322,7 +322,7 @@ static void on_backup_dbus_notify(DBusPendingCall *pending_call,
 
 static gboolean send_backup_dbus_message(const char *oper,
 					struct backup_object *obj,
-					size_t *size)
+					int64_t *size)
 {
 	DBusConnection *conn;
 	DBusMessage *msg;
@@ -330,7 +330,8 @@ static gboolean send_backup_dbus_message(const char *oper,
 	gboolean ret = FALSE;
 	dbus_uint32_t file_size;
 
-	file_size = size ? *size : 0;
+	/* The backup daemon takes 32 bits, 0 means the size is unknown */
+	file_size = size && *size > 0 && *size <= UINT32_MAX ? *size : 0;
 
 	conn = g_dbus_setup_bus(DBUS_BUS_SESSION, NULL, NULL);
 
@@ -372,7 +373,7 @@ static gboolean send_backup_dbus_message(const char *oper,
 }
 
 static void *backup_open(const char *name, int oflag, mode_t mode,
-				void *context, size_t *size, int *err)
+				void *context, int64_t *size, int *err)
 {
 	struct backup_object *obj = g_new0(struct backup_object, 1);
 
@@ -400,7 +401,7 @@ static void *backup_open(const char *name, int oflag, mode_t mode,
 static int backup_close(void *object)
 {
 	struct backup_object *obj = object;
-	size_t size = 0;
+	int64_t size = 0;
 
 	DBG("cmd = %s", obj->cmd);
 
@@ -0,0 +1,130 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+#include "log.h"
+#include "phonebook.h"
+
+int phonebook_pull_next(void *request, gboolean *reading)
+{
+	int ret;
+
+	DBG("requesting next part");
+
+	ret = phonebook_pull_read(request, PHONEBOOK_PART_VCARDS,
+							PHONEBOOK_PART_SIZE);
+	if (ret < 0)
+		return ret;
+
+	*reading = TRUE;
+
+	return 0;
+}
+
+void phonebook_pull_next_later(guint *id, GSourceFunc func, void *user_data)
+{
+	/*
+	 * Back-ends may deliver the next part from within phonebook_pull_read,
+	 * so never ask for it while a phonebook_cb is still on the stack.
+	 */
+	if (*id == 0)
+		*id = g_idle_add(func, user_data);
+}
+
+void phonebook_prefetch_init(struct phonebook_prefetch *pf)
+{
+	memset(pf, 0, sizeof(*pf));
+	pf->parts = g_queue_new();
+}
+
+void phonebook_prefetch_clear(struct phonebook_prefetch *pf)
+{
+	if (pf->id > 0) {
+		g_source_remove(pf->id);
+		pf->id = 0;
+	}
+
+	if (pf->parts) {
+		g_queue_free(pf->parts);
+		pf->parts = NULL;
+	}
+}
+
+gboolean phonebook_prefetch_needed(struct phonebook_prefetch *pf,
+					unsigned int depth, size_t max_size)
+{
+	if (pf->lastpart || pf->reading)
+		return FALSE;
+
+	/* Part currently being sent plus the configured prefetch depth */
+	if (g_queue_get_length(pf->parts) > depth)
+		return FALSE;
+
+	/* The part being sent is always allowed to be refilled */
+	if (g_queue_is_empty(pf->parts))
+		return TRUE;
+
+	return pf->buffered < max_size;
+}
+
+void phonebook_prefetch_received(struct phonebook_prefetch *pf, size_t len,
+					gboolean lastpart, GSourceFunc func,
+					void *user_data)
+{
+	pf->reading = FALSE;
+	pf->lastpart = lastpart;
+
+	if (len > 0) {
+		g_queue_push_tail(pf->parts, GSIZE_TO_POINTER(len));
+		pf->buffered += len;
+	}
+
+	if (!lastpart)
+		phonebook_pull_next_later(&pf->id, func, user_data);
+}
+
+void phonebook_prefetch_consume(struct phonebook_prefetch *pf, size_t len)
+{
+	len = MIN(len, pf->buffered);
+	pf->buffered -= len;
+
+	while (len > 0 && !g_queue_is_empty(pf->parts)) {
+		GList *head = g_queue_peek_head_link(pf->parts);
+		size_t size = GPOINTER_TO_SIZE(head->data);
+
+		if (size > len) {
+			head->data = GSIZE_TO_POINTER(size - len);
+			break;
+		}
+
+		g_queue_pop_head(pf->parts);
+		len -= size;
+	}
+}
@@ -37,6 +37,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/inotify.h>
 #include <libical/ical.h>
 #include <libical/vobject.h>
 #include <libical/vcc.h>
@@ -47,45 +48,58 @@
 
 typedef void (*vcard_func_t) (const char *file, VObject *vo, void *user_data);
 
+/* Every request, whatever its kind, lives until phonebook_req_finalize */
 struct dummy_data {
 	phonebook_cb cb;
+	phonebook_entry_cb entry_cb;
+	phonebook_cache_ready_cb ready_cb;
 	void *user_data;
 	const struct apparam_field *apparams;
 	char *folder;
 	int fd;
+	DIR *dp;
+	gboolean started;
+	GSList *pending;	/* vCard file names not sent yet */
+	uint16_t remaining;	/* Left of MaxListCount */
+	unsigned int max_vcards;
+	size_t max_bytes;
 	guint id;
 };
 
-struct cache_query {
-	phonebook_entry_cb entry_cb;
-	phonebook_cache_ready_cb ready_cb;
-	void *user_data;
-	DIR *dp;
+struct folder_watch {
+	int wd;
+	const char *folder;
 };
 
 static char *root_folder = NULL;
 
+static const char *watched_folders[] = { "/telecom/pb", "/telecom/ich",
+					"/telecom/och", "/telecom/mch",
+					"/telecom/cch", NULL };
+
+static phonebook_change_cb change_cb = NULL;
+static void *change_user_data = NULL;
+static GSList *folder_watches = NULL;
+static guint inotify_watch = 0;
+
 static void dummy_free(void *user_data)
 {
 	struct dummy_data *dummy = user_data;
 
+	if (dummy->id > 0)
+		g_source_remove(dummy->id);
+
 	if (dummy->fd >= 0)
 		close(dummy->fd);
 
+	if (dummy->dp)
+		closedir(dummy->dp);
+
+	g_slist_free_full(dummy->pending, g_free);
 	g_free(dummy->folder);
 	g_free(dummy);
 }
 
-static void query_free(void *user_data)
-{
-	struct cache_query *query = user_data;
-
-	if (query->dp)
-		closedir(query->dp);
-
-	g_free(query);
-}
-
 int phonebook_init(void)
 {
 	if (root_folder)
@@ -99,6 +113,8 @@ int phonebook_init(void)
 
 void phonebook_exit(void)
 {
+	phonebook_set_change_notification(NULL, NULL);
+
 	g_free(root_folder);
 	root_folder = NULL;
 }
@@ -118,29 +134,17 @@ static int handle_cmp(gconstpointer a, gconstpointer b)
 	return (i1 - i2);
 }
 
-static int foreach_vcard(DIR *dp, vcard_func_t func, uint16_t offset,
-			uint16_t maxlistcount, void *user_data, uint16_t *count)
+/*
+ * Sorting vcards by file name. versionsort is a GNU extension.
+ * The simple sorting function implemented on handle_cmp address
+ * vcards handle only(handle is always a number). This sort function
+ * doesn't address filename started by "0".
+ */
+static GSList *sorted_vcards(DIR *dp)
 {
 	struct dirent *ep;
-	GSList *sorted = NULL, *l;
-	VObject *v;
-	FILE *fp;
-	int err, fd, folderfd;
-	uint16_t n = 0;
+	GSList *sorted = NULL;
 
-	folderfd = dirfd(dp);
-	if (folderfd < 0) {
-		err = errno;
-		error("dirfd(): %s(%d)", strerror(err), err);
-		return -err;
-	}
-
-	/*
-	 * Sorting vcards by file name. versionsort is a GNU extension.
-	 * The simple sorting function implemented on handle_cmp address
-	 * vcards handle only(handle is always a number). This sort function
-	 * doesn't address filename started by "0".
-	 */
 	while ((ep = readdir(dp))) {
 		char *filename;
 
@@ -161,6 +165,44 @@ static int foreach_vcard(DIR *dp, vcard_func_t func, uint16_t offset,
 		sorted = g_slist_insert_sorted(sorted, filename, handle_cmp);
 	}
 
+	return sorted;
+}
+
+static VObject *parse_vcard(DIR *dp, const char *filename)
+{
+	VObject *v;
+	FILE *fp;
+	int err, fd;
+
+	fd = openat(dirfd(dp), filename, O_RDONLY);
+	if (fd < 0) {
+		err = errno;
+		error("openat(%s): %s(%d)", filename, strerror(err), err);
+		return NULL;
+	}
+
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	v = Parse_MIME_FromFile(fp);
+
+	fclose(fp);
+
+	return v;
+}
+
+static int foreach_vcard(DIR *dp, vcard_func_t func, uint16_t offset,
+			uint16_t maxlistcount, void *user_data, uint16_t *count)
+{
+	GSList *sorted, *l;
+	VObject *v;
+	uint16_t n = 0;
+
+	sorted = sorted_vcards(dp);
+
 	/*
 	 * Filtering only the requested vCards attributes. Offset
 	 * shall be based on the first entry of the phonebook.
@@ -169,22 +211,12 @@ static int foreach_vcard(DIR *dp, vcard_func_t func, uint16_t offset,
 			l && n < maxlistcount; l = l->next) {
 		const char *filename = l->data;
 
-		fd = openat(folderfd, filename, O_RDONLY);
-		if (fd < 0) {
-			err = errno;
-			error("openat(%s): %s(%d)", filename, strerror(err), err);
-			continue;
-		}
-
-		fp = fdopen(fd, "r");
-		v = Parse_MIME_FromFile(fp);
+		v = parse_vcard(dp, filename);
 		if (v != NULL) {
 			func(filename, v, user_data);
 			deleteVObject(v);
 			n++;
 		}
-
-		close(fd);
 	}
 
 	g_slist_free_full(sorted, g_free);
@@ -214,22 +246,53 @@ static void entry_concat(const char *filename, VObject *v, void *user_data)
 	g_string_append_len(buffer, tmp, len);
 }
 
-static gboolean read_dir(void *user_data)
+static void count_vcard(const char *filename, VObject *v, void *user_data)
 {
-	struct dummy_data *dummy = user_data;
-	GString *buffer;
-	DIR *dp;
-	uint16_t count, max, offset;
+}
 
-	buffer = g_string_new("");
+static int read_dir_start(struct dummy_data *dummy)
+{
+	GSList *skipped;
 
-	dp = opendir(dummy->folder);
-	if (dp == NULL) {
+	dummy->started = TRUE;
+
+	dummy->dp = opendir(dummy->folder);
+	if (dummy->dp == NULL) {
 		int err = errno;
 		DBG("opendir(): %s(%d)", strerror(err), err);
-		goto done;
+		return -err;
 	}
 
+	dummy->pending = sorted_vcards(dummy->dp);
+
+	/* Offset shall be based on the first entry of the phonebook */
+	skipped = dummy->pending;
+	dummy->pending = g_slist_nth(skipped, dummy->apparams->liststartoffset);
+
+	if (dummy->pending != skipped) {
+		GSList *l = skipped;
+
+		while (l->next != dummy->pending)
+			l = l->next;
+
+		l->next = NULL;
+		g_slist_free_full(skipped, g_free);
+	}
+
+	dummy->remaining = dummy->apparams->maxlistcount;
+
+	return 0;
+}
+
+static gboolean read_dir(void *user_data)
+{
+	struct dummy_data *dummy = user_data;
+	GString *buffer;
+	gboolean lastpart;
+	uint16_t count = 0;
+
+	dummy->id = 0;
+
 	/*
 	 * For PullPhoneBook function, the decision of returning the size
 	 * or contacts is made in the PBAP core. When MaxListCount is ZERO,
@@ -237,19 +300,56 @@ static gboolean read_dir(void *user_data)
 	 * other applicattion parameters that may be present in the request.
 	 */
 	if (dummy->apparams->maxlistcount == 0) {
-		max = 0xffff;
-		offset = 0;
-	} else {
-		max = dummy->apparams->maxlistcount;
-		offset = dummy->apparams->liststartoffset;
+		DIR *dp = opendir(dummy->folder);
+
+		if (dp != NULL) {
+			foreach_vcard(dp, count_vcard, 0, 0xffff, NULL,
+								&count);
+			closedir(dp);
+		}
+
+		dummy->cb(NULL, 0, count, 0, TRUE, dummy->user_data);
+
+		return FALSE;
 	}
 
-	foreach_vcard(dp, entry_concat, offset, max, buffer, &count);
+	if (!dummy->started && read_dir_start(dummy) < 0) {
+		dummy->cb(NULL, 0, -ENOENT, 0, TRUE, dummy->user_data);
+		return FALSE;
+	}
+
+	buffer = g_string_new("");
+
+	while (dummy->pending && dummy->remaining > 0) {
+		char *filename;
+		VObject *v;
+
+		if (dummy->max_vcards > 0 && count >= dummy->max_vcards)
+			break;
+
+		if (dummy->max_bytes > 0 && buffer->len >= dummy->max_bytes)
+			break;
+
+		filename = dummy->pending->data;
+		dummy->pending = g_slist_delete_link(dummy->pending,
+							dummy->pending);
+
+		v = parse_vcard(dummy->dp, filename);
+		if (v != NULL) {
+			entry_concat(filename, v, buffer);
+			deleteVObject(v);
+			dummy->remaining--;
+			count++;
+		}
+
+		g_free(filename);
+	}
+
+	lastpart = dummy->pending == NULL || dummy->remaining == 0;
 
-	closedir(dp);
-done:
 	/* FIXME: Missing vCards fields filtering */
-	dummy->cb(buffer->str, buffer->len, count, 0, TRUE, dummy->user_data);
+	dummy->cb(buffer->str, buffer->len, count, 0, lastpart,
+							dummy->user_data);
 
 	g_string_free(buffer, TRUE);
 
@@ -258,10 +358,11 @@ done:
 
 static void entry_notify(const char *filename, VObject *v, void *user_data)
 {
-	struct cache_query *query = user_data;
+	struct dummy_data *query = user_data;
 	VObject *property, *subproperty;
+	VObjectIterator iter;
 	GString *name;
-	const char *tel;
+	GSList *tels = NULL;
 	long unsigned int handle;
 
 	property = isAPropertyOf(v, VCNameProp);
@@ -304,18 +405,29 @@ static void entry_notify(const char *filename, VObject *v, void *user_data)
 		g_string_append_printf(name, ";%s",
 				fakeCString(vObjectUStringZValue(subproperty)));
 
-	property = isAPropertyOf(v, VCTelephoneProp);
+	initPropIterator(&iter, v);
+	while (moreIteration(&iter)) {
+		property = nextVObject(&iter);
 
-	tel = property ? fakeCString(vObjectUStringZValue(property)) : NULL;
+		if (strcasecmp(vObjectName(property), VCTelephoneProp) != 0)
+			continue;
+
+		tels = g_slist_append(tels,
+				fakeCString(vObjectUStringZValue(property)));
+	}
 
-	query->entry_cb(filename, handle, name->str, NULL, tel,
+	query->entry_cb(filename, handle, name->str, NULL, tels,
 							query->user_data);
+
+	g_slist_free_full(tels, free);
 	g_string_free(name, TRUE);
 }
 
 static gboolean create_cache(void *user_data)
 {
-	struct cache_query *query = user_data;
+	struct dummy_data *query = user_data;
+
+	query->id = 0;
 
 	/*
 	 * MaxListCount and ListStartOffset shall not be used
@@ -336,6 +448,8 @@ static gboolean read_entry(void *user_data)
 	char buffer[1024];
 	ssize_t count;
 
+	dummy->id = 0;
+
 	memset(buffer, 0, sizeof(buffer));
 	count = read(dummy->fd, buffer, sizeof(buffer));
 
@@ -452,10 +566,8 @@ void phonebook_req_finalize(void *request)
 {
 	struct dummy_data *dummy = request;
 
-	/* dummy_data will be cleaned when request will be finished via
-	 * g_source_remove */
-	if (dummy && dummy->id)
-		g_source_remove(dummy->id);
+	if (dummy)
+		dummy_free(dummy);
 }
 
 void *phonebook_pull(const char *name, const struct apparam_field *params,
@@ -501,15 +613,23 @@ void *phonebook_pull(const char *name, const struct apparam_field *params,
 	return dummy;
 }
 
-int phonebook_pull_read(void *request)
+int phonebook_pull_read(void *request, unsigned int max_vcards,
+							size_t max_bytes)
 {
 	struct dummy_data *dummy = request;
 
 	if (!dummy)
 		return -ENOENT;
 
+	if (dummy->id > 0)
+		return -EBUSY;
+
+	dummy->max_vcards = max_vcards;
+	dummy->max_bytes = max_bytes;
+
+	/* Each part is read on demand, the rest stays on disk */
 	dummy->id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, read_dir, dummy,
-								dummy_free);
+									NULL);
 
 	return 0;
 }
@@ -521,7 +641,6 @@ void *phonebook_get_entry(const char *folder, const char *id,
 	struct dummy_data *dummy;
 	char *filename;
 	int fd;
-	guint ret;
 
 	filename = g_build_filename(root_folder, folder, id, NULL);
 
@@ -539,22 +658,21 @@ void *phonebook_get_entry(const char *folder, const char *id,
 	dummy->apparams = params;
 	dummy->fd = fd;
 
-	ret = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, read_entry, dummy,
-								dummy_free);
+	dummy->id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, read_entry,
+								dummy, NULL);
 
 	if (err)
 		*err = 0;
 
-	return GINT_TO_POINTER(ret);
+	return dummy;
 }
 
 void *phonebook_create_cache(const char *name, phonebook_entry_cb entry_cb,
 		phonebook_cache_ready_cb ready_cb, void *user_data, int *err)
 {
-	struct cache_query *query;
+	struct dummy_data *query;
 	char *foldername;
 	DIR *dp;
-	guint ret;
 
 	foldername = g_build_filename(root_folder, name, NULL);
 	dp = opendir(foldername);
@@ -567,17 +685,131 @@ void *phonebook_create_cache(const char *name, phonebook_entry_cb entry_cb,
 		return NULL;
 	}
 
-	query = g_new0(struct cache_query, 1);
+	query = g_new0(struct dummy_data, 1);
 	query->entry_cb = entry_cb;
 	query->ready_cb = ready_cb;
 	query->user_data = user_data;
 	query->dp = dp;
+	query->fd = -1;
 
-	ret = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, create_cache, query,
-								query_free);
+	query->id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, create_cache,
+								query, NULL);
 
 	if (err)
 		*err = 0;
 
-	return GINT_TO_POINTER(ret);
+	return query;
+}
+
+static const char *find_watched_folder(int wd)
+{
+	GSList *l;
+
+	for (l = folder_watches; l; l = l->next) {
+		struct folder_watch *watch = l->data;
+
+		if (watch->wd == wd)
+			return watch->folder;
+	}
+
+	return NULL;
+}
+
+static gboolean inotify_event(GIOChannel *io, GIOCondition cond,
+							void *user_data)
+{
+	char buf[1024];
+	ssize_t len, offset = 0;
+	int fd;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		inotify_watch = 0;
+		return FALSE;
+	}
+
+	fd = g_io_channel_unix_get_fd(io);
+
+	len = read(fd, buf, sizeof(buf));
+	if (len < 0)
+		return TRUE;
+
+	while (offset + (ssize_t) sizeof(struct inotify_event) <= len) {
+		struct inotify_event *event = (void *) buf + offset;
+		const char *folder;
+
+		offset += sizeof(struct inotify_event) + event->len;
+
+		/* Only vCard files count as phonebook entries */
+		if (event->len > 0 && !g_str_has_suffix(event->name, ".vcf"))
+			continue;
+
+		folder = find_watched_folder(event->wd);
+		if (folder == NULL || change_cb == NULL)
+			continue;
+
+		/* Any vCard property may have changed */
+		change_cb(folder, TRUE, change_user_data);
+	}
+
+	return TRUE;
+}
+
+int phonebook_set_change_notification(phonebook_change_cb cb,
+							void *user_data)
+{
+	GIOChannel *io;
+	int fd, i;
+
+	change_cb = cb;
+	change_user_data = user_data;
+
+	if (cb == NULL) {
+		if (inotify_watch > 0) {
+			g_source_remove(inotify_watch);
+			inotify_watch = 0;
+		}
+
+		g_slist_free_full(folder_watches, g_free);
+		folder_watches = NULL;
+
+		return 0;
+	}
+
+	if (inotify_watch > 0)
+		return 0;
+
+	fd = inotify_init();
+	if (fd < 0) {
+		int err = errno;
+		error("inotify_init(): %s(%d)", strerror(err), err);
+		return -err;
+	}
+
+	for (i = 0; watched_folders[i]; i++) {
+		struct folder_watch *watch;
+		char *path;
+		int wd;
+
+		path = g_build_filename(root_folder, watched_folders[i], NULL);
+		wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_DELETE |
+						IN_MOVED_FROM | IN_MOVED_TO);
+		g_free(path);
+
+		if (wd < 0)
+			continue;
+
+		watch = g_new0(struct folder_watch, 1);
+		watch->wd = wd;
+		watch->folder = watched_folders[i];
+		folder_watches = g_slist_append(folder_watches, watch);
+	}
+
+	io = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(io, TRUE);
+	inotify_watch = g_io_add_watch(io,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				inotify_event, NULL);
+	g_io_channel_unref(io);
+
+	return 0;
 }
@@ -43,6 +43,12 @@
 #define QUERY_NAME "(contains \"given_name\" \"%s\")"
 #define QUERY_PHONE "(contains \"phone\" \"%s\")"
 
+/* Contact selected by a pull, fetched when its part is due */
+struct pull_uid {
+	EBook *ebook;
+	char *uid;
+};
+
 struct query_context {
 	const struct apparam_field *params;
 	phonebook_cb contacts_cb;
@@ -56,8 +62,25 @@ struct query_context {
 	void *user_data;
 	GSList *ebooks;
 	gboolean canceled;
+	gboolean fetched;
+	GQueue *uids;		/* struct pull_uid not fetched yet */
+	GSList *window;		/* struct pull_uid being fetched */
+	GHashTable *window_contacts;	/* UID -> EContact of the window */
+	GList *pending;		/* EContacts not converted to vCards yet */
+	unsigned int max_vcards;
+	size_t max_bytes;
+	guint part_id;
+};
+
+struct change_view {
+	EBookView *view;
+	gboolean complete;
 };
 
+static phonebook_change_cb change_cb = NULL;
+static void *change_user_data = NULL;
+static GSList *change_views = NULL;
+
 static char *attribute_mask[] = {
 /* 0 */		"VERSION",
 		"FN",
@@ -97,6 +120,14 @@ static void close_ebooks(GSList *ebooks)
 	g_slist_free_full(ebooks, g_object_unref);
 }
 
+static void pull_uid_free(void *data)
+{
+	struct pull_uid *pu = data;
+
+	g_free(pu->uid);
+	g_free(pu);
+}
+
 static void free_query_context(struct query_context *data)
 {
 	g_free(data->id);
@@ -107,6 +138,19 @@ static void free_query_context(struct query_context *data)
 	if (data->query != NULL)
 		e_book_query_unref(data->query);
 
+	if (data->part_id > 0)
+		g_source_remove(data->part_id);
+
+	if (data->uids != NULL)
+		g_queue_free_full(data->uids, pull_uid_free);
+
+	g_slist_free_full(data->window, pull_uid_free);
+
+	if (data->window_contacts != NULL)
+		g_hash_table_destroy(data->window_contacts);
+
+	g_list_free_full(data->pending, g_object_unref);
+
 	close_ebooks(data->ebooks);
 
 	g_free(data);
@@ -158,6 +202,217 @@ static char *evcard_to_string(EVCard *evcard, unsigned int format,
 	return vcard;
 }
 
+static GSList *evcard_tels(EVCard *evcard)
+{
+	GSList *tels = NULL;
+	GList *l;
+
+	for (l = e_vcard_get_attributes(evcard); l; l = g_list_next(l)) {
+		EVCardAttribute *attrib = l->data;
+		char *tel;
+
+		if (!attrib)
+			continue;
+
+		if (g_strcmp0(e_vcard_attribute_get_name(attrib), EVC_TEL))
+			continue;
+
+		tel = e_vcard_attribute_get_value(attrib);
+		if (tel)
+			tels = g_slist_append(tels, tel);
+	}
+
+	return tels;
+}
+
+static void ebookpull_send_part(struct query_context *data)
+{
+	GString *buf;
+	unsigned int count = 0;
+	gboolean lastpart;
+
+	/* Size requests carry only the number of contacts */
+	if (data->params->maxlistcount == 0) {
+		data->contacts_cb(NULL, 0, data->count, 0, TRUE,
+							data->user_data);
+		return;
+	}
+
+	buf = g_string_new("");
+
+	while (data->pending != NULL) {
+		EContact *contact = E_CONTACT(data->pending->data);
+		char *vcard;
+
+		if (data->max_vcards > 0 && count >= data->max_vcards)
+			break;
+
+		if (data->max_bytes > 0 && buf->len >= data->max_bytes)
+			break;
+
+		data->pending = g_list_delete_link(data->pending,
+							data->pending);
+
+		vcard = evcard_to_string(E_VCARD(contact), EVC_FORMAT_VCARD_30,
+						data->params->filter);
+
+		buf = g_string_append(buf, vcard);
+		buf = g_string_append(buf, "\r\n");
+		g_free(vcard);
+		g_object_unref(contact);
+
+		count++;
+	}
+
+	lastpart = data->pending == NULL && g_queue_is_empty(data->uids);
+
+	DBG("sending %u vcards, lastpart %d", count, lastpart);
+
+	/* The callback may finalize the request */
+	data->contacts_cb(buf->str, buf->len, count, 0, lastpart,
+							data->user_data);
+
+	g_string_free(buf, TRUE);
+}
+
+static gboolean ebookpull_part_cb(void *user_data)
+{
+	struct query_context *data = user_data;
+
+	data->part_id = 0;
+
+	ebookpull_send_part(data);
+
+	return FALSE;
+}
+
+static void ebookwindow_cb(EBook *book, const GError *gerr, GList *contacts,
+							void *user_data)
+{
+	struct query_context *data = user_data;
+	GSList *w;
+	GList *l;
+
+	data->queued_calls--;
+
+	if (data->canceled)
+		goto canceled;
+
+	if (gerr != NULL)
+		error("E-Book query failed: %s", gerr->message);
+
+	for (l = contacts; l; l = g_list_next(l)) {
+		const char *uid = e_contact_get_const(l->data, E_CONTACT_UID);
+
+		if (uid != NULL)
+			g_hash_table_replace(data->window_contacts,
+					g_strdup(uid), g_object_ref(l->data));
+	}
+
+	g_list_free_full(contacts, g_object_unref);
+
+	if (data->queued_calls > 0)
+		return;
+
+	/* Back to the listing order, removed contacts are skipped */
+	for (w = data->window; w; w = w->next) {
+		struct pull_uid *pu = w->data;
+		EContact *contact;
+
+		contact = g_hash_table_lookup(data->window_contacts, pu->uid);
+		if (contact != NULL)
+			data->pending = g_list_prepend(data->pending,
+							g_object_ref(contact));
+	}
+
+	data->pending = g_list_reverse(data->pending);
+
+	g_slist_free_full(data->window, pull_uid_free);
+	data->window = NULL;
+	g_hash_table_remove_all(data->window_contacts);
+
+	ebookpull_send_part(data);
+
+	return;
+
+canceled:
+	g_list_free_full(contacts, g_object_unref);
+
+	if (data->queued_calls == 0)
+		free_query_context(data);
+}
+
+static EBookQuery *window_query(GSList *window, EBook *ebook)
+{
+	EBookQuery **qs, *query;
+	unsigned int n = 0;
+	GSList *w;
+
+	qs = g_new0(EBookQuery *, g_slist_length(window));
+
+	for (w = window; w; w = w->next) {
+		struct pull_uid *pu = w->data;
+
+		if (pu->ebook != ebook)
+			continue;
+
+		qs[n++] = e_book_query_field_test(E_CONTACT_UID,
+						E_BOOK_QUERY_IS, pu->uid);
+	}
+
+	query = n > 0 ? e_book_query_or(n, qs, TRUE) : NULL;
+
+	g_free(qs);
+
+	return query;
+}
+
+/*
+ * Fetches the contacts of the next part only, one query per address book,
+ * so at most one part worth of EContacts is held at a time.
+ */
+static void ebookpull_fetch_window(struct query_context *data)
+{
+	unsigned int size, n;
+	GSList *l;
+
+	size = data->max_vcards > 0 ? data->max_vcards : PHONEBOOK_PART_VCARDS;
+
+	for (n = 0; n < size && !g_queue_is_empty(data->uids); n++)
+		data->window = g_slist_prepend(data->window,
+					g_queue_pop_head(data->uids));
+
+	data->window = g_slist_reverse(data->window);
+
+	if (data->window_contacts == NULL)
+		data->window_contacts = g_hash_table_new_full(g_str_hash,
+					g_str_equal, g_free, g_object_unref);
+
+	for (l = data->ebooks; l != NULL; l = g_slist_next(l)) {
+		EBook *ebook = l->data;
+		EBookQuery *query;
+
+		query = window_query(data->window, ebook);
+		if (query == NULL)
+			continue;
+
+		if (e_book_get_contacts_async(ebook, query,
+						ebookwindow_cb, data) == TRUE)
+			data->queued_calls++;
+
+		e_book_query_unref(query);
+	}
+
+	if (data->queued_calls > 0)
+		return;
+
+	/* Nothing could be fetched, let the part go out empty */
+	g_slist_free_full(data->window, pull_uid_free);
+	data->window = NULL;
+
+	data->part_id = g_idle_add(ebookpull_part_cb, data);
+}
+
 static void ebookpull_cb(EBook *book, const GError *gerr, GList *contacts,
 							void *user_data)
 {
@@ -188,43 +443,52 @@ static void ebookpull_cb(EBook *book, const GError *gerr, GList *contacts,
 		goto done;
 	}
 
+	/*
+	 * Only the UIDs are kept, contacts are fetched again one part at a
+	 * time when PBAP core asks for it, so neither the EContacts nor their
+	 * vCards of the whole phonebook sit in memory.
+	 */
 	l = g_list_nth(contacts, data->params->liststartoffset);
 
-	for (count = 0; l && count + data->count < maxcount; l = g_list_next(l),
-								count++) {
-		EContact *contact = E_CONTACT(l->data);
-		EVCard *evcard = E_VCARD(contact);
-		char *vcard;
+	for (count = 0; l && count + data->count < maxcount;
+							l = g_list_next(l)) {
+		struct pull_uid *pu;
+		const char *uid;
 
-		vcard = evcard_to_string(evcard, EVC_FORMAT_VCARD_30,
-						data->params->filter);
+		uid = e_contact_get_const(l->data, E_CONTACT_UID);
+		if (uid == NULL)
+			continue;
 
-		data->buf = g_string_append(data->buf, vcard);
-		data->buf = g_string_append(data->buf, "\r\n");
-		g_free(vcard);
+		pu = g_new0(struct pull_uid, 1);
+		pu->ebook = book;
+		pu->uid = g_strdup(uid);
+		g_queue_push_tail(data->uids, pu);
+
+		count++;
 	}
 
-	DBG("collected %d vcards", count);
+	DBG("collected %d contacts", count);
 
 	data->count += count;
 
-	g_list_free_full(contacts, g_object_unref);
-
 done:
-	if (data->queued_calls == 0) {
-		GString *buf = data->buf;
-		data->buf = NULL;
+	g_list_free_full(contacts, g_object_unref);
 
-		data->contacts_cb(buf->str, buf->len, data->count,
-						0, TRUE, data->user_data);
+	if (data->queued_calls > 0)
+		return;
 
-		g_string_free(buf, TRUE);
+	data->fetched = TRUE;
 
-	}
+	if (data->params->maxlistcount == 0 || g_queue_is_empty(data->uids))
+		ebookpull_send_part(data);
+	else
+		ebookpull_fetch_window(data);
 
 	return;
 
 canceled:
+	g_list_free_full(contacts, g_object_unref);
+
 	if (data->queued_calls == 0)
 		free_query_context(data);
 }
@@ -326,7 +590,8 @@ static void cache_cb(EBook *book, const GError *gerr, GList *contacts,
 		EContact *contact = E_CONTACT(l->data);
 		EVCard *evcard = E_VCARD(contact);
 		EVCardAttribute *attrib;
-		char *uid, *tel, *name;
+		char *uid, *name;
+		GSList *tels;
 
 		name = evcard_name_attribute_to_string(evcard);
 		if (!name)
@@ -340,18 +605,14 @@ static void cache_cb(EBook *book, const GError *gerr, GList *contacts,
 		if (!uid)
 			continue;
 
-		attrib = e_vcard_get_attribute(evcard, EVC_TEL);
-		if (attrib)
-			tel = e_vcard_attribute_get_value(attrib);
-		else
-			tel = g_strdup("");
+		tels = evcard_tels(evcard);
 
 		data->entry_cb(uid, PHONEBOOK_INVALID_HANDLE, name, NULL,
-							tel, data->user_data);
+							tels, data->user_data);
 
 		g_free(name);
 		g_free(uid);
-		g_free(tel);
+		g_slist_free_full(tels, g_free);
 	}
 
 	g_list_free_full(contacts, g_object_unref);
@@ -448,6 +709,100 @@ static GSList *open_ebooks(void)
 
 void phonebook_exit(void)
 {
+	phonebook_set_change_notification(NULL, NULL);
+}
+
+static void contacts_changed(EBookView *view, GList *contacts,
+							void *user_data)
+{
+	struct change_view *cv = user_data;
+
+	/* Initial population of the view is not a change */
+	if (!cv->complete || change_cb == NULL)
+		return;
+
+	change_cb("/telecom/pb", TRUE, change_user_data);
+}
+
+static void sequence_complete(EBookView *view, EBookViewStatus status,
+							void *user_data)
+{
+	struct change_view *cv = user_data;
+
+	cv->complete = TRUE;
+}
+
+static void change_view_free(void *data)
+{
+	struct change_view *cv = data;
+
+	e_book_view_stop(cv->view);
+	g_signal_handlers_disconnect_by_func(cv->view, contacts_changed, cv);
+	g_signal_handlers_disconnect_by_func(cv->view, sequence_complete, cv);
+	g_object_unref(cv->view);
+	g_free(cv);
+}
+
+static void watch_ebook(void *data, void *user_data)
+{
+	EBook *ebook = data;
+	EBookQuery *query;
+	EBookView *view;
+	struct change_view *cv;
+	GError *gerr = NULL;
+
+	query = e_book_query_any_field_contains("");
+
+	if (e_book_get_book_view(ebook, query, NULL, -1, &view,
+							&gerr) == FALSE) {
+		error("Can't watch address book: %s", gerr->message);
+		g_error_free(gerr);
+		e_book_query_unref(query);
+		return;
+	}
+
+	e_book_query_unref(query);
+
+	cv = g_new0(struct change_view, 1);
+	cv->view = view;
+
+	g_signal_connect(view, "contacts-added",
+				G_CALLBACK(contacts_changed), cv);
+	g_signal_connect(view, "contacts-changed",
+				G_CALLBACK(contacts_changed), cv);
+	g_signal_connect(view, "contacts-removed",
+				G_CALLBACK(contacts_changed), cv);
+	g_signal_connect(view, "sequence-complete",
+				G_CALLBACK(sequence_complete), cv);
+
+	e_book_view_start(view);
+
+	change_views = g_slist_append(change_views, cv);
+}
+
+int phonebook_set_change_notification(phonebook_change_cb cb,
+							void *user_data)
+{
+	GSList *ebooks;
+
+	change_cb = cb;
+	change_user_data = user_data;
+
+	if (cb == NULL) {
+		g_slist_free_full(change_views, change_view_free);
+		change_views = NULL;
+		return 0;
+	}
+
+	if (change_views != NULL)
+		return 0;
+
+	/* Views keep a reference to their address book */
+	ebooks = open_ebooks();
+	g_slist_foreach(ebooks, watch_ebook, NULL);
+	close_ebooks(ebooks);
+
+	return 0;
 }
 
 char *phonebook_set_folder(const char *current_folder,
@@ -560,9 +915,9 @@ void *phonebook_pull(const char *name, const struct apparam_field *params,
 	data->contacts_cb = cb;
 	data->params = params;
 	data->user_data = user_data;
-	data->buf = g_string_new("");
 	data->query = e_book_query_any_field_contains("");
 	data->ebooks = open_ebooks();
+	data->uids = g_queue_new();
 
 	if (err)
 		*err = data->ebooks == NULL ? -EIO : 0;
@@ -570,7 +925,8 @@ void *phonebook_pull(const char *name, const struct apparam_field *params,
 	return data;
 }
 
-int phonebook_pull_read(void *request)
+int phonebook_pull_read(void *request, unsigned int max_vcards,
+							size_t max_bytes)
 {
 	struct query_context *data = request;
 	GSList *l;
@@ -578,6 +934,25 @@ int phonebook_pull_read(void *request)
 	if (!data)
 		return -ENOENT;
 
+	if (data->part_id > 0 || data->queued_calls > 0)
+		return -EBUSY;
+
+	data->max_vcards = max_vcards;
+	data->max_bytes = max_bytes;
+
+	/*
+	 * The first read lists the contacts, the next ones convert what is
+	 * left of the current window or fetch the next one.
+	 */
+	if (data->fetched) {
+		if (data->pending == NULL && !g_queue_is_empty(data->uids))
+			ebookpull_fetch_window(data);
+		else
+			data->part_id = g_idle_add(ebookpull_part_cb, data);
+
+		return 0;
+	}
+
 	for (l = data->ebooks; l != NULL; l = g_slist_next(l)) {
 		EBook *ebook = l->data;
 
@@ -631,13 +1006,12 @@ void *phonebook_create_cache(const char *name, phonebook_entry_cb entry_cb,
 {
 	struct query_context *data;
 	EBookQuery *query;
-	GSList *l;
+	GSList *l, *tels;
 	EContact *me;
 	EVCard *evcard;
 	GError *gerr = NULL;
 	EBook *eb;
-	EVCardAttribute *attrib;
-	char *uid, *tel, *cname;
+	char *uid, *cname;
 
 	if (g_strcmp0("/telecom/pb", name) != 0) {
 		if (err)
@@ -669,24 +1043,19 @@ void *phonebook_create_cache(const char *name, phonebook_entry_cb entry_cb,
 	if (!cname)
 		cname = g_strdup("");
 
-	attrib = e_vcard_get_attribute(evcard, EVC_UID);
-	uid = e_vcard_attribute_get_value(attrib);
+	uid = e_contact_get(me, E_CONTACT_UID);
 	if (!uid)
 		uid = g_strdup("");
 
-	attrib = e_vcard_get_attribute(evcard, EVC_TEL);
-	if (attrib)
-		tel =  e_vcard_attribute_get_value(attrib);
-	else
-		tel = g_strdup("");
+	tels = evcard_tels(evcard);
 
-	data->entry_cb(uid, 0, cname, NULL, tel, data->user_data);
+	data->entry_cb(uid, 0, cname, NULL, tels, data->user_data);
 
 	data->count++;
 
 	g_free(cname);
 	g_free(uid);
-	g_free(tel);
+	g_slist_free_full(tels, g_free);
 	g_object_unref(eb);
 
 next:
@@ -29,6 +29,8 @@
 #include <dbus/dbus.h>
 #include <libtracker-sparql/tracker-sparql.h>
 
+#include <gdbus.h>
+
 #include "log.h"
 #include "obex.h"
 #include "service.h"
@@ -41,6 +43,9 @@
 #define TRACKER_RESOURCES_PATH "/org/freedesktop/Tracker1/Resources"
 #define TRACKER_RESOURCES_INTERFACE "org.freedesktop.Tracker1.Resources"
 
+#define TRACKER_CONTACT_CLASS "nco#PersonContact"
+#define TRACKER_CALL_CLASS "nmo#Call"
+
 #define TRACKER_DEFAULT_CONTACT_ME "http://www.semanticdesktop.org/ontologies/2007/03/22/nco#default-contact-me"
 #define AFFILATION_HOME "Home"
 #define AFFILATION_WORK "Work"
@@ -81,7 +86,6 @@
 #define SUB_DELIM "\31" /* Delimiter used in telephone number strings*/
 #define ADDR_DELIM "\37" /* Delimiter used for address data fields */
 #define MAX_FIELDS 100 /* Max amount of fields to be concatenated at once*/
-#define VCARDS_PART_COUNT 50 /* amount of vcards sent at once to PBAP core */
 #define QUERY_OFFSET_FORMAT "%s OFFSET %d"
 
 #define CONTACTS_QUERY_ALL						\
@@ -167,7 +171,7 @@
 			"} "						\
 		"} "							\
 	") "								\
-	"nco:phoneNumber(?h) "						\
+	"GROUP_CONCAT(nco:phoneNumber(?h), \"\30\") "			\
 	"WHERE { "							\
 		"?c a nco:PersonContact . "				\
 	"OPTIONAL { ?c nco:hasPhoneNumber ?h . } "			\
@@ -502,6 +506,7 @@ struct phonebook_data {
 	GCancellable *query_canc;
 	char *req_name;
 	int vcard_part_count;
+	unsigned int vcard_part_max;	/* Requested by the PBAP core */
 	int tracker_index;
 };
 
@@ -512,6 +517,11 @@ struct phonebook_index {
 
 static TrackerSparqlConnection *connection = NULL;
 
+static DBusConnection *dbus_conn = NULL;
+static guint graph_watch = 0;
+static phonebook_change_cb change_cb = NULL;
+static void *change_user_data = NULL;
+
 static const char *name2query(const char *name)
 {
 	if (g_str_equal(name, "/telecom/pb.vcf"))
@@ -1308,7 +1318,9 @@ static int pull_contacts(const char **reply, int num_fields, void *user_data)
 			data->vcard_part_count++;
 	}
 
-	if (data->vcard_part_count > VCARDS_PART_COUNT) {
+	/* Only a vCard count is known here, max_bytes isn't enforced */
+	if (data->vcard_part_max > 0 &&
+			data->vcard_part_count > (int) data->vcard_part_max) {
 		DBG("Part of vcard data ready for sending...");
 		data->vcard_part_count = 0;
 		/* Sending part of data to PBAP core - more data can be still
@@ -1381,8 +1393,9 @@ fail:
 static int add_to_cache(const char **reply, int num_fields, void *user_data)
 {
 	struct phonebook_data *data = user_data;
-	char *formatted;
-	int i;
+	char *formatted, **numbers;
+	GSList *tels = NULL;
+	int i, n;
 
 	if (reply == NULL || num_fields < 0)
 		goto done;
@@ -1397,8 +1410,14 @@ static int add_to_cache(const char **reply, int num_fields, void *user_data)
 			!g_str_equal(reply[0], TRACKER_DEFAULT_CONTACT_ME))
 		return 0;
 
+	/* Contacts list concatenates all numbers of the contact */
+	numbers = g_strsplit(reply[7], "\30", -1);
+	for (n = 0; numbers[n]; n++)
+		if (numbers[n][0] != '\0')
+			tels = g_slist_append(tels, numbers[n]);
+
 	if (i == 7)
-		formatted = g_strdup(reply[7]);
+		formatted = g_strdup(numbers[0]);
 	else if (i == 6)
 		formatted = g_strdup(reply[6]);
 	else
@@ -1409,12 +1428,14 @@ static int add_to_cache(const char **reply, int num_fields, void *user_data)
 	/* The owner vCard must have the 0 handle */
 	if (strcmp(reply[0], TRACKER_DEFAULT_CONTACT_ME) == 0)
 		data->entry_cb(reply[0], 0, formatted, "",
-						reply[6], data->user_data);
+						tels, data->user_data);
 	else
 		data->entry_cb(reply[0], PHONEBOOK_INVALID_HANDLE, formatted,
-					"", reply[6], data->user_data);
+					"", tels, data->user_data);
 
 	g_free(formatted);
+	g_slist_free(tels);
+	g_strfreev(numbers);
 
 	return 0;
 
@@ -1439,6 +1460,74 @@ int phonebook_init(void)
 
 void phonebook_exit(void)
 {
+	phonebook_set_change_notification(NULL, NULL);
+}
+
+static gboolean graph_updated(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	const char *class;
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &class,
+							DBUS_TYPE_INVALID))
+		return TRUE;
+
+	DBG("class %s", class);
+
+	if (change_cb == NULL)
+		return TRUE;
+
+	/* Tracker doesn't tell which properties changed */
+	if (g_str_has_suffix(class, TRACKER_CONTACT_CLASS)) {
+		change_cb("/telecom/pb", TRUE, change_user_data);
+	} else if (g_str_has_suffix(class, TRACKER_CALL_CLASS)) {
+		change_cb("/telecom/ich", TRUE, change_user_data);
+		change_cb("/telecom/och", TRUE, change_user_data);
+		change_cb("/telecom/mch", TRUE, change_user_data);
+		change_cb("/telecom/cch", TRUE, change_user_data);
+	}
+
+	return TRUE;
+}
+
+int phonebook_set_change_notification(phonebook_change_cb cb,
+							void *user_data)
+{
+	change_cb = cb;
+	change_user_data = user_data;
+
+	if (cb == NULL) {
+		if (graph_watch > 0) {
+			g_dbus_remove_watch(dbus_conn, graph_watch);
+			graph_watch = 0;
+		}
+
+		if (dbus_conn != NULL) {
+			dbus_connection_unref(dbus_conn);
+			dbus_conn = NULL;
+		}
+
+		return 0;
+	}
+
+	if (graph_watch > 0)
+		return 0;
+
+	if (dbus_conn == NULL)
+		dbus_conn = g_dbus_setup_bus(DBUS_BUS_SESSION, NULL, NULL);
+
+	if (dbus_conn == NULL)
+		return -EIO;
+
+	graph_watch = g_dbus_add_signal_watch(dbus_conn, TRACKER_SERVICE,
+					TRACKER_RESOURCES_PATH,
+					TRACKER_RESOURCES_INTERFACE,
+					"GraphUpdated", graph_updated,
+					NULL, NULL);
+	if (graph_watch == 0)
+		return -EIO;
+
+	return 0;
 }
 
 char *phonebook_set_folder(const char *current_folder, const char *new_folder,
@@ -1600,7 +1689,8 @@ void *phonebook_pull(const char *name, const struct apparam_field *params,
 	return data;
 }
 
-int phonebook_pull_read(void *request)
+int phonebook_pull_read(void *request, unsigned int max_vcards,
+							size_t max_bytes)
 {
 	struct phonebook_data *data = request;
 	reply_list_foreach_t pull_cb;
@@ -1612,6 +1702,8 @@ int phonebook_pull_read(void *request)
 	if (!data)
 		return -ENOENT;
 
+	data->vcard_part_max = max_vcards;
+
 	data->newmissedcalls = 0;
 
 	if (g_strcmp0(data->req_name, "/telecom/mch.vcf") == 0 &&
@@ -26,7 +26,8 @@
 	"<?xml version=\"1.0\"?>" EOL\
 	"<!DOCTYPE vcard-listing SYSTEM \"vcard-listing.dtd\">" EOL\
 	"<vCard-listing version=\"1.0\">" EOL
-#define VCARD_LISTING_ELEMENT "<card handle = \"%d.vcf\" name = \"%s\"/>" EOL
+/* Typical length of a <card/> element, used to pre-size listings */
+#define VCARD_LISTING_ELEMENT_SIZE 48
 #define VCARD_LISTING_END "</vCard-listing>"
 
 struct apparam_field {
@@ -54,12 +55,14 @@ typedef void (*phonebook_cb) (const char *buffer, size_t bufsize,
 
 /*
  * Interface between the PBAP core and backends to
- * append a new entry in the PBAP folder cache.
+ * append a new entry in the PBAP folder cache. tels is a list of
+ * all the numbers (const char *) of the entry, it is not kept by
+ * the PBAP core.
  */
 #define PHONEBOOK_INVALID_HANDLE 0xffffffff
 typedef void (*phonebook_entry_cb) (const char *id, uint32_t handle,
 					const char *name, const char *sound,
-					const char *tel, void *user_data);
+					GSList *tels, void *user_data);
 
 /*
  * After notify all entries to PBAP core, the backend
@@ -67,10 +70,27 @@ typedef void (*phonebook_entry_cb) (const char *id, uint32_t handle,
  */
 typedef void (*phonebook_cache_ready_cb) (void *user_data);
 
+/*
+ * Interface used by backends to notify the PBAP core that contacts in a
+ * folder (e.g. "/telecom/pb") were added, removed or modified. secondary
+ * shall be TRUE when the change may affect the N, FN, TEL, EMAIL or MAILER
+ * properties, backends unable to tell the difference shall pass TRUE.
+ */
+typedef void (*phonebook_change_cb) (const char *folder, gboolean secondary,
+							void *user_data);
 
 int phonebook_init(void);
 void phonebook_exit(void);
 
+/*
+ * Registers the function called whenever the backend detects a change in
+ * the phonebook. The PBAP core uses it to maintain the folder version
+ * counters. To unregister call this with cb set to NULL. Backends which
+ * are not able to detect changes may ignore the registration.
+ */
+int phonebook_set_change_notification(phonebook_change_cb cb,
+							void *user_data);
+
 /*
  * Changes the current folder in the phonebook back-end. The PBAP core
  * doesn't validate or restrict the possible values for the folders,
@@ -92,17 +112,65 @@ char *phonebook_set_folder(const char *current_folder,
 void *phonebook_pull(const char *name, const struct apparam_field *params,
 				phonebook_cb cb, void *user_data, int *err);
 
+/*
+ * Part bounds used by the PBAP and IrMC cores, small enough to keep the
+ * memory needed for a slow client low while amortizing backend queries.
+ */
+#define PHONEBOOK_PART_VCARDS	50
+#define PHONEBOOK_PART_SIZE	(32 * 1024)
+
 /*
  * phonebook_pull_read should be used to start getting results from back-end.
- * The back-end can return data as one response or can return it many parts.
- * After obtaining one part, PBAP core need to call phonebook_pull_read with
- * the same request again to get more results from back-end.
+ * Each call produces exactly one asynchronous phonebook_cb invocation,
+ * carrying at most max_vcards vCards and stopping once max_bytes have been
+ * collected (0 means no bound, a single vCard is always delivered whole).
+ * lastpart is set on the final part, otherwise the back-end keeps its
+ * position and waits until PBAP core calls phonebook_pull_read with the
+ * same request again. The pace of the client is therefore the pace of the
+ * back-end. Requests with MaxListCount set to zero are answered in a
+ * single part carrying only the number of vCards.
  * The back-end MUST return only the content based on the application
  * parameters requested by the client.
  *
  * Returns error code or 0 in case of success
  */
-int phonebook_pull_read(void *request);
+int phonebook_pull_read(void *request, unsigned int max_vcards,
+							size_t max_bytes);
+
+/*
+ * Prefetch helpers for PBAP and IrMC, which ask for the next part while
+ * the current one is being sent. phonebook_pull_next requests a part of
+ * PHONEBOOK_PART_SIZE and sets *reading, to be cleared by the phonebook_cb.
+ * phonebook_pull_next_later schedules func to do so once the running
+ * phonebook_cb has returned, unless *id already holds a pending source;
+ * func MUST reset *id.
+ */
+int phonebook_pull_next(void *request, gboolean *reading);
+void phonebook_pull_next_later(guint *id, GSourceFunc func, void *user_data);
+
+/*
+ * Bookkeeping of the parts received from the back-end and not yet sent,
+ * used by the PBAP core to keep up to depth parts (and max_size bytes)
+ * requested ahead of the client. phonebook_prefetch_received is called
+ * from the phonebook_cb and schedules func like phonebook_pull_next_later;
+ * phonebook_prefetch_consume drops the bytes handed to the client.
+ */
+struct phonebook_prefetch {
+	GQueue *parts;		/* Sizes of the parts not sent yet */
+	size_t buffered;
+	gboolean reading;
+	gboolean lastpart;
+	guint id;
+};
+
+void phonebook_prefetch_init(struct phonebook_prefetch *pf);
+void phonebook_prefetch_clear(struct phonebook_prefetch *pf);
+gboolean phonebook_prefetch_needed(struct phonebook_prefetch *pf,
+					unsigned int depth, size_t max_size);
+void phonebook_prefetch_received(struct phonebook_prefetch *pf, size_t len,
+					gboolean lastpart, GSourceFunc func,
+					void *user_data);
+void phonebook_prefetch_consume(struct phonebook_prefetch *pf, size_t len);
 
 /*
  * Function used to retrieve a contact from the backend. Only contacts
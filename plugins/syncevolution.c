@@ -283,7 +283,7 @@ static void synce_disconnect(struct obex_session *os, void *user_data)
 }
 
 static void *synce_open(const char *name, int oflag, mode_t mode,
-				void *user_data, size_t *size, int *err)
+				void *user_data, int64_t *size, int *err)
 {
 	struct synce_context *context = user_data;
 
@@ -29,10 +29,16 @@
 #include <stdint.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <gdbus.h>
 
+#include "obexd.h"
+#include "log.h"
 #include "vcard.h"
 #include "glib-helper.h"
 
@@ -84,6 +90,24 @@
 #define QP_SELECT "\n!\"#$=@[\\]^`{|}~"
 #define ASCII_LIMIT 0x7F
 
+/* Photos are base64 encoded while being read, a chunk at a time */
+#define PHOTO_LINE_LEN 75
+#define PHOTO_READ_SIZE (3 * 1024)
+#define PHOTO_ENCODED_SIZE (PHOTO_READ_SIZE / 3 * 4 + 4)
+
+/* Larger images are left as a reference instead of bloating the pull */
+#define PHOTO_MAX_SIZE (128 * 1024)
+
+/* Once over the cap the cache is trimmed down to three quarters of it */
+#ifndef PHOTO_CACHE_MAX
+#define PHOTO_CACHE_MAX (8 * 1024 * 1024)
+#endif
+#define PHOTO_CACHE_LOW (PHOTO_CACHE_MAX / 4 * 3)
+
+/* Running size of the cache folder, -1 until it has been scanned */
+static char *photo_cache_dir = NULL;
+static off_t photo_cache_size = -1;
+
 /* according to RFC 2425, the output string may need folding */
 static void vcard_printf(GString *str, const char *fmt, ...)
 {
@@ -784,6 +808,364 @@ static void vcard_printf_end(GString *vcards)
 	vcard_printf(vcards, "END:VCARD");
 }
 
+static const char *photo_type(const uint8_t *data, size_t len)
+{
+	if (len >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+		return "JPEG";
+
+	if (len >= 4 && memcmp(data, "\x89PNG", 4) == 0)
+		return "PNG";
+
+	if (len >= 4 && memcmp(data, "GIF8", 4) == 0)
+		return "GIF";
+
+	return NULL;
+}
+
+static void photo_append_folded(GString *vcards, size_t *column,
+					const char *data, size_t len)
+{
+	while (len > 0) {
+		size_t n;
+
+		if (*column >= PHOTO_LINE_LEN) {
+			g_string_append(vcards, "\r\n ");
+			*column = 1;
+		}
+
+		n = MIN(len, PHOTO_LINE_LEN - *column);
+		g_string_append_len(vcards, data, n);
+
+		*column += n;
+		data += n;
+		len -= n;
+	}
+}
+
+static int photo_encode(GString *vcards, uint8_t format, int fd)
+{
+	uint8_t buf[PHOTO_READ_SIZE];
+	char encoded[PHOTO_ENCODED_SIZE];
+	const char *type;
+	size_t column;
+	ssize_t len;
+	gsize n;
+	int state = 0, save = 0;
+
+	len = read(fd, buf, sizeof(buf));
+	if (len < 0)
+		return -errno;
+
+	type = photo_type(buf, len);
+	if (type == NULL)
+		return -EINVAL;
+
+	column = vcards->len;
+
+	if (format == FORMAT_VCARD30)
+		g_string_append_printf(vcards, "PHOTO;ENCODING=b;TYPE=%s:",
+									type);
+	else
+		g_string_append_printf(vcards, "PHOTO;ENCODING=BASE64;TYPE=%s:",
+									type);
+
+	column = vcards->len - column;
+
+	while (len > 0) {
+		n = g_base64_encode_step(buf, len, FALSE, encoded, &state,
+									&save);
+		photo_append_folded(vcards, &column, encoded, n);
+
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0)
+			return -errno;
+	}
+
+	n = g_base64_encode_close(FALSE, encoded, &state, &save);
+	photo_append_folded(vcards, &column, encoded, n);
+
+	g_string_append(vcards, "\r\n");
+
+	/* vCard 2.1 ends BASE64 values with an empty line */
+	if (format == FORMAT_VCARD21)
+		g_string_append(vcards, "\r\n");
+
+	return 0;
+}
+
+static char *photo_cache_path(const char *dir, const char *path,
+							uint8_t format)
+{
+	char *checksum, *name, *cache;
+
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, path, -1);
+	name = g_strdup_printf("%s.%s", checksum,
+				format == FORMAT_VCARD30 ? "30" : "21");
+	cache = g_build_filename(dir, name, NULL);
+
+	g_free(name);
+	g_free(checksum);
+
+	return cache;
+}
+
+/* Cache entries start with the mtime and size of the source image */
+static gboolean photo_cache_load(GString *vcards, const char *cache,
+							struct stat *st)
+{
+	char buf[PHOTO_READ_SIZE];
+	char header[64];
+	size_t start = vcards->len;
+	ssize_t len;
+	int fd, hlen;
+
+	fd = open(cache, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+
+	hlen = snprintf(header, sizeof(header), "%ld %lld\n",
+				(long) st->st_mtime, (long long) st->st_size);
+
+	len = read(fd, buf, hlen);
+	if (len != hlen || memcmp(buf, header, hlen) != 0)
+		goto fail;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		g_string_append_len(vcards, buf, len);
+
+	if (len < 0)
+		goto fail;
+
+	close(fd);
+
+	return TRUE;
+
+fail:
+	g_string_truncate(vcards, start);
+	close(fd);
+
+	return FALSE;
+}
+
+static off_t photo_cache_scan(DIR *dp, GSList **entries)
+{
+	struct dirent *ep;
+	off_t total = 0;
+
+	while ((ep = readdir(dp))) {
+		struct stat st;
+
+		if (ep->d_name[0] == '.')
+			continue;
+
+		if (fstatat(dirfd(dp), ep->d_name, &st, 0) < 0)
+			continue;
+
+		total += st.st_size;
+
+		if (entries == NULL)
+			continue;
+
+		/* Oldest first, entries are rewritten when their source is */
+		*entries = g_slist_prepend(*entries,
+					g_strdup_printf("%020ld %s",
+					(long) st.st_mtime, ep->d_name));
+	}
+
+	if (entries != NULL)
+		*entries = g_slist_sort(*entries, (GCompareFunc) strcmp);
+
+	return total;
+}
+
+static void photo_cache_trim(const char *dir)
+{
+	GSList *entries = NULL, *l;
+	off_t total;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return;
+
+	total = photo_cache_scan(dp, &entries);
+
+	for (l = entries; l && total > PHOTO_CACHE_LOW; l = l->next) {
+		const char *name = strchr(l->data, ' ') + 1;
+		struct stat st;
+
+		if (fstatat(dirfd(dp), name, &st, 0) < 0)
+			continue;
+
+		if (unlinkat(dirfd(dp), name, 0) == 0)
+			total -= st.st_size;
+	}
+
+	DBG("%s: %lld bytes left", dir, (long long) total);
+
+	photo_cache_size = total;
+
+	g_slist_free_full(entries, g_free);
+	closedir(dp);
+}
+
+static void photo_cache_account(const char *dir, off_t delta)
+{
+	DIR *dp;
+
+	if (g_strcmp0(photo_cache_dir, dir) != 0) {
+		g_free(photo_cache_dir);
+		photo_cache_dir = g_strdup(dir);
+		photo_cache_size = -1;
+	}
+
+	/* Scanned once, later stores only add their own size */
+	if (photo_cache_size < 0) {
+		dp = opendir(dir);
+		if (dp == NULL)
+			return;
+
+		photo_cache_size = photo_cache_scan(dp, NULL);
+		closedir(dp);
+	} else
+		photo_cache_size += delta;
+
+	if (photo_cache_size > PHOTO_CACHE_MAX)
+		photo_cache_trim(dir);
+}
+
+static void photo_cache_store(const char *dir, const char *cache,
+				struct stat *st, const char *data, size_t len)
+{
+	struct stat old;
+	off_t size;
+	char *tmp;
+	FILE *fp;
+	int hlen;
+
+	tmp = g_strconcat(cache, ".tmp", NULL);
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL)
+		goto done;
+
+	hlen = fprintf(fp, "%ld %lld\n", (long) st->st_mtime,
+						(long long) st->st_size);
+	fwrite(data, 1, len, fp);
+
+	/* A stale entry for the same source is replaced */
+	if (stat(cache, &old) < 0)
+		old.st_size = 0;
+
+	if (fclose(fp) != 0 || hlen < 0 || rename(tmp, cache) < 0) {
+		unlink(tmp);
+		goto done;
+	}
+
+	size = hlen + len;
+	photo_cache_account(dir, size - old.st_size);
+
+done:
+	g_free(tmp);
+}
+
+/*
+ * Photo references come from contact data, which the remote device may
+ * have written, so only files below the configured folder are read.
+ */
+static char *photo_resolve(const char *photo)
+{
+	const char *folder = obex_option_photo_folder();
+	char *path, *real, *base, *ret = NULL;
+	size_t len;
+
+	if (folder == NULL)
+		return NULL;
+
+	if (g_str_has_prefix(photo, "file://"))
+		path = g_filename_from_uri(photo, NULL, NULL);
+	else if (g_path_is_absolute(photo))
+		path = g_strdup(photo);
+	else
+		return NULL;
+
+	if (path == NULL)
+		return NULL;
+
+	real = realpath(path, NULL);
+	base = realpath(folder, NULL);
+	if (real == NULL || base == NULL)
+		goto done;
+
+	len = strlen(base);
+	if (strncmp(real, base, len) == 0 && real[len] == '/')
+		ret = g_strdup(real);
+	else
+		DBG("%s is outside of %s", path, base);
+
+done:
+	free(base);
+	free(real);
+	g_free(path);
+
+	return ret;
+}
+
+static gboolean vcard_printf_photo(GString *vcards, uint8_t format,
+							const char *photo)
+{
+	const char *dir = obex_option_photo_cache();
+	char *path, *cache = NULL;
+	size_t start = vcards->len;
+	gboolean ret = FALSE;
+	struct stat st;
+	int fd, err;
+
+	path = photo_resolve(photo);
+	if (path == NULL)
+		return FALSE;
+
+	/* Resolved already, a link showing up now is not followed */
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		goto done;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+						st.st_size > PHOTO_MAX_SIZE)
+		goto done;
+
+	if (dir != NULL) {
+		cache = photo_cache_path(dir, path, format);
+
+		if (photo_cache_load(vcards, cache, &st)) {
+			ret = TRUE;
+			goto done;
+		}
+	}
+
+	err = photo_encode(vcards, format, fd);
+	if (err < 0) {
+		DBG("%s: %s(%d)", path, strerror(-err), -err);
+		g_string_truncate(vcards, start);
+		goto done;
+	}
+
+	if (cache != NULL)
+		photo_cache_store(dir, cache, &st, vcards->str + start,
+						vcards->len - start);
+
+	ret = TRUE;
+
+done:
+	if (fd >= 0)
+		close(fd);
+
+	g_free(cache);
+	g_free(path);
+
+	return ret;
+}
+
 void phonebook_add_contact(GString *vcards, struct phonebook_contact *contact,
 					uint64_t filter, uint8_t format)
 {
@@ -861,7 +1243,8 @@ void phonebook_add_contact(GString *vcards, struct phonebook_contact *contact,
 		}
 	}
 
-	if (filter & FILTER_PHOTO && *contact->photo)
+	if (filter & FILTER_PHOTO && *contact->photo &&
+			!vcard_printf_photo(vcards, format, contact->photo))
 		vcard_printf_tag(vcards, format, "PHOTO", NULL,
 							contact->photo);
 
@@ -0,0 +1,76 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2011  Intel Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+
+#include "fileio.h"
+
+/* Largest count a single sendfile call takes, see Makefile.am for tests */
+#ifndef SENDFILE_MAX
+#define SENDFILE_MAX	0x7ffff000
+#endif
+
+gboolean fileio_length_fits(int64_t size)
+{
+	return size >= 0 && size <= UINT32_MAX;
+}
+
+int fileio_preallocate(int fd, int64_t size)
+{
+	if (size <= 0)
+		return 0;
+
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int fileio_sendfile(int out_fd, int in_fd, off_t *offset, int64_t count)
+{
+	while (count > 0) {
+		ssize_t ret;
+
+		ret = sendfile(out_fd, in_fd, offset, MIN(count, SENDFILE_MAX));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		if (ret == 0)
+			return -EIO;
+
+		count -= ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2011  Intel Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Object sizes are 64 bit, shared by the server and the client so both
+ * handle objects above 4 GiB the same way.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <glib.h>
+
+/* Length is a 32 bit header, bigger objects go out without it */
+gboolean fileio_length_fits(int64_t size);
+
+/* Reserves size bytes for fd without changing its apparent size, so an
+ * interrupted transfer isn't zero padded. Returns 0 or -errno.
+ */
+int fileio_preallocate(int fd, int64_t size);
+
+/* Copies count bytes with as many sendfile calls as needed. offset works
+ * as for sendfile. Returns 0, -EIO if in_fd ends early, or -errno.
+ */
+int fileio_sendfile(int out_fd, int in_fd, off_t *offset, int64_t count);
@@ -27,19 +27,230 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
 #include <syslog.h>
+#include <time.h>
 
 #include <glib.h>
 
 #include "log.h"
 
+/*
+ * Messages are formatted by the caller into a bounded ring and written out
+ * by a separate thread, so a slow syslog socket or disk never stalls the
+ * main loop. When the ring is full messages are dropped and counted.
+ */
+#define LOG_QUEUE_SIZE		1024	/* Must be a power of two */
+#define LOG_MSG_MAX		512
+#define LOG_WAIT_USEC		(G_USEC_PER_SEC / 2)
+
+enum log_target {
+	LOG_TARGET_SYSLOG,
+	LOG_TARGET_JOURNAL,
+	LOG_TARGET_FILE,
+};
+
+struct log_slot {
+	volatile gint seq;
+	int priority;
+	char msg[LOG_MSG_MAX];
+};
+
+static struct log_slot log_queue[LOG_QUEUE_SIZE];
+static volatile gint enqueue_pos = 0;
+static volatile gint dequeue_pos = 0;
+static volatile gint dropped = 0;
+static volatile gint writer_sleeping = 0;
+static volatile gint writer_quit = 0;
+static guint64 dropped_total = 0;
+
+static GThread *writer = NULL;
+static GMutex *writer_mutex = NULL;
+static GCond *writer_cond = NULL;
+
+static enum log_target target = LOG_TARGET_SYSLOG;
+static char *log_path = NULL;
+static int log_fd = -1;
+static const char *log_label = NULL;
+
+static void log_write(int priority, const char *msg)
+{
+	char prefix[64];
+	struct tm tm;
+	time_t now;
+
+	switch (target) {
+	case LOG_TARGET_SYSLOG:
+		syslog(priority, "%s", msg);
+		break;
+	case LOG_TARGET_JOURNAL:
+		/* journald reads the level from a <N> prefix on stderr,
+		 * which main() only allows together with --nodaemon */
+		dprintf(STDERR_FILENO, "<%d>%s\n", priority, msg);
+		break;
+	case LOG_TARGET_FILE:
+		now = time(NULL);
+		localtime_r(&now, &tm);
+		strftime(prefix, sizeof(prefix), "%b %d %H:%M:%S", &tm);
+		dprintf(log_fd, "%s %s[%d]: %s\n", prefix, log_label,
+							getpid(), msg);
+		break;
+	}
+}
+
+static gboolean log_dequeue(int *priority, char *msg)
+{
+	struct log_slot *slot;
+	gint pos, seq, diff;
+
+	for (;;) {
+		pos = g_atomic_int_get(&dequeue_pos);
+		slot = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+		seq = g_atomic_int_get(&slot->seq);
+		diff = seq - (pos + 1);
+
+		if (diff < 0)
+			return FALSE;
+
+		if (diff > 0)
+			continue;
+
+		if (g_atomic_int_compare_and_exchange(&dequeue_pos, pos,
+								pos + 1))
+			break;
+	}
+
+	*priority = slot->priority;
+	memcpy(msg, slot->msg, LOG_MSG_MAX);
+
+	g_atomic_int_set(&slot->seq, pos + LOG_QUEUE_SIZE);
+
+	return TRUE;
+}
+
+static void log_report_dropped(void)
+{
+	char msg[LOG_MSG_MAX];
+	gint count;
+
+	do {
+		count = g_atomic_int_get(&dropped);
+	} while (count > 0 &&
+		!g_atomic_int_compare_and_exchange(&dropped, count, 0));
+
+	if (count <= 0)
+		return;
+
+	dropped_total += count;
+
+	snprintf(msg, sizeof(msg), "%d log messages dropped (%" G_GUINT64_FORMAT
+					" total)", count, dropped_total);
+	log_write(LOG_WARNING, msg);
+}
+
+static unsigned int log_drain(void)
+{
+	char msg[LOG_MSG_MAX];
+	unsigned int count = 0;
+	int priority;
+
+	while (log_dequeue(&priority, msg)) {
+		log_write(priority, msg);
+		count++;
+	}
+
+	log_report_dropped();
+
+	return count;
+}
+
+static gpointer writer_thread(gpointer data)
+{
+	GTimeVal timeout;
+
+	while (!g_atomic_int_get(&writer_quit)) {
+		if (log_drain() > 0)
+			continue;
+
+		g_mutex_lock(writer_mutex);
+
+		g_atomic_int_set(&writer_sleeping, 1);
+
+		/* Recheck now that producers will signal us */
+		if (g_atomic_int_get(&enqueue_pos) ==
+					g_atomic_int_get(&dequeue_pos) &&
+					!g_atomic_int_get(&writer_quit)) {
+			g_get_current_time(&timeout);
+			g_time_val_add(&timeout, LOG_WAIT_USEC);
+			g_cond_timed_wait(writer_cond, writer_mutex, &timeout);
+		}
+
+		g_atomic_int_set(&writer_sleeping, 0);
+
+		g_mutex_unlock(writer_mutex);
+	}
+
+	log_drain();
+
+	return NULL;
+}
+
+static void log_enqueue(int priority, const char *format, va_list ap)
+{
+	struct log_slot *slot;
+	gint pos, seq, diff;
+
+	if (writer == NULL) {
+		char msg[LOG_MSG_MAX];
+
+		vsnprintf(msg, sizeof(msg), format, ap);
+		log_write(priority, msg);
+		return;
+	}
+
+	for (;;) {
+		pos = g_atomic_int_get(&enqueue_pos);
+		slot = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+		seq = g_atomic_int_get(&slot->seq);
+		diff = seq - pos;
+
+		if (diff < 0) {
+			g_atomic_int_inc(&dropped);
+			return;
+		}
+
+		if (diff > 0)
+			continue;
+
+		if (g_atomic_int_compare_and_exchange(&enqueue_pos, pos,
+								pos + 1))
+			break;
+	}
+
+	slot->priority = priority;
+	vsnprintf(slot->msg, sizeof(slot->msg), format, ap);
+
+	g_atomic_int_set(&slot->seq, pos + 1);
+
+	if (g_atomic_int_get(&writer_sleeping)) {
+		g_mutex_lock(writer_mutex);
+		g_cond_signal(writer_cond);
+		g_mutex_unlock(writer_mutex);
+	}
+}
+
 void info(const char *format, ...)
 {
 	va_list ap;
 
 	va_start(ap, format);
 
-	vsyslog(LOG_INFO, format, ap);
+	log_enqueue(LOG_INFO, format, ap);
 
 	va_end(ap);
 }
@@ -50,7 +261,7 @@ void error(const char *format, ...)
 
 	va_start(ap, format);
 
-	vsyslog(LOG_ERR, format, ap);
+	log_enqueue(LOG_ERR, format, ap);
 
 	va_end(ap);
 }
@@ -61,11 +272,139 @@ void obex_debug(const char *format, ...)
 
 	va_start(ap, format);
 
-	vsyslog(LOG_DEBUG, format, ap);
+	log_enqueue(LOG_DEBUG, format, ap);
 
 	va_end(ap);
 }
 
+void __obex_log_flush(void)
+{
+	log_drain();
+}
+
+/*
+ * Only async-signal-safe calls are allowed from here: messages still in the
+ * ring are copied out with write(2) to stderr, or to the log file, since
+ * neither syslog() nor the stdio based formatting may be used.
+ */
+static char crash_buf[LOG_MSG_MAX + 8];
+
+static void crash_write(int fd, int priority, const char *msg)
+{
+	size_t len = 0, i;
+
+	if (target == LOG_TARGET_JOURNAL) {
+		crash_buf[len++] = '<';
+		crash_buf[len++] = '0' + (priority & 7);
+		crash_buf[len++] = '>';
+	}
+
+	for (i = 0; i < LOG_MSG_MAX && msg[i] != '\0'; i++)
+		crash_buf[len++] = msg[i];
+
+	crash_buf[len++] = '\n';
+
+	if (write(fd, crash_buf, len) < 0)
+		return;
+}
+
+static void sig_crash(int sig)
+{
+	struct log_slot *slot;
+	gint pos, end;
+	int fd;
+
+	/* Best effort: get the last words out before dying */
+	fd = target == LOG_TARGET_FILE ? log_fd : STDERR_FILENO;
+
+	pos = g_atomic_int_get(&dequeue_pos);
+	end = g_atomic_int_get(&enqueue_pos);
+
+	for (; pos != end; pos++) {
+		slot = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+
+		/* Stop at a slot a producer has not finished yet */
+		if (g_atomic_int_get(&slot->seq) != pos + 1)
+			break;
+
+		crash_write(fd, slot->priority, slot->msg);
+	}
+
+	/* SA_RESETHAND restored the default action */
+	raise(sig);
+}
+
+int __obex_log_set_target(const char *name)
+{
+	if (name == NULL || g_str_equal(name, "syslog"))
+		target = LOG_TARGET_SYSLOG;
+	else if (g_str_equal(name, "journal"))
+		target = LOG_TARGET_JOURNAL;
+	else if (g_str_has_prefix(name, "file:") && name[5] != '\0') {
+		target = LOG_TARGET_FILE;
+		g_free(log_path);
+		log_path = g_strdup(name + 5);
+	} else
+		return -EINVAL;
+
+	return 0;
+}
+
+static void log_start_writer(void)
+{
+	struct sigaction sa;
+	int i;
+
+	if (!g_thread_supported())
+		return;
+
+	for (i = 0; i < LOG_QUEUE_SIZE; i++)
+		log_queue[i].seq = i;
+
+	enqueue_pos = 0;
+	dequeue_pos = 0;
+	writer_quit = 0;
+
+	writer_mutex = g_mutex_new();
+	writer_cond = g_cond_new();
+
+	writer = g_thread_create(writer_thread, NULL, TRUE, NULL);
+	if (writer == NULL) {
+		g_cond_free(writer_cond);
+		g_mutex_free(writer_mutex);
+		return;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_crash;
+	sa.sa_flags = SA_RESETHAND;
+	sigaction(SIGSEGV, &sa, NULL);
+	sigaction(SIGBUS, &sa, NULL);
+	sigaction(SIGFPE, &sa, NULL);
+	sigaction(SIGABRT, &sa, NULL);
+}
+
+static void log_stop_writer(void)
+{
+	if (writer == NULL)
+		return;
+
+	g_atomic_int_set(&writer_quit, 1);
+
+	g_mutex_lock(writer_mutex);
+	g_cond_signal(writer_cond);
+	g_mutex_unlock(writer_mutex);
+
+	g_thread_join(writer);
+	writer = NULL;
+
+	g_cond_free(writer_cond);
+	g_mutex_free(writer_mutex);
+
+	/* Anything logged while the writer was exiting */
+	log_drain();
+}
+
 extern struct obex_debug_desc __start___debug[];
 extern struct obex_debug_desc __stop___debug[];
 
@@ -123,14 +462,38 @@ void __obex_log_init(const char *label, const char *debug, int detach)
 	if (!detach)
 		option |= LOG_PERROR;
 
+	log_label = label;
+
+	if (target == LOG_TARGET_FILE) {
+		log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND |
+							O_CLOEXEC, 0600);
+		if (log_fd < 0) {
+			fprintf(stderr, "Can't open log file %s: %s\n",
+						log_path, strerror(errno));
+			target = LOG_TARGET_SYSLOG;
+		}
+	}
+
 	openlog(label, option, LOG_DAEMON);
 
-	syslog(LOG_INFO, "%s daemon %s", label, VERSION);
+	log_start_writer();
+
+	info("%s daemon %s", label, VERSION);
 }
 
 void __obex_log_cleanup(void)
 {
+	log_stop_writer();
+
 	closelog();
 
+	if (log_fd >= 0) {
+		close(log_fd);
+		log_fd = -1;
+	}
+
+	g_free(log_path);
+	log_path = NULL;
+
 	g_strfreev(enabled);
 }
@@ -26,8 +26,10 @@ void error(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
 void obex_debug(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
+int __obex_log_set_target(const char *name);
 void __obex_log_init(const char *label, const char *debug, int detach);
 void __obex_log_cleanup(void);
+void __obex_log_flush(void);
 void __obex_log_enable_debug(void);
 
 struct obex_debug_desc {
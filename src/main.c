@@ -76,6 +76,52 @@ static char *option_noplugin = NULL;
 static gboolean option_autoaccept = FALSE;
 static gboolean option_symlinks = FALSE;
 
+static int option_pbap_prefetch = 1;
+
+static int option_mem_soft_limit = 0;
+static int option_mem_hard_limit = 0;
+
+static char *option_log_target = NULL;
+
+static char *option_photo_cache = NULL;
+static char *option_photo_folder = NULL;
+
+static int option_idle_timeout = 0;
+static int option_stall_timeout = 0;
+
+static int option_rate_limit = 0;
+static int option_peer_rate_limit = 0;
+
+/* Per service settings, -1 falls back to the global option */
+static struct service_option {
+	const char *name;
+	uint16_t service;
+	int idle_timeout;
+	int rate_limit;
+} service_options[] = {
+	{ "opp",		OBEX_OPP,		-1, -1 },
+	{ "ftp",		OBEX_FTP,		-1, -1 },
+	{ "bip",		OBEX_BIP,		-1, -1 },
+	{ "pbap",		OBEX_PBAP,		-1, -1 },
+	{ "irmc",		OBEX_IRMC,		-1, -1 },
+	{ "pcsuite",		OBEX_PCSUITE,		-1, -1 },
+	{ "syncevolution",	OBEX_SYNCEVOLUTION,	-1, -1 },
+	{ "mas",		OBEX_MAS,		-1, -1 },
+	{ NULL }
+};
+
+static struct service_option *service_option_find(const char *name)
+{
+	int i;
+
+	for (i = 0; service_options[i].name; i++) {
+		if (g_ascii_strcasecmp(service_options[i].name, name) == 0)
+			return &service_options[i];
+	}
+
+	return NULL;
+}
+
 static gboolean parse_debug(const char *key, const char *value,
 				gpointer user_data, GError **error)
 {
@@ -87,6 +133,80 @@ static gboolean parse_debug(const char *key, const char *value,
 	return TRUE;
 }
 
+static gboolean parse_number(const char *str, int *number)
+{
+	char *end;
+	long val;
+
+	val = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || val < 0 || val > G_MAXINT)
+		return FALSE;
+
+	*number = val;
+
+	return TRUE;
+}
+
+/* Parses [SERVICE=]VALUE,... into the global and per service values */
+static gboolean parse_service_list(const char *value, int *global,
+							size_t offset)
+{
+	char **tokens, **t;
+	gboolean ret = TRUE;
+
+	tokens = g_strsplit(value, ",", 0);
+
+	for (t = tokens; *t && ret; t++) {
+		struct service_option *opt;
+		char *sep = strchr(*t, '=');
+
+		if (sep == NULL) {
+			ret = parse_number(*t, global);
+			continue;
+		}
+
+		*sep = '\0';
+
+		opt = service_option_find(*t);
+		if (opt == NULL) {
+			ret = FALSE;
+			break;
+		}
+
+		ret = parse_number(sep + 1, G_STRUCT_MEMBER_P(opt, offset));
+	}
+
+	g_strfreev(tokens);
+
+	return ret;
+}
+
+static gboolean parse_idle_timeout(const char *key, const char *value,
+				gpointer user_data, GError **error)
+{
+	if (parse_service_list(value, &option_idle_timeout,
+			G_STRUCT_OFFSET(struct service_option, idle_timeout)))
+		return TRUE;
+
+	g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+					"Invalid idle timeout %s", value);
+
+	return FALSE;
+}
+
+static gboolean parse_rate_limit(const char *key, const char *value,
+				gpointer user_data, GError **error)
+{
+	if (parse_service_list(value, &option_rate_limit,
+			G_STRUCT_OFFSET(struct service_option, rate_limit)))
+		return TRUE;
+
+	g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+					"Invalid rate limit %s", value);
+
+	return FALSE;
+}
+
 static GOptionEntry options[] = {
 	{ "nodaemon", 'n', G_OPTION_FLAG_REVERSE,
 				G_OPTION_ARG_NONE, &option_detach,
@@ -113,6 +233,42 @@ static GOptionEntry options[] = {
 				"Specify plugins to load", "NAME,..." },
 	{ "noplugin", 'P', 0, G_OPTION_ARG_STRING, &option_noplugin,
 				"Specify plugins not to load", "NAME,..." },
+	{ "pbap-prefetch", 0, 0, G_OPTION_ARG_INT, &option_pbap_prefetch,
+				"Number of phonebook parts requested from the "
+				"backend ahead of the client (0 disables)",
+				"NUM" },
+	{ "mem-soft-limit", 0, 0, G_OPTION_ARG_INT, &option_mem_soft_limit,
+				"Per session buffer budget in KiB above which "
+				"incoming data is throttled (0 disables)",
+				"KIB" },
+	{ "mem-hard-limit", 0, 0, G_OPTION_ARG_INT, &option_mem_hard_limit,
+				"Total buffer budget in KiB above which new "
+				"connections are refused (0 disables)", "KIB" },
+	{ "log-target", 0, 0, G_OPTION_ARG_STRING, &option_log_target,
+				"Where to write log messages: syslog, journal "
+				"(stderr, needs --nodaemon) or file:PATH",
+				"TARGET" },
+	{ "photo-cache", 0, 0, G_OPTION_ARG_STRING, &option_photo_cache,
+				"Folder used to cache encoded vCard photos",
+				"PATH" },
+	{ "photo-folder", 0, 0, G_OPTION_ARG_STRING, &option_photo_folder,
+				"Folder vCard photos may be read from to be "
+				"embedded (default: none)", "PATH" },
+	{ "idle-timeout", 0, 0, G_OPTION_ARG_CALLBACK, parse_idle_timeout,
+				"Seconds a session may stay idle before it is "
+				"closed, optionally per service as "
+				"e.g. pbap=600 (0 disables)",
+				"[SERVICE=]SECONDS,..." },
+	{ "stall-timeout", 0, 0, G_OPTION_ARG_INT, &option_stall_timeout,
+				"Seconds a transfer may make no progress "
+				"before it is aborted (0 disables)", "SECONDS" },
+	{ "rate-limit", 0, 0, G_OPTION_ARG_CALLBACK, parse_rate_limit,
+				"Per session send rate in KiB/s, optionally "
+				"per service as e.g. ftp=64 (0 disables)",
+				"[SERVICE=]KIBPS,..." },
+	{ "peer-rate-limit", 0, 0, G_OPTION_ARG_INT, &option_peer_rate_limit,
+				"Send rate in KiB/s shared by all sessions "
+				"to the same device (0 disables)", "KIBPS" },
 	{ NULL },
 };
 
@@ -136,6 +292,103 @@ const char *obex_option_capability(void)
 	return option_capability;
 }
 
+unsigned int obex_option_pbap_prefetch(void)
+{
+	return option_pbap_prefetch > 0 ? option_pbap_prefetch : 0;
+}
+
+size_t obex_option_mem_soft_limit(void)
+{
+	return option_mem_soft_limit > 0 ?
+				(size_t) option_mem_soft_limit * 1024 : 0;
+}
+
+size_t obex_option_mem_hard_limit(void)
+{
+	return option_mem_hard_limit > 0 ?
+				(size_t) option_mem_hard_limit * 1024 : 0;
+}
+
+const char *obex_option_photo_cache(void)
+{
+	return option_photo_cache;
+}
+
+const char *obex_option_photo_folder(void)
+{
+	return option_photo_folder;
+}
+
+static struct service_option *service_option_get(uint16_t service)
+{
+	int i;
+
+	for (i = 0; service_options[i].name; i++) {
+		if (service_options[i].service == service)
+			return &service_options[i];
+	}
+
+	return NULL;
+}
+
+unsigned int obex_option_idle_timeout(uint16_t service)
+{
+	struct service_option *opt = service_option_get(service);
+
+	if (opt && opt->idle_timeout >= 0)
+		return opt->idle_timeout;
+
+	return option_idle_timeout;
+}
+
+unsigned int obex_option_stall_timeout(void)
+{
+	return option_stall_timeout > 0 ? option_stall_timeout : 0;
+}
+
+size_t obex_option_rate_limit(uint16_t service)
+{
+	struct service_option *opt = service_option_get(service);
+
+	if (opt && opt->rate_limit >= 0)
+		return (size_t) opt->rate_limit * 1024;
+
+	return (size_t) option_rate_limit * 1024;
+}
+
+size_t obex_option_peer_rate_limit(void)
+{
+	return option_peer_rate_limit > 0 ?
+				(size_t) option_peer_rate_limit * 1024 : 0;
+}
+
+/* Rate limits can be changed at runtime, "peer" names the shared limit */
+int obex_option_set_rate_limit(const char *service, unsigned int kib)
+{
+	struct service_option *opt;
+
+	if (kib > G_MAXINT)
+		return -EINVAL;
+
+	if (service == NULL || service[0] == '\0') {
+		option_rate_limit = kib;
+		return 0;
+	}
+
+	if (g_ascii_strcasecmp(service, "peer") == 0) {
+		option_peer_rate_limit = kib;
+		return 0;
+	}
+
+	opt = service_option_find(service);
+	if (opt == NULL)
+		return -EINVAL;
+
+	opt->rate_limit = kib;
+
+	return 0;
+}
+
 static gboolean is_dir(const char *dir) {
 	struct stat st;
 
@@ -181,10 +434,9 @@ int main(int argc, char *argv[])
 	GError *err = NULL;
 	struct sigaction sa;
 
-#ifdef NEED_THREADS
+	/* Logging is done from a writer thread */
 	if (g_thread_supported() == FALSE)
 		g_thread_init(NULL);
-#endif
 
 	context = g_option_context_new(NULL);
 	g_option_context_add_main_entries(context, options, NULL);
@@ -200,6 +452,18 @@ int main(int argc, char *argv[])
 
 	g_option_context_free(context);
 
+	if (__obex_log_set_target(option_log_target) < 0) {
+		g_printerr("Invalid log target %s\n", option_log_target);
+		exit(EXIT_FAILURE);
+	}
+
+	/* daemon() points stderr at /dev/null */
+	if (option_detach == TRUE &&
+			g_strcmp0(option_log_target, "journal") == 0) {
+		g_printerr("The journal log target needs --nodaemon\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (option_detach == TRUE) {
 		if (daemon(0, 0)) {
 			perror("Can't start daemon");
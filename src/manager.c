@@ -43,6 +43,7 @@
 #include "log.h"
 #include "btio.h"
 #include "service.h"
+#include "filesystem.h"
 
 #define OPENOBEX_MANAGER_PATH "/"
 #define OPENOBEX_MANAGER_INTERFACE OPENOBEX_SERVICE ".Manager"
@@ -52,6 +53,9 @@
 
 #define TIMEOUT 60*1000 /* Timeout for user response (miliseconds) */
 
+/* Idle transfer objects kept registered for reuse */
+#define TRANSFER_POOL_MAX 8
+
 struct agent {
 	char *bus_name;
 	char *path;
@@ -61,10 +65,18 @@ struct agent {
 	unsigned int watch_id;
 };
 
+struct transfer_object {
+	char *path;
+	struct obex_session *os;
+};
+
 static struct agent *agent = NULL;
 
 static DBusConnection *connection = NULL;
 
+static GSList *transfer_pool = NULL;
+static unsigned int transfer_id = 0;
+
 static void agent_free(struct agent *agent)
 {
 	if (!agent)
@@ -131,6 +143,9 @@ static void dbus_message_iter_append_variant(DBusMessageIter *iter,
 	case DBUS_TYPE_UINT32:
 		sig = DBUS_TYPE_UINT32_AS_STRING;
 		break;
+	case DBUS_TYPE_UINT64:
+		sig = DBUS_TYPE_UINT64_AS_STRING;
+		break;
 	case DBUS_TYPE_BOOLEAN:
 		sig = DBUS_TYPE_BOOLEAN_AS_STRING;
 		break;
@@ -243,6 +258,83 @@ static DBusMessage *unregister_agent(DBusConnection *conn,
 	return dbus_message_new_method_return(msg);
 }
 
+static void append_mem_entry(DBusMessageIter *dict, const char *key,
+							size_t bytes)
+{
+	DBusMessageIter entry;
+	dbus_uint64_t value = bytes;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+					NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_mem_owner(const char *owner, size_t bytes,
+							void *user_data)
+{
+	append_mem_entry(user_data, owner, bytes);
+}
+
+static DBusMessage *get_memory_usage(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	DBusMessageIter dict;
+	unsigned int hits, misses;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT64_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	append_mem_entry(&dict, "Total", obex_mem_get_usage(NULL));
+	append_mem_entry(&dict, "SoftLimit", obex_option_mem_soft_limit());
+	append_mem_entry(&dict, "HardLimit", obex_option_mem_hard_limit());
+	append_mem_entry(&dict, "ReclaimedSessions",
+						obex_reclaimed_sessions());
+	append_mem_entry(&dict, "ReclaimedBytes", obex_reclaimed_bytes());
+
+	filesystem_listing_stats(&hits, &misses);
+	append_mem_entry(&dict, "ListingCacheHits", hits);
+	append_mem_entry(&dict, "ListingCacheMisses", misses);
+
+	obex_mem_foreach(append_mem_owner, &dict);
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+	return reply;
+}
+
+static DBusMessage *set_rate_limit(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *service;
+	dbus_uint32_t rate;
+
+	if (!dbus_message_get_args(msg, NULL,
+				DBUS_TYPE_STRING, &service,
+				DBUS_TYPE_UINT32, &rate,
+				DBUS_TYPE_INVALID))
+		return invalid_args(msg);
+
+	if (obex_option_set_rate_limit(service, rate) < 0)
+		return invalid_args(msg);
+
+	obex_rate_limits_changed();
+
+	DBG("%s limited to %u KiB/s", service[0] ? service : "default", rate);
+
+	return dbus_message_new_method_return(msg);
+}
+
 static char *target2str(const uint8_t *t)
 {
 	if (!t)
@@ -263,6 +355,7 @@ static DBusMessage *get_properties(DBusConnection *conn,
 	DBusMessageIter dict;
 	char *uuid;
 	const char *root;
+	dbus_uint64_t usage;
 
 	reply = dbus_message_new_method_return(msg);
 	if (!reply)
@@ -285,6 +378,11 @@ static DBusMessage *get_properties(DBusConnection *conn,
 	dbus_message_iter_append_dict_entry(&dict, "Root",
 					DBUS_TYPE_STRING, &root);
 
+	/* Buffered bytes */
+	usage = obex_mem_get_usage(os);
+	dbus_message_iter_append_dict_entry(&dict, "MemoryUsage",
+					DBUS_TYPE_UINT64, &usage);
+
 	/* FIXME: Added Remote Address or USB */
 
 	dbus_message_iter_close_container(&iter, &dict);
@@ -295,9 +393,11 @@ static DBusMessage *get_properties(DBusConnection *conn,
 static DBusMessage *transfer_cancel(DBusConnection *connection,
 				DBusMessage *msg, void *user_data)
 {
-	struct obex_session *os = user_data;
+	struct transfer_object *transfer = user_data;
+	struct obex_session *os = transfer->os;
 	const char *sender;
 
+	/* Pooled object not bound to any transfer */
 	if (!os)
 		return invalid_args(msg);
 
@@ -313,6 +413,8 @@ static DBusMessage *transfer_cancel(DBusConnection *connection,
 static GDBusMethodTable manager_methods[] = {
 	{ "RegisterAgent",	"o",	"",	register_agent		},
 	{ "UnregisterAgent",	"o",	"",	unregister_agent	},
+	{ "GetMemoryUsage",	"",	"a{st}", get_memory_usage	},
+	{ "SetRateLimit",	"su",	"",	set_rate_limit		},
 	{ }
 };
 
@@ -330,7 +432,7 @@ static GDBusMethodTable transfer_methods[] = {
 };
 
 static GDBusSignalTable transfer_signals[] = {
-	{ "Progress",	"ii"	},
+	{ "Progress",	"xx"	},
 	{ }
 };
 
@@ -339,6 +441,80 @@ static GDBusMethodTable session_methods[] = {
 	{ }
 };
 
+static void transfer_object_free(void *user_data)
+{
+	struct transfer_object *transfer = user_data;
+
+	g_free(transfer->path);
+	g_free(transfer);
+}
+
+static void transfer_object_unregister(gpointer data, gpointer user_data)
+{
+	struct transfer_object *transfer = data;
+
+	/* Frees the object through the destroy callback */
+	g_dbus_unregister_interface(connection, transfer->path,
+							TRANSFER_INTERFACE);
+}
+
+/*
+ * Registering an object path invalidates the introspection data of all
+ * its parents, so objects are only registered the first time a transfer
+ * is announced on the bus and are pooled afterwards instead of being
+ * unregistered.
+ */
+static struct transfer_object *transfer_object_get(struct obex_session *os)
+{
+	struct transfer_object *transfer;
+
+	if (os->transfer)
+		return os->transfer;
+
+	if (transfer_pool) {
+		transfer = transfer_pool->data;
+		transfer_pool = g_slist_remove(transfer_pool, transfer);
+	} else {
+		transfer = g_new0(struct transfer_object, 1);
+		transfer->path = g_strdup_printf("/transfer%u", ++transfer_id);
+
+		if (!g_dbus_register_interface(connection, transfer->path,
+					TRANSFER_INTERFACE,
+					transfer_methods, transfer_signals,
+					NULL, transfer, transfer_object_free)) {
+			error("Cannot register Transfer interface.");
+			transfer_object_free(transfer);
+			return NULL;
+		}
+	}
+
+	DBG("%s bound to session %p", transfer->path, os);
+
+	transfer->os = os;
+	os->transfer = transfer;
+
+	return transfer;
+}
+
+static void transfer_object_put(struct obex_session *os)
+{
+	struct transfer_object *transfer = os->transfer;
+
+	if (transfer == NULL)
+		return;
+
+	os->transfer = NULL;
+	transfer->os = NULL;
+
+	if (g_slist_length(transfer_pool) >= TRANSFER_POOL_MAX) {
+		transfer_object_unregister(transfer, NULL);
+		return;
+	}
+
+	/* Appended so the most recently used path is reused last */
+	transfer_pool = g_slist_append(transfer_pool, transfer);
+}
+
 gboolean manager_init(void)
 {
 	DBusError err;
@@ -371,6 +547,10 @@ void manager_cleanup(void)
 	g_dbus_unregister_interface(connection, OPENOBEX_MANAGER_PATH,
 						OPENOBEX_MANAGER_INTERFACE);
 
+	g_slist_foreach(transfer_pool, transfer_object_unregister, NULL);
+	g_slist_free(transfer_pool);
+	transfer_pool = NULL;
+
 	/* FIXME: Release agent? */
 
 	if (agent)
@@ -381,71 +561,53 @@ void manager_cleanup(void)
 
 void manager_emit_transfer_started(struct obex_session *os)
 {
-	char *path = g_strdup_printf("/transfer%u", os->id);
+	struct transfer_object *transfer = transfer_object_get(os);
+
+	if (transfer == NULL)
+		return;
 
 	g_dbus_emit_signal(connection, OPENOBEX_MANAGER_PATH,
 			OPENOBEX_MANAGER_INTERFACE, "TransferStarted",
-			DBUS_TYPE_OBJECT_PATH, &path,
+			DBUS_TYPE_OBJECT_PATH, &transfer->path,
 			DBUS_TYPE_INVALID);
-
-	g_free(path);
 }
 
 static void emit_transfer_completed(struct obex_session *os, gboolean success)
 {
-	char *path = g_strdup_printf("/transfer%u", os->id);
+	struct transfer_object *transfer = transfer_object_get(os);
+
+	if (transfer == NULL)
+		return;
 
 	g_dbus_emit_signal(connection, OPENOBEX_MANAGER_PATH,
 			OPENOBEX_MANAGER_INTERFACE, "TransferCompleted",
-			DBUS_TYPE_OBJECT_PATH, &path,
+			DBUS_TYPE_OBJECT_PATH, &transfer->path,
 			DBUS_TYPE_BOOLEAN, &success,
 			DBUS_TYPE_INVALID);
-
-	g_free(path);
 }
 
-static void emit_transfer_progress(struct obex_session *os, uint32_t total,
-							uint32_t transfered)
+static void emit_transfer_progress(struct obex_session *os, int64_t total,
+							int64_t transfered)
 {
-	char *path = g_strdup_printf("/transfer%u", os->id);
-
-	g_dbus_emit_signal(connection, path,
-			TRANSFER_INTERFACE, "Progress",
-			DBUS_TYPE_INT32, &total,
-			DBUS_TYPE_INT32, &transfered,
-			DBUS_TYPE_INVALID);
+	struct transfer_object *transfer = transfer_object_get(os);
 
-	g_free(path);
-}
-
-void manager_register_transfer(struct obex_session *os)
-{
-	char *path = g_strdup_printf("/transfer%u", os->id);
-
-	if (!g_dbus_register_interface(connection, path,
-				TRANSFER_INTERFACE,
-				transfer_methods, transfer_signals,
-				NULL, os, NULL)) {
-		error("Cannot register Transfer interface.");
-		g_free(path);
+	if (transfer == NULL)
 		return;
-	}
 
-	g_free(path);
+	g_dbus_emit_signal(connection, transfer->path,
+			TRANSFER_INTERFACE, "Progress",
+			DBUS_TYPE_INT64, &total,
+			DBUS_TYPE_INT64, &transfered,
+			DBUS_TYPE_INVALID);
 }
 
 void manager_unregister_transfer(struct obex_session *os)
 {
-	char *path = g_strdup_printf("/transfer%u", os->id);
-
 	/* Got an error during a transfer. */
 	if (os->object)
 		emit_transfer_completed(os, os->offset == os->size);
 
-	g_dbus_unregister_interface(connection, path,
-				TRANSFER_INTERFACE);
-
-	g_free(path);
+	transfer_object_put(os);
 }
 
 static void agent_cancel(void)
@@ -521,9 +683,11 @@ int manager_request_authorization(struct obex_session *os, int32_t time,
 	DBusPendingCall *call;
 	const char *filename = os->name ? os->name : "";
 	const char *type = os->type ? os->type : "";
-	char *path, *address;
+	struct transfer_object *transfer;
+	char *address;
 	unsigned int watch;
 	gboolean got_reply;
+	int32_t length;
 	int err;
 
 	if (!agent)
@@ -535,25 +699,29 @@ int manager_request_authorization(struct obex_session *os, int32_t time,
 	if (!new_folder || !new_name)
 		return -EINVAL;
 
+	transfer = transfer_object_get(os);
+	if (transfer == NULL)
+		return -EPERM;
+
 	err = obex_getpeername(os, &address);
 	if (err < 0)
 		return err;
 
-	path = g_strdup_printf("/transfer%u", GPOINTER_TO_UINT(os));
-
 	msg = dbus_message_new_method_call(agent->bus_name, agent->path,
 					"org.openobex.Agent", "Authorize");
 
+	/* Agents take 32 bits, bigger objects are reported as unknown */
+	length = os->size >= 0 && os->size <= INT32_MAX ? os->size : -1;
+
 	dbus_message_append_args(msg,
-			DBUS_TYPE_OBJECT_PATH, &path,
+			DBUS_TYPE_OBJECT_PATH, &transfer->path,
 			DBUS_TYPE_STRING, &address,
 			DBUS_TYPE_STRING, &filename,
 			DBUS_TYPE_STRING, &type,
-			DBUS_TYPE_INT32, &os->size,
+			DBUS_TYPE_INT32, &length,
 			DBUS_TYPE_INT32, &time,
 			DBUS_TYPE_INVALID);
 
-	g_free(path);
 	g_free(address);
 
 	if (!dbus_connection_send_with_reply(connection,
@@ -27,7 +27,6 @@
 
 void manager_register_session(struct obex_session *os);
 void manager_unregister_session(struct obex_session *os);
-void manager_register_transfer(struct obex_session *os);
 void manager_unregister_transfer(struct obex_session *os);
 void manager_emit_transfer_started(struct obex_session *os);
 void manager_emit_transfer_progress(struct obex_session *os);
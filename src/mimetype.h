@@ -31,7 +31,7 @@ struct obex_mime_type_driver {
 	const uint8_t *who;
 	unsigned int who_size;
 	void *(*open) (const char *name, int oflag, mode_t mode,
-			void *driver_data, size_t *size, int *err);
+			void *driver_data, int64_t *size, int *err);
 	int (*close) (void *object);
 	ssize_t (*get_next_header)(void *object, void *buf, size_t mtu,
 								uint8_t *hi);
@@ -50,6 +50,14 @@ struct obex_session {
 	GObex *obex;
 	struct obex_mime_type_driver *driver;
 	gboolean headers_sent;
+	GSList *mem;
+	size_t mem_total;
+	gboolean mem_suspended;
+	struct transfer_object *transfer;
+	guint timeout_id;
+	time_t last_activity;
+	GObexShaper *shaper;
+	struct obex_peer *peer;
 };
 
 int obex_session_start(GIOChannel *io, uint16_t tx_mtu, uint16_t rx_mtu,
@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <sys/statvfs.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -51,6 +52,7 @@
 #include "mimetype.h"
 #include "service.h"
 #include "transport.h"
+#include "fileio.h"
 #include "btio.h"
 
 /* Challenge request */
@@ -67,6 +69,28 @@
 
 static GSList *sessions = NULL;
 
+struct mem_usage {
+	const char *owner;
+	size_t bytes;
+};
+
+/* Daemon wide usage per owner */
+static GSList *mem_owners = NULL;
+static size_t mem_total = 0;
+
+/* Send rate shared by all sessions to the same device */
+struct obex_peer {
+	char *address;
+	GObexShaper *shaper;
+	unsigned int refs;
+};
+
+static GSList *peers = NULL;
+
+/* Sessions closed for being idle or stalled and the memory they held */
+static unsigned int reclaimed_sessions = 0;
+static size_t reclaimed_bytes = 0;
+
 typedef struct {
 	uint8_t  version;
 	uint8_t  flags;
@@ -189,6 +213,7 @@ static void os_set_response(struct obex_session *os, int err)
 		rsp = G_OBEX_RSP_BAD_REQUEST;
 		break;
 	case -EFAULT:
+	case -EBUSY:
 		rsp = G_OBEX_RSP_SERVICE_UNAVAILABLE;
 		break;
 	case -EINVAL:
@@ -207,6 +232,174 @@ static void os_set_response(struct obex_session *os, int err)
 	g_obex_send_rsp(os->obex, rsp, NULL, G_OBEX_HDR_INVALID);
 }
 
+static struct mem_usage *mem_usage_find(GSList **list, const char *owner)
+{
+	struct mem_usage *usage;
+	GSList *l;
+
+	for (l = *list; l; l = l->next) {
+		usage = l->data;
+
+		if (g_str_equal(usage->owner, owner))
+			return usage;
+	}
+
+	usage = g_new0(struct mem_usage, 1);
+	usage->owner = owner;
+	*list = g_slist_prepend(*list, usage);
+
+	return usage;
+}
+
+static void mem_check(struct obex_session *os)
+{
+	size_t soft = obex_option_mem_soft_limit();
+
+	/*
+	 * Only incoming data can be throttled by holding back responses,
+	 * suspending a GET would also stop the buffer from draining.
+	 */
+	if (soft > 0 && os->mem_total > soft && os->cmd == G_OBEX_OP_PUT) {
+		if (!os->mem_suspended)
+			DBG("session %p over soft limit (%zu bytes)", os,
+							os->mem_total);
+
+		os->mem_suspended = TRUE;
+		g_obex_suspend(os->obex);
+		return;
+	}
+
+	if (!os->mem_suspended)
+		return;
+
+	os->mem_suspended = FALSE;
+	g_obex_resume(os->obex);
+}
+
+void obex_mem_update(struct obex_session *os, const char *owner,
+							size_t bytes)
+{
+	struct mem_usage *usage, *global;
+
+	usage = mem_usage_find(&os->mem, owner);
+	if (usage->bytes == bytes)
+		return;
+
+	global = mem_usage_find(&mem_owners, owner);
+
+	global->bytes = global->bytes - usage->bytes + bytes;
+	os->mem_total = os->mem_total - usage->bytes + bytes;
+	mem_total = mem_total - usage->bytes + bytes;
+	usage->bytes = bytes;
+
+	mem_check(os);
+}
+
+static void mem_release(struct obex_session *os)
+{
+	GSList *l;
+
+	for (l = os->mem; l; l = l->next) {
+		struct mem_usage *usage = l->data;
+
+		obex_mem_update(os, usage->owner, 0);
+	}
+}
+
+gboolean obex_mem_soft_exceeded(struct obex_session *os)
+{
+	size_t soft = obex_option_mem_soft_limit();
+
+	return soft > 0 && os->mem_total >= soft;
+}
+
+size_t obex_mem_get_usage(struct obex_session *os)
+{
+	if (os == NULL)
+		return mem_total;
+
+	return os->mem_total;
+}
+
+void obex_mem_foreach(obex_mem_func_t func, void *user_data)
+{
+	GSList *l;
+
+	for (l = mem_owners; l; l = l->next) {
+		struct mem_usage *usage = l->data;
+
+		func(usage->owner, usage->bytes, user_data);
+	}
+}
+
+unsigned int obex_reclaimed_sessions(void)
+{
+	return reclaimed_sessions;
+}
+
+size_t obex_reclaimed_bytes(void)
+{
+	return reclaimed_bytes;
+}
+
+static struct obex_peer *peer_get(const char *address)
+{
+	struct obex_peer *peer;
+	GSList *l;
+
+	for (l = peers; l; l = l->next) {
+		peer = l->data;
+
+		if (g_str_equal(peer->address, address)) {
+			peer->refs++;
+			return peer;
+		}
+	}
+
+	peer = g_new0(struct obex_peer, 1);
+	peer->address = g_strdup(address);
+	peer->shaper = g_obex_shaper_new(obex_option_peer_rate_limit());
+	peer->refs = 1;
+
+	peers = g_slist_prepend(peers, peer);
+
+	return peer;
+}
+
+static void peer_put(struct obex_peer *peer)
+{
+	if (--peer->refs > 0)
+		return;
+
+	peers = g_slist_remove(peers, peer);
+
+	g_obex_shaper_unref(peer->shaper);
+	g_free(peer->address);
+	g_free(peer);
+}
+
+static void os_update_rate(struct obex_session *os)
+{
+	uint16_t service = os->service ? os->service->service : 0;
+
+	g_obex_shaper_set_rate(os->shaper, obex_option_rate_limit(service));
+}
+
+void obex_rate_limits_changed(void)
+{
+	GSList *l;
+
+	for (l = sessions; l; l = l->next)
+		os_update_rate(l->data);
+
+	for (l = peers; l; l = l->next) {
+		struct obex_peer *peer = l->data;
+
+		g_obex_shaper_set_rate(peer->shaper,
+					obex_option_peer_rate_limit());
+	}
+}
+
 static void os_session_mark_aborted(struct obex_session *os)
 {
 	/* the session was already cancelled/aborted or size in unknown */
@@ -231,6 +424,9 @@ static void os_reset_session(struct obex_session *os)
 	if (os->service && os->service->reset)
 		os->service->reset(os, os->service_data);
 
+	/* Accounted buffers only live as long as the transfer */
+	mem_release(os);
+
 	if (os->name) {
 		g_free(os->name);
 		os->name = NULL;
@@ -271,6 +467,18 @@ static void obex_session_free(struct obex_session *os)
 {
 	sessions = g_slist_remove(sessions, os);
 
+	if (os->timeout_id > 0)
+		g_source_remove(os->timeout_id);
+
+	mem_release(os);
+	g_slist_free_full(os->mem, g_free);
+
+	if (os->shaper)
+		g_obex_shaper_unref(os->shaper);
+
+	if (os->peer)
+		peer_put(os->peer);
+
 	if (os->io)
 		g_io_channel_unref(os->io);
 
@@ -429,6 +637,119 @@ static void parse_authchal(struct obex_session *session, GObexPacket *req,
 	g_obex_packet_add_header(rsp, hdr);
 }
 
+static time_t monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static unsigned int session_timeout_limit(struct obex_session *os)
+{
+	/* An operation in flight is bound by the stall timeout instead */
+	if (os->object != NULL)
+		return obex_option_stall_timeout();
+
+	return obex_option_idle_timeout(os->service ? os->service->service
+									: 0);
+}
+
+static gboolean session_timeout(gpointer user_data);
+
+static void session_timeout_schedule(struct obex_session *os,
+							unsigned int seconds)
+{
+	unsigned int idle, stall;
+
+	/*
+	 * With no limit for the current state keep checking at the other
+	 * one since the session may change state without any activity.
+	 */
+	if (seconds == 0) {
+		idle = obex_option_idle_timeout(os->service ?
+						os->service->service : 0);
+		stall = obex_option_stall_timeout();
+
+		if (idle == 0 || (stall > 0 && stall < idle))
+			seconds = stall;
+		else
+			seconds = idle;
+	}
+
+	if (seconds == 0)
+		return;
+
+	os->timeout_id = g_timeout_add_seconds(seconds, session_timeout, os);
+}
+
+/* Activity only updates a timestamp, the timer rearms itself lazily */
+static void os_touch(struct obex_session *os)
+{
+	os->last_activity = monotonic_time();
+
+	if (os->timeout_id == 0)
+		session_timeout_schedule(os, session_timeout_limit(os));
+}
+
+static void obex_session_destroy(struct obex_session *os);
+
+static gboolean session_timeout(gpointer user_data)
+{
+	struct obex_session *os = user_data;
+	unsigned int limit;
+	time_t elapsed;
+
+	os->timeout_id = 0;
+
+	limit = session_timeout_limit(os);
+	elapsed = monotonic_time() - os->last_activity;
+
+	if (limit == 0 || elapsed < (time_t) limit) {
+		session_timeout_schedule(os, limit ? limit - elapsed : 0);
+		return FALSE;
+	}
+
+	error("Session %p %s for %u seconds, closing it", os,
+				os->object ? "stalled" : "idle", limit);
+
+	reclaimed_sessions++;
+	reclaimed_bytes += os->mem_total;
+
+	DBG("reclaimed %zu bytes, %u sessions %zu bytes in total",
+			os->mem_total, reclaimed_sessions, reclaimed_bytes);
+
+	/*
+	 * Shutting the socket down makes sure the peer notices even if the
+	 * transport holds other references to it.
+	 */
+	shutdown(g_io_channel_unix_get_fd(os->io), SHUT_RDWR);
+
+	obex_session_destroy(os);
+
+	return FALSE;
+}
+
+static void parse_apparam(struct obex_session *os, GObexPacket *req)
+{
+	GObexHeader *hdr;
+	const guint8 *apparam;
+	gsize len;
+
+	hdr = g_obex_packet_get_header(req, G_OBEX_HDR_APPARAM);
+	if (hdr == NULL)
+		return;
+
+	if (!g_obex_header_get_bytes(hdr, &apparam, &len))
+		return;
+
+	g_free(os->apparam);
+	os->apparam = g_memdup(apparam, len);
+	os->apparam_len = len;
+	DBG("APPARAM");
+}
+
 static void cmd_connect(GObex *obex, GObexPacket *req, void *user_data)
 {
 	struct obex_session *os = user_data;
@@ -440,6 +761,16 @@ static void cmd_connect(GObex *obex, GObexPacket *req, void *user_data)
 
 	print_event(G_OBEX_OP_CONNECT, -1);
 
+	os_touch(os);
+
+	if (obex_option_mem_hard_limit() > 0 &&
+				mem_total >= obex_option_mem_hard_limit()) {
+		error("Memory budget exhausted (%zu bytes), refusing connect",
+								mem_total);
+		os_set_response(os, -EBUSY);
+		return;
+	}
+
 	parse_service(os, req);
 
 	if (os->service == NULL || os->service->connect == NULL) {
@@ -450,7 +781,18 @@ static void cmd_connect(GObex *obex, GObexPacket *req, void *user_data)
 
 	DBG("Selected driver: %s", os->service->name);
 
+	/* The limit depends on the service the peer connects to */
+	os_update_rate(os);
+
+	/* Services may read the application parameters of the connect */
+	parse_apparam(os, req);
+
 	os->service_data = os->service->connect(os, &err);
+
+	g_free(os->apparam);
+	os->apparam = NULL;
+	os->apparam_len = 0;
+
 	if (err < 0) {
 		os_set_response(os, err);
 		return;
@@ -480,6 +822,8 @@ static void cmd_disconnect(GObex *obex, GObexPacket *req, void *user_data)
 
 	print_event(G_OBEX_OP_DISCONNECT, -1);
 
+	os_touch(os);
+
 	os_set_response(os, 0);
 }
 
@@ -506,6 +850,8 @@ static ssize_t driver_write(struct obex_session *os)
 		os->pending -= w;
 	}
 
+	obex_mem_update(os, "obex", os->pending);
+
 	DBG("%zd written", len);
 
 	if (os->service->progress != NULL)
@@ -551,6 +897,8 @@ static gssize send_data(void *buf, gsize size, gpointer user_data)
 	if (os->aborted)
 		return -EPERM;
 
+	os_touch(os);
+
 	return driver_read(os, buf, size);
 }
 
@@ -582,7 +930,9 @@ static void cmd_get_rsp(GObex *obex, GObexPacket *req, gpointer user_data)
 
 	print_event(G_OBEX_OP_GET, -1);
 
-	if (os->size != OBJECT_SIZE_UNKNOWN && os->size < UINT32_MAX)
+	os_touch(os);
+
+	if (fileio_length_fits(os->size))
 		g_obex_get_rsp(os->obex, send_data, transfer_complete,
 						os, NULL,
 						G_OBEX_HDR_LENGTH, os->size,
@@ -668,6 +1018,8 @@ static gboolean handle_async_io(void *object, int flags, int err,
 	if (err < 0)
 		goto done;
 
+	os_touch(os);
+
 	if (flags & G_IO_OUT)
 		err = driver_write(os);
 	if ((flags & G_IO_IN) && !os->headers_sent)
@@ -680,7 +1032,8 @@ done:
 	if (err < 0)
 		os_set_response(os, err);
 
-	g_obex_resume(os->obex);
+	if (!os->mem_suspended)
+		g_obex_resume(os->obex);
 
 	return FALSE;
 }
@@ -696,6 +1049,8 @@ static gboolean recv_data(const void *buf, gsize size, gpointer user_data)
 	if (os->aborted)
 		return FALSE;
 
+	os_touch(os);
+
 	/* workaround: client didn't send the object lenght */
 	if (os->size == OBJECT_SIZE_DELETE)
 		os->size = OBJECT_SIZE_UNKNOWN;
@@ -704,6 +1059,8 @@ static gboolean recv_data(const void *buf, gsize size, gpointer user_data)
 	memcpy(os->buf + os->pending, buf, size);
 	os->pending += size;
 
+	obex_mem_update(os, "obex", os->pending);
+
 	/* only write if both object and driver are valid */
 	if (os->object == NULL || os->driver == NULL) {
 		DBG("Stored %" PRIu64 " bytes into temporary buffer",
@@ -774,24 +1131,6 @@ static void parse_name(struct obex_session *os, GObexPacket *req)
 	DBG("NAME: %s", os->name);
 }
 
-static void parse_apparam(struct obex_session *os, GObexPacket *req)
-{
-	GObexHeader *hdr;
-	const guint8 *apparam;
-	gsize len;
-
-	hdr = g_obex_packet_get_header(req, G_OBEX_HDR_APPARAM);
-	if (hdr == NULL)
-		return;
-
-	if (!g_obex_header_get_bytes(hdr, &apparam, &len))
-		return;
-
-	os->apparam = g_memdup(apparam, len);
-	os->apparam_len = len;
-	DBG("APPARAM");
-}
-
 static void cmd_get(GObex *obex, GObexPacket *req, gpointer user_data)
 {
 	struct obex_session *os = user_data;
@@ -801,6 +1140,8 @@ static void cmd_get(GObex *obex, GObexPacket *req, gpointer user_data)
 
 	print_event(G_OBEX_OP_GET, -1);
 
+	os_touch(os);
+
 	if (os->service == NULL) {
 		os_set_response(os, -EPERM);
 		return;
@@ -846,6 +1187,8 @@ static void cmd_setpath(GObex *obex, GObexPacket *req, gpointer user_data)
 
 	print_event(G_OBEX_OP_SETPATH, -1);
 
+	os_touch(os);
+
 	if (os->service == NULL) {
 		err = -EPERM;
 		goto done;
@@ -869,7 +1212,7 @@ int obex_get_stream_start(struct obex_session *os, const char *filename)
 {
 	int err;
 	void *object;
-	size_t size = OBJECT_SIZE_UNKNOWN;
+	int64_t size = OBJECT_SIZE_UNKNOWN;
 
 	object = os->driver->open(filename, O_RDONLY, 0, os->service_data,
 								&size, &err);
@@ -882,6 +1225,9 @@ int obex_get_stream_start(struct obex_session *os, const char *filename)
 	os->offset = 0;
 	os->size = size;
 
+	if (size > UINT32_MAX)
+		DBG("%" PRId64 " bytes don't fit in Length, omitting it", size);
+
 	err = driver_get_headers(os);
 	if (err == -EAGAIN) {
 		g_obex_suspend(os->obex);
@@ -892,7 +1238,7 @@ int obex_get_stream_start(struct obex_session *os, const char *filename)
 	} else if (err > 0)
 		return 0;
 
-	if (os->size != OBJECT_SIZE_UNKNOWN && os->size < UINT32_MAX)
+	if (fileio_length_fits(os->size))
 		g_obex_get_rsp(os->obex, send_data, transfer_complete,
 						os, NULL,
 						G_OBEX_HDR_LENGTH, os->size,
@@ -914,7 +1260,7 @@ int obex_put_stream_start(struct obex_session *os, const char *filename)
 	os->object = os->driver->open(filename, O_WRONLY | O_CREAT | O_TRUNC,
 					0600, os->service_data,
 					os->size != OBJECT_SIZE_UNKNOWN ?
-					(size_t *) &os->size : NULL, &err);
+					&os->size : NULL, &err);
 	if (os->object == NULL) {
 		error("open(%s): %s (%d)", filename, strerror(-err), -err);
 		return err;
@@ -925,6 +1271,22 @@ int obex_put_stream_start(struct obex_session *os, const char *filename)
 	return 0;
 }
 
+int obex_put_set_response_name(struct obex_session *os, const char *name)
+{
+	GObexHeader *hdr;
+
+	hdr = g_obex_header_new_unicode(G_OBEX_HDR_NAME, name);
+	if (hdr == NULL)
+		return -EINVAL;
+
+	if (!g_obex_put_rsp_add_header(os->obex, hdr)) {
+		g_obex_header_free(hdr);
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
 static void parse_length(struct obex_session *os, GObexPacket *req)
 {
 	GObexHeader *hdr;
@@ -938,7 +1300,7 @@ static void parse_length(struct obex_session *os, GObexPacket *req)
 		return;
 
 	os->size = size;
-	DBG("LENGTH: %" PRIu64, os->size);
+	DBG("LENGTH: %" PRId64, os->size);
 }
 
 static void parse_time(struct obex_session *os, GObexPacket *req)
@@ -998,6 +1360,8 @@ static void cmd_put(GObex *obex, GObexPacket *req, gpointer user_data)
 
 	print_event(G_OBEX_OP_PUT, -1);
 
+	os_touch(os);
+
 	if (os->service == NULL) {
 		os_set_response(os, -EPERM);
 		return;
@@ -1014,6 +1378,7 @@ static void cmd_put(GObex *obex, GObexPacket *req, gpointer user_data)
 	parse_name(os, req);
 	parse_length(os, req);
 	parse_time(os, req);
+	parse_apparam(os, req);
 
 	if (!os->checked) {
 		if (!check_put(obex, req, user_data))
@@ -1080,6 +1445,8 @@ static void cmd_action(GObex *obex, GObexPacket *req, gpointer user_data)
 
 	print_event(G_OBEX_OP_ACTION, -1);
 
+	os_touch(os);
+
 	if (os->service == NULL) {
 		err = -EPERM;
 		goto done;
@@ -1117,6 +1484,8 @@ static void cmd_abort(GObex *obex, GObexPacket *req, gpointer user_data)
 
 	print_event(G_OBEX_OP_ABORT, -1);
 
+	os_touch(os);
+
 	os_reset_session(os);
 
 	os_set_response(os, 0);
@@ -1147,6 +1516,7 @@ int obex_session_start(GIOChannel *io, uint16_t tx_mtu, uint16_t rx_mtu,
 {
 	struct obex_session *os;
 	GObex *obex;
+	char *address;
 	static uint32_t id = 0;
 
 	DBG("");
@@ -1178,8 +1548,24 @@ int obex_session_start(GIOChannel *io, uint16_t tx_mtu, uint16_t rx_mtu,
 	os->obex = obex;
 	os->io = g_io_channel_ref(io);
 
+	/* Shapers are always attached so limits can be set at runtime */
+	os->shaper = g_obex_shaper_new(0);
+	os_update_rate(os);
+	g_obex_add_shaper(obex, os->shaper);
+
+	/* Transports without addresses, like USB, have a single peer */
+	if (obex_getpeername(os, &address) < 0)
+		address = g_strdup(server->transport ?
+					server->transport->name : "");
+
+	os->peer = peer_get(address);
+	g_obex_add_shaper(obex, os->peer->shaper);
+	g_free(address);
+
 	sessions = g_slist_prepend(sessions, os);
 
+	os_touch(os);
+
 	return 0;
 }
 
@@ -1200,7 +1586,7 @@ void obex_set_name(struct obex_session *os, const char *name)
 	DBG("Name changed: %s", os->name);
 }
 
-ssize_t obex_get_size(struct obex_session *os)
+int64_t obex_get_size(struct obex_session *os)
 {
 	return os->size;
 }
@@ -33,10 +33,11 @@ void obex_connect_cb(GIOChannel *io, GError *err, void *user_data);
 
 int obex_get_stream_start(struct obex_session *os, const char *filename);
 int obex_put_stream_start(struct obex_session *os, const char *filename);
+int obex_put_set_response_name(struct obex_session *os, const char *name);
 const char *obex_get_name(struct obex_session *os);
 const char *obex_get_destname(struct obex_session *os);
 void obex_set_name(struct obex_session *os, const char *name);
-ssize_t obex_get_size(struct obex_session *os);
+int64_t obex_get_size(struct obex_session *os);
 const char *obex_get_type(struct obex_session *os);
 uint16_t obex_get_service(struct obex_session *os);
 gboolean obex_get_auto_accept(struct obex_session *os);
@@ -51,5 +52,22 @@ ssize_t obex_get_non_header_data(struct obex_session *os,
 							const uint8_t **data);
 int obex_getpeername(struct obex_session *os, char **name);
 
+/* Memory accounting, owner is a static string naming the plugin */
+typedef void (*obex_mem_func_t) (const char *owner, size_t bytes,
+							void *user_data);
+
+void obex_mem_update(struct obex_session *os, const char *owner,
+							size_t bytes);
+gboolean obex_mem_soft_exceeded(struct obex_session *os);
+size_t obex_mem_get_usage(struct obex_session *os);
+void obex_mem_foreach(obex_mem_func_t func, void *user_data);
+
+/* Applies changed rate limit options to the running sessions */
+void obex_rate_limits_changed(void);
+
+/* Sessions closed by the idle and stall timeouts */
+unsigned int obex_reclaimed_sessions(void);
+size_t obex_reclaimed_bytes(void);
+
 /* Just a thin wrapper around memcmp to deal with NULL values */
 int memncmp0(const void *a, size_t na, const void *b, size_t nb);
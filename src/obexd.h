@@ -40,3 +40,13 @@ gboolean obex_option_auto_accept(void);
 const char *obex_option_root_folder(void);
 gboolean obex_option_symlinks(void);
 const char *obex_option_capability(void);
+unsigned int obex_option_pbap_prefetch(void);
+size_t obex_option_mem_soft_limit(void);
+size_t obex_option_mem_hard_limit(void);
+const char *obex_option_photo_cache(void);
+const char *obex_option_photo_folder(void);
+unsigned int obex_option_idle_timeout(uint16_t service);
+unsigned int obex_option_stall_timeout(void);
+size_t obex_option_rate_limit(uint16_t service);
+size_t obex_option_peer_rate_limit(void);
+int obex_option_set_rate_limit(const char *service, unsigned int kib);
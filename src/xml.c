@@ -0,0 +1,185 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2011  Intel Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "xml.h"
+
+static void append_entity(GString *out, const char *text, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char ref[8] = "&#x";
+	unsigned int c;
+	size_t n = 3;
+
+	/* Control characters, decoded from UTF-8 in the C1 case */
+	c = len == 1 ? (unsigned char) text[0] :
+			(((unsigned char) text[0] & 0x1f) << 6) |
+			((unsigned char) text[1] & 0x3f);
+
+	if (c >= 0x10)
+		ref[n++] = hex[c >> 4];
+	ref[n++] = hex[c & 0xf];
+	ref[n++] = ';';
+
+	g_string_append_len(out, ref, n);
+}
+
+/* Same rules as g_markup_escape_text() */
+void xml_append_escaped(GString *out, const char *text)
+{
+	const char *start = text, *p = text;
+	const char *entity;
+
+	if (text == NULL)
+		return;
+
+	for (;; p++) {
+		unsigned char c = *p;
+		size_t skip = 1;
+
+		switch (c) {
+		case '\0':
+			g_string_append_len(out, start, p - start);
+			return;
+		case '&':
+			entity = "&amp;";
+			break;
+		case '<':
+			entity = "&lt;";
+			break;
+		case '>':
+			entity = "&gt;";
+			break;
+		case '\'':
+			entity = "&apos;";
+			break;
+		case '"':
+			entity = "&quot;";
+			break;
+		case '\t':
+		case '\n':
+		case '\r':
+			continue;
+		case 0xc2:
+			c = (unsigned char) p[1];
+			if (c < 0x80 || c > 0x9f || c == 0x85)
+				continue;
+			entity = NULL;
+			skip = 2;
+			break;
+		default:
+			if (c >= 0x20 && c != 0x7f)
+				continue;
+			entity = NULL;
+			break;
+		}
+
+		g_string_append_len(out, start, p - start);
+
+		if (entity)
+			g_string_append(out, entity);
+		else
+			append_entity(out, p, skip);
+
+		p += skip - 1;
+		start = p + 1;
+	}
+}
+
+void xml_append_uint64(GString *out, uint64_t value)
+{
+	char buf[20];
+	size_t n = sizeof(buf);
+
+	do {
+		buf[--n] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	g_string_append_len(out, buf + n, sizeof(buf) - n);
+}
+
+static char *put_digits(char *p, unsigned int value, int width)
+{
+	int i;
+
+	for (i = width - 1; i >= 0; i--) {
+		p[i] = '0' + value % 10;
+		value /= 10;
+	}
+
+	return p + width;
+}
+
+void xml_append_time(GString *out, time_t t)
+{
+	char buf[XML_TIME_LEN];
+	struct tm tm;
+	char *p = buf;
+
+	gmtime_r(&t, &tm);
+
+	p = put_digits(p, tm.tm_year + 1900, 4);
+	p = put_digits(p, tm.tm_mon + 1, 2);
+	p = put_digits(p, tm.tm_mday, 2);
+	*p++ = 'T';
+	p = put_digits(p, tm.tm_hour, 2);
+	p = put_digits(p, tm.tm_min, 2);
+	p = put_digits(p, tm.tm_sec, 2);
+	*p++ = 'Z';
+
+	g_string_append_len(out, buf, p - buf);
+}
+
+static void attr_begin(GString *out, const char *name)
+{
+	g_string_append_c(out, ' ');
+	g_string_append(out, name);
+	g_string_append_len(out, "=\"", 2);
+}
+
+void xml_attr(GString *out, const char *name, const char *value)
+{
+	attr_begin(out, name);
+	xml_append_escaped(out, value);
+	g_string_append_c(out, '"');
+}
+
+void xml_attr_uint64(GString *out, const char *name, uint64_t value)
+{
+	attr_begin(out, name);
+	xml_append_uint64(out, value);
+	g_string_append_c(out, '"');
+}
+
+void xml_attr_time(GString *out, const char *name, time_t t)
+{
+	attr_begin(out, name);
+	xml_append_time(out, t);
+	g_string_append_c(out, '"');
+}
@@ -0,0 +1,47 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2011  Intel Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Helpers for generating folder, vCard and message listings straight into
+ * a GString. Nothing is allocated besides growing the output buffer.
+ */
+
+#include <time.h>
+#include <inttypes.h>
+#include <glib.h>
+
+/* Room needed by "YYYYMMDDTHHMMSSZ" */
+#define XML_TIME_LEN	16
+
+/* Appends text escaped for use in character data or attribute values */
+void xml_append_escaped(GString *out, const char *text);
+
+void xml_append_uint64(GString *out, uint64_t value);
+
+/* Appends an UTC timestamp in ISO 8601 basic format */
+void xml_append_time(GString *out, time_t t);
+
+/* Append ' name="value"' with value escaped or formatted */
+void xml_attr(GString *out, const char *name, const char *value);
+void xml_attr_uint64(GString *out, const char *name, uint64_t value);
+void xml_attr_time(GString *out, const char *name, time_t t);
@@ -0,0 +1,271 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Scaling of the dummy messages back-end with the size of a folder: the
+ * index is rebuilt from a synthetic inbox, then listing sizes and pages
+ * are timed for filters answered by the counters and for filters that
+ * need a walk. Running it with growing --messages shows which operations
+ * depend on the folder size; the last page of a paged listing should
+ * cost about as much as the first one.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "messages.h"
+
+static int option_messages = 10000;
+static int option_page = 100;
+
+static GOptionEntry options[] = {
+	{ "messages", 'n', 0, G_OPTION_ARG_INT, &option_messages,
+			"Number of messages in the folder", "NUM" },
+	{ "page", 'p', 0, G_OPTION_ARG_INT, &option_page,
+			"Number of entries per listing page", "NUM" },
+	{ NULL },
+};
+
+static GMainLoop *mainloop = NULL;
+static unsigned int listed = 0;
+
+void obex_debug(const char *format, ...)
+{
+}
+
+void error(const char *format, ...)
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_inbox(const char *inbox, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		char *name, *path, *bmsg;
+
+		bmsg = g_strdup_printf("BEGIN:BMSG\r\nVERSION:1.0\r\n"
+				"STATUS:%s\r\nTYPE:%s\r\n"
+				"BEGIN:VCARD\r\nVERSION:2.1\r\nN:Sender %d\r\n"
+				"TEL:+100%d\r\nEND:VCARD\r\nBEGIN:BENV\r\n"
+				"BEGIN:VCARD\r\nVERSION:2.1\r\nN:%s\r\n"
+				"END:VCARD\r\nBEGIN:BBODY\r\nLENGTH:36\r\n"
+				"BEGIN:MSG\r\nMessage %05d\r\nEND:MSG\r\n"
+				"END:BBODY\r\nEND:BENV\r\nEND:BMSG\r\n",
+				i % 2 ? "UNREAD" : "READ",
+				i % 3 ? "SMS_GSM" : "EMAIL", i, i,
+				i % 10 ? "Bob" : "Alice", i % 100000);
+
+		name = g_strdup_printf("%X.bmsg", i + 1);
+		path = g_build_filename(inbox, name, NULL);
+
+		if (!g_file_set_contents(path, bmsg, -1, NULL)) {
+			g_printerr("Unable to write %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+
+		g_free(path);
+		g_free(name);
+		g_free(bmsg);
+	}
+}
+
+static void remove_dir(const char *path)
+{
+	const char *name;
+	GDir *dir;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (dir == NULL) {
+		unlink(path);
+		return;
+	}
+
+	while ((name = g_dir_read_name(dir))) {
+		char *child = g_build_filename(path, name, NULL);
+
+		remove_dir(child);
+		g_free(child);
+	}
+
+	g_dir_close(dir);
+	rmdir(path);
+}
+
+static void listing_cb(void *session, int err, uint16_t size,
+				gboolean newmsg,
+				const struct messages_message *message,
+				void *user_data)
+{
+	uint16_t *total = user_data;
+
+	*total = size;
+
+	if (message != NULL) {
+		listed++;
+		return;
+	}
+
+	if (err < 0 && err != -EAGAIN)
+		g_printerr("Listing failed: %s\n", strerror(-err));
+
+	g_main_loop_quit(mainloop);
+}
+
+/* Returns the time a listing took in ms, the listing size in size */
+static double list(void *session, const struct messages_filter *filter,
+			uint16_t max, uint16_t offset, uint16_t *size)
+{
+	double start = now();
+	int err;
+
+	err = messages_get_messages_listing(session, NULL, max, offset,
+						filter, listing_cb, size);
+	if (err < 0) {
+		g_printerr("Listing failed: %s\n", strerror(-err));
+		exit(EXIT_FAILURE);
+	}
+
+	g_main_loop_run(mainloop);
+
+	return (now() - start) * 1000;
+}
+
+static void bench_filter(void *session, const char *name,
+					const struct messages_filter *filter)
+{
+	double size_ms, first_ms = 0, last_ms = 0, total_ms = 0;
+	unsigned int pages = 0, offset;
+	uint16_t size;
+
+	size_ms = list(session, filter, 0, 0, &size);
+
+	listed = 0;
+
+	for (offset = 0; offset < size; offset += option_page) {
+		double ms;
+
+		ms = list(session, filter, option_page, offset, &size);
+
+		if (pages++ == 0)
+			first_ms = ms;
+
+		last_ms = ms;
+		total_ms += ms;
+	}
+
+	if (listed != size)
+		g_printerr("%s: %u entries listed out of %u\n", name, listed,
+									size);
+
+	printf("%-8s size %5u in %8.3f ms, %4u pages in %8.3f ms "
+			"(first %6.3f ms, last %6.3f ms)\n", name, size,
+			size_ms, pages, total_ms, first_ms, last_ms);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct messages_filter filter;
+	char *root, *inbox;
+	void *session;
+	uint16_t size;
+	double ms;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	g_option_context_parse(context, &argc, &argv, &gerr);
+	if (gerr != NULL) {
+		g_printerr("%s\n", gerr->message);
+		g_error_free(gerr);
+		exit(EXIT_FAILURE);
+	}
+
+	g_option_context_free(context);
+
+	if (option_messages <= 0 || option_messages > 0xffff ||
+				option_page <= 0 || option_page > 0xffff) {
+		g_printerr("Invalid number of messages or page size\n");
+		exit(EXIT_FAILURE);
+	}
+
+	root = g_strdup("/tmp/messages-bench-XXXXXX");
+	if (g_mkdtemp(root) == NULL) {
+		g_printerr("Unable to create %s\n", root);
+		exit(EXIT_FAILURE);
+	}
+
+	inbox = g_build_filename(root, "telecom", "msg", "inbox", NULL);
+	g_mkdir_with_parents(inbox, 0700);
+	write_inbox(inbox, option_messages);
+
+	g_setenv("MAP_ROOT", root, TRUE);
+	mainloop = g_main_loop_new(NULL, FALSE);
+
+	messages_init();
+	messages_connect(&session);
+	messages_set_folder(session, "telecom", FALSE);
+	messages_set_folder(session, "msg", FALSE);
+	messages_set_folder(session, "inbox", FALSE);
+
+	memset(&filter, 0, sizeof(filter));
+
+	/* No index yet, the first listing builds it from the messages */
+	ms = list(session, &filter, 0, 0, &size);
+	printf("rebuild  %u messages in %8.3f ms\n", size, ms);
+
+	bench_filter(session, "all", &filter);
+
+	filter.read_status = 0x01;
+	bench_filter(session, "unread", &filter);
+
+	filter.read_status = 0;
+	filter.recipient = "Alice";
+	bench_filter(session, "alice", &filter);
+
+	messages_disconnect(session);
+	messages_exit();
+
+	g_main_loop_unref(mainloop);
+
+	remove_dir(root);
+	g_free(inbox);
+	g_free(root);
+
+	return 0;
+}
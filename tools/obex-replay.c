@@ -0,0 +1,578 @@
+/*
+ *
+ *  OBEX library with GLib integration
+ *
+ *  Copyright (C) 2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+
+#include <gobex/gobex.h>
+#include <btio/btio.h>
+
+#define FINAL_BIT		0x80
+#define CONNID_INVALID		0xffffffff
+
+static GMainLoop *main_loop = NULL;
+static GObex *obex = NULL;
+
+static gboolean option_packet = FALSE;
+static gboolean option_bluetooth = FALSE;
+static char *option_source = NULL;
+static char *option_dest = NULL;
+static int option_channel = -1;
+static int option_imtu = -1;
+static int option_omtu = -1;
+static gboolean option_max_speed = FALSE;
+static gboolean option_verbose = FALSE;
+
+static GOptionEntry options[] = {
+	{ "unix", 'u', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE,
+			&option_bluetooth, "Use a UNIX socket" },
+	{ "bluetooth", 'b', 0, G_OPTION_ARG_NONE,
+			&option_bluetooth, "Use Bluetooth" },
+	{ "source", 's', 0, G_OPTION_ARG_STRING,
+			&option_source, "Bluetooth adapter address",
+			"00:..." },
+	{ "destination", 'd', 0, G_OPTION_ARG_STRING,
+			&option_dest, "Remote bluetooth address",
+			"00:..." },
+	{ "channel", 'c', 0, G_OPTION_ARG_INT,
+			&option_channel, "Transport channel", "CHANNEL" },
+	{ "packet", 'p', 0, G_OPTION_ARG_NONE,
+			&option_packet, "Packet based transport" },
+	{ "input-mtu", 'i', 0, G_OPTION_ARG_INT,
+			&option_imtu, "Transport input MTU", "MTU" },
+	{ "output-mtu", 'o', 0, G_OPTION_ARG_INT,
+			&option_omtu, "Transport output MTU", "MTU" },
+	{ "max-speed", 'm', 0, G_OPTION_ARG_NONE,
+			&option_max_speed, "Don't honor recorded think time" },
+	{ "verbose", 'v', 0, G_OPTION_ARG_NONE,
+			&option_verbose, "Print timing of every request" },
+	{ NULL },
+};
+
+struct replay_req {
+	const guint8 *data;
+	guint16 len;
+	guint64 gap;
+	guint64 latency;
+	guint8 rsp_code;
+	guint64 replayed;
+	guint8 replayed_code;
+};
+
+static GArray *requests = NULL;
+static guint current = 0;
+static guint32 conn_id = CONNID_INVALID;
+static guint64 req_start = 0;
+static guint64 replay_start = 0;
+static guint mismatches = 0;
+static guint8 capture_transport = G_OBEX_TRANSPORT_STREAM;
+
+static void sig_term(int sig)
+{
+	g_print("Terminating due to signal %d\n", sig);
+	g_main_loop_quit(main_loop);
+}
+
+static guint64 replay_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static gboolean is_request(guint8 opcode)
+{
+	/* Response codes always have one of the 0x70 bits set */
+	return (opcode & ~FINAL_BIT) == G_OBEX_OP_ABORT ||
+						(opcode & 0x70) == 0;
+}
+
+static const char *op2str(guint8 opcode)
+{
+	switch (opcode & ~FINAL_BIT) {
+	case G_OBEX_OP_CONNECT:
+		return "connect";
+	case G_OBEX_OP_DISCONNECT:
+		return "disconnect";
+	case G_OBEX_OP_PUT:
+		return "put";
+	case G_OBEX_OP_GET:
+		return "get";
+	case G_OBEX_OP_SETPATH:
+		return "setpath";
+	case G_OBEX_OP_ACTION:
+		return "action";
+	case G_OBEX_OP_SESSION:
+		return "session";
+	case G_OBEX_OP_ABORT:
+		return "abort";
+	default:
+		return "unknown";
+	}
+}
+
+static gssize req_header_offset(guint8 opcode)
+{
+	switch (opcode & ~FINAL_BIT) {
+	case G_OBEX_OP_CONNECT:
+		return 4;
+	case G_OBEX_OP_SETPATH:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static gboolean load_capture(const char *filename, char **contents)
+{
+	GError *err = NULL;
+	guint64 now = 0, last_rsp = 0, req_time = 0;
+	struct replay_req *req = NULL;
+	gsize len, off;
+
+	if (!g_file_get_contents(filename, contents, &len, &err)) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+
+	if (len < G_OBEX_CAPTURE_HDR_SIZE ||
+			memcmp(*contents, G_OBEX_CAPTURE_MAGIC,
+				strlen(G_OBEX_CAPTURE_MAGIC)) != 0 ||
+			(*contents)[8] != G_OBEX_CAPTURE_VERSION) {
+		g_printerr("%s: not a gobex capture file\n", filename);
+		return FALSE;
+	}
+
+	capture_transport = (*contents)[9];
+
+	requests = g_array_new(FALSE, TRUE, sizeof(struct replay_req));
+
+	for (off = G_OBEX_CAPTURE_HDR_SIZE; off < len;) {
+		const guint8 *rec = (const guint8 *) *contents + off;
+		guint32 u32;
+		guint16 u16;
+
+		if (len - off < G_OBEX_CAPTURE_REC_SIZE)
+			goto truncated;
+
+		memcpy(&u32, rec, sizeof(u32));
+		memcpy(&u16, &rec[5], sizeof(u16));
+		now += g_ntohl(u32);
+		u16 = g_ntohs(u16);
+
+		off += G_OBEX_CAPTURE_REC_SIZE;
+		if (len - off < u16 || u16 < 3)
+			goto truncated;
+
+		rec += G_OBEX_CAPTURE_REC_SIZE;
+		off += u16;
+
+		if (is_request(rec[0])) {
+			struct replay_req new;
+
+			memset(&new, 0, sizeof(new));
+			new.data = rec;
+			new.len = u16;
+			new.gap = last_rsp ? now - last_rsp : 0;
+			req_time = now;
+
+			g_array_append_val(requests, new);
+			req = &g_array_index(requests, struct replay_req,
+							requests->len - 1);
+			continue;
+		}
+
+		if (req == NULL || req->rsp_code != 0)
+			continue;
+
+		req->latency = now - req_time;
+		req->rsp_code = rec[0];
+		last_rsp = now;
+	}
+
+	return TRUE;
+
+truncated:
+	g_printerr("%s: truncated record at offset %zu\n", filename, off);
+	return FALSE;
+}
+
+static void set_connid(guint8 *buf, gsize len, guint32 id)
+{
+	gsize off = 3 + req_header_offset(buf[0]);
+
+	while (off < len) {
+		guint8 hdr_id = buf[off];
+		gsize hdr_len;
+		guint16 u16;
+
+		switch (hdr_id & 0xc0) {
+		case 0x00:
+		case 0x40:
+			if (len - off < 3)
+				return;
+			memcpy(&u16, &buf[off + 1], sizeof(u16));
+			hdr_len = g_ntohs(u16);
+			break;
+		case 0x80:
+			hdr_len = 2;
+			break;
+		default:
+			hdr_len = 5;
+			break;
+		}
+
+		if (hdr_len < 2 || len - off < hdr_len)
+			return;
+
+		if (hdr_id == G_OBEX_HDR_CONNECTION) {
+			guint32 u32 = g_htonl(id);
+			memcpy(&buf[off + 1], &u32, sizeof(u32));
+		}
+
+		off += hdr_len;
+	}
+}
+
+static void report(void)
+{
+	guint64 recorded = 0, replayed = 0;
+	guint i;
+
+	for (i = 0; i < current; i++) {
+		struct replay_req *req = &g_array_index(requests,
+						struct replay_req, i);
+
+		recorded += req->latency;
+		replayed += req->replayed;
+	}
+
+	printf("%u/%u requests replayed, %u response mismatches\n", current,
+						requests->len, mismatches);
+	printf("recorded %" G_GUINT64_FORMAT " us, replayed %"
+			G_GUINT64_FORMAT " us, delta %+" G_GINT64_FORMAT
+			" us (%+.1f%%)\n", recorded, replayed,
+			(gint64) (replayed - recorded),
+			recorded ? 100.0 * ((gint64) (replayed - recorded)) /
+							recorded : 0);
+	printf("wall time %.3f s (%s speed)\n",
+			(replay_time() - replay_start) / 1000000.0,
+			option_max_speed ? "maximum" : "original");
+}
+
+static void send_next(void);
+
+static void replay_rsp(GObex *obex, GError *err, GObexPacket *rsp,
+							gpointer user_data)
+{
+	struct replay_req *req = &g_array_index(requests, struct replay_req,
+								current);
+	GObexHeader *hdr;
+
+	req->replayed = replay_time() - req_start;
+
+	if (err != NULL) {
+		g_printerr("%s request %u failed: %s\n", op2str(req->data[0]),
+						current, err->message);
+		report();
+		g_main_loop_quit(main_loop);
+		return;
+	}
+
+	req->replayed_code = g_obex_packet_get_operation(rsp, NULL) |
+								FINAL_BIT;
+
+	if ((req->data[0] & ~FINAL_BIT) == G_OBEX_OP_CONNECT) {
+		hdr = g_obex_packet_get_header(rsp, G_OBEX_HDR_CONNECTION);
+		if (hdr != NULL)
+			g_obex_header_get_uint32(hdr, &conn_id);
+	}
+
+	if (req->rsp_code != 0 && req->replayed_code != req->rsp_code)
+		mismatches++;
+
+	if (option_verbose)
+		printf("%5u %-10s %10" G_GUINT64_FORMAT " %10"
+				G_GUINT64_FORMAT " %+10" G_GINT64_FORMAT
+				"%s\n", current, op2str(req->data[0]),
+				req->latency, req->replayed,
+				(gint64) (req->replayed - req->latency),
+				req->rsp_code != 0 &&
+				req->replayed_code != req->rsp_code ?
+				" response mismatch" : "");
+
+	current++;
+	send_next();
+}
+
+static void send_req(void)
+{
+	struct replay_req *req = &g_array_index(requests, struct replay_req,
+								current);
+	GError *err = NULL;
+	GObexPacket *pkt;
+	guint8 *buf;
+
+	buf = g_memdup(req->data, req->len);
+
+	if (conn_id != CONNID_INVALID)
+		set_connid(buf, req->len, conn_id);
+
+	pkt = g_obex_packet_decode(buf, req->len,
+					req_header_offset(buf[0]),
+					G_OBEX_DATA_COPY, &err);
+	g_free(buf);
+
+	if (pkt == NULL)
+		goto failed;
+
+	req_start = replay_time();
+
+	if (g_obex_send_req(obex, pkt, -1, replay_rsp, NULL, &err) > 0)
+		return;
+
+failed:
+	g_printerr("Unable to replay request %u: %s\n", current,
+							err->message);
+	g_error_free(err);
+	report();
+	g_main_loop_quit(main_loop);
+}
+
+static gboolean send_timeout(gpointer user_data)
+{
+	send_req();
+
+	return FALSE;
+}
+
+static void send_next(void)
+{
+	struct replay_req *req;
+
+	if (current == requests->len) {
+		report();
+		g_main_loop_quit(main_loop);
+		return;
+	}
+
+	req = &g_array_index(requests, struct replay_req, current);
+
+	if (!option_max_speed && req->gap >= 1000) {
+		g_timeout_add(req->gap / 1000, send_timeout, NULL);
+		return;
+	}
+
+	send_req();
+}
+
+static void disconn_func(GObex *obex, GError *err, gpointer user_data)
+{
+	g_printerr("Disconnected: %s\n", err ? err->message : "(no error)");
+	g_main_loop_quit(main_loop);
+}
+
+static void transport_connect(GIOChannel *io, GObexTransportType transport)
+{
+	g_io_channel_set_flags(io, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	obex = g_obex_new(io, transport, option_imtu, option_omtu);
+	g_obex_set_disconnect_function(obex, disconn_func, NULL);
+
+	if (option_verbose)
+		printf("%5s %-10s %10s %10s %10s\n", "#", "op",
+				"rec (us)", "rep (us)", "delta");
+
+	replay_start = replay_time();
+	send_next();
+}
+
+static GIOChannel *unix_connect(GObexTransportType transport)
+{
+	GIOChannel *io;
+	struct sockaddr_un addr = {
+		AF_UNIX, "\0/gobex/server"
+	};
+	int sk, err, sock_type;
+
+	if (transport == G_OBEX_TRANSPORT_PACKET)
+		sock_type = SOCK_SEQPACKET;
+	else
+		sock_type = SOCK_STREAM;
+
+	sk = socket(PF_LOCAL, sock_type, 0);
+	if (sk < 0) {
+		err = errno;
+		g_printerr("Can't create unix socket: %s (%d)\n",
+						strerror(err), err);
+		return NULL;
+	}
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		err = errno;
+		g_printerr("connect: %s (%d)\n", strerror(err), err);
+		close(sk);
+		return NULL;
+	}
+
+	io = g_io_channel_unix_new(sk);
+
+	transport_connect(io, transport);
+
+	return io;
+}
+
+static void conn_callback(GIOChannel *io, GError *err, gpointer user_data)
+{
+	GObexTransportType transport = GPOINTER_TO_UINT(user_data);
+
+	if (err != NULL) {
+		g_printerr("%s\n", err->message);
+		g_main_loop_quit(main_loop);
+		return;
+	}
+
+	transport_connect(io, transport);
+}
+
+static GIOChannel *bluetooth_connect(GObexTransportType transport)
+{
+	GIOChannel *io;
+	GError *err = NULL;
+	BtIOType type;
+	BtIOOption option;
+
+	if (option_dest == NULL || option_channel < 0)
+		return NULL;
+
+	if (transport == G_OBEX_TRANSPORT_PACKET || option_channel > 31) {
+		type = BT_IO_L2CAP;
+		option = BT_IO_OPT_PSM;
+	} else {
+		type = BT_IO_RFCOMM;
+		option = BT_IO_OPT_CHANNEL;
+	}
+
+	if (option_source)
+		io = bt_io_connect(type, conn_callback,
+				GUINT_TO_POINTER(transport), NULL, &err,
+				BT_IO_OPT_SOURCE, option_source,
+				BT_IO_OPT_DEST, option_dest,
+				option, option_channel,
+				BT_IO_OPT_SEC_LEVEL, BT_IO_SEC_LOW,
+				BT_IO_OPT_INVALID);
+	else
+		io = bt_io_connect(type, conn_callback,
+				GUINT_TO_POINTER(transport), NULL, &err,
+				BT_IO_OPT_DEST, option_dest,
+				option, option_channel,
+				BT_IO_OPT_SEC_LEVEL, BT_IO_SEC_LOW,
+				BT_IO_OPT_INVALID);
+
+	if (io != NULL)
+		return io;
+
+	g_printerr("%s\n", err->message);
+	g_error_free(err);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *err = NULL;
+	struct sigaction sa;
+	GIOChannel *io;
+	GObexTransportType transport;
+	char *contents = NULL;
+
+	context = g_option_context_new("CAPTURE");
+	g_option_context_add_main_entries(context, options, NULL);
+
+	g_option_context_parse(context, &argc, &argv, &err);
+	if (err != NULL) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		exit(EXIT_FAILURE);
+	}
+
+	if (argc < 2) {
+		g_printerr("No capture file given\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!load_capture(argv[1], &contents))
+		exit(EXIT_FAILURE);
+
+	if (requests->len == 0) {
+		g_printerr("%s: no requests recorded\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (option_packet || capture_transport == G_OBEX_TRANSPORT_PACKET)
+		transport = G_OBEX_TRANSPORT_PACKET;
+	else
+		transport = G_OBEX_TRANSPORT_STREAM;
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	if (option_bluetooth)
+		io = bluetooth_connect(transport);
+	else
+		io = unix_connect(transport);
+
+	if (io == NULL)
+		exit(EXIT_FAILURE);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_term;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	g_main_loop_run(main_loop);
+
+	if (obex != NULL)
+		g_obex_unref(obex);
+
+	g_io_channel_unref(io);
+	g_array_free(requests, TRUE);
+	g_free(contents);
+	g_option_context_free(context);
+	g_main_loop_unref(main_loop);
+
+	exit(EXIT_SUCCESS);
+}
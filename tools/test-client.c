@@ -28,6 +28,7 @@
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -45,6 +46,8 @@ static char *option_dest = NULL;
 static int option_channel = -1;
 static int option_imtu = -1;
 static int option_omtu = -1;
+static char *option_batch = NULL;
+static int option_connections = 1;
 
 static void sig_term(int sig)
 {
@@ -73,6 +76,12 @@ static GOptionEntry options[] = {
 			&option_imtu, "Transport input MTU", "MTU" },
 	{ "output-mtu", 'o', 0, G_OPTION_ARG_INT,
 			&option_omtu, "Transport output MTU", "MTU" },
+	{ "batch", 'B', 0, G_OPTION_ARG_STRING,
+			&option_batch, "Run benchmark script non-interactively",
+			"FILE" },
+	{ "connections", 'n', 0, G_OPTION_ARG_INT,
+			&option_connections, "Parallel connections in batch mode",
+			"NUM" },
 	{ NULL },
 };
 
@@ -294,9 +303,8 @@ static void transport_connect(GIOChannel *io, GObexTransportType transport)
 	rl_callback_handler_install("client> ", parse_line);
 }
 
-static GIOChannel *unix_connect(GObexTransportType transport)
+static int unix_socket(void)
 {
-	GIOChannel *io;
 	struct sockaddr_un addr = {
 		AF_UNIX, "\0/gobex/server"
 	};
@@ -312,15 +320,28 @@ static GIOChannel *unix_connect(GObexTransportType transport)
 		err = errno;
 		g_printerr("Can't create unix socket: %s (%d)\n",
 						strerror(err), err);
-		return NULL;
+		return -err;
 	}
 
 	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
 		err = errno;
 		g_printerr("connect: %s (%d)\n", strerror(err), err);
-		return NULL;
+		close(sk);
+		return -err;
 	}
 
+	return sk;
+}
+
+static GIOChannel *unix_connect(GObexTransportType transport)
+{
+	GIOChannel *io;
+	int sk;
+
+	sk = unix_socket();
+	if (sk < 0)
+		return NULL;
+
 	io = g_io_channel_unix_new(sk);
 
 	g_print("Unix socket created: %d\n", sk);
@@ -386,6 +407,392 @@ static GIOChannel *bluetooth_connect(GObexTransportType transport)
 	return NULL;
 }
 
+enum bench_op {
+	BENCH_CONNECT,
+	BENCH_PUT,
+	BENCH_GET,
+	BENCH_LIST,
+	BENCH_SETPATH,
+	BENCH_OPS
+};
+
+static const char *bench_op_names[] = {
+	"connect", "put", "get", "list", "setpath"
+};
+
+struct bench_step {
+	enum bench_op op;
+	gsize size;
+	guint count;
+};
+
+struct bench_conn {
+	GObex *obex;
+	guint id;
+	GSList *step;
+	guint done;
+	char *name;
+	gsize size;
+	gsize offset;
+	gboolean inside;
+	guint64 start;
+};
+
+static GSList *bench_steps = NULL;
+static GArray *bench_latency[BENCH_OPS];
+static guint64 bench_bytes = 0;
+static guint64 bench_start = 0;
+static guint bench_running = 0;
+static guint bench_failures = 0;
+
+static void bench_next(struct bench_conn *conn);
+
+static guint64 bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static gboolean bench_parse(const char *filename)
+{
+	char *contents, **lines;
+	GError *err = NULL;
+	int i;
+
+	if (!g_file_get_contents(filename, &contents, NULL, &err)) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	for (i = 0; lines[i]; i++) {
+		struct bench_step *step;
+		char **argv;
+		int argc, op;
+
+		g_strstrip(lines[i]);
+
+		if (lines[i][0] == '\0' || lines[i][0] == '#')
+			continue;
+
+		if (!g_shell_parse_argv(lines[i], &argc, &argv, NULL))
+			goto failed;
+
+		for (op = BENCH_PUT; op < BENCH_OPS; op++)
+			if (strcasecmp(bench_op_names[op], argv[0]) == 0)
+				break;
+
+		if (op == BENCH_OPS || (op == BENCH_PUT && argc < 2)) {
+			g_strfreev(argv);
+			goto failed;
+		}
+
+		step = g_new0(struct bench_step, 1);
+		step->op = op;
+		step->count = 1;
+
+		if (op == BENCH_PUT) {
+			step->size = strtoul(argv[1], NULL, 0);
+			if (argc > 2)
+				step->count = atoi(argv[2]);
+		} else if (argc > 1)
+			step->count = atoi(argv[1]);
+
+		bench_steps = g_slist_append(bench_steps, step);
+		g_strfreev(argv);
+	}
+
+	g_strfreev(lines);
+
+	return TRUE;
+
+failed:
+	g_printerr("%s:%d: invalid command \"%s\"\n", filename, i + 1,
+								lines[i]);
+	g_strfreev(lines);
+
+	return FALSE;
+}
+
+static int latency_cmp(gconstpointer a, gconstpointer b)
+{
+	guint64 l1 = *(const guint64 *) a;
+	guint64 l2 = *(const guint64 *) b;
+
+	return (l1 > l2) - (l1 < l2);
+}
+
+static guint64 percentile(GArray *array, unsigned int pct)
+{
+	guint i = (array->len * pct + 99) / 100;
+
+	return g_array_index(array, guint64, i > 0 ? i - 1 : 0);
+}
+
+static void bench_report(void)
+{
+	guint64 elapsed = bench_time() - bench_start;
+	int op;
+
+	printf("%-10s %8s %10s %10s %10s %10s\n", "op", "count",
+				"p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+
+	for (op = 0; op < BENCH_OPS; op++) {
+		GArray *array = bench_latency[op];
+
+		if (array->len == 0)
+			continue;
+
+		g_array_sort(array, latency_cmp);
+
+		printf("%-10s %8u %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+				" %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+				"\n", bench_op_names[op], array->len,
+				percentile(array, 50), percentile(array, 90),
+				percentile(array, 99), percentile(array, 100));
+	}
+
+	printf("%u connections, %u failures, %" G_GUINT64_FORMAT
+			" bytes in %.3f s, %.2f MB/s\n", option_connections,
+			bench_failures, bench_bytes, elapsed / 1000000.0,
+			elapsed ? (bench_bytes / 1048576.0) /
+						(elapsed / 1000000.0) : 0);
+}
+
+static void bench_done(struct bench_conn *conn)
+{
+	g_obex_unref(conn->obex);
+	g_free(conn->name);
+	g_free(conn);
+
+	if (--bench_running > 0)
+		return;
+
+	bench_report();
+	g_main_loop_quit(main_loop);
+}
+
+static void bench_record(struct bench_conn *conn, enum bench_op op,
+								GError *err)
+{
+	guint64 latency = bench_time() - conn->start;
+
+	if (err != NULL) {
+		g_printerr("conn %u %s failed: %s\n", conn->id,
+					bench_op_names[op], err->message);
+		bench_failures++;
+		return;
+	}
+
+	g_array_append_val(bench_latency[op], latency);
+}
+
+static void bench_rsp(GObex *obex, GError *err, GObexPacket *rsp,
+							gpointer user_data)
+{
+	struct bench_conn *conn = user_data;
+	struct bench_step *step = conn->step ? conn->step->data : NULL;
+	GError *rsp_err = NULL;
+	guint8 code;
+
+	if (err == NULL) {
+		code = g_obex_packet_get_operation(rsp, NULL);
+		if (code != G_OBEX_RSP_SUCCESS)
+			rsp_err = g_error_new(G_OBEX_ERROR, code, "%s",
+							g_obex_strerror(code));
+	}
+
+	bench_record(conn, step ? step->op : BENCH_CONNECT,
+						err ? err : rsp_err);
+
+	if (rsp_err != NULL)
+		g_error_free(rsp_err);
+
+	if (err != NULL) {
+		bench_done(conn);
+		return;
+	}
+
+	if (step != NULL)
+		conn->done++;
+
+	bench_next(conn);
+}
+
+static void bench_complete(GObex *obex, GError *err, gpointer user_data)
+{
+	struct bench_conn *conn = user_data;
+	struct bench_step *step = conn->step->data;
+
+	bench_record(conn, step->op, err);
+
+	if (err != NULL) {
+		bench_done(conn);
+		return;
+	}
+
+	conn->done++;
+	bench_next(conn);
+}
+
+static gssize bench_put_data(void *buf, gsize len, gpointer user_data)
+{
+	struct bench_conn *conn = user_data;
+
+	len = MIN(len, conn->size - conn->offset);
+	memset(buf, 'a' + conn->offset % 26, len);
+
+	conn->offset += len;
+	bench_bytes += len;
+
+	return len;
+}
+
+static gboolean bench_get_data(const void *buf, gsize len, gpointer user_data)
+{
+	bench_bytes += len;
+
+	return TRUE;
+}
+
+static void bench_next(struct bench_conn *conn)
+{
+	struct bench_step *step;
+	GError *err = NULL;
+
+	if (conn->step == NULL)
+		conn->step = bench_steps;
+	else if (conn->done >= ((struct bench_step *) conn->step->data)->count) {
+		conn->step = conn->step->next;
+		conn->done = 0;
+	}
+
+	if (conn->step == NULL) {
+		bench_done(conn);
+		return;
+	}
+
+	step = conn->step->data;
+	if (step->count == 0) {
+		bench_next(conn);
+		return;
+	}
+
+	conn->start = bench_time();
+
+	switch (step->op) {
+	case BENCH_PUT:
+		conn->size = step->size;
+		conn->offset = 0;
+		g_obex_put_req(conn->obex, bench_put_data, bench_complete,
+					conn, &err,
+					G_OBEX_HDR_NAME, conn->name,
+					G_OBEX_HDR_LENGTH, (guint32) step->size,
+					G_OBEX_HDR_INVALID);
+		break;
+	case BENCH_GET:
+		g_obex_get_req(conn->obex, bench_get_data, bench_complete,
+					conn, &err,
+					G_OBEX_HDR_NAME, conn->name,
+					G_OBEX_HDR_INVALID);
+		break;
+	case BENCH_LIST:
+		g_obex_get_req(conn->obex, bench_get_data, bench_complete,
+					conn, &err,
+					G_OBEX_HDR_TYPE, "x-obex/folder-listing",
+					strlen("x-obex/folder-listing") + 1,
+					G_OBEX_HDR_INVALID);
+		break;
+	case BENCH_SETPATH:
+		/* Alternate between a child folder and its parent */
+		g_obex_setpath(conn->obex, conn->inside ? ".." : "bench",
+						bench_rsp, conn, &err);
+		conn->inside = !conn->inside;
+		break;
+	default:
+		break;
+	}
+
+	if (err != NULL) {
+		bench_record(conn, step->op, err);
+		g_error_free(err);
+		bench_done(conn);
+	}
+}
+
+static gboolean bench_start_conn(guint id, GObexTransportType transport)
+{
+	struct bench_conn *conn;
+	GIOChannel *io;
+	GError *err = NULL;
+	int sk;
+
+	sk = unix_socket();
+	if (sk < 0)
+		return FALSE;
+
+	io = g_io_channel_unix_new(sk);
+	g_io_channel_set_flags(io, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	conn = g_new0(struct bench_conn, 1);
+	conn->id = id;
+	conn->name = g_strdup_printf("bench-%u-%d", id, getpid());
+	conn->obex = g_obex_new(io, transport, option_imtu, option_omtu);
+	g_io_channel_unref(io);
+
+	bench_running++;
+	conn->start = bench_time();
+
+	g_obex_connect(conn->obex, bench_rsp, conn, &err, G_OBEX_HDR_INVALID);
+	if (err != NULL) {
+		bench_record(conn, BENCH_CONNECT, err);
+		g_error_free(err);
+		bench_done(conn);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean bench_run(GObexTransportType transport)
+{
+	int i;
+
+	if (!bench_parse(option_batch))
+		return FALSE;
+
+	for (i = 0; i < BENCH_OPS; i++)
+		bench_latency[i] = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+	bench_start = bench_time();
+
+	for (i = 0; i < MAX(option_connections, 1); i++) {
+		if (!bench_start_conn(i, transport))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void bench_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < BENCH_OPS; i++)
+		if (bench_latency[i] != NULL)
+			g_array_free(bench_latency[i], TRUE);
+
+	g_slist_foreach(bench_steps, (GFunc) g_free, NULL);
+	g_slist_free(bench_steps);
+}
+
 int main(int argc, char *argv[])
 {
 	GOptionContext *context;
@@ -409,26 +816,41 @@ int main(int argc, char *argv[])
 	else
 		transport = G_OBEX_TRANSPORT_STREAM;
 
-	if (option_bluetooth)
-		io = bluetooth_connect(transport);
-	else
-		io = unix_connect(transport);
+	main_loop = g_main_loop_new(NULL, FALSE);
 
-	if (io == NULL)
-		exit(EXIT_FAILURE);
+	if (option_batch != NULL) {
+		if (option_bluetooth) {
+			g_printerr("Batch mode requires a UNIX socket\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (!bench_run(transport))
+			exit(EXIT_FAILURE);
+	} else {
+		if (option_bluetooth)
+			io = bluetooth_connect(transport);
+		else
+			io = unix_connect(transport);
+
+		if (io == NULL)
+			exit(EXIT_FAILURE);
+	}
 
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = sig_term;
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
-	main_loop = g_main_loop_new(NULL, FALSE);
-
 	g_main_loop_run(main_loop);
 
-	rl_callback_handler_remove();
-	clear_history();
-	g_obex_unref(obex);
+	if (option_batch != NULL)
+		bench_cleanup();
+	else {
+		rl_callback_handler_remove();
+		clear_history();
+		g_obex_unref(obex);
+	}
+
 	g_option_context_free(context);
 	g_main_loop_unref(main_loop);
 
@@ -27,6 +27,8 @@
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <sys/un.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -48,6 +50,7 @@ static int option_channel = -1;
 static int option_imtu = -1;
 static int option_omtu = -1;
 static char *option_root = NULL;
+static gboolean option_quiet = FALSE;
 
 static void sig_term(int sig)
 {
@@ -72,18 +75,23 @@ static GOptionEntry options[] = {
 			&option_imtu, "Transport input MTU", "MTU" },
 	{ "output-mtu", 'o', 0, G_OPTION_ARG_INT,
 			&option_omtu, "Transport output MTU", "MTU" },
+	{ "quiet", 'q', 0, G_OPTION_ARG_NONE,
+			&option_quiet, "Don't print per request output" },
 	{ NULL },
 };
 
 static void disconn_func(GObex *obex, GError *err, gpointer user_data)
 {
-	g_print("Client disconnected: %s\n", err ? err->message : "<no err>");
+	if (!option_quiet)
+		g_print("Client disconnected: %s\n", err ? err->message : "<no err>");
 	clients = g_slist_remove(clients, obex);
 	g_obex_unref(obex);
 }
 
 struct transfer_data {
 	int fd;
+	GString *listing;
+	gsize offset;
 };
 
 static void transfer_complete(GObex *obex, GError *err, gpointer user_data)
@@ -92,10 +100,14 @@ static void transfer_complete(GObex *obex, GError *err, gpointer user_data)
 
 	if (err != NULL)
 		g_printerr("transfer failed: %s\n", err->message);
-	else
+	else if (!option_quiet)
 		g_print("transfer succeeded\n");
 
-	close(data->fd);
+	if (data->listing != NULL)
+		g_string_free(data->listing, TRUE);
+	else
+		close(data->fd);
+
 	g_free(data);
 }
 
@@ -103,7 +115,8 @@ static gboolean recv_data(const void *buf, gsize len, gpointer user_data)
 {
 	struct transfer_data *data = user_data;
 
-	g_print("received %zu bytes of data\n", len);
+	if (!option_quiet)
+		g_print("received %zu bytes of data\n", len);
 
 	if (write(data->fd, buf, len) < 0) {
 		g_printerr("write: %s\n", strerror(errno));
@@ -138,7 +151,8 @@ static void handle_put(GObex *obex, GObexPacket *req, gpointer user_data)
 	else
 		name = NULL;
 
-	g_print("put type \"%s\" name \"%s\"\n", type ? type : "",
+	if (!option_quiet)
+		g_print("put type \"%s\" name \"%s\"\n", type ? type : "",
 							name ? name : "");
 
 	data = g_new0(struct transfer_data, 1);
@@ -166,12 +180,62 @@ static gssize send_data(void *buf, gsize len, gpointer user_data)
 	struct transfer_data *data = user_data;
 	gssize ret;
 
-	ret = read(data->fd, buf, len);
-	g_print("sending %zu bytes of data\n", ret);
+	if (data->listing != NULL) {
+		ret = MIN(len, data->listing->len - data->offset);
+		memcpy(buf, data->listing->str + data->offset, ret);
+		data->offset += ret;
+	} else
+		ret = read(data->fd, buf, len);
+
+	if (!option_quiet)
+		g_print("sending %zd bytes of data\n", ret);
 
 	return ret;
 }
 
+static GString *folder_listing(void)
+{
+	GString *listing;
+	struct dirent *ep;
+	DIR *dp;
+
+	dp = opendir(".");
+	if (dp == NULL)
+		return NULL;
+
+	listing = g_string_new("<?xml version=\"1.0\"?>\n"
+				"<folder-listing version=\"1.0\">\n");
+
+	while ((ep = readdir(dp)) != NULL) {
+		struct stat st;
+		char *name;
+
+		if (ep->d_name[0] == '.')
+			continue;
+
+		if (stat(ep->d_name, &st) < 0)
+			continue;
+
+		name = g_markup_escape_text(ep->d_name, -1);
+
+		if (S_ISDIR(st.st_mode))
+			g_string_append_printf(listing,
+					"<folder name=\"%s\"/>\n", name);
+		else
+			g_string_append_printf(listing,
+					"<file name=\"%s\" size=\"%lld\"/>\n",
+					name, (long long) st.st_size);
+
+		g_free(name);
+	}
+
+	closedir(dp);
+
+	g_string_append(listing, "</folder-listing>\n");
+
+	return listing;
+}
+
 static void handle_get(GObex *obex, GObexPacket *req, gpointer user_data)
 {
 	GError *err = NULL;
@@ -197,11 +261,24 @@ static void handle_get(GObex *obex, GObexPacket *req, gpointer user_data)
 	else
 		name = NULL;
 
-	g_print("get type \"%s\" name \"%s\"\n", type ? type : "",
+	if (!option_quiet)
+		g_print("get type \"%s\" name \"%s\"\n", type ? type : "",
 							name ? name : "");
 
 	data = g_new0(struct transfer_data, 1);
 
+	if (type != NULL && g_str_equal(type, "x-obex/folder-listing")) {
+		data->listing = folder_listing();
+		if (data->listing == NULL) {
+			g_free(data);
+			g_obex_send_rsp(obex, G_OBEX_RSP_FORBIDDEN, NULL,
+							G_OBEX_HDR_INVALID);
+			return;
+		}
+
+		goto send;
+	}
+
 	data->fd = open(name, O_RDONLY | O_NOCTTY, 0);
 	if (data->fd < 0) {
 		g_printerr("open(%s): %s\n", name, strerror(errno));
@@ -211,20 +288,42 @@ static void handle_get(GObex *obex, GObexPacket *req, gpointer user_data)
 		return;
 	}
 
+send:
 	g_obex_get_rsp(obex, send_data, transfer_complete, data, &err,
 							G_OBEX_HDR_INVALID);
 	if (err != NULL) {
 		g_printerr("Unable to send response: %s\n", err->message);
 		g_error_free(err);
+		if (data->listing != NULL)
+			g_string_free(data->listing, TRUE);
 		g_free(data);
 	}
 }
 
+static void handle_setpath(GObex *obex, GObexPacket *req, gpointer user_data)
+{
+	GObexHeader *hdr;
+	const char *name;
+
+	hdr = g_obex_packet_get_header(req, G_OBEX_HDR_NAME);
+	if (hdr != NULL)
+		g_obex_header_get_unicode(hdr, &name);
+	else
+		name = NULL;
+
+	if (!option_quiet)
+		g_print("setpath name \"%s\"\n", name ? name : "");
+
+	/* All clients share the process cwd so only acknowledge it */
+	g_obex_send_rsp(obex, G_OBEX_RSP_SUCCESS, NULL, G_OBEX_HDR_INVALID);
+}
+
 static void handle_connect(GObex *obex, GObexPacket *req, gpointer user_data)
 {
 	GObexPacket *rsp;
 
-	g_print("connect\n");
+	if (!option_quiet)
+		g_print("connect\n");
 
 	rsp = g_obex_packet_new(G_OBEX_RSP_SUCCESS, TRUE, G_OBEX_HDR_INVALID);
 	g_obex_send(obex, rsp, NULL);
@@ -249,6 +348,8 @@ static void transport_accept(GIOChannel *io)
 	g_obex_add_request_function(obex, G_OBEX_OP_GET, handle_get, NULL);
 	g_obex_add_request_function(obex, G_OBEX_OP_CONNECT, handle_connect,
 									NULL);
+	g_obex_add_request_function(obex, G_OBEX_OP_SETPATH, handle_setpath,
+									NULL);
 	clients = g_slist_append(clients, obex);
 }
 
@@ -278,8 +379,9 @@ static gboolean unix_accept(GIOChannel *chan, GIOCondition cond, gpointer data)
 		return TRUE;
 	}
 
-	g_print("Accepted new client connection on unix socket (fd=%d)\n",
-								cli_sk);
+	if (!option_quiet)
+		g_print("Accepted new client connection on unix socket "
+						"(fd=%d)\n", cli_sk);
 
 	io = g_io_channel_unix_new(cli_sk);
 
@@ -381,7 +483,7 @@ static guint unix_listen(void)
 		return 0;
 	}
 
-	if (listen(sk, 1) < 0) {
+	if (listen(sk, SOMAXCONN) < 0) {
 		g_printerr("Can't listen on unix socket: %s (%d)\n",
 						strerror(errno), errno);
 		close(sk);
@@ -0,0 +1,234 @@
+/*
+ *
+ *  D-Bus helper library
+ *
+ *  Copyright (C) 2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Microbenchmark for gdbus/watch.c: registers thousands of signal and
+ * name watches on the session bus and then feeds synthetic signals
+ * straight into the connection filter, so only the dispatch cost inside
+ * gdbus is measured.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "watch.c"
+
+#define BENCH_SENDER ":1.4242"
+#define BENCH_INTERFACE "org.openobex.Bench"
+
+static int option_watches = 2000;
+static int option_signals = 200000;
+
+static GOptionEntry options[] = {
+	{ "watches", 'n', 0, G_OPTION_ARG_INT, &option_watches,
+			"Number of watches of each kind", "NUM" },
+	{ "signals", 's', 0, G_OPTION_ARG_INT, &option_signals,
+			"Number of signals dispatched per test", "NUM" },
+	{ NULL },
+};
+
+static guint dispatched = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static gboolean bench_signal(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	dispatched++;
+
+	return TRUE;
+}
+
+static void bench_disconnect(DBusConnection *conn, void *user_data)
+{
+	dispatched++;
+}
+
+static void report(const char *test, double start, int count)
+{
+	double elapsed = now() - start;
+
+	printf("%-24s %8d ops %10.3f ms %10.1f ns/op\n", test, count,
+					elapsed * 1000, elapsed * 1e9 / count);
+}
+
+static DBusMessage **signal_messages(int count)
+{
+	DBusMessage **msgs = g_new0(DBusMessage *, count);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		char *path = g_strdup_printf("/bench/%d", i);
+		char *member = g_strdup_printf("Signal%d", i);
+
+		msgs[i] = dbus_message_new_signal(path, BENCH_INTERFACE,
+								member);
+		dbus_message_set_sender(msgs[i], BENCH_SENDER);
+
+		g_free(member);
+		g_free(path);
+	}
+
+	return msgs;
+}
+
+static DBusMessage **owner_messages(int count)
+{
+	DBusMessage **msgs = g_new0(DBusMessage *, count);
+	const char *old = BENCH_SENDER, *new = "";
+	int i;
+
+	for (i = 0; i < count; i++) {
+		char *name = g_strdup_printf("org.openobex.Bench%d", i);
+
+		msgs[i] = dbus_message_new_signal(DBUS_PATH_DBUS,
+						DBUS_INTERFACE_DBUS,
+						"NameOwnerChanged");
+		dbus_message_set_sender(msgs[i], DBUS_SERVICE_DBUS);
+		dbus_message_append_args(msgs[i], DBUS_TYPE_STRING, &name,
+						DBUS_TYPE_STRING, &old,
+						DBUS_TYPE_STRING, &new,
+						DBUS_TYPE_INVALID);
+
+		g_free(name);
+	}
+
+	return msgs;
+}
+
+static void dispatch(DBusConnection *conn, const char *test,
+					DBusMessage **msgs, int count)
+{
+	double start;
+	int i;
+
+	dispatched = 0;
+	start = now();
+
+	for (i = 0; i < option_signals; i++)
+		message_filter(conn, msgs[i % count], NULL);
+
+	report(test, start, option_signals);
+
+	if (dispatched != (guint) option_signals)
+		fprintf(stderr, "%s: %u of %d signals reached a watch\n",
+					test, dispatched, option_signals);
+}
+
+static void free_messages(DBusMessage **msgs, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		dbus_message_unref(msgs[i]);
+
+	g_free(msgs);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	DBusConnection *conn;
+	DBusMessage **msgs;
+	guint *ids;
+	double start;
+	int i, n;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	g_option_context_parse(context, &argc, &argv, &gerr);
+	if (gerr != NULL) {
+		g_printerr("%s\n", gerr->message);
+		g_error_free(gerr);
+		exit(EXIT_FAILURE);
+	}
+
+	g_option_context_free(context);
+
+	if (option_watches <= 0 || option_signals <= 0) {
+		g_printerr("Invalid number of watches or signals\n");
+		exit(EXIT_FAILURE);
+	}
+
+	conn = dbus_bus_get(DBUS_BUS_SESSION, NULL);
+	if (conn == NULL) {
+		g_printerr("Unable to connect to the session bus\n");
+		exit(EXIT_FAILURE);
+	}
+
+	n = option_watches;
+	ids = g_new0(guint, 2 * n);
+
+	start = now();
+
+	for (i = 0; i < n; i++) {
+		char *path = g_strdup_printf("/bench/%d", i);
+		char *member = g_strdup_printf("Signal%d", i);
+
+		ids[i] = g_dbus_add_signal_watch(conn, NULL, path,
+						BENCH_INTERFACE, member,
+						bench_signal, NULL, NULL);
+
+		g_free(member);
+		g_free(path);
+	}
+
+	for (i = 0; i < n; i++) {
+		char *name = g_strdup_printf("org.openobex.Bench%d", i);
+
+		ids[n + i] = g_dbus_add_disconnect_watch(conn, name,
+						bench_disconnect, NULL, NULL);
+
+		g_free(name);
+	}
+
+	report("add (incl. bus calls)", start, 2 * n);
+
+	msgs = signal_messages(n);
+	dispatch(conn, "signal dispatch", msgs, n);
+	free_messages(msgs, n);
+
+	msgs = owner_messages(n);
+	dispatch(conn, "NameOwnerChanged", msgs, n);
+	free_messages(msgs, n);
+
+	start = now();
+
+	for (i = 0; i < 2 * n; i++)
+		g_dbus_remove_watch(conn, ids[i]);
+
+	report("remove (incl. bus calls)", start, 2 * n);
+
+	g_free(ids);
+	dbus_connection_unref(conn);
+
+	return 0;
+}
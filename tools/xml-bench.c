@@ -0,0 +1,309 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2011  Intel Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Compares the listing generators before and after the switch to the
+ * xml.h writer: the same synthetic folder, vCard and message listings are
+ * rendered with the printf + g_markup based code and with the writer, and
+ * CPU time and GLib allocations are reported per listing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <glib.h>
+
+#include "xml.h"
+
+static int option_entries = 10000;
+static int option_rounds = 20;
+
+static GOptionEntry options[] = {
+	{ "entries", 'n', 0, G_OPTION_ARG_INT, &option_entries,
+			"Number of entries per listing", "NUM" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &option_rounds,
+			"Number of times each listing is rendered", "NUM" },
+	{ NULL },
+};
+
+static gsize allocations = 0;
+
+static gpointer count_malloc(gsize size)
+{
+	allocations++;
+	return malloc(size);
+}
+
+static gpointer count_realloc(gpointer mem, gsize size)
+{
+	allocations++;
+	return realloc(mem, size);
+}
+
+static GMemVTable count_vtable = {
+	.malloc = count_malloc,
+	.realloc = count_realloc,
+	.free = free,
+};
+
+struct entry {
+	char *name;
+	uint64_t size;
+	time_t mtime;
+	unsigned int handle;
+	char *handle_str;
+	char *subject;
+	char *datetime;
+	char *sender;
+};
+
+typedef void (*render_func) (GString *out, const struct entry *entry);
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void folder_printf(GString *out, const struct entry *e)
+{
+	char atime[18], mtime[18], ctime[18];
+	char *escaped, *line;
+
+	strftime(atime, 17, "%Y%m%dT%H%M%SZ", gmtime(&e->mtime));
+	strftime(mtime, 17, "%Y%m%dT%H%M%SZ", gmtime(&e->mtime));
+	strftime(ctime, 17, "%Y%m%dT%H%M%SZ", gmtime(&e->mtime));
+
+	escaped = g_markup_escape_text(e->name, -1);
+	line = g_strdup_printf("<file name=\"%s\" size=\"%" PRIu64 "\""
+				" accessed=\"%s\" modified=\"%s\""
+				" created=\"%s\"/>\n", escaped, e->size,
+				atime, mtime, ctime);
+	g_string_append(out, line);
+
+	g_free(line);
+	g_free(escaped);
+}
+
+static void folder_writer(GString *out, const struct entry *e)
+{
+	g_string_append(out, "<file");
+	xml_attr(out, "name", e->name);
+	xml_attr_uint64(out, "size", e->size);
+	xml_attr_time(out, "accessed", e->mtime);
+	xml_attr_time(out, "modified", e->mtime);
+	xml_attr_time(out, "created", e->mtime);
+	g_string_append(out, "/>\n");
+}
+
+static void vcard_printf(GString *out, const struct entry *e)
+{
+	char *escaped = g_markup_escape_text(e->name, -1);
+
+	g_string_append_printf(out, "<card handle = \"%d.vcf\" name = "
+					"\"%s\"/>\n", e->handle, escaped);
+
+	g_free(escaped);
+}
+
+static void vcard_writer(GString *out, const struct entry *e)
+{
+	g_string_append(out, "<card handle = \"");
+	xml_append_uint64(out, e->handle);
+	g_string_append(out, ".vcf\" name = \"");
+	xml_append_escaped(out, e->name);
+	g_string_append(out, "\"/>\n");
+}
+
+static void append_escaped_printf(GString *out, const char *format, ...)
+{
+	va_list ap;
+	char *escaped;
+
+	va_start(ap, format);
+	escaped = g_markup_vprintf_escaped(format, ap);
+	g_string_append(out, escaped);
+	g_free(escaped);
+	va_end(ap);
+}
+
+static void msg_printf(GString *out, const struct entry *e)
+{
+	g_string_append(out, "<msg");
+	append_escaped_printf(out, " handle=\"%s\"", e->handle_str);
+	append_escaped_printf(out, " subject=\"%s\"", e->subject);
+	append_escaped_printf(out, " datetime=\"%s\"", e->datetime);
+	append_escaped_printf(out, " sender_name=\"%s\"", e->sender);
+	append_escaped_printf(out, " read=\"%s\"", "yes");
+	g_string_append(out, "/>\n");
+}
+
+static void msg_writer(GString *out, const struct entry *e)
+{
+	g_string_append(out, "<msg");
+	xml_attr(out, "handle", e->handle_str);
+	xml_attr(out, "subject", e->subject);
+	xml_attr(out, "datetime", e->datetime);
+	xml_attr(out, "sender_name", e->sender);
+	xml_attr(out, "read", "yes");
+	g_string_append(out, "/>\n");
+}
+
+static GString *render(const struct entry *entries, int count,
+					render_func func, gboolean presize)
+{
+	GString *out;
+	int i;
+
+	out = presize ? g_string_sized_new(count * 128) : g_string_new("");
+
+	for (i = 0; i < count; i++)
+		func(out, &entries[i]);
+
+	return out;
+}
+
+static void bench(const char *test, const struct entry *entries,
+				render_func old_func, render_func new_func)
+{
+	GString *old_out, *new_out;
+	gsize old_allocs, new_allocs;
+	double start, old_time, new_time;
+	int i;
+
+	old_out = render(entries, option_entries, old_func, FALSE);
+	new_out = render(entries, option_entries, new_func, TRUE);
+
+	if (!g_str_equal(old_out->str, new_out->str))
+		fprintf(stderr, "%s: outputs differ\n", test);
+
+	g_string_free(old_out, TRUE);
+	g_string_free(new_out, TRUE);
+
+	allocations = 0;
+	start = now();
+	for (i = 0; i < option_rounds; i++)
+		g_string_free(render(entries, option_entries, old_func, FALSE),
+									TRUE);
+	old_time = (now() - start) / option_rounds;
+	old_allocs = allocations / option_rounds;
+
+	allocations = 0;
+	start = now();
+	for (i = 0; i < option_rounds; i++)
+		g_string_free(render(entries, option_entries, new_func, TRUE),
+									TRUE);
+	new_time = (now() - start) / option_rounds;
+	new_allocs = allocations / option_rounds;
+
+	printf("%-8s printf %8.3f ms %8" G_GSIZE_FORMAT " allocs   "
+			"writer %8.3f ms %8" G_GSIZE_FORMAT " allocs\n",
+			test, old_time * 1000, old_allocs,
+			new_time * 1000, new_allocs);
+}
+
+static struct entry *entries_new(int count)
+{
+	struct entry *entries = g_new0(struct entry, count);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct entry *e = &entries[i];
+
+		/* Every tenth entry needs escaping */
+		e->name = g_strdup_printf(i % 10 ? "Document %d.odt" :
+					"Tom & Jerry <%d>.odt", i);
+		e->size = (uint64_t) i * 4099;
+		e->mtime = 1300000000 + i * 60;
+		e->handle = i;
+		e->handle_str = g_strdup_printf("%016X", i);
+		e->subject = g_strdup_printf("Re: \"meeting\" #%d", i);
+		e->datetime = g_strdup("20110324T120000");
+		e->sender = g_strdup(e->name);
+	}
+
+	return entries;
+}
+
+static void entries_free(struct entry *entries, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		g_free(entries[i].name);
+		g_free(entries[i].handle_str);
+		g_free(entries[i].subject);
+		g_free(entries[i].datetime);
+		g_free(entries[i].sender);
+	}
+
+	g_free(entries);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct entry *entries;
+
+	/* Must come before anything else allocates */
+	g_mem_set_vtable(&count_vtable);
+
+	/* Timestamps are rendered in UTC by both implementations */
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	g_option_context_parse(context, &argc, &argv, &gerr);
+	if (gerr != NULL) {
+		g_printerr("%s\n", gerr->message);
+		g_error_free(gerr);
+		exit(EXIT_FAILURE);
+	}
+
+	g_option_context_free(context);
+
+	if (option_entries <= 0 || option_rounds <= 0) {
+		g_printerr("Invalid number of entries or rounds\n");
+		exit(EXIT_FAILURE);
+	}
+
+	entries = entries_new(option_entries);
+
+	bench("folder", entries, folder_printf, folder_writer);
+	bench("vcard", entries, vcard_printf, vcard_writer);
+	bench("message", entries, msg_printf, msg_writer);
+
+	entries_free(entries, option_entries);
+
+	return 0;
+}
@@ -0,0 +1,349 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+#include "messages.h"
+#include "bmsg.h"
+
+#define BMSG_OVERHEAD	22
+
+/* Content with lines the envelope parser must not look at */
+static const char content[] = "Hello\r\nEND:BMSG\r\nBEGIN:MSG\r\n\0\xff bin";
+
+struct test_push {
+	unsigned int begun;
+	unsigned int ended;
+	char *type;
+	gboolean read;
+	char *encoding;
+	char *charset;
+	GSList *recipients;
+	GString *content;
+	int begin_err;
+};
+
+static int push_begin(const struct messages_bmessage *bmsg, void *user_data)
+{
+	struct test_push *t = user_data;
+	GSList *l;
+
+	if (t->begin_err < 0)
+		return t->begin_err;
+
+	t->begun++;
+	t->type = g_strdup(bmsg->type);
+	t->read = bmsg->read;
+	t->encoding = g_strdup(bmsg->encoding);
+	t->charset = g_strdup(bmsg->charset);
+
+	for (l = bmsg->recipients; l; l = l->next)
+		t->recipients = g_slist_append(t->recipients,
+							g_strdup(l->data));
+
+	return 0;
+}
+
+static int push_data(const char *chunk, size_t len, void *user_data)
+{
+	struct test_push *t = user_data;
+
+	g_assert(t->begun == 1);
+	g_string_append_len(t->content, chunk, len);
+
+	return 0;
+}
+
+static int push_end(void *user_data)
+{
+	struct test_push *t = user_data;
+
+	t->ended++;
+
+	return 0;
+}
+
+static const struct bmsg_parser_cb push_cb = {
+	.begin = push_begin,
+	.data = push_data,
+	.end = push_end,
+};
+
+static void test_push_init(struct test_push *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->content = g_string_new(NULL);
+}
+
+static void test_push_clear(struct test_push *t)
+{
+	g_free(t->type);
+	g_free(t->encoding);
+	g_free(t->charset);
+	g_slist_free_full(t->recipients, g_free);
+	g_string_free(t->content, TRUE);
+}
+
+static GString *build_bmsg(const char *type, const char *length)
+{
+	GString *bmsg = g_string_new("BEGIN:BMSG\r\nVERSION:1.0\r\n"
+						"STATUS:READ\r\n");
+
+	if (type)
+		g_string_append_printf(bmsg, "TYPE:%s\r\n", type);
+
+	g_string_append(bmsg, "FOLDER:telecom/msg/outbox\r\n"
+			/* The originator is not a recipient */
+			"BEGIN:VCARD\r\nVERSION:2.1\r\nN:Me\r\n"
+			"TEL:+100\r\nEND:VCARD\r\n"
+			"BEGIN:BENV\r\n"
+			"BEGIN:VCARD\r\nVERSION:2.1\r\nN:Alice\r\n"
+			"TEL:+4412345\r\nEMAIL:alice@example.com\r\n"
+			"END:VCARD\r\n"
+			"BEGIN:BBODY\r\nENCODING:8BIT\r\nCHARSET:UTF-8\r\n");
+
+	if (length)
+		g_string_append_printf(bmsg, "LENGTH:%s\r\n", length);
+	else
+		g_string_append_printf(bmsg, "LENGTH:%zu\r\n",
+					sizeof(content) - 1 + BMSG_OVERHEAD);
+
+	g_string_append(bmsg, "BEGIN:MSG\r\n");
+	g_string_append_len(bmsg, content, sizeof(content) - 1);
+	g_string_append(bmsg, "\r\nEND:MSG\r\nEND:BBODY\r\nEND:BENV\r\n"
+							"END:BMSG\r\n");
+
+	return bmsg;
+}
+
+static int feed(struct test_push *t, const GString *bmsg, size_t step)
+{
+	struct bmsg_parser *parser;
+	size_t offset;
+	int err = 0;
+
+	parser = bmsg_parser_new(&push_cb, t);
+
+	for (offset = 0; offset < bmsg->len && err == 0; offset += step)
+		err = bmsg_parser_feed(parser, bmsg->str + offset,
+					MIN(step, bmsg->len - offset));
+
+	if (err == 0)
+		g_assert(bmsg_parser_finished(parser));
+
+	bmsg_parser_free(parser);
+
+	return err;
+}
+
+static void check_valid(struct test_push *t)
+{
+	g_assert_cmpuint(t->begun, ==, 1);
+	g_assert_cmpuint(t->ended, ==, 1);
+	g_assert_cmpstr(t->type, ==, "SMS_GSM");
+	g_assert(t->read);
+	g_assert_cmpstr(t->encoding, ==, "8BIT");
+	g_assert_cmpstr(t->charset, ==, "UTF-8");
+
+	g_assert_cmpuint(g_slist_length(t->recipients), ==, 2);
+	g_assert_cmpstr(t->recipients->data, ==, "+4412345");
+	g_assert_cmpstr(t->recipients->next->data, ==, "alice@example.com");
+
+	g_assert_cmpuint(t->content->len, ==, sizeof(content) - 1);
+	g_assert(memcmp(t->content->str, content, sizeof(content) - 1) == 0);
+}
+
+static void test_push_valid(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	bmsg = build_bmsg("SMS_GSM", NULL);
+
+	g_assert_cmpint(feed(&t, bmsg, bmsg->len), ==, 0);
+	check_valid(&t);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+static void test_push_bytewise(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	bmsg = build_bmsg("SMS_GSM", NULL);
+
+	/* Lines and content split across every possible boundary */
+	g_assert_cmpint(feed(&t, bmsg, 1), ==, 0);
+	check_valid(&t);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+static void test_push_trailing(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	bmsg = build_bmsg("SMS_GSM", NULL);
+	g_string_append(bmsg, "END:BMSG\r\nBEGIN:MSG\r\n");
+
+	/* Nothing is parsed after END:BMSG */
+	g_assert_cmpint(feed(&t, bmsg, bmsg->len), ==, 0);
+	check_valid(&t);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+static void test_push_bad_length(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	bmsg = build_bmsg("SMS_GSM", "12x");
+
+	g_assert_cmpint(feed(&t, bmsg, bmsg->len), ==, -EBADMSG);
+	g_assert_cmpuint(t.begun, ==, 0);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+
+	test_push_init(&t);
+	bmsg = build_bmsg("SMS_GSM", "");
+
+	g_assert_cmpint(feed(&t, bmsg, bmsg->len), ==, -EBADMSG);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+static void test_push_short_length(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	bmsg = build_bmsg("SMS_GSM", "10");
+
+	/* Shorter than BEGIN:MSG and END:MSG themselves */
+	g_assert_cmpint(feed(&t, bmsg, bmsg->len), ==, -EBADMSG);
+	g_assert_cmpuint(t.begun, ==, 0);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+static void test_push_no_type(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	bmsg = build_bmsg(NULL, NULL);
+
+	g_assert_cmpint(feed(&t, bmsg, bmsg->len), ==, -EBADMSG);
+	g_assert_cmpuint(t.begun, ==, 0);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+static void test_push_no_msg(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	bmsg = g_string_new("BEGIN:BMSG\r\nVERSION:1.0\r\nTYPE:SMS_GSM\r\n"
+				"BEGIN:BENV\r\nEND:BENV\r\nEND:BMSG\r\n");
+
+	g_assert_cmpint(feed(&t, bmsg, bmsg->len), ==, -EBADMSG);
+	g_assert_cmpuint(t.ended, ==, 0);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+static void test_push_long_line(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	bmsg = g_string_new("BEGIN:BMSG\r\nFOLDER:");
+
+	while (bmsg->len < 2048)
+		g_string_append_c(bmsg, 'x');
+
+	/* Refused even before the end of the line arrives */
+	g_assert_cmpint(feed(&t, bmsg, 100), ==, -EBADMSG);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+static void test_push_begin_error(void)
+{
+	struct test_push t;
+	GString *bmsg;
+
+	test_push_init(&t);
+	t.begin_err = -ENOSPC;
+	bmsg = build_bmsg("SMS_GSM", NULL);
+
+	g_assert_cmpint(feed(&t, bmsg, bmsg->len), ==, -ENOSPC);
+	g_assert_cmpuint(t.content->len, ==, 0);
+	g_assert_cmpuint(t.ended, ==, 0);
+
+	g_string_free(bmsg, TRUE);
+	test_push_clear(&t);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/bmsg/test_push_valid", test_push_valid);
+	g_test_add_func("/bmsg/test_push_bytewise", test_push_bytewise);
+	g_test_add_func("/bmsg/test_push_trailing", test_push_trailing);
+	g_test_add_func("/bmsg/test_push_bad_length", test_push_bad_length);
+	g_test_add_func("/bmsg/test_push_short_length",
+						test_push_short_length);
+	g_test_add_func("/bmsg/test_push_no_type", test_push_no_type);
+	g_test_add_func("/bmsg/test_push_no_msg", test_push_no_msg);
+	g_test_add_func("/bmsg/test_push_long_line", test_push_long_line);
+	g_test_add_func("/bmsg/test_push_begin_error",
+						test_push_begin_error);
+
+	g_test_run();
+
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "fileio.h"
+
+/* Built with SENDFILE_MAX set to this, see Makefile.am */
+#define SENDFILE_MAX	4096
+
+#define COPY_SIZE	(256 * 1024 + 123)
+#define SIZE_4GIB	(G_GINT64_CONSTANT(1) << 32)
+
+static int open_tmp(gint64 size)
+{
+	char *name;
+	int fd;
+
+	fd = g_file_open_tmp("test-fileio-XXXXXX", &name, NULL);
+	g_assert(fd >= 0);
+
+	unlink(name);
+	g_free(name);
+
+	/* Sparse, nothing is written below size */
+	g_assert(ftruncate(fd, size) == 0);
+
+	return fd;
+}
+
+static int open_pattern(void)
+{
+	guint8 buf[COPY_SIZE];
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i % 251;
+
+	fd = open_tmp(0);
+	g_assert(write(fd, buf, sizeof(buf)) == sizeof(buf));
+
+	return fd;
+}
+
+static void check_pattern(int fd)
+{
+	guint8 buf[COPY_SIZE];
+	struct stat st;
+	unsigned int i;
+
+	g_assert(fstat(fd, &st) == 0);
+	g_assert_cmpint(st.st_size, ==, COPY_SIZE);
+
+	g_assert(pread(fd, buf, sizeof(buf), 0) == sizeof(buf));
+
+	for (i = 0; i < sizeof(buf); i++)
+		g_assert_cmpuint(buf[i], ==, i % 251);
+}
+
+static void test_length_fits(void)
+{
+	g_assert(fileio_length_fits(0));
+	g_assert(fileio_length_fits(UINT32_MAX));
+	g_assert(!fileio_length_fits((int64_t) UINT32_MAX + 1));
+	g_assert(!fileio_length_fits(SIZE_4GIB * 2));
+
+	/* Unknown size */
+	g_assert(!fileio_length_fits(-1));
+}
+
+static void test_sendfile_offset(void)
+{
+	int in, out;
+	off_t offset = 0;
+
+	in = open_pattern();
+	out = open_tmp(0);
+
+	/* Takes many calls of at most SENDFILE_MAX bytes */
+	g_assert_cmpint(fileio_sendfile(out, in, &offset, COPY_SIZE), ==, 0);
+	g_assert_cmpint(offset, ==, COPY_SIZE);
+
+	check_pattern(out);
+
+	close(in);
+	close(out);
+}
+
+static void test_sendfile_position(void)
+{
+	int in, out;
+
+	in = open_pattern();
+	out = open_tmp(0);
+
+	/* Without an offset the file position moves, as in a copy */
+	g_assert(lseek(in, 0, SEEK_SET) == 0);
+	g_assert_cmpint(fileio_sendfile(out, in, NULL, COPY_SIZE), ==, 0);
+	g_assert_cmpint(lseek(in, 0, SEEK_CUR), ==, COPY_SIZE);
+
+	check_pattern(out);
+
+	close(in);
+	close(out);
+}
+
+static void test_sendfile_short(void)
+{
+	int in, out;
+	off_t offset = 0;
+
+	in = open_pattern();
+	out = open_tmp(0);
+
+	g_assert_cmpint(fileio_sendfile(out, in, &offset, COPY_SIZE + 1), ==,
+									-EIO);
+	g_assert_cmpint(offset, ==, COPY_SIZE);
+
+	close(in);
+	close(out);
+}
+
+static void test_sendfile_4gib(void)
+{
+	off_t offset = SIZE_4GIB - SENDFILE_MAX;
+	char mark[4];
+	int in, out;
+
+	in = open_tmp(SIZE_4GIB + SENDFILE_MAX);
+	out = open_tmp(0);
+
+	g_assert(pwrite(in, "head", 4, offset) == 4);
+	g_assert(pwrite(in, "4GiB", 4, SIZE_4GIB) == 4);
+	g_assert(pwrite(in, "tail", 4, SIZE_4GIB + SENDFILE_MAX - 4) == 4);
+
+	/* Offsets past 32 bits are neither truncated nor wrapped */
+	g_assert_cmpint(fileio_sendfile(out, in, &offset, 2 * SENDFILE_MAX),
+									==, 0);
+	g_assert_cmpint(offset, ==, SIZE_4GIB + SENDFILE_MAX);
+
+	g_assert(pread(out, mark, 4, 0) == 4);
+	g_assert(memcmp(mark, "head", 4) == 0);
+	g_assert(pread(out, mark, 4, SENDFILE_MAX) == 4);
+	g_assert(memcmp(mark, "4GiB", 4) == 0);
+	g_assert(pread(out, mark, 4, 2 * SENDFILE_MAX - 4) == 4);
+	g_assert(memcmp(mark, "tail", 4) == 0);
+
+	close(in);
+	close(out);
+}
+
+static void test_preallocate(void)
+{
+	struct stat st;
+	int fd, err;
+
+	fd = open_tmp(0);
+
+	/* Unknown and empty sizes are left alone */
+	g_assert_cmpint(fileio_preallocate(fd, -1), ==, 0);
+	g_assert_cmpint(fileio_preallocate(fd, 0), ==, 0);
+
+	err = fileio_preallocate(fd, COPY_SIZE);
+	if (err == -EOPNOTSUPP) {
+		g_test_message("fallocate not supported, skipping");
+		goto done;
+	}
+
+	g_assert_cmpint(err, ==, 0);
+
+	/* The blocks are there, the size is not */
+	g_assert(fstat(fd, &st) == 0);
+	g_assert_cmpint(st.st_size, ==, 0);
+	g_assert_cmpint((gint64) st.st_blocks * 512, >=, COPY_SIZE);
+
+done:
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/fileio/test_length_fits", test_length_fits);
+	g_test_add_func("/fileio/test_sendfile_offset", test_sendfile_offset);
+	g_test_add_func("/fileio/test_sendfile_position",
+						test_sendfile_position);
+	g_test_add_func("/fileio/test_sendfile_short", test_sendfile_short);
+	g_test_add_func("/fileio/test_sendfile_4gib", test_sendfile_4gib);
+	g_test_add_func("/fileio/test_preallocate", test_preallocate);
+
+	g_test_run();
+
+	return 0;
+}
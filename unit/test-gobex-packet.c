@@ -39,6 +39,12 @@ static uint8_t pkt_put_body[] = { G_OBEX_OP_PUT, 0x00, 0x0a,
 static uint8_t pkt_put[] = { G_OBEX_OP_PUT, 0x00, 0x03 };
 
 static uint8_t pkt_nval_len[] = { G_OBEX_OP_PUT, 0xab, 0xcd, 0x12 };
+static uint8_t pkt_nval_hdr_len[] = { G_OBEX_OP_PUT, 0x00, 0x07,
+					G_OBEX_HDR_BODY, 0x00, 0x09, 0x01 };
+static uint8_t pkt_put_connid_action[] = { G_OBEX_OP_PUT, 0x00, 0x0a,
+					G_OBEX_HDR_CONNECTION,
+						0x01, 0x02, 0x03, 0x04,
+					G_OBEX_HDR_ACTION, 0xab };
 
 static guint8 pkt_put_long[] = { G_OBEX_OP_PUT, 0x00, 0x32,
 	G_OBEX_HDR_CONNECTION, 0x01, 0x02, 0x03, 0x04,
@@ -133,6 +139,96 @@ static void test_decode_nval(void)
 	g_error_free(err);
 }
 
+static void test_decode_nval_header(void)
+{
+	GObexPacket *pkt;
+	GError *err = NULL;
+
+	pkt = g_obex_packet_decode(pkt_nval_hdr_len, sizeof(pkt_nval_hdr_len),
+						0, G_OBEX_DATA_REF, &err);
+	g_assert_error(err, G_OBEX_ERROR, G_OBEX_ERROR_PARSE_ERROR);
+	g_assert(pkt == NULL);
+
+	g_error_free(err);
+}
+
+static void test_decode_lookup(void)
+{
+	GObexPacket *pkt;
+	GObexHeader *header;
+	GError *err = NULL;
+	const char *str;
+	guint32 val;
+
+	pkt = g_obex_packet_decode(pkt_put_long, sizeof(pkt_put_long),
+						0, G_OBEX_DATA_COPY, &err);
+	g_assert_no_error(err);
+
+	header = g_obex_packet_get_header(pkt, G_OBEX_HDR_NAME);
+	g_assert(header != NULL);
+	g_assert(g_obex_packet_get_header(pkt, G_OBEX_HDR_NAME) == header);
+
+	g_assert(g_obex_header_get_unicode(header, &str) == TRUE);
+	g_assert_cmpstr(str, ==, "file.txt");
+
+	header = g_obex_packet_get_header(pkt, G_OBEX_HDR_CONNECTION);
+	g_assert(header != NULL);
+	g_assert(g_obex_header_get_uint32(header, &val) == TRUE);
+	g_assert_cmpuint(val, ==, 0x01020304);
+
+	g_assert(g_obex_packet_get_body(pkt) != NULL);
+	g_assert(g_obex_packet_get_header(pkt, G_OBEX_HDR_WHO) == NULL);
+
+	g_obex_packet_free(pkt);
+}
+
+static void test_decode_encode_long(void)
+{
+	GObexPacket *pkt;
+	GError *err = NULL;
+	uint8_t buf[255];
+	gssize len;
+
+	pkt = g_obex_packet_decode(pkt_put_long, sizeof(pkt_put_long),
+						0, G_OBEX_DATA_REF, &err);
+	g_assert_no_error(err);
+
+	g_assert(g_obex_packet_get_header(pkt, G_OBEX_HDR_TYPE) != NULL);
+
+	len = g_obex_packet_encode(pkt, buf, sizeof(buf));
+	g_assert(len > 0);
+
+	assert_memequal(pkt_put_long, sizeof(pkt_put_long), buf, len);
+
+	g_obex_packet_free(pkt);
+}
+
+static void test_decode_prepend(void)
+{
+	GObexPacket *pkt;
+	GObexHeader *header;
+	GError *err = NULL;
+	uint8_t buf[255];
+	gssize len;
+
+	pkt = g_obex_packet_decode(pkt_put_action, sizeof(pkt_put_action),
+						0, G_OBEX_DATA_REF, &err);
+	g_assert_no_error(err);
+
+	header = g_obex_header_new_uint32(G_OBEX_HDR_CONNECTION, 0x01020304);
+	g_obex_packet_prepend_header(pkt, header);
+
+	g_assert(g_obex_packet_get_header(pkt, G_OBEX_HDR_ACTION) != NULL);
+
+	len = g_obex_packet_encode(pkt, buf, sizeof(buf));
+	g_assert(len > 0);
+
+	assert_memequal(pkt_put_connid_action, sizeof(pkt_put_connid_action),
+								buf, len);
+
+	g_obex_packet_free(pkt);
+}
+
 static void test_decode_encode(void)
 {
 	GObexPacket *pkt;
@@ -241,8 +337,14 @@ int main(int argc, char *argv[])
 						test_decode_connect);
 
 	g_test_add_func("/gobex/test_decode_nval", test_decode_nval);
+	g_test_add_func("/gobex/test_decode_nval_header",
+						test_decode_nval_header);
+	g_test_add_func("/gobex/test_decode_lookup", test_decode_lookup);
+	g_test_add_func("/gobex/test_decode_prepend", test_decode_prepend);
 
 	g_test_add_func("/gobex/test_encode_pkt", test_decode_encode);
+	g_test_add_func("/gobex/test_encode_pkt_long",
+						test_decode_encode_long);
 
 	g_test_add_func("/gobex/test_encode_on_demand", test_encode_on_demand);
 	g_test_add_func("/gobex/test_encode_on_demand_fail",
@@ -0,0 +1,290 @@
+/*
+ *
+ *  OBEX library with GLib integration
+ *
+ *  Copyright (C) 2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <gobex/gobex.h>
+
+#include "util.h"
+
+#define BULK_SIZE	(64 * 1024)
+#define BULK_RATE	(128 * 1024)
+#define SMALL_SIZE	512
+
+struct pair {
+	GObex *client;
+	GObex *server;
+	gsize size;
+	gsize provided;
+	gsize received;
+	gboolean done;
+	double start;
+	double finish;
+	struct test_data *d;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static gssize provide_data(void *buf, gsize len, gpointer user_data)
+{
+	struct pair *p = user_data;
+	gsize count = MIN(len, p->size - p->provided);
+
+	memset(buf, 0xab, count);
+	p->provided += count;
+
+	return count;
+}
+
+static void server_complete(GObex *obex, GError *err, gpointer user_data)
+{
+	struct pair *p = user_data;
+
+	if (err != NULL && p->d->err == NULL)
+		p->d->err = g_error_copy(err);
+}
+
+static void handle_get(GObex *obex, GObexPacket *req, gpointer user_data)
+{
+	struct pair *p = user_data;
+
+	g_obex_get_rsp(obex, provide_data, server_complete, p, &p->d->err,
+							G_OBEX_HDR_INVALID);
+}
+
+static void create_pair(struct pair *p, struct test_data *d, gsize size)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+		g_printerr("socketpair: %s", strerror(errno));
+		abort();
+	}
+
+	memset(p, 0, sizeof(*p));
+	p->d = d;
+	p->size = size;
+
+	p->client = create_gobex(sv[0], G_OBEX_TRANSPORT_STREAM, TRUE);
+	g_assert(p->client != NULL);
+
+	p->server = create_gobex(sv[1], G_OBEX_TRANSPORT_STREAM, TRUE);
+	g_assert(p->server != NULL);
+
+	g_obex_add_request_function(p->server, G_OBEX_OP_GET, handle_get, p);
+}
+
+static void destroy_pair(struct pair *p)
+{
+	g_obex_unref(p->client);
+	g_obex_unref(p->server);
+}
+
+static gboolean recv_data(const void *buf, gsize len, gpointer user_data)
+{
+	struct pair *p = user_data;
+
+	p->received += len;
+
+	return TRUE;
+}
+
+static void client_complete(GObex *obex, GError *err, gpointer user_data)
+{
+	struct pair *p = user_data;
+
+	if (err != NULL && p->d->err == NULL)
+		p->d->err = g_error_copy(err);
+
+	p->done = TRUE;
+	p->finish = now();
+
+	if (++p->d->count == 2 || err != NULL)
+		g_main_loop_quit(p->d->mainloop);
+}
+
+static void start_get(struct pair *p)
+{
+	p->start = now();
+
+	g_obex_get_req(p->client, recv_data, client_complete, p, &p->d->err,
+						G_OBEX_HDR_NAME, "file.txt",
+						G_OBEX_HDR_INVALID);
+	g_assert_no_error(p->d->err);
+}
+
+static void test_shaper_rate(void)
+{
+	struct test_data d = { 0, NULL };
+	struct pair p;
+	GObexShaper *shaper;
+	guint timer_id;
+	double elapsed;
+
+	create_pair(&p, &d, BULK_SIZE);
+
+	shaper = g_obex_shaper_new(BULK_RATE);
+	g_obex_add_shaper(p.server, shaper);
+
+	d.mainloop = g_main_loop_new(NULL, FALSE);
+	timer_id = g_timeout_add_seconds(5, test_timeout, &d);
+
+	/* Only one transfer, count the missing one as done */
+	d.count = 1;
+	start_get(&p);
+
+	g_main_loop_run(d.mainloop);
+
+	g_assert_no_error(d.err);
+	g_assert_cmpuint(p.received, ==, BULK_SIZE);
+
+	/* Everything beyond the initial burst has to wait for tokens */
+	elapsed = p.finish - p.start;
+	g_assert_cmpfloat(elapsed, >=, 0.3);
+	g_assert_cmpfloat(elapsed, <, 2.0);
+
+	g_source_remove(timer_id);
+	g_main_loop_unref(d.mainloop);
+
+	g_obex_shaper_unref(shaper);
+	destroy_pair(&p);
+}
+
+static void test_shaper_shared(void)
+{
+	struct test_data d = { 0, NULL };
+	struct pair p1, p2;
+	GObexShaper *shaper;
+	guint timer_id;
+	double elapsed;
+
+	create_pair(&p1, &d, BULK_SIZE / 2);
+	create_pair(&p2, &d, BULK_SIZE / 2);
+
+	/* One bucket for both, like all sessions to the same peer */
+	shaper = g_obex_shaper_new(BULK_RATE);
+	g_obex_add_shaper(p1.server, shaper);
+	g_obex_add_shaper(p2.server, shaper);
+
+	d.mainloop = g_main_loop_new(NULL, FALSE);
+	timer_id = g_timeout_add_seconds(5, test_timeout, &d);
+
+	start_get(&p1);
+	start_get(&p2);
+
+	g_main_loop_run(d.mainloop);
+
+	g_assert_no_error(d.err);
+	g_assert_cmpuint(p1.received + p2.received, ==, BULK_SIZE);
+
+	elapsed = MAX(p1.finish, p2.finish) - MIN(p1.start, p2.start);
+	g_assert_cmpfloat(elapsed, >=, 0.3);
+
+	g_source_remove(timer_id);
+	g_main_loop_unref(d.mainloop);
+
+	g_obex_shaper_unref(shaper);
+	destroy_pair(&p1);
+	destroy_pair(&p2);
+}
+
+static gboolean start_small(gpointer user_data)
+{
+	start_get(user_data);
+
+	return FALSE;
+}
+
+static void test_shaper_latency(void)
+{
+	struct test_data d = { 0, NULL };
+	struct pair bulk, small;
+	GObexShaper *session, *peer;
+	guint timer_id;
+	double elapsed;
+
+	create_pair(&bulk, &d, BULK_SIZE);
+	create_pair(&small, &d, SMALL_SIZE);
+
+	/* The bulk transfer is capped well below the peer budget */
+	session = g_obex_shaper_new(BULK_RATE / 4);
+	peer = g_obex_shaper_new(BULK_RATE * 8);
+
+	g_obex_add_shaper(bulk.server, session);
+	g_obex_add_shaper(bulk.server, peer);
+	g_obex_add_shaper(small.server, peer);
+
+	d.mainloop = g_main_loop_new(NULL, FALSE);
+	timer_id = g_timeout_add_seconds(5, test_timeout, &d);
+
+	start_get(&bulk);
+	g_timeout_add(200, start_small, &small);
+
+	/* Stop as soon as the small request is done */
+	d.count = 1;
+
+	g_main_loop_run(d.mainloop);
+
+	g_assert_no_error(d.err);
+	g_assert(small.done);
+	g_assert_cmpuint(small.received, ==, SMALL_SIZE);
+
+	elapsed = small.finish - small.start;
+	g_assert_cmpfloat(elapsed, <, 0.1);
+
+	/* Burst plus rate times the elapsed time, with some slack */
+	g_assert(!bulk.done);
+	g_assert_cmpuint(bulk.received, <=, 4096 +
+			(small.finish - bulk.start) * BULK_RATE / 4 + 4096);
+
+	g_source_remove(timer_id);
+	g_main_loop_unref(d.mainloop);
+
+	g_obex_shaper_unref(session);
+	g_obex_shaper_unref(peer);
+	destroy_pair(&bulk);
+	destroy_pair(&small);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/gobex/test_shaper_rate", test_shaper_rate);
+	g_test_add_func("/gobex/test_shaper_shared", test_shaper_shared);
+	g_test_add_func("/gobex/test_shaper_latency", test_shaper_latency);
+
+	g_test_run();
+
+	return 0;
+}
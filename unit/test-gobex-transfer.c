@@ -73,6 +73,11 @@ static guint8 get_rsp_first_app[] = { G_OBEX_RSP_CONTINUE | FINAL_BIT, 0x00, 0x0
 static guint8 get_rsp_first[] = { G_OBEX_RSP_CONTINUE | FINAL_BIT, 0x00, 0x10,
 					G_OBEX_HDR_BODY, 0x00, 0x0d,
 					0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+static guint8 get_rsp_first_len[] = { G_OBEX_RSP_CONTINUE | FINAL_BIT,
+					0x00, 0x15,
+					G_OBEX_HDR_LENGTH, 0x00, 0x00, 0x00, 0x0a,
+					G_OBEX_HDR_BODY, 0x00, 0x0d,
+					0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
 static guint8 get_rsp_last[] = { G_OBEX_RSP_SUCCESS | FINAL_BIT, 0x00, 0x06,
 					G_OBEX_HDR_BODY_END, 0x00, 0x03 };
 
@@ -364,6 +369,65 @@ static void test_get_req(void)
 	g_assert_no_error(d.err);
 }
 
+static guint get_len_id = 0;
+
+static gboolean rcv_data_len(const void *buf, gsize len, gpointer user_data)
+{
+	struct test_data *d = user_data;
+	guint32 length;
+
+	if (!g_obex_get_transfer_length(get_len_id, &length))
+		d->err = g_error_new(TEST_ERROR, TEST_ERROR_UNEXPECTED,
+					"Length header not available");
+	else if (length != sizeof(body_data))
+		d->err = g_error_new(TEST_ERROR, TEST_ERROR_UNEXPECTED,
+					"Unexpected length %u", length);
+
+	return rcv_data(buf, len, user_data);
+}
+
+static void test_get_req_len(void)
+{
+	GIOChannel *io;
+	GIOCondition cond;
+	guint io_id, timer_id;
+	GObex *obex;
+	struct test_data d = { 0, NULL, {
+				{ get_req_first, sizeof(get_req_first) },
+				{ get_req_last, sizeof(get_req_last) } }, {
+				{ get_rsp_first_len, sizeof(get_rsp_first_len) },
+				{ get_rsp_last, sizeof(get_rsp_last) } } };
+
+	create_endpoints(&obex, &io, SOCK_STREAM);
+
+	cond = G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+	io_id = g_io_add_watch(io, cond, test_io_cb, &d);
+
+	d.mainloop = g_main_loop_new(NULL, FALSE);
+
+	timer_id = g_timeout_add_seconds(1, test_timeout, &d);
+
+	get_len_id = g_obex_get_req(obex, rcv_data_len, transfer_complete,
+				&d, &d.err,
+				G_OBEX_HDR_TYPE, hdr_type, sizeof(hdr_type),
+				G_OBEX_HDR_NAME, "file.txt",
+				G_OBEX_HDR_INVALID);
+	g_assert_no_error(d.err);
+
+	g_main_loop_run(d.mainloop);
+
+	g_assert_cmpuint(d.count, ==, 2);
+
+	g_main_loop_unref(d.mainloop);
+
+	g_source_remove(timer_id);
+	g_io_channel_unref(io);
+	g_source_remove(io_id);
+	g_obex_unref(obex);
+
+	g_assert_no_error(d.err);
+}
+
 static void test_get_req_app(void)
 {
 	GIOChannel *io;
@@ -1348,6 +1412,8 @@ int main(int argc, char *argv[])
 	g_test_add_func("/gobex/test_get_req", test_get_req);
 	g_test_add_func("/gobex/test_get_rsp", test_get_rsp);
 
+	g_test_add_func("/gobex/test_get_req_len", test_get_req_len);
+
 	g_test_add_func("/gobex/test_get_req_app", test_get_req_app);
 	g_test_add_func("/gobex/test_get_rsp_app", test_get_rsp_app);
 
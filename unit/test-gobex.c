@@ -315,6 +315,84 @@ static void test_send_connect_req_timeout_pkt(void)
 	send_connect(timeout_rsp, send_nothing, 0, SOCK_SEQPACKET);
 }
 
+static void test_capture(void)
+{
+	GError *gerr = NULL;
+	GIOChannel *io;
+	GIOCondition cond;
+	guint io_id, timer_id;
+	GObexPacket *req;
+	GObex *obex;
+	guint8 connect_data[] = { 0x10, 0x00, 0x10, 0x00 };
+	char *filename, *contents;
+	gsize len;
+	guint8 *rec;
+	int fd;
+
+	fd = g_file_open_tmp("gobex-XXXXXX.cap", &filename, &gerr);
+	g_assert_no_error(gerr);
+	close(fd);
+
+	create_endpoints(&obex, &io, SOCK_STREAM);
+
+	g_obex_capture_start(obex, filename, &gerr);
+	g_assert_no_error(gerr);
+
+	req = g_obex_packet_new(G_OBEX_OP_CONNECT, TRUE, G_OBEX_HDR_INVALID);
+	g_obex_packet_set_data(req, connect_data, sizeof(connect_data),
+							G_OBEX_DATA_REF);
+
+	g_obex_send_req(obex, req, -1, connect_rsp, &gerr, &gerr);
+	g_assert_no_error(gerr);
+
+	cond = G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+	io_id = g_io_add_watch(io, cond, send_connect_rsp, &gerr);
+
+	mainloop = g_main_loop_new(NULL, FALSE);
+
+	timer_id = g_timeout_add_seconds(1, timeout, &gerr);
+
+	g_main_loop_run(mainloop);
+
+	g_main_loop_unref(mainloop);
+	mainloop = NULL;
+
+	g_source_remove(timer_id);
+	g_io_channel_unref(io);
+	g_source_remove(io_id);
+	g_obex_unref(obex);
+
+	g_assert_no_error(gerr);
+
+	g_file_get_contents(filename, &contents, &len, &gerr);
+	g_assert_no_error(gerr);
+
+	unlink(filename);
+	g_free(filename);
+
+	g_assert_cmpuint(len, ==, G_OBEX_CAPTURE_HDR_SIZE +
+				2 * G_OBEX_CAPTURE_REC_SIZE +
+				sizeof(pkt_connect_req) +
+				sizeof(pkt_connect_rsp));
+	g_assert(memcmp(contents, G_OBEX_CAPTURE_MAGIC, 8) == 0);
+	g_assert_cmpuint((guint8) contents[8], ==, G_OBEX_CAPTURE_VERSION);
+	g_assert_cmpuint((guint8) contents[9], ==, G_OBEX_TRANSPORT_STREAM);
+
+	rec = (guint8 *) contents + G_OBEX_CAPTURE_HDR_SIZE;
+	g_assert_cmpuint(rec[4], ==, G_OBEX_CAPTURE_TX);
+	g_assert_cmpuint(rec[6], ==, sizeof(pkt_connect_req));
+	assert_memequal(pkt_connect_req, sizeof(pkt_connect_req),
+				rec + G_OBEX_CAPTURE_REC_SIZE, rec[6]);
+
+	rec += G_OBEX_CAPTURE_REC_SIZE + sizeof(pkt_connect_req);
+	g_assert_cmpuint(rec[4], ==, G_OBEX_CAPTURE_RX);
+	g_assert_cmpuint(rec[6], ==, sizeof(pkt_connect_rsp));
+	assert_memequal(pkt_connect_rsp, sizeof(pkt_connect_rsp),
+				rec + G_OBEX_CAPTURE_REC_SIZE, rec[6]);
+
+	g_free(contents);
+}
+
 struct req_info {
 	GObex *obex;
 	guint id;
@@ -1179,6 +1257,8 @@ int main(int argc, char *argv[])
 	g_test_add_func("/gobex/test_cancel_req_delay_pkt",
 					test_cancel_req_delay_pkt);
 
+	g_test_add_func("/gobex/test_capture", test_capture);
+
 	g_test_add_func("/gobex/test_connect", test_connect);
 
 	g_test_add_func("/gobex/test_setpath", test_setpath);
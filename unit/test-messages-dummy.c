@@ -0,0 +1,348 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "messages.h"
+
+/*
+ * MESSAGES messages in the inbox, handles 1 to MESSAGES. Message i has
+ * types[i % 4], is unread when i is odd and goes to Alice when i % 3 == 0.
+ */
+#define MESSAGES	100
+#define ALICE		34
+
+#define FILTER_EMAIL	(1 << 2)
+#define FILTER_MMS	(1 << 3)
+
+static const char *types[] = { "SMS_GSM", "SMS_CDMA", "EMAIL", "MMS" };
+
+struct test_listing {
+	GMainLoop *mainloop;
+	GPtrArray *handles;
+	uint16_t size;
+	int err;
+};
+
+void obex_debug(const char *format, ...)
+{
+}
+
+void error(const char *format, ...)
+{
+}
+
+static void write_message(const char *dir, unsigned int i)
+{
+	char *name, *path, *bmsg;
+
+	bmsg = g_strdup_printf("BEGIN:BMSG\r\nVERSION:1.0\r\nSTATUS:%s\r\n"
+				"TYPE:%s\r\nFOLDER:telecom/msg/inbox\r\n"
+				"BEGIN:VCARD\r\nVERSION:2.1\r\nN:Sender\r\n"
+				"TEL:+100%u\r\nEND:VCARD\r\n"
+				"BEGIN:BENV\r\n"
+				"BEGIN:VCARD\r\nVERSION:2.1\r\nN:%s\r\n"
+				"TEL:+200\r\nEND:VCARD\r\n"
+				"BEGIN:BBODY\r\nLENGTH:30\r\n"
+				"BEGIN:MSG\r\nHello\r\nEND:MSG\r\n"
+				"END:BBODY\r\nEND:BENV\r\nEND:BMSG\r\n",
+				i % 2 ? "UNREAD" : "READ", types[i % 4], i,
+				i % 3 ? "Bob" : "Alice");
+
+	name = g_strdup_printf("%X.bmsg", i + 1);
+	path = g_build_filename(dir, name, NULL);
+	g_assert(g_file_set_contents(path, bmsg, -1, NULL));
+
+	g_free(path);
+	g_free(name);
+	g_free(bmsg);
+}
+
+static char *setup(void **session)
+{
+	char *root, *inbox;
+	unsigned int i;
+
+	root = g_strdup("/tmp/test-messages-XXXXXX");
+	g_assert(g_mkdtemp(root) != NULL);
+
+	inbox = g_build_filename(root, "telecom", "msg", "inbox", NULL);
+	g_assert(g_mkdir_with_parents(inbox, 0700) == 0);
+
+	for (i = 0; i < MESSAGES; i++)
+		write_message(inbox, i);
+
+	g_free(inbox);
+
+	g_setenv("MAP_ROOT", root, TRUE);
+	g_assert(messages_init() == 0);
+	g_assert(messages_connect(session) == 0);
+
+	g_assert(messages_set_folder(*session, "telecom", FALSE) == 0);
+	g_assert(messages_set_folder(*session, "msg", FALSE) == 0);
+	g_assert(messages_set_folder(*session, "inbox", FALSE) == 0);
+
+	return root;
+}
+
+static void remove_dir(const char *path)
+{
+	const char *name;
+	GDir *dir;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (dir == NULL) {
+		unlink(path);
+		return;
+	}
+
+	while ((name = g_dir_read_name(dir))) {
+		char *child = g_build_filename(path, name, NULL);
+
+		remove_dir(child);
+		g_free(child);
+	}
+
+	g_dir_close(dir);
+	rmdir(path);
+}
+
+static void teardown(char *root, void *session)
+{
+	messages_disconnect(session);
+	messages_exit();
+
+	remove_dir(root);
+	g_free(root);
+}
+
+static void listing_cb(void *session, int err, uint16_t size,
+				gboolean newmsg,
+				const struct messages_message *message,
+				void *user_data)
+{
+	struct test_listing *t = user_data;
+
+	t->size = size;
+
+	if (err < 0 && err != -EAGAIN) {
+		t->err = err;
+		g_main_loop_quit(t->mainloop);
+		return;
+	}
+
+	if (message == NULL) {
+		g_main_loop_quit(t->mainloop);
+		return;
+	}
+
+	g_ptr_array_add(t->handles, g_strdup(message->handle));
+}
+
+static void list(void *session, const struct messages_filter *filter,
+			uint16_t max, uint16_t offset, struct test_listing *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->handles = g_ptr_array_new_with_free_func(g_free);
+	t->mainloop = g_main_loop_new(NULL, FALSE);
+
+	g_assert(messages_get_messages_listing(session, NULL, max, offset,
+					filter, listing_cb, t) == 0);
+
+	g_main_loop_run(t->mainloop);
+	g_main_loop_unref(t->mainloop);
+
+	g_assert_cmpint(t->err, ==, 0);
+}
+
+static void list_clear(struct test_listing *t)
+{
+	g_ptr_array_free(t->handles, TRUE);
+}
+
+/* Listing size and number of entries of a full listing */
+static void check_size(void *session, const struct messages_filter *filter,
+							unsigned int size)
+{
+	struct test_listing t;
+
+	list(session, filter, 0xffff, 0, &t);
+	g_assert_cmpuint(t.size, ==, size);
+	g_assert_cmpuint(t.handles->len, ==, size);
+	list_clear(&t);
+}
+
+static void test_listing_counted(void)
+{
+	struct messages_filter filter;
+	void *session;
+	char *root;
+
+	root = setup(&session);
+
+	memset(&filter, 0, sizeof(filter));
+	check_size(session, &filter, MESSAGES);
+
+	/* Types and flags are counted, not walked */
+	filter.type = FILTER_EMAIL | FILTER_MMS;
+	check_size(session, &filter, MESSAGES / 2);
+
+	filter.read_status = 0x01;
+	check_size(session, &filter, MESSAGES / 4);
+
+	filter.type = 0;
+	filter.read_status = 0x02;
+	check_size(session, &filter, MESSAGES / 2);
+
+	filter.read_status = 0;
+	filter.priority = 0x01;
+	check_size(session, &filter, 0);
+
+	teardown(root, session);
+}
+
+static void test_listing_paging(void)
+{
+	struct messages_filter filter, other;
+	struct test_listing full, page;
+	unsigned int offset, i;
+	void *session;
+	char *root;
+
+	root = setup(&session);
+
+	memset(&filter, 0, sizeof(filter));
+	filter.recipient = "Alice";
+
+	list(session, &filter, 0xffff, 0, &full);
+	g_assert_cmpuint(full.size, ==, ALICE);
+	g_assert_cmpuint(full.handles->len, ==, ALICE);
+
+	/* Newest first */
+	g_assert_cmpstr(g_ptr_array_index(full.handles, 0), ==, "64");
+
+	/* Every page carries on from the previous one */
+	for (offset = 0; offset < ALICE; offset += 10) {
+		list(session, &filter, 10, offset, &page);
+		g_assert_cmpuint(page.size, ==, ALICE);
+		g_assert_cmpuint(page.handles->len, ==,
+						MIN(10, ALICE - offset));
+
+		for (i = 0; i < page.handles->len; i++)
+			g_assert_cmpstr(g_ptr_array_index(page.handles, i), ==,
+				g_ptr_array_index(full.handles, offset + i));
+
+		list_clear(&page);
+	}
+
+	/* Going back, or another filter in between, starts over */
+	list(session, &filter, 5, 3, &page);
+	g_assert_cmpuint(page.handles->len, ==, 5);
+	g_assert_cmpstr(g_ptr_array_index(page.handles, 0), ==,
+					g_ptr_array_index(full.handles, 3));
+	list_clear(&page);
+
+	memset(&other, 0, sizeof(other));
+	other.recipient = "Bob";
+	list(session, &other, 5, 0, &page);
+	g_assert_cmpuint(page.size, ==, MESSAGES - ALICE);
+	list_clear(&page);
+
+	list(session, &filter, 5, 8, &page);
+	g_assert_cmpuint(page.size, ==, ALICE);
+	g_assert_cmpstr(g_ptr_array_index(page.handles, 0), ==,
+					g_ptr_array_index(full.handles, 8));
+	list_clear(&page);
+
+	list_clear(&full);
+	teardown(root, session);
+}
+
+static void test_listing_status(void)
+{
+	struct messages_filter filter, alice;
+	struct messages_status status;
+	struct test_listing page;
+	void *session;
+	char *root;
+
+	root = setup(&session);
+
+	memset(&filter, 0, sizeof(filter));
+	memset(&alice, 0, sizeof(alice));
+	alice.recipient = "Alice";
+
+	/* Leaves a cursor behind that the changes below invalidate */
+	list(session, &alice, 10, 0, &page);
+	list_clear(&page);
+
+	/* Message 99 is the newest, unread and for Alice */
+	memset(&status, 0, sizeof(status));
+	status.handle = "64";
+	status.indicator = MESSAGES_STATUS_READ;
+	status.value = 1;
+	g_assert(messages_set_message_status(session, &status, 1) == 0);
+
+	filter.read_status = 0x01;
+	check_size(session, &filter, MESSAGES / 2 - 1);
+
+	status.indicator = MESSAGES_STATUS_DELETED;
+	g_assert(messages_set_message_status(session, &status, 1) == 0);
+
+	/* Gone already, the deleted count is not touched again */
+	g_assert(messages_set_message_status(session, &status, 1) ==
+								-ENOENT);
+
+	filter.read_status = 0;
+	check_size(session, &filter, MESSAGES - 1);
+
+	filter.read_status = 0x02;
+	check_size(session, &filter, MESSAGES / 2);
+
+	check_size(session, &alice, ALICE - 1);
+
+	/* The window is found past the deleted entry */
+	list(session, &alice, 1, 0, &page);
+	g_assert_cmpstr(g_ptr_array_index(page.handles, 0), ==, "61");
+	list_clear(&page);
+
+	teardown(root, session);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/messages/test_listing_counted",
+						test_listing_counted);
+	g_test_add_func("/messages/test_listing_paging", test_listing_paging);
+	g_test_add_func("/messages/test_listing_status", test_listing_status);
+
+	g_test_run();
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "phonebook.h"
+
+/*
+ * A slow back-end answers each phonebook_pull_read after BACKEND_DELAY,
+ * while the client needs SEND_TICKS ticks to send a part. With prefetch
+ * the next part is in by the time the current one is sent.
+ */
+#define PARTS		6
+#define PART_LEN	4096
+#define BACKEND_DELAY	40	/* ms */
+#define SEND_TICK	10	/* ms */
+#define SEND_TICKS	8
+#define CHUNK		(PART_LEN / SEND_TICKS)
+#define PREFETCH_MAX	(256 * 1024)
+
+struct test_pull {
+	struct phonebook_prefetch pf;
+	unsigned int depth;
+	unsigned int served;
+	unsigned int stalls;
+	size_t sent;
+	guint backend_id;
+	GMainLoop *mainloop;
+};
+
+void obex_debug(const char *format, ...)
+{
+}
+
+static gboolean idle_noop(gpointer user_data)
+{
+	return FALSE;
+}
+
+static gboolean prefetch_cb(gpointer user_data);
+
+static gboolean backend_deliver(gpointer user_data)
+{
+	struct test_pull *t = user_data;
+
+	t->backend_id = 0;
+	t->served++;
+
+	phonebook_prefetch_received(&t->pf, PART_LEN, t->served == PARTS,
+							prefetch_cb, t);
+
+	/* The part being sent plus at most depth parts ahead of it */
+	g_assert_cmpuint(g_queue_get_length(t->pf.parts), <=, t->depth + 1);
+
+	return FALSE;
+}
+
+/* The delayed back-end, the request is the test itself */
+int phonebook_pull_read(void *request, unsigned int max_vcards,
+							size_t max_bytes)
+{
+	struct test_pull *t = request;
+
+	/* One outstanding read per request */
+	g_assert(t->backend_id == 0);
+	g_assert(t->served < PARTS);
+
+	t->backend_id = g_timeout_add(BACKEND_DELAY, backend_deliver, t);
+
+	return 0;
+}
+
+static void client_prefetch(struct test_pull *t)
+{
+	if (phonebook_prefetch_needed(&t->pf, t->depth, PREFETCH_MAX))
+		g_assert(phonebook_pull_next(t, &t->pf.reading) == 0);
+}
+
+static gboolean prefetch_cb(gpointer user_data)
+{
+	struct test_pull *t = user_data;
+
+	t->pf.id = 0;
+	client_prefetch(t);
+
+	return FALSE;
+}
+
+static gboolean client_send(gpointer user_data)
+{
+	struct test_pull *t = user_data;
+	size_t len = MIN(CHUNK, t->pf.buffered);
+
+	phonebook_prefetch_consume(&t->pf, len);
+	t->sent += len;
+
+	client_prefetch(t);
+
+	if (len > 0)
+		return TRUE;
+
+	if (t->pf.lastpart) {
+		g_main_loop_quit(t->mainloop);
+		return FALSE;
+	}
+
+	/* Waiting for the back-end in the middle of the pull */
+	if (t->sent > 0)
+		t->stalls++;
+
+	return TRUE;
+}
+
+static gint64 run_pull(struct test_pull *t, unsigned int depth)
+{
+	gint64 start;
+	guint id;
+
+	memset(t, 0, sizeof(*t));
+	phonebook_prefetch_init(&t->pf);
+	t->depth = depth;
+	t->mainloop = g_main_loop_new(NULL, FALSE);
+
+	start = g_get_monotonic_time();
+
+	g_assert(phonebook_pull_next(t, &t->pf.reading) == 0);
+	id = g_timeout_add(SEND_TICK, client_send, t);
+
+	g_main_loop_run(t->mainloop);
+
+	g_source_remove(id);
+	g_main_loop_unref(t->mainloop);
+	phonebook_prefetch_clear(&t->pf);
+
+	g_assert_cmpuint(t->served, ==, PARTS);
+	g_assert_cmpuint(t->sent, ==, PARTS * PART_LEN);
+	g_assert_cmpuint(t->pf.buffered, ==, 0);
+
+	return (g_get_monotonic_time() - start) / 1000;
+}
+
+static void test_prefetch_hides_latency(void)
+{
+	struct test_pull t;
+	gint64 elapsed;
+
+	elapsed = run_pull(&t, 1);
+
+	g_test_message("prefetch: %" G_GINT64_FORMAT " ms, %u stalls", elapsed,
+								t.stalls);
+
+	/* Only the first part is waited for */
+	g_assert_cmpuint(t.stalls, ==, 0);
+}
+
+static void test_prefetch_disabled(void)
+{
+	struct test_pull t;
+	gint64 elapsed;
+
+	elapsed = run_pull(&t, 0);
+
+	g_test_message("no prefetch: %" G_GINT64_FORMAT " ms, %u stalls",
+							elapsed, t.stalls);
+
+	/* Every part boundary waits for the back-end */
+	g_assert_cmpuint(t.stalls, >=, PARTS - 1);
+}
+
+static void test_prefetch_consume(void)
+{
+	struct phonebook_prefetch pf;
+
+	phonebook_prefetch_init(&pf);
+
+	pf.reading = TRUE;
+	phonebook_prefetch_received(&pf, 100, FALSE, idle_noop, NULL);
+	g_source_remove(pf.id);
+	pf.id = 0;
+
+	g_assert(!pf.reading);
+	phonebook_prefetch_received(&pf, 50, TRUE, idle_noop, NULL);
+	g_assert(pf.id == 0);
+
+	g_assert_cmpuint(pf.buffered, ==, 150);
+	g_assert_cmpuint(g_queue_get_length(pf.parts), ==, 2);
+
+	/* Partial reads shrink the head, a part is dropped once sent */
+	phonebook_prefetch_consume(&pf, 60);
+	g_assert_cmpuint(g_queue_get_length(pf.parts), ==, 2);
+	phonebook_prefetch_consume(&pf, 60);
+	g_assert_cmpuint(g_queue_get_length(pf.parts), ==, 1);
+	g_assert_cmpuint(pf.buffered, ==, 30);
+
+	/* Nothing is requested past the last part */
+	g_assert(!phonebook_prefetch_needed(&pf, 1, PREFETCH_MAX));
+
+	phonebook_prefetch_consume(&pf, 30);
+	g_assert(g_queue_is_empty(pf.parts));
+
+	phonebook_prefetch_clear(&pf);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/phonebook/test_prefetch_consume",
+						test_prefetch_consume);
+	g_test_add_func("/phonebook/test_prefetch_hides_latency",
+						test_prefetch_hides_latency);
+	g_test_add_func("/phonebook/test_prefetch_disabled",
+						test_prefetch_disabled);
+
+	g_test_run();
+
+	return 0;
+}
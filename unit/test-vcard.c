@@ -0,0 +1,351 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "vcard.h"
+
+/* Built with PHOTO_CACHE_MAX set to this, see Makefile.am */
+#define CACHE_MAX	(16 * 1024)
+#define PHOTO_SIZE	(4 * 1024)
+
+#define FILTER_PHOTO	(1 << 3)
+#define FORMAT_VCARD30	0x01
+
+static char *photo_dir = NULL;
+static char *cache_dir = NULL;
+
+/* Symbols vcard.c takes from the daemon */
+const char *obex_option_photo_cache(void)
+{
+	return cache_dir;
+}
+
+const char *obex_option_photo_folder(void)
+{
+	return photo_dir;
+}
+
+void obex_debug(const char *format, ...)
+{
+}
+
+static char *make_photo(const char *dir, const char *name, char fill)
+{
+	char data[PHOTO_SIZE], *path;
+
+	memset(data, fill, sizeof(data));
+	memcpy(data, "\x89PNG", 4);
+
+	path = g_build_filename(dir, name, NULL);
+	g_assert(g_file_set_contents(path, data, sizeof(data), NULL));
+
+	return path;
+}
+
+static GString *pull_photo(const char *path)
+{
+	struct phonebook_contact *contact;
+	GString *vcards;
+
+	contact = g_new0(struct phonebook_contact, 1);
+	contact->uid = g_strdup("");
+	contact->fullname = g_strdup("");
+	contact->given = g_strdup("");
+	contact->family = g_strdup("");
+	contact->additional = g_strdup("");
+	contact->prefix = g_strdup("");
+	contact->suffix = g_strdup("");
+	contact->photo = g_strdup(path);
+
+	vcards = g_string_new(NULL);
+	phonebook_add_contact(vcards, contact, FILTER_PHOTO, FORMAT_VCARD30);
+
+	phonebook_contact_free(contact);
+
+	return vcards;
+}
+
+static GSList *cache_entries(off_t *total)
+{
+	GSList *entries = NULL;
+	struct dirent *ep;
+	DIR *dp;
+
+	*total = 0;
+
+	dp = opendir(cache_dir);
+	g_assert(dp != NULL);
+
+	while ((ep = readdir(dp))) {
+		struct stat st;
+		char *path;
+
+		if (ep->d_name[0] == '.')
+			continue;
+
+		path = g_build_filename(cache_dir, ep->d_name, NULL);
+		g_assert(stat(path, &st) == 0);
+
+		*total += st.st_size;
+		entries = g_slist_prepend(entries, path);
+	}
+
+	closedir(dp);
+
+	return entries;
+}
+
+static char *setup(void)
+{
+	char *dir;
+
+	dir = g_strdup("/tmp/test-vcard-XXXXXX");
+	g_assert(g_mkdtemp(dir) != NULL);
+
+	photo_dir = g_build_filename(dir, "photos", NULL);
+	g_assert(g_mkdir(photo_dir, 0700) == 0);
+
+	cache_dir = g_build_filename(dir, "cache", NULL);
+	g_assert(g_mkdir(cache_dir, 0700) == 0);
+
+	return dir;
+}
+
+static void remove_dir(const char *path)
+{
+	const char *name;
+	GDir *dir;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (dir == NULL) {
+		unlink(path);
+		return;
+	}
+
+	while ((name = g_dir_read_name(dir))) {
+		char *child = g_build_filename(path, name, NULL);
+
+		remove_dir(child);
+		g_free(child);
+	}
+
+	g_dir_close(dir);
+	rmdir(path);
+}
+
+static void teardown(char *dir)
+{
+	remove_dir(dir);
+	g_free(dir);
+
+	g_free(photo_dir);
+	photo_dir = NULL;
+
+	g_free(cache_dir);
+	cache_dir = NULL;
+}
+
+static void test_photo_cache_store(void)
+{
+	char *dir, *photo, *contents, header[64];
+	GString *vcards;
+	GSList *entries;
+	struct stat st;
+	off_t total;
+
+	dir = setup();
+	photo = make_photo(photo_dir, "photo.png", 'a');
+
+	vcards = pull_photo(photo);
+	g_assert(strstr(vcards->str, "PHOTO;ENCODING=b;TYPE=PNG:") != NULL);
+
+	entries = cache_entries(&total);
+	g_assert_cmpuint(g_slist_length(entries), ==, 1);
+
+	/* The entry is tagged with the mtime and size of the source */
+	g_assert(stat(photo, &st) == 0);
+	snprintf(header, sizeof(header), "%ld %lld\n", (long) st.st_mtime,
+						(long long) st.st_size);
+
+	g_assert(g_file_get_contents(entries->data, &contents, NULL, NULL));
+	g_assert(g_str_has_prefix(contents, header));
+	g_assert(strstr(vcards->str, contents + strlen(header)) != NULL);
+
+	g_free(contents);
+	g_slist_free_full(entries, g_free);
+	g_string_free(vcards, TRUE);
+	g_free(photo);
+	teardown(dir);
+}
+
+static void test_photo_cache_hit(void)
+{
+	char *dir, *photo, *contents, *marked;
+	struct utimbuf times;
+	GString *vcards;
+	GSList *entries;
+	off_t total;
+
+	dir = setup();
+	photo = make_photo(photo_dir, "photo.png", 'a');
+
+	vcards = pull_photo(photo);
+	g_string_free(vcards, TRUE);
+
+	/* Mark the cached copy, a hit returns it instead of encoding again */
+	entries = cache_entries(&total);
+	g_assert_cmpuint(g_slist_length(entries), ==, 1);
+
+	g_assert(g_file_get_contents(entries->data, &contents, NULL, NULL));
+	marked = g_strconcat(contents, "X-CACHED:1\r\n", NULL);
+	g_assert(g_file_set_contents(entries->data, marked, -1, NULL));
+
+	vcards = pull_photo(photo);
+	g_assert(strstr(vcards->str, "X-CACHED:1\r\n") != NULL);
+	g_string_free(vcards, TRUE);
+
+	/* A changed source invalidates the entry */
+	g_free(photo);
+	photo = make_photo(photo_dir, "photo.png", 'b');
+	times.actime = times.modtime = 1000;
+	g_assert(utime(photo, &times) == 0);
+
+	vcards = pull_photo(photo);
+	g_assert(strstr(vcards->str, "PHOTO;ENCODING=b;TYPE=PNG:") != NULL);
+	g_assert(strstr(vcards->str, "X-CACHED:1\r\n") == NULL);
+	g_string_free(vcards, TRUE);
+
+	g_free(marked);
+	g_free(contents);
+	g_slist_free_full(entries, g_free);
+	g_free(photo);
+	teardown(dir);
+}
+
+static void test_photo_cache_trim(void)
+{
+	char *dir, *photo, *name, *cache = NULL;
+	GString *vcards;
+	GSList *entries, *l;
+	struct utimbuf times;
+	off_t total;
+	int i;
+
+	dir = setup();
+
+	for (i = 0; i < 16; i++) {
+		name = g_strdup_printf("photo%d.png", i);
+		photo = make_photo(photo_dir, name, 'a' + i);
+
+		vcards = pull_photo(photo);
+		g_string_free(vcards, TRUE);
+
+		entries = cache_entries(&total);
+		g_assert_cmpint(total, <=, CACHE_MAX);
+
+		/* Age the entries so trimming order does not depend on
+		 * the clock */
+		for (l = entries; l; l = l->next) {
+			struct stat st;
+
+			g_assert(stat(l->data, &st) == 0);
+			if (st.st_mtime < 1000000)
+				continue;
+
+			g_free(cache);
+			cache = g_strdup(l->data);
+			times.actime = times.modtime = 1000 + i;
+			g_assert(utime(cache, &times) == 0);
+		}
+
+		g_slist_free_full(entries, g_free);
+		g_free(photo);
+		g_free(name);
+	}
+
+	/* The newest entry is kept, the oldest ones are gone */
+	entries = cache_entries(&total);
+	g_assert_cmpuint(g_slist_length(entries), <, 16);
+	g_assert(g_slist_find_custom(entries, cache,
+					(GCompareFunc) strcmp) != NULL);
+
+	g_slist_free_full(entries, g_free);
+	g_free(cache);
+	teardown(dir);
+}
+
+static void test_photo_outside_folder(void)
+{
+	char *dir, *photo, *link, *uri;
+	GString *vcards;
+	GSList *entries;
+	off_t total;
+
+	dir = setup();
+	photo = make_photo(dir, "photo.png", 'a');
+
+	/* Left as a reference, whether given directly or through a link */
+	vcards = pull_photo(photo);
+	g_assert(strstr(vcards->str, "ENCODING=b") == NULL);
+	g_assert(strstr(vcards->str, photo) != NULL);
+	g_string_free(vcards, TRUE);
+
+	link = g_build_filename(photo_dir, "link.png", NULL);
+	g_assert(symlink(photo, link) == 0);
+
+	uri = g_filename_to_uri(link, NULL, NULL);
+	vcards = pull_photo(uri);
+	g_assert(strstr(vcards->str, "ENCODING=b") == NULL);
+	g_string_free(vcards, TRUE);
+
+	entries = cache_entries(&total);
+	g_assert(entries == NULL);
+
+	g_free(uri);
+	g_free(link);
+	g_free(photo);
+	teardown(dir);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/vcard/test_photo_cache_store",
+						test_photo_cache_store);
+	g_test_add_func("/vcard/test_photo_cache_hit", test_photo_cache_hit);
+	g_test_add_func("/vcard/test_photo_cache_trim", test_photo_cache_trim);
+	g_test_add_func("/vcard/test_photo_outside_folder",
+						test_photo_outside_folder);
+
+	g_test_run();
+
+	return 0;
+}